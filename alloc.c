@@ -0,0 +1,106 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Lukas Niederbremer <webmaster@flippeh.de> and Clark Gaebel <cg.wowus.cg@gmail.com>
+ * wrote this file. As long as you retain this notice you can do whatever you
+ * want with this stuff. If we meet some day, and you think this stuff is worth
+ * it, you can buy us a beer in return.
+ * -----------------------------------------------------------------------------
+ */
+#include "alloc.h"
+
+#include "slab.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void* libc_allocate(size_t size, void* ctx)
+{
+    (void)ctx;
+    return malloc(size);
+}
+
+static void* libc_reallocate(void* ptr, size_t size, void* ctx)
+{
+    (void)ctx;
+    return realloc(ptr, size);
+}
+
+static void libc_release(void* ptr, void* ctx)
+{
+    (void)ctx;
+    free(ptr);
+}
+
+static const nbt_allocator libc_allocator = { libc_allocate, libc_reallocate, libc_release, NULL };
+
+static nbt_allocator global = { libc_allocate, libc_reallocate, libc_release, NULL };
+
+/* NULL unless the thread said otherwise */
+static __thread const nbt_allocator* override;
+
+void nbt_set_allocator(const nbt_allocator* alloc)
+{
+    /* the pools' slabs came from the old one */
+    slab_release_all();
+    global = alloc ? *alloc : libc_allocator;
+}
+
+const nbt_allocator* nbt_use_allocator(const nbt_allocator* alloc)
+{
+    const nbt_allocator* old = override;
+    override = alloc;
+    return old;
+}
+
+const nbt_allocator* mem_allocator(void)
+{
+    return override ? override : &global;
+}
+
+const nbt_allocator* mem_override(void)
+{
+    return override;
+}
+
+const nbt_allocator* mem_global(void)
+{
+    return &global;
+}
+
+size_t mem_overhead(size_t n)
+{
+    size_t block = (n + sizeof(size_t) + 15) & ~(size_t)15;
+    if(block < 32) block = 32;
+    return block - n;
+}
+
+void* mem_alloc(size_t size)
+{
+    const nbt_allocator* a = mem_allocator();
+    return a->allocate(size, a->ctx);
+}
+
+void* mem_calloc(size_t n, size_t size)
+{
+    if(size != 0 && n > SIZE_MAX / size) return NULL;
+
+    void* ptr = mem_alloc(n * size);
+    if(ptr) memset(ptr, 0, n * size);
+    return ptr;
+}
+
+void* mem_realloc(void* ptr, size_t size)
+{
+    const nbt_allocator* a = mem_allocator();
+    return a->reallocate(ptr, size, a->ctx);
+}
+
+void mem_free(void* ptr)
+{
+    if(ptr == NULL) return;
+
+    const nbt_allocator* a = mem_allocator();
+    a->release(ptr, a->ctx);
+}
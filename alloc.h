@@ -0,0 +1,46 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Lukas Niederbremer <webmaster@flippeh.de> and Clark Gaebel <cg.wowus.cg@gmail.com>
+ * wrote this file. As long as you retain this notice you can do whatever you
+ * want with this stuff. If we meet some day, and you think this stuff is worth
+ * it, you can buy us a beer in return.
+ * -----------------------------------------------------------------------------
+ */
+#ifndef NBT_ALLOC_H
+#define NBT_ALLOC_H
+
+#include "nbt.h" /* for nbt_allocator */
+
+#include <stddef.h>
+
+/*
+ * Where the library gets its memory. These go to the calling thread's
+ * allocator, see nbt_set_allocator and nbt_use_allocator, and behave like the
+ * standard functions they're named after.
+ */
+void* mem_alloc(size_t size);
+void* mem_calloc(size_t n, size_t size);
+void* mem_realloc(void* ptr, size_t size);
+void  mem_free(void* ptr);
+
+/*
+ * The allocator the functions above would use right now. Memory that is to be
+ * freed later, perhaps on another thread, can be freed through it directly.
+ */
+const nbt_allocator* mem_allocator(void);
+
+/* The calling thread's override, NULL if it hasn't one. */
+const nbt_allocator* mem_override(void);
+
+/* The process's allocator, whatever the thread's override. */
+const nbt_allocator* mem_global(void);
+
+/*
+ * About what malloc spends on top of an `n' byte block, for memory accounting.
+ * It's what glibc does, which is typical: a word of header, and blocks rounded
+ * up to 16 bytes, 32 at the least.
+ */
+size_t mem_overhead(size_t n);
+
+#endif
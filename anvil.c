@@ -0,0 +1,312 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Lukas Niederbremer <webmaster@flippeh.de> and Clark Gaebel <cg.wowus.cg@gmail.com>
+ * wrote this file. As long as you retain this notice you can do whatever you
+ * want with this stuff. If we meet some day, and you think this stuff is worth
+ * it, you can buy us a beer in return.
+ * -----------------------------------------------------------------------------
+ */
+#include "nbt.h"
+
+#include "alloc.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SECTION_BLOCKS 4096
+#define NSECTIONS (ANVIL_SECTION_MAX - ANVIL_SECTION_MIN + 1)
+
+struct anvil_chunk {
+    nbt_node *root;
+    nbt_node *level; // NULL from 1.18 on
+    nbt_node *sections;
+    anvil_section section[NSECTIONS];
+    nbt_node *section_node[NSECTIONS];
+    bool present[NSECTIONS];
+    bool touched[NSECTIONS]; // may have been written through, so its cached hashes are suspect
+};
+
+// direct child of a compound, no recursion into grandchildren. Views write
+// straight into what's found here, so it's copied out of any tree it's shared with.
+static nbt_node *_anvil_child(nbt_node *compound, const char *name)
+{
+    if (compound == NULL || compound->type != TAG_COMPOUND) return NULL;
+
+    struct list_head *pos;
+    list_for_each(pos, &compound->payload.tag_compound->entry) {
+        nbt_node *child = list_entry(pos, struct tag_list, entry)->data;
+        if (child->name && strcmp(child->name, name) == 0) return nbt_mutable(compound, child);
+    }
+    return NULL;
+}
+
+static unsigned char *_anvil_bytes(nbt_node *node, int32_t length)
+{
+    if (node == NULL || node->type != TAG_BYTE_ARRAY) return NULL;
+    if (node->payload.tag_byte_array.length != length) return NULL;
+    return node->payload.tag_byte_array.data;
+}
+
+static int _anvil_bits(int palette_len)
+{
+    int bits = 4;
+    while ((1 << bits) < palette_len) bits++;
+    return bits;
+}
+
+// fills in the palette half of a view from a palette list and its packed indices
+static void _anvil_palette(anvil_section *s, nbt_node *palette, nbt_node *states)
+{
+    if (palette == NULL || palette->type != TAG_LIST) return;
+
+    s->palette = palette;
+    s->bits = _anvil_bits((int)list_length(&palette->payload.tag_list.list->entry));
+    if (states == NULL || states->type != TAG_LONG_ARRAY) return;
+
+    int32_t len = states->payload.tag_long_array.length;
+    int per_long = 64 / s->bits;
+    if (len == 64 * s->bits && 64 % s->bits != 0) {
+        s->states_span = true;
+    } else if (len != (SECTION_BLOCKS + per_long - 1) / per_long) {
+        return; // neither layout, leave it alone
+    }
+    s->states = states->payload.tag_long_array.data;
+    s->states_len = len;
+}
+
+static void _anvil_section(anvil_section *s, nbt_node *section)
+{
+    nbt_node *states;
+
+    s->blocks      = _anvil_bytes(_anvil_child(section, "Blocks"), SECTION_BLOCKS);
+    s->add         = _anvil_bytes(_anvil_child(section, "Add"), SECTION_BLOCKS / 2);
+    s->data        = _anvil_bytes(_anvil_child(section, "Data"), SECTION_BLOCKS / 2);
+    s->block_light = _anvil_bytes(_anvil_child(section, "BlockLight"), SECTION_BLOCKS / 2);
+    s->sky_light   = _anvil_bytes(_anvil_child(section, "SkyLight"), SECTION_BLOCKS / 2);
+
+    if ((states = _anvil_child(section, "block_states")) != NULL) {
+        _anvil_palette(s, _anvil_child(states, "palette"), _anvil_child(states, "data"));
+    } else {
+        _anvil_palette(s, _anvil_child(section, "Palette"), _anvil_child(section, "BlockStates"));
+    }
+}
+
+anvil_chunk *anvil_chunk_wrap(nbt_node *root)
+{
+    nbt_node *level = _anvil_child(root, "Level");
+    nbt_node *sections = _anvil_child(level, "Sections");
+    if (sections == NULL) {
+        level = NULL;
+        sections = _anvil_child(root, "sections");
+    }
+    if (sections == NULL || sections->type != TAG_LIST) {
+        errno = NBT_ERR;
+        return NULL;
+    }
+
+    anvil_chunk *chunk = mem_calloc(1, sizeof *chunk);
+    if (chunk == NULL) {
+        errno = NBT_EMEM;
+        return NULL;
+    }
+    chunk->root = root;
+    chunk->level = level;
+    chunk->sections = sections;
+
+    struct list_head *pos;
+    list_for_each(pos, &sections->payload.tag_list.list->entry) {
+        nbt_node *section = nbt_mutable(sections, list_entry(pos, struct tag_list, entry)->data);
+        nbt_node *y = _anvil_child(section, "Y");
+        if (y == NULL) continue;
+
+        int sy = y->type == TAG_BYTE ? y->payload.tag_byte : y->type == TAG_INT ? y->payload.tag_int : 0;
+        if (sy < ANVIL_SECTION_MIN || sy > ANVIL_SECTION_MAX) continue;
+
+        anvil_section *s = &chunk->section[sy - ANVIL_SECTION_MIN];
+        s->y = sy;
+        _anvil_section(s, section);
+        chunk->section_node[sy - ANVIL_SECTION_MIN] = section;
+        chunk->present[sy - ANVIL_SECTION_MIN] = true;
+    }
+
+    return chunk;
+}
+
+anvil_chunk *anvil_chunk_get(MCR *mcr, int x, int z)
+{
+    nbt_node *root = mcr_chunk_get(mcr, x, z);
+    if (root == NULL) return NULL;
+
+    anvil_chunk *chunk = anvil_chunk_wrap(root);
+    if (chunk == NULL) nbt_free(root);
+    return chunk;
+}
+
+// clears the cached hashes that block writes may have made stale, before the tree is let out
+static void _anvil_unhash(anvil_chunk *chunk)
+{
+    bool any = false;
+    for (int i = 0; i < NSECTIONS; i++) {
+        if (!chunk->touched[i]) continue;
+        nbt_hash_invalidate(chunk->section_node[i]);
+        chunk->touched[i] = false;
+        any = true;
+    }
+    if (!any) return;
+    chunk->sections->hash = 0;
+    if (chunk->level) chunk->level->hash = 0;
+    chunk->root->hash = 0;
+}
+
+int anvil_chunk_set(MCR *mcr, int x, int z, anvil_chunk *chunk)
+{
+    assert(chunk);
+    _anvil_unhash(chunk);
+    return mcr_chunk_set(mcr, x, z, chunk->root);
+}
+
+nbt_node *anvil_chunk_root(anvil_chunk *chunk)
+{
+    assert(chunk);
+    _anvil_unhash(chunk);
+    return chunk->root;
+}
+
+void anvil_chunk_free(anvil_chunk *chunk)
+{
+    if (chunk == NULL) return;
+    nbt_free(chunk->root);
+    mem_free(chunk);
+}
+
+anvil_section *anvil_chunk_section(anvil_chunk *chunk, int y)
+{
+    assert(chunk);
+    if (y < ANVIL_SECTION_MIN || y > ANVIL_SECTION_MAX) return NULL;
+    if (!chunk->present[y - ANVIL_SECTION_MIN]) return NULL;
+    chunk->touched[y - ANVIL_SECTION_MIN] = true; // the view can be written through
+    return &chunk->section[y - ANVIL_SECTION_MIN];
+}
+
+// the section holding world height y, and the block's index within it
+static const anvil_section *_anvil_locate(const anvil_chunk *chunk, int x, int y, int z, int *index)
+{
+    assert(chunk && x >= 0 && x < 16 && z >= 0 && z < 16);
+
+    int sy = y < 0 ? (y + 1) / 16 - 1 : y / 16;
+    if (sy < ANVIL_SECTION_MIN || sy > ANVIL_SECTION_MAX || !chunk->present[sy - ANVIL_SECTION_MIN]) return NULL;
+
+    *index = (y - sy * 16) * 256 + z * 16 + x;
+    return &chunk->section[sy - ANVIL_SECTION_MIN];
+}
+
+static int _anvil_nibble(const unsigned char *nibbles, int index)
+{
+    return index & 1 ? nibbles[index / 2] >> 4 : nibbles[index / 2] & 0x0F;
+}
+
+static void _anvil_set_nibble(unsigned char *nibbles, int index, int value)
+{
+    if (index & 1) {
+        nibbles[index / 2] = (nibbles[index / 2] & 0x0F) | (value << 4);
+    } else {
+        nibbles[index / 2] = (nibbles[index / 2] & 0xF0) | value;
+    }
+}
+
+// where the packed index for block `index' starts: which long, and which bit in it
+static void _anvil_packed_at(const anvil_section *s, int index, int *word, int *shift)
+{
+    if (s->states_span) {
+        *word  = index * s->bits / 64;
+        *shift = index * s->bits % 64;
+    } else {
+        int per_long = 64 / s->bits;
+        *word  = index / per_long;
+        *shift = index % per_long * s->bits;
+    }
+}
+
+static int _anvil_packed_get(const anvil_section *s, int index)
+{
+    int word, shift;
+    _anvil_packed_at(s, index, &word, &shift);
+
+    uint64_t mask = (UINT64_C(1) << s->bits) - 1;
+    uint64_t value = (uint64_t)s->states[word] >> shift;
+    if (shift + s->bits > 64) value |= (uint64_t)s->states[word + 1] << (64 - shift);
+    return (int)(value & mask);
+}
+
+static void _anvil_packed_set(const anvil_section *s, int index, int value)
+{
+    int word, shift;
+    _anvil_packed_at(s, index, &word, &shift);
+
+    uint64_t mask = (UINT64_C(1) << s->bits) - 1;
+    uint64_t lo = (uint64_t)s->states[word];
+    lo = (lo & ~(mask << shift)) | ((uint64_t)value << shift);
+    s->states[word] = (int64_t)lo;
+
+    if (shift + s->bits > 64) {
+        int spill = shift + s->bits - 64;
+        uint64_t hi = (uint64_t)s->states[word + 1];
+        hi = (hi & ~((UINT64_C(1) << spill) - 1)) | ((uint64_t)value >> (64 - shift));
+        s->states[word + 1] = (int64_t)hi;
+    }
+}
+
+int anvil_get_block(const anvil_chunk *chunk, int x, int y, int z)
+{
+    int index;
+    const anvil_section *s = _anvil_locate(chunk, x, y, z, &index);
+    if (s == NULL) return 0;
+
+    if (s->blocks) {
+        int id = s->blocks[index];
+        if (s->add) id |= _anvil_nibble(s->add, index) << 8;
+        return id;
+    }
+    return s->states ? _anvil_packed_get(s, index) : 0;
+}
+
+int anvil_get_data(const anvil_chunk *chunk, int x, int y, int z)
+{
+    int index;
+    const anvil_section *s = _anvil_locate(chunk, x, y, z, &index);
+    if (s == NULL || s->data == NULL) return 0;
+    return _anvil_nibble(s->data, index);
+}
+
+int anvil_set_block(anvil_chunk *chunk, int x, int y, int z, int block, int data)
+{
+    int index;
+    const anvil_section *s = _anvil_locate(chunk, x, y, z, &index);
+    if (s == NULL || block < 0) goto err;
+
+    chunk->touched[s->y - ANVIL_SECTION_MIN] = true;
+    if (s->blocks) {
+        if (block > 0xFFF || (block > 0xFF && s->add == NULL) || data < 0 || data > 0xF) goto err;
+        s->blocks[index] = block & 0xFF;
+        if (s->add) _anvil_set_nibble(s->add, index, block >> 8);
+        if (s->data) _anvil_set_nibble(s->data, index, data);
+        return 0;
+    }
+
+    if (s->palette == NULL) goto err;
+    if ((size_t)block >= list_length(&s->palette->payload.tag_list.list->entry)) goto err;
+    if (s->states == NULL) {
+        // a one entry palette has nowhere to write anything else
+        if (block != 0) goto err;
+        return 0;
+    }
+    _anvil_packed_set(s, index, block);
+    return 0;
+
+err:
+    errno = NBT_ERR;
+    return -1;
+}
@@ -9,6 +9,8 @@
 */
 #include "buffer.h"
 
+#include "alloc.h"
+
 #include <assert.h>
 #include <stdlib.h>
 #include <stddef.h>
@@ -29,7 +31,7 @@ static int lazy_init(struct buffer* b)
     size_t cap = 1024;
 
     *b = (struct buffer) {
-        .data = malloc(cap),
+        .data = mem_alloc(cap),
         .len  = 0,
         .cap  = cap
     };
@@ -44,7 +46,7 @@ void buffer_free(struct buffer* b)
 {
     assert(b);
 
-    free(b->data);
+    mem_free(b->data);
 
     b->data = NULL;
     b->len = 0;
@@ -65,7 +67,7 @@ int buffer_reserve(struct buffer* b, size_t reserved_amount)
     while(b->cap < reserved_amount)
         b->cap *= 2;
 
-    unsigned char* temp = realloc(b->data, b->cap);
+    unsigned char* temp = mem_realloc(b->data, b->cap);
 
     if(unlikely(temp == NULL))
         return buffer_free(b), 1;
@@ -5,7 +5,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 static void die(const char* message)
 {
@@ -31,6 +34,367 @@ static nbt_node* get_tree(const char* filename)
     return ret;
 }
 
+static char* copy_string(const char* s)
+{
+    char* r = malloc(strlen(s) + 1);
+    if(r == NULL) die("Out of memory.");
+    return strcpy(r, s);
+}
+
+static void add_child(nbt_node* compound, nbt_node* child)
+{
+    struct tag_list* entry = nbt_new_entry(child);
+    if(entry == NULL) die("Out of memory.");
+
+    list_add_tail(&entry->entry, &compound->payload.tag_compound->entry);
+}
+
+static nbt_node* new_node(nbt_type type, const char* name)
+{
+    nbt_node* node = nbt_new_node(type, name);
+    if(node == NULL) die("Out of memory.");
+
+    if(type == TAG_LIST) node->payload.tag_list.type = TAG_COMPOUND;
+
+    return node;
+}
+
+static nbt_node* new_byte_array(const char* name, int32_t length)
+{
+    nbt_node* node = new_node(TAG_BYTE_ARRAY, name);
+    node->payload.tag_byte_array.length = length;
+    node->payload.tag_byte_array.data = calloc(length, 1);
+    if(node->payload.tag_byte_array.data == NULL) die("Out of memory.");
+    return node;
+}
+
+static void add_list_item(nbt_node* list, nbt_node* item)
+{
+    struct tag_list* entry = nbt_new_entry(item);
+    if(entry == NULL) die("Out of memory.");
+
+    list_add_tail(&entry->entry, &list->payload.tag_list.list->entry);
+}
+
+/*
+ * An Anvil chunk with a pre-1.13 section at Y=1, and a palette section with
+ * twenty block states (so five bits an index) at Y=2.
+ */
+static nbt_node* make_anvil_chunk(void)
+{
+    nbt_node* root     = new_node(TAG_COMPOUND, "");
+    nbt_node* level    = new_node(TAG_COMPOUND, "Level");
+    nbt_node* sections = new_node(TAG_LIST, "Sections");
+
+    nbt_node* legacy = new_node(TAG_COMPOUND, NULL);
+    nbt_node* y = new_node(TAG_BYTE, "Y");
+    y->payload.tag_byte = 1;
+    add_child(legacy, y);
+    add_child(legacy, new_byte_array("Blocks", 4096));
+    add_child(legacy, new_byte_array("Data", 2048));
+
+    nbt_node* paletted = new_node(TAG_COMPOUND, NULL);
+    y = new_node(TAG_BYTE, "Y");
+    y->payload.tag_byte = 2;
+    add_child(paletted, y);
+
+    nbt_node* palette = new_node(TAG_LIST, "Palette");
+    for(int i = 0; i < 20; i++)
+        add_list_item(palette, new_node(TAG_COMPOUND, NULL));
+    add_child(paletted, palette);
+
+    nbt_node* states = new_node(TAG_LONG_ARRAY, "BlockStates");
+    states->payload.tag_long_array.length = 342; /* ceil(4096 / 12) */
+    states->payload.tag_long_array.data = calloc(342, sizeof(int64_t));
+    if(states->payload.tag_long_array.data == NULL) die("Out of memory.");
+    add_child(paletted, states);
+
+    add_list_item(sections, legacy);
+    add_list_item(sections, paletted);
+    add_child(level, sections);
+    add_child(root, level);
+
+    return root;
+}
+
+static void check_anvil_blocks(const anvil_chunk* chunk)
+{
+    if(anvil_get_block(chunk, 3, 20, 5) != 42 || anvil_get_data(chunk, 3, 20, 5) != 7)
+        die("FAILED. Wrong legacy block.");
+    if(anvil_get_block(chunk, 4, 37, 9) != 17 || anvil_get_block(chunk, 5, 37, 9) != 19)
+        die("FAILED. Wrong palette block.");
+    if(anvil_get_block(chunk, 3, 20, 4) != 0 || anvil_get_block(chunk, 6, 37, 9) != 0)
+        die("FAILED. Neighbouring block changed.");
+    if(anvil_get_block(chunk, 0, 100, 0) != 0)
+        die("FAILED. Missing section isn't air.");
+}
+
+struct parallel_visit {
+    pthread_mutex_t lock;
+    const nbt_node* expected;
+    int visited;
+    int wrong;
+};
+
+static bool visit_chunk(int x, int z, nbt_node* tree, void* aux)
+{
+    struct parallel_visit* v = aux;
+    bool ok = (x + z) % 3 == 0 && nbt_eq(tree, v->expected);
+
+    pthread_mutex_lock(&v->lock);
+    v->visited++;
+    if(!ok) v->wrong++;
+    pthread_mutex_unlock(&v->lock);
+
+    nbt_free(tree);
+    return true;
+}
+
+/* Counts visits made under some other allocator than `expected'. */
+struct allocator_visit {
+    pthread_mutex_t lock;
+    const nbt_allocator* expected;
+    int wrong;
+};
+
+static bool visit_under(int x, int z, nbt_node* tree, void* aux)
+{
+    struct allocator_visit* v = aux;
+    (void)x; (void)z;
+
+    const nbt_allocator* mine = nbt_use_allocator(NULL);
+    nbt_use_allocator(mine);
+
+    pthread_mutex_lock(&v->lock);
+    if(mine != v->expected) v->wrong++;
+    pthread_mutex_unlock(&v->lock);
+
+    nbt_free(tree);
+    return true;
+}
+
+static bool count_match(nbt_node* node, size_t which, void* aux)
+{
+    (void)node;
+    ((int*)aux)[which]++;
+    return true;
+}
+
+static bool first_match(nbt_node* node, void* aux)
+{
+    *(nbt_node**)aux = node;
+    return false;
+}
+
+static bool keep_all_but_data(const nbt_node* node, void* aux)
+{
+    (void)aux;
+    return node->name == NULL || strcmp(node->name, "Data") != 0;
+}
+
+/* The same, counting how often it's asked. */
+static bool count_all_but_data(const nbt_node* node, void* aux)
+{
+    (*(size_t*)aux)++;
+    return keep_all_but_data(node, NULL);
+}
+
+/* The nodes nbt_map visits, in order. */
+struct visit_order {
+    nbt_node** nodes;
+    size_t len;
+};
+
+static bool record_node(nbt_node* node, void* aux)
+{
+    struct visit_order* o = aux;
+    o->nodes[o->len++] = node;
+    return true;
+}
+
+static bool count_node(nbt_node* node, void* aux)
+{
+    (void)node;
+    __atomic_fetch_add((size_t*)aux, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+static bool stop_at_ints(nbt_node* node, void* aux)
+{
+    (void)aux;
+    return node->type != TAG_INT;
+}
+
+/* Nodes, and the sum of every TAG_INT, per thread. */
+struct int_sum {
+    size_t nodes;
+    int64_t sum;
+};
+
+static void int_sum_init(void* partial, void* aux)
+{
+    (void)aux;
+    memset(partial, 0, sizeof(struct int_sum));
+}
+
+static bool int_sum_visit(nbt_node* node, void* partial, void* aux)
+{
+    struct int_sum* s = partial;
+    (void)aux;
+
+    s->nodes++;
+    if(node->type == TAG_INT) s->sum += node->payload.tag_int;
+    return true;
+}
+
+static void int_sum_merge(void* result, const void* partial, void* aux)
+{
+    struct int_sum* into = result;
+    const struct int_sum* from = partial;
+    (void)aux;
+
+    into->nodes += from->nodes;
+    into->sum   += from->sum;
+}
+
+struct since_visit {
+    pthread_mutex_t lock;
+    int visited;
+    int last_x, last_z;
+};
+
+static bool visit_since(int x, int z, nbt_node* tree, void* aux)
+{
+    struct since_visit* v = aux;
+
+    pthread_mutex_lock(&v->lock);
+    v->visited++;
+    v->last_x = x;
+    v->last_z = z;
+    pthread_mutex_unlock(&v->lock);
+
+    nbt_free(tree);
+    return true;
+}
+
+/* Keeps count of what's allocated through it, from any thread. */
+struct counting_allocator {
+    pthread_mutex_t lock;
+    long live;      /* blocks allocated and not yet freed */
+    size_t largest;
+};
+
+static void count_allocation(struct counting_allocator* c, bool new_block, size_t size)
+{
+    pthread_mutex_lock(&c->lock);
+    if(new_block) c->live++;
+    if(size > c->largest) c->largest = size;
+    pthread_mutex_unlock(&c->lock);
+}
+
+static void* counted_allocate(size_t size, void* ctx)
+{
+    void* ptr = malloc(size);
+    if(ptr) count_allocation(ctx, true, size);
+    return ptr;
+}
+
+static void* counted_reallocate(void* ptr, size_t size, void* ctx)
+{
+    bool new_block = ptr == NULL;
+    void* grown = realloc(ptr, size);
+    if(grown) count_allocation(ctx, new_block, size);
+    return grown;
+}
+
+/* Never has anything to give, to see how running out is handled. */
+static void* refused_allocate(size_t size, void* ctx)
+{
+    (void)size; (void)ctx;
+    return NULL;
+}
+
+static void* refused_reallocate(void* ptr, size_t size, void* ctx)
+{
+    (void)ptr; (void)size; (void)ctx;
+    return NULL;
+}
+
+static void refused_release(void* ptr, void* ctx)
+{
+    (void)ctx;
+    free(ptr);
+}
+
+/* Gives out `*ctx' more blocks, or any number while that's negative, then no more. */
+static void* limited_allocate(size_t size, void* ctx)
+{
+    long* left = ctx;
+    if(*left == 0) return NULL;
+    if(*left > 0) (*left)--;
+    return malloc(size);
+}
+
+static void* limited_reallocate(void* ptr, size_t size, void* ctx)
+{
+    long* left = ctx;
+    if(*left == 0) return NULL;
+    if(*left > 0) (*left)--;
+    return realloc(ptr, size);
+}
+
+static void counted_release(void* ptr, void* ctx)
+{
+    struct counting_allocator* c = ctx;
+
+    pthread_mutex_lock(&c->lock);
+    c->live--;
+    pthread_mutex_unlock(&c->lock);
+
+    free(ptr);
+}
+
+/* Parses its own copies of a tree, for somebody else to free. */
+struct parse_job {
+    pthread_t thread;
+    const struct buffer* data;
+    nbt_node* trees[50];
+};
+
+static void* parse_copies(void* vjob)
+{
+    struct parse_job* job = vjob;
+
+    for(size_t i = 0; i < sizeof job->trees / sizeof *job->trees; i++)
+        if((job->trees[i] = nbt_parse(job->data->data, job->data->len)) == NULL)
+            die_with_err(errno);
+
+    return NULL;
+}
+
+/*
+ * Wraps a copy of `tree' in a compound next to a few megabytes of filler, so
+ * there's enough data for the parallel compressor to split up.
+ */
+static nbt_node* make_big_tree(nbt_node* tree)
+{
+    nbt_node* big    = new_node(TAG_COMPOUND, "big");
+    nbt_node* filler = new_node(TAG_BYTE_ARRAY, "filler");
+
+    int32_t length = 3 * 1024 * 1024 + 12345;
+    filler->payload.tag_byte_array.length = length;
+    filler->payload.tag_byte_array.data = malloc(length);
+    if(filler->payload.tag_byte_array.data == NULL) die("Out of memory.");
+
+    for(int32_t i = 0; i < length; i++)
+        filler->payload.tag_byte_array.data[i] = (unsigned char)((i * 7) ^ (i >> 11));
+
+    add_child(big, nbt_clone(tree));
+    add_child(big, filler);
+
+    return big;
+}
+
 int main(int argc, char** argv)
 {
     if(argc == 1 || strcmp(argv[1], "--help") == 0)
@@ -43,6 +407,16 @@ int main(int argc, char** argv)
     nbt_node* tree = get_tree(argv[1]);
     printf("OK.\n");
 
+    {
+        printf("Checking nbt_parse_path... ");
+        nbt_node* mapped = nbt_parse_path(argv[1]);
+        if(mapped == NULL) die_with_err(errno);
+        if(!nbt_eq(tree, mapped))
+            die("FAILED. Trees not equal.");
+        nbt_free(mapped);
+        printf("OK.\n");
+    }
+
     /* Use this to refer to the tree in gdb. */
     char* the_tree = nbt_dump_ascii(tree);
 
@@ -52,8 +426,16 @@ int main(int argc, char** argv)
     {
         printf("Checking nbt_clone... ");
         nbt_node* clone = nbt_clone(tree);
+        if(clone == NULL) die_with_err(errno);
         if(!nbt_eq(tree, clone))
             die("FAILED. Clones not equal.");
+
+        /* every node of it is its own */
+        nbt_iterator it;
+        for(nbt_node* n = nbt_iter_begin(&it, clone); n; n = nbt_iter_next(&it))
+            if(n->refs != 0) die("FAILED. Deep clone shares a node.");
+        nbt_iter_end(&it);
+
         nbt_free(tree); /* swap the tree out for its clone */
         tree = clone;
         printf("OK.\n");
@@ -91,6 +473,196 @@ int main(int argc, char** argv)
     }
     printf("OK.\n");
 
+    printf("Checking compression presets... ");
+    {
+        nbt_compression_options presets[] = {
+            NBT_COMPRESSION_FAST,
+            NBT_COMPRESSION_DEFAULT,
+            NBT_COMPRESSION_ARCHIVE
+        };
+
+        for(size_t i = 0; i < sizeof presets / sizeof *presets; i++)
+        {
+            struct buffer b = nbt_dump_compressed_opts(tree, STRAT_GZIP, &presets[i]);
+            if(b.data == NULL) die_with_err(errno);
+
+            nbt_node* reparsed = nbt_parse_compressed(b.data, b.len);
+            if(reparsed == NULL) die_with_err(errno);
+            if(!nbt_eq(tree, reparsed)) die("Trees not equal.");
+
+            nbt_free(reparsed);
+            buffer_free(&b);
+        }
+    }
+    printf("OK.\n");
+
+#ifdef HAVE_LZ4
+    printf("Checking LZ4... ");
+    {
+        /* the big tree takes more than one block */
+        nbt_node* big = make_big_tree(tree);
+        nbt_node* trees[] = { tree, big };
+
+        for(size_t i = 0; i < sizeof trees / sizeof *trees; i++)
+        {
+            struct buffer b = nbt_dump_compressed(trees[i], STRAT_LZ4);
+            if(b.data == NULL) die_with_err(errno);
+
+            nbt_node* reparsed = nbt_parse_compressed_strat(b.data, b.len, STRAT_LZ4);
+            if(reparsed == NULL) die_with_err(errno);
+            if(!nbt_eq(trees[i], reparsed)) die("Trees not equal.");
+
+            nbt_free(reparsed);
+            buffer_free(&b);
+        }
+
+        /* running out at every point it allocates, and leaking nothing when it does */
+        long left;
+        nbt_allocator limited = { limited_allocate, limited_reallocate, refused_release, &left };
+        for(long budget = 0; ; budget++)
+        {
+            left = budget;
+            nbt_use_allocator(&limited);
+            struct buffer b = nbt_dump_compressed(big, STRAT_LZ4);
+            int err = errno;
+            nbt_use_allocator(NULL);
+
+            if(b.data)
+            {
+                buffer_free(&b);
+                break;
+            }
+            if(err != NBT_EMEM) die_with_err(err);
+        }
+
+        nbt_free(big);
+    }
+    printf("OK.\n");
+#endif
+
+    printf("Checking parallel gzip... ");
+    {
+        nbt_node* big = make_big_tree(tree);
+
+        nbt_compression_options opts = NBT_COMPRESSION_DEFAULT;
+        opts.threads = 4;
+
+        struct buffer b = nbt_dump_compressed_opts(big, STRAT_GZIP, &opts);
+        if(b.data == NULL) die_with_err(errno);
+
+        nbt_node* reparsed = nbt_parse_compressed(b.data, b.len);
+        if(reparsed == NULL) die_with_err(errno);
+        if(!nbt_eq(big, reparsed)) die("Trees not equal.");
+
+        nbt_free(reparsed);
+        nbt_free(big);
+        buffer_free(&b);
+    }
+    printf("OK.\n");
+
+    printf("Checking custom allocator... ");
+    {
+        struct counting_allocator counter = { PTHREAD_MUTEX_INITIALIZER, 0, 0 };
+        nbt_allocator counting = { counted_allocate, counted_reallocate, counted_release, &counter };
+
+        nbt_node* big = make_big_tree(tree);
+        if(nbt_use_allocator(&counting) != NULL) die("FAILED. Thread already had an allocator.");
+
+        nbt_compression_options opts = NBT_COMPRESSION_DEFAULT;
+        opts.threads = 4;
+
+        /* the workers compress under this thread's allocator */
+        struct buffer b = nbt_dump_compressed_opts(big, STRAT_GZIP, &opts);
+        if(b.data == NULL) die_with_err(errno);
+
+        nbt_node* reparsed = nbt_parse_compressed(b.data, b.len);
+        if(reparsed == NULL) die_with_err(errno);
+
+        nbt_node* clone = nbt_clone(reparsed);
+        if(clone == NULL) die_with_err(errno);
+        if(!nbt_eq(big, clone)) die("Trees not equal.");
+
+        char* ascii = nbt_dump_ascii(clone);
+        if(ascii == NULL) die_with_err(errno);
+
+        if(counter.live == 0) die("FAILED. Nothing came from the allocator.");
+
+        /* deflate's window is 64k, far more than any buffer of ours starts at */
+        if(counter.largest < 65536) die("FAILED. zlib didn't use the allocator.");
+
+        counted_release(ascii, &counter);
+        nbt_free(clone);
+        nbt_free(reparsed);
+        buffer_free(&b);
+
+        if(nbt_use_allocator(NULL) != &counting) die("FAILED. Allocator not put back.");
+        if(counter.live != 0) die("FAILED. Freed memory that wasn't allocated, or vice versa.");
+
+        nbt_free(big);
+        pthread_mutex_destroy(&counter.lock);
+    }
+    printf("OK.\n");
+
+    printf("Checking node pools... ");
+    {
+        struct buffer b = nbt_dump_binary(tree);
+        if(b.data == NULL) die_with_err(errno);
+
+        struct parse_job jobs[4];
+        for(size_t i = 0; i < 4; i++)
+        {
+            jobs[i].data = &b;
+            if(pthread_create(&jobs[i].thread, NULL, parse_copies, &jobs[i]) != 0)
+                die("Could not start a thread.");
+        }
+
+        /* the parsers are gone by now, so their nodes go back through this thread */
+        for(size_t i = 0; i < 4; i++)
+        {
+            pthread_join(jobs[i].thread, NULL);
+
+            for(size_t j = 0; j < 50; j++)
+            {
+                if(!nbt_eq(tree, jobs[i].trees[j])) die("Trees not equal.");
+                nbt_free(jobs[i].trees[j]);
+            }
+        }
+
+        /* and come out again as new trees, none the worse */
+        for(size_t i = 0; i < 200; i++)
+        {
+            nbt_node* again = nbt_parse(b.data, b.len);
+            if(again == NULL) die_with_err(errno);
+            if(!nbt_eq(tree, again)) die("Trees not equal.");
+            nbt_free(again);
+        }
+
+        /* nodes go back where they came from, whatever allocator is in use when they're freed */
+        struct counting_allocator counter = { PTHREAD_MUTEX_INITIALIZER, 0, 0 };
+        nbt_allocator counting = { counted_allocate, counted_reallocate, counted_release, &counter };
+
+        nbt_node* pooled = nbt_parse(b.data, b.len);
+        if(pooled == NULL) die_with_err(errno);
+
+        nbt_use_allocator(&counting);
+        nbt_node* clone = nbt_clone_shared(pooled);
+        nbt_use_allocator(NULL);
+        if(clone == NULL) die_with_err(errno);
+
+        nbt_free(pooled);
+        if(counter.live == 0) die("FAILED. Nothing came from the allocator.");
+
+        nbt_use_allocator(&counting);
+        nbt_free(clone);
+        nbt_use_allocator(NULL);
+        if(counter.live != 0) die("FAILED. Freed memory that wasn't allocated, or vice versa.");
+
+        pthread_mutex_destroy(&counter.lock);
+
+        buffer_free(&b);
+    }
+    printf("OK.\n");
+
     // write tree to a new mcr file
     printf("Checking region file... ");
     MCR *mcr = mcr_open("delete_me.mcr", O_RDWR|O_CREAT);
@@ -117,8 +689,1047 @@ int main(int argc, char** argv)
     if(remove("delete_me.mcr") == -1)
         die("Could not delete delete_me.mcr. Race condition?");
     printf("OK.\n");
+
+    printf("Checking failed flush of a new region... ");
+    {
+        static unsigned char small[100], big[10000];
+        long left = -1;
+        nbt_allocator limited = { limited_allocate, limited_reallocate, refused_release, &left };
+
+        /* running out at every point a flush allocates, in turn */
+        for(long budget = 0; budget < 16; budget++)
+        {
+            nbt_use_allocator(&limited);
+            mcr = mcr_open("delete_me_flush.mcr", O_RDWR|O_CREAT|O_TRUNC);
+            nbt_use_allocator(NULL);
+            if (mcr == NULL) die("Could not create region file");
+
+            left = -1;
+            if(mcr_chunk_set_raw(mcr, 0, 0, 2, small, sizeof small, 1) ||
+               mcr_chunk_set_raw(mcr, 0, 1, 2, big, sizeof big, 2))
+                die_with_err(errno);
+
+            left = budget;
+            int failed = mcr_flush(mcr) != 0;
+            left = -1;
+
+            /* whatever the writer thinks is on disk, a reader has to find */
+            MCR* reader = mcr_open("delete_me_flush.mcr", O_RDONLY);
+            for(int z = 0; z < 2; z++)
+            {
+                mcr_chunk_info info;
+                mcr_chunk_stat(mcr, 0, z, false, &info);
+                if(info.sectors > 0 && (reader == NULL || !mcr_chunk_exists(reader, 0, z)))
+                    die("FAILED. Written chunk lost to a missing header.");
+            }
+            if(reader) mcr_close(reader);
+
+            if (mcr_close(mcr)) die_with_err(errno);
+            if(!failed) break;
+        }
+
+        if(remove("delete_me_flush.mcr") == -1)
+            die("Could not delete delete_me_flush.mcr. Race condition?");
+    }
+    printf("OK.\n");
+
+    printf("Checking chunk compression types... ");
+    {
+        nbt_compression_strategy strats[] = { STRAT_GZIP, STRAT_INFLATE, STRAT_NONE, STRAT_LZ4 };
+        size_t nstrats = sizeof strats / sizeof *strats;
+
+        mcr = mcr_open("delete_me.mcr", O_RDWR|O_CREAT);
+        if (mcr == NULL) die("Could not create region file");
+
+        for(size_t i = 0; i < nstrats; i++)
+            if(mcr_chunk_set_strat(mcr, (int)i, 0, tree_copy, strats[i]))
+            {
+#ifndef HAVE_LZ4
+                if(strats[i] == STRAT_LZ4 && errno == NBT_ECOMP) continue;
+#endif
+                die_with_err(errno);
+            }
+
+        if (mcr_close(mcr)) die("could not save mcr");
+
+        mcr = mcr_open("delete_me.mcr", O_RDONLY);
+        if (mcr == NULL) die("Could not read region file");
+
+        for(size_t i = 0; i < nstrats; i++)
+        {
+            nbt_node* chunk = mcr_chunk_get(mcr, (int)i, 0);
+#ifndef HAVE_LZ4
+            if(chunk == NULL && strats[i] == STRAT_LZ4 && errno == NBT_OK)
+                continue; /* built without LZ4, so it was never written */
+#endif
+            if(chunk == NULL) die_with_err(errno);
+            if(!nbt_eq(chunk, tree_copy)) die("Trees not equal.");
+            nbt_free(chunk);
+        }
+
+        mcr_close(mcr);
+    }
+    printf("OK.\n");
+
+    printf("Checking chunk rewrite... ");
+    {
+        struct stat before, after;
+
+        /*
+         * The same chunk again. It can't go over its old copy, but the next
+         * time round the copy before is free, so the file only grows once.
+         */
+        for(int round = 0; round < 2; round++)
+        {
+            if(stat("delete_me.mcr", &before)) die("Could not stat region file");
+
+            mcr = mcr_open("delete_me.mcr", O_RDWR);
+            if (mcr == NULL) die("Could not open region file");
+
+            mcr_chunk_info old;
+            mcr_chunk_stat(mcr, 0, 0, false, &old);
+            if (mcr_chunk_set_strat(mcr, 0, 0, tree_copy, STRAT_GZIP)) die_with_err(errno);
+            if (mcr_chunk_set(mcr, 1, 0, NULL)) die_with_err(errno);
+            if (mcr_flush(mcr)) die_with_err(errno);
+
+            mcr_chunk_info now;
+            mcr_chunk_stat(mcr, 0, 0, false, &now);
+            if(now.offset < old.offset + old.sectors && old.offset < now.offset + now.sectors)
+                die("FAILED. Chunk written over its only copy.");
+            if (mcr_close(mcr)) die("could not save mcr");
+
+            if(stat("delete_me.mcr", &after)) die("Could not stat region file");
+        }
+        if(after.st_size != before.st_size) die("FAILED. Region file kept growing.");
+
+        mcr = mcr_open("delete_me.mcr", O_RDONLY);
+        if (mcr == NULL) die("Could not read region file");
+
+        nbt_node* chunk = mcr_chunk_get(mcr, 0, 0);
+        if(chunk == NULL) die_with_err(errno);
+        if(!nbt_eq(chunk, tree_copy)) die("Trees not equal.");
+        nbt_free(chunk);
+
+        if(mcr_chunk_get(mcr, 1, 0) != NULL) die("FAILED. Deleted chunk still there.");
+
+        mcr_chunk_info info;
+        if(mcr_chunk_stat(mcr, 0, 0, true, &info)) die_with_err(errno);
+        if(info.offset < 2 || info.sectors == 0 || info.type != 1) die("FAILED. Bad chunk header.");
+        if(mcr_chunk_stat(mcr, 1, 0, true, &info)) die_with_err(errno);
+        if(info.sectors != 0 || info.type != -1) die("FAILED. Deleted chunk has sectors.");
+
+        chunk = mcr_chunk_get(mcr, 2, 0);
+        if(chunk == NULL) die_with_err(errno);
+        if(!nbt_eq(chunk, tree_copy)) die("Trees not equal.");
+        nbt_free(chunk);
+
+        mcr_close(mcr);
+
+        if(remove("delete_me.mcr") == -1)
+            die("Could not delete delete_me.mcr. Race condition?");
+    }
+    printf("OK.\n");
     
     
+    printf("Checking parallel region decode... ");
+    {
+        mcr = mcr_open("delete_me.mcr", O_RDWR|O_CREAT);
+        if (mcr == NULL) die("Could not create region file");
+
+        int expected = 0;
+        for(int x = 0; x < 32; x++)
+            for(int z = 0; z < 32; z++)
+                if((x + z) % 3 == 0)
+                {
+                    if(mcr_chunk_set(mcr, x, z, tree_copy)) die_with_err(errno);
+                    expected++;
+                }
+
+        if (mcr_close(mcr)) die("could not save mcr");
+
+        mcr = mcr_open("delete_me.mcr", O_RDONLY);
+        if (mcr == NULL) die("Could not read region file");
+
+        for(int threads = 1; threads <= 4; threads *= 2)
+        {
+            struct parallel_visit v = { PTHREAD_MUTEX_INITIALIZER, tree_copy, 0, 0 };
+
+            if(mcr_for_each_chunk_parallel(mcr, threads, visit_chunk, &v) != 0)
+                die_with_err(errno);
+            if(v.visited != expected || v.wrong != 0)
+                die("FAILED. Wrong chunks visited.");
+
+            pthread_mutex_destroy(&v.lock);
+        }
+
+        /* the chunks are the region's, but what the visitor does is the caller's */
+        struct counting_allocator counter = { PTHREAD_MUTEX_INITIALIZER, 0, 0 };
+        nbt_allocator counting = { counted_allocate, counted_reallocate, counted_release, &counter };
+        for(int threads = 1; threads <= 4; threads *= 4)
+        {
+            struct allocator_visit v = { PTHREAD_MUTEX_INITIALIZER, &counting, 0 };
+
+            nbt_use_allocator(&counting);
+            int ret = mcr_for_each_chunk_parallel(mcr, threads, visit_under, &v);
+            nbt_use_allocator(NULL);
+            if(ret != 0) die_with_err(errno);
+            if(v.wrong != 0) die("FAILED. Visitor ran under the region's allocator.");
+
+            pthread_mutex_destroy(&v.lock);
+        }
+        if(counter.live != 0) die("FAILED. Freed memory that wasn't allocated, or vice versa.");
+        pthread_mutex_destroy(&counter.lock);
+
+        mcr_close(mcr);
+    }
+    printf("OK.\n");
+
+    printf("Checking chunk prefetch... ");
+    {
+        mcr_io_backend backends[] = { MCR_IO_PREADV, MCR_IO_URING };
+
+        for(size_t i = 0; i < sizeof backends / sizeof *backends; i++)
+        {
+            mcr = mcr_open("delete_me.mcr", O_RDONLY);
+            if (mcr == NULL) die("Could not read region file");
+
+            if(mcr_set_io_backend(mcr, backends[i]))
+            {
+                mcr_close(mcr);
+                continue; /* not in this build */
+            }
+
+            /* every chunk is back to back, so that's one call per run of 512 */
+            long calls = mcr_prefetch(mcr, NULL, 0);
+            if(calls < 0) die_with_err(errno);
+            if(calls > 3) die("FAILED. Neighbouring chunks not coalesced.");
+            if(backends[i] == MCR_IO_PREADV && mcr_get_io_backend(mcr) != MCR_IO_PREADV)
+                die("FAILED. Wrong backend reported.");
+            if(mcr_prefetch(mcr, NULL, 0) != 0) die("FAILED. Chunks read twice.");
+
+            for(int x = 0; x < 32; x++)
+                for(int z = 0; z < 32; z++)
+                {
+                    nbt_node* chunk = mcr_chunk_get(mcr, x, z);
+                    if(((x + z) % 3 == 0) != (chunk != NULL)) die("FAILED. Wrong chunks prefetched.");
+                    if(chunk && !nbt_eq(chunk, tree_copy)) die("Trees not equal.");
+                    nbt_free(chunk);
+                }
+
+            mcr_close(mcr);
+        }
+
+        if(remove("delete_me.mcr") == -1)
+            die("Could not delete delete_me.mcr. Race condition?");
+    }
+    printf("OK.\n");
+
+    printf("Checking background chunk compression... ");
+    {
+        mcr = mcr_open("delete_me.mcr", O_RDWR|O_CREAT);
+        if (mcr == NULL) die("Could not create region file");
+        if (mcr_set_async(mcr, 2)) die_with_err(errno);
+
+        for(int x = 0; x < 32; x++)
+            if(mcr_chunk_set(mcr, x, 3, tree_copy)) die_with_err(errno);
+
+        /* the last word on a chunk wins, however the workers finish */
+        if(mcr_chunk_set(mcr, 0, 3, NULL)) die_with_err(errno);
+        if(mcr_chunk_set(mcr, 1, 3, NULL) || mcr_chunk_set(mcr, 1, 3, tree_copy)) die_with_err(errno);
+
+        if(mcr_chunk_exists(mcr, 0, 3) || !mcr_chunk_exists(mcr, 1, 3))
+            die("FAILED. Chunk set out of order.");
+        if(mcr_flush(mcr)) die_with_err(errno);
+
+        /* and back to compressing on the spot */
+        if(mcr_set_async(mcr, 0)) die_with_err(errno);
+        if(mcr_chunk_set(mcr, 31, 3, NULL)) die_with_err(errno);
+        if (mcr_close(mcr)) die("could not save mcr");
+
+        mcr = mcr_open("delete_me.mcr", O_RDONLY);
+        if (mcr == NULL) die("Could not read region file");
+        for(int x = 0; x < 32; x++)
+        {
+            nbt_node* chunk = mcr_chunk_get(mcr, x, 3);
+            if((x == 0 || x == 31) != (chunk == NULL)) die("FAILED. Wrong chunks written.");
+            if(chunk && !nbt_eq(chunk, tree_copy)) die("Trees not equal.");
+            nbt_free(chunk);
+        }
+        mcr_close(mcr);
+
+        if(remove("delete_me.mcr") == -1)
+            die("Could not delete delete_me.mcr. Race condition?");
+    }
+    printf("OK.\n");
+
+    printf("Checking raw chunk copy... ");
+    {
+        mcr = mcr_open("delete_me.mcr", O_RDWR|O_CREAT);
+        if (mcr == NULL) die("Could not create region file");
+        if (mcr_chunk_set_strat(mcr, 0, 0, tree_copy, STRAT_GZIP)) die_with_err(errno);
+
+        uint8_t type;
+        struct buffer raw = mcr_chunk_get_raw(mcr, 0, 0, &type);
+        if(raw.data == NULL) die_with_err(errno);
+        if(type != 1) die("FAILED. Wrong compression type.");
+        if(mcr_chunk_set_raw(mcr, 5, 5, type, raw.data, raw.len, 1234)) die_with_err(errno);
+        size_t raw_len = raw.len;
+        buffer_free(&raw);
+
+        raw = mcr_chunk_get_raw(mcr, 6, 6, &type);
+        if(raw.data != NULL || errno != NBT_OK) die("FAILED. Missing chunk copied.");
+        if (mcr_close(mcr)) die("could not save mcr");
+
+        mcr = mcr_open("delete_me.mcr", O_RDONLY);
+        if (mcr == NULL) die("Could not read region file");
+        nbt_node* chunk = mcr_chunk_get(mcr, 5, 5);
+        if(chunk == NULL) die_with_err(errno);
+        if(!nbt_eq(chunk, tree_copy)) die("Trees not equal.");
+        nbt_free(chunk);
+        if(mcr_chunk_timestamp(mcr, 5, 5) != 1234) die("FAILED. Timestamp not copied.");
+
+        /* some writers leave the last byte out of the length, which a copy has to keep */
+        mcr_chunk_info info;
+        mcr_chunk_stat(mcr, 5, 5, false, &info);
+        mcr_close(mcr);
+
+        FILE* fp = fopen("delete_me.mcr", "r+b");
+        unsigned char length[4];
+        if(fp == NULL || fseek(fp, (long)info.offset * 4096, SEEK_SET) || fread(length, 4, 1, fp) != 1)
+            die("Could not read the chunk length back.");
+        uint32_t shorter = ((uint32_t)length[0] << 24 | (uint32_t)length[1] << 16 | (uint32_t)length[2] << 8 | length[3]) - 1;
+        for(int b = 0; b < 4; b++) length[b] = (unsigned char)(shorter >> (24 - 8 * b));
+        if(fseek(fp, (long)info.offset * 4096, SEEK_SET) || fwrite(length, 4, 1, fp) != 1 || fclose(fp))
+            die("Could not shorten the chunk length.");
+
+        mcr = mcr_open("delete_me.mcr", O_RDONLY);
+        if (mcr == NULL) die("Could not read region file");
+        raw = mcr_chunk_get_raw(mcr, 5, 5, &type);
+        if(raw.data == NULL) die_with_err(errno);
+        if(raw.len != raw_len) die("FAILED. Raw copy lost the byte the length left out.");
+        buffer_free(&raw);
+        mcr_close(mcr);
+
+        if(remove("delete_me.mcr") == -1)
+            die("Could not delete delete_me.mcr. Race condition?");
+    }
+    printf("OK.\n");
+
+    printf("Checking memory accounting... ");
+    {
+        nbt_node* root = new_node(TAG_COMPOUND, "root");
+        nbt_node* id = new_node(TAG_STRING, "id");
+        id->payload.tag_string = copy_string("abc");
+        add_child(root, new_byte_array("Blocks", 100));
+        add_child(root, id);
+
+        nbt_memory_stats m = nbt_memory_usage(root);
+        if(m.nodes != 3 * sizeof(nbt_node) || m.entries != 3 * sizeof(struct tag_list))
+            die("FAILED. Wrong structure size.");
+        if(m.names != 5 + 7 + 3 || m.strings != 4 || m.arrays != 100)
+            die("FAILED. Wrong payload size.");
+        if(m.overhead == 0 || m.total != m.nodes + m.entries + m.names + m.strings + m.arrays + m.overhead)
+            die("FAILED. Wrong total.");
+
+        /* a snapshot shares everything but its root, which is all it adds */
+        nbt_node* snap = nbt_clone_shared(root);
+        if(snap == NULL) die_with_err(errno);
+        nbt_memory_stats own = nbt_memory_usage_unshared(snap);
+        if(own.nodes != sizeof(nbt_node) || own.entries != 3 * sizeof(struct tag_list) || own.names != 5)
+            die("FAILED. Shared children counted as the snapshot's own.");
+        if(nbt_memory_usage(snap).total != m.total) die("FAILED. Snapshot not counted in full.");
+        nbt_free(snap);
+        nbt_free(root);
+
+        mcr = mcr_open("delete_me.mcr", O_RDWR|O_CREAT);
+        if (mcr == NULL) die("Could not create region file");
+        mcr_memory_stats before = mcr_memory_usage(mcr);
+        if(before.pending != 0 || before.cached != 0 || before.total < before.header)
+            die("FAILED. Empty region has chunks.");
+
+        if (mcr_chunk_set(mcr, 3, 4, tree_copy)) die_with_err(errno);
+        mcr_memory_stats set = mcr_memory_usage(mcr);
+        if(set.pending == 0 || set.total <= before.total) die("FAILED. Set chunk not counted.");
+
+        if (mcr_flush(mcr)) die_with_err(errno);
+        mcr_memory_stats flushed = mcr_memory_usage(mcr);
+        if(flushed.pending != 0 || flushed.cached != set.pending) die("FAILED. Flushed chunk still pending.");
+
+        if (mcr_close(mcr)) die("could not save mcr");
+        if(remove("delete_me.mcr") == -1)
+            die("Could not delete delete_me.mcr. Race condition?");
+    }
+    printf("OK.\n");
+
+    printf("Checking world chunk cache... ");
+    {
+        if(mkdir("delete_me_world", 0777) == -1) die("Could not create a temporary world.");
+
+        mcr = mcr_open("delete_me_world/r.0.0.mca", O_RDWR|O_CREAT);
+        if (mcr == NULL) die("Could not create region file");
+        if (mcr_chunk_set(mcr, 1, 2, tree_copy)) die_with_err(errno);
+        if (mcr_close(mcr)) die("could not save mcr");
+
+        mcr = mcr_open("delete_me_world/r.-1.-1.mca", O_RDWR|O_CREAT);
+        if (mcr == NULL) die("Could not create region file");
+        if (mcr_chunk_set(mcr, 31, 31, tree_copy)) die_with_err(errno);
+        if (mcr_close(mcr)) die("could not save mcr");
+
+        /* a budget of one byte keeps nothing that isn't being held */
+        World* world = world_open("delete_me_world", 1);
+        if (world == NULL) die_with_err(errno);
+
+        nbt_intern* pool = nbt_intern_create();
+        if (pool == NULL) die_with_err(errno);
+        world_set_intern(world, pool);
+
+        nbt_node* a = world_chunk_get(world, 1, 2);
+        nbt_node* b = world_chunk_get(world, 1, 2);
+        nbt_node* c = world_chunk_get(world, -1, -1);
+        if(a == NULL || c == NULL) die_with_err(errno);
+        if(a != b) die("FAILED. Held chunk not shared.");
+        if(!nbt_eq(a, tree_copy) || !nbt_eq(c, tree_copy)) die("Trees not equal.");
+
+        /* the two chunks are the same, so the second is all the pool's */
+        nbt_intern_stats pool_stats;
+        nbt_intern_get_stats(pool, &pool_stats);
+        if(pool_stats.hits == 0) die("FAILED. Chunks not interned.");
+
+        /* what the chunks share is the pool's, and counted there */
+        world_stats stats;
+        world_get_stats(world, &stats);
+        if(pool_stats.bytes == 0 || stats.bytes <= pool_stats.bytes) die("FAILED. Pool not charged to the world.");
+        if(world_chunk_get(world, 0, 0) != NULL || errno != NBT_OK) die("FAILED. Missing chunk found.");
+        if(world_chunk_get(world, 40, 40) != NULL || errno != NBT_OK) die("FAILED. Missing region found.");
+
+        world_chunk_release(world, 1, 2);
+        world_chunk_release(world, 1, 2);
+        world_chunk_release(world, -1, -1);
+
+        world_get_stats(world, &stats);
+        if(stats.hits != 1 || stats.misses != 4 || stats.evictions != 2 || stats.bytes != 0)
+            die("FAILED. Wrong cache counters.");
+        if(stats.region_misses != 3 || stats.region_hits != 1 || stats.regions != 2)
+            die("FAILED. Wrong region counters.");
+
+        /* a region that can't be read is an error, not a missing region, and it isn't remembered */
+        if(mkdir("delete_me_world/r.5.5.mca", 0777) == -1) die("Could not create an unreadable region.");
+        if(world_chunk_get(world, 160, 160) != NULL || errno == NBT_OK) die("FAILED. Unreadable region taken for missing.");
+        if(world_chunk_exists(world, 160, 160) != -1) die("FAILED. Unreadable region taken for missing.");
+        if(remove("delete_me_world/r.5.5.mca") == -1) die("Could not delete the unreadable region.");
+        world_get_stats(world, &stats);
+        if(stats.regions != 2) die("FAILED. Unreadable region cached.");
+
+        int rx, rz, x, z;
+        world_chunk_region(-1, -33, &rx, &rz, &x, &z);
+        if(rx != -1 || rz != -2 || x != 31 || z != 31)
+            die("FAILED. Wrong region for a chunk.");
+
+        world_set_region_limit(world, 1);
+        if(world_chunk_exists(world, 1, 2) != 1 || world_chunk_exists(world, -1, -1) != 1 ||
+           world_chunk_exists(world, 1, 3) != 0 || world_chunk_exists(world, 40, 40) != 0)
+            die("FAILED. Wrong chunk presence.");
+
+        world_get_stats(world, &stats);
+        if(stats.regions != 1 || stats.region_evictions < 2)
+            die("FAILED. Region limit not kept.");
+
+        world_close(world);
+
+        nbt_intern_trim(pool);
+        nbt_intern_get_stats(pool, &pool_stats);
+        if(pool_stats.entries != 0) die("FAILED. Pool kept a closed world's chunks.");
+        nbt_intern_free(pool);
+
+        /* a world keeps to the allocator it was opened under, whoever uses it */
+        struct counting_allocator counter = { PTHREAD_MUTEX_INITIALIZER, 0, 0 };
+        nbt_allocator counting = { counted_allocate, counted_reallocate, counted_release, &counter };
+
+        nbt_use_allocator(&counting);
+        world = world_open("delete_me_world", 1);
+        nbt_use_allocator(NULL);
+        if (world == NULL) die_with_err(errno);
+
+        if(world_chunk_get(world, 1, 2) == NULL) die_with_err(errno);
+        world_chunk_release(world, 1, 2);
+        if(counter.live == 0) die("FAILED. Nothing came from the world's allocator.");
+
+        world_close(world);
+        if(counter.live != 0) die("FAILED. Freed memory that wasn't allocated, or vice versa.");
+        pthread_mutex_destroy(&counter.lock);
+
+        if(remove("delete_me_world/r.0.0.mca") == -1 ||
+           remove("delete_me_world/r.-1.-1.mca") == -1 ||
+           remove("delete_me_world") == -1)
+            die("Could not delete delete_me_world. Race condition?");
+    }
+    printf("OK.\n");
+
+    printf("Checking incremental world scan... ");
+    {
+        if(mkdir("delete_me_world", 0777) == -1) die("Could not create a temporary world.");
+
+        uint32_t before = (uint32_t)time(NULL);
+
+        mcr = mcr_open("delete_me_world/r.0.0.mca", O_RDWR|O_CREAT);
+        if (mcr == NULL) die("Could not create region file");
+        if (mcr_chunk_set(mcr, 1, 2, tree_copy)) die_with_err(errno);
+        if (mcr_close(mcr)) die("could not save mcr");
+
+        mcr = mcr_open("delete_me_world/r.-1.-1.mca", O_RDWR|O_CREAT);
+        if (mcr == NULL) die("Could not create region file");
+        if (mcr_chunk_set(mcr, 31, 31, tree_copy)) die_with_err(errno);
+        if (mcr_close(mcr)) die("could not save mcr");
+
+        uint32_t after = (uint32_t)time(NULL);
+
+        /* backdate chunk (31, 31): its timestamp is the last entry of the header */
+        FILE* fp = fopen("delete_me_world/r.-1.-1.mca", "r+b");
+        const unsigned char old[4] = { 0, 0, 0x03, 0xE8 }; /* 1000 */
+        if(fp == NULL || fseek(fp, 8188, SEEK_SET) || fwrite(old, 1, 4, fp) != 4 || fclose(fp))
+            die("Could not backdate a chunk.");
+
+        mcr = mcr_open("delete_me_world/r.0.0.mca", O_RDONLY);
+        if (mcr == NULL) die("Could not read region file");
+        uint32_t t = mcr_chunk_timestamp(mcr, 1, 2);
+        if(t < before || t > after) die("FAILED. Wrong chunk timestamp.");
+        if(mcr_chunk_timestamp(mcr, 0, 0) != 0) die("FAILED. Missing chunk has a timestamp.");
+        mcr_close(mcr);
+
+        mcr = mcr_open("delete_me_world/r.-1.-1.mca", O_RDONLY);
+        if (mcr == NULL) die("Could not read region file");
+        if(mcr_chunk_timestamp(mcr, 31, 31) != 1000) die("FAILED. Wrong chunk timestamp.");
+        mcr_close(mcr);
+
+        World* world = world_open("delete_me_world", 1);
+        if (world == NULL) die_with_err(errno);
+
+        uint32_t since;
+        if(world_checkpoint_load(world, "checkpoint", &since) || since != 0)
+            die("FAILED. A missing checkpoint isn't 0.");
+
+        struct since_visit v = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0 };
+        if(world_for_each_chunk_since(world, since, 2, visit_since, &v) != 0) die_with_err(errno);
+        if(v.visited != 2) die("FAILED. Not every chunk visited.");
+
+        if(world_checkpoint_save(world, "checkpoint", 2000)) die_with_err(errno);
+        if(world_checkpoint_load(world, "checkpoint", &since) || since != 2000)
+            die("FAILED. Checkpoint not kept.");
+
+        v.visited = 0;
+        if(world_for_each_chunk_since(world, since, 2, visit_since, &v) != 0) die_with_err(errno);
+        if(v.visited != 1 || v.last_x != 1 || v.last_z != 2) die("FAILED. Old chunk visited.");
+
+        v.visited = 0;
+        if(world_for_each_chunk_since(world, after + 1, 1, visit_since, &v) != 0) die_with_err(errno);
+        if(v.visited != 0) die("FAILED. Chunk from the future.");
+
+        world_close(world);
+
+        if(remove("delete_me_world/checkpoint") == -1 ||
+           remove("delete_me_world/r.0.0.mca") == -1 ||
+           remove("delete_me_world/r.-1.-1.mca") == -1 ||
+           remove("delete_me_world") == -1)
+            die("Could not delete delete_me_world. Race condition?");
+    }
+    printf("OK.\n");
+
+    printf("Checking anvil chunks... ");
+    {
+        anvil_chunk* chunk = anvil_chunk_wrap(make_anvil_chunk());
+        if(chunk == NULL) die_with_err(errno);
+
+        if(anvil_chunk_section(chunk, 1) == NULL || anvil_chunk_section(chunk, 1)->blocks == NULL)
+            die("FAILED. Legacy section not found.");
+        if(anvil_chunk_section(chunk, 2) == NULL || anvil_chunk_section(chunk, 2)->bits != 5)
+            die("FAILED. Palette section not found.");
+
+        if(anvil_set_block(chunk, 3, 20, 5, 42, 7)) die_with_err(errno);
+        if(anvil_set_block(chunk, 4, 37, 9, 17, 0)) die_with_err(errno);
+        if(anvil_set_block(chunk, 5, 37, 9, 19, 0)) die_with_err(errno);
+        if(anvil_set_block(chunk, 3, 20, 5, 300, 0) == 0) die("FAILED. Id too big for a section without Add.");
+        if(anvil_set_block(chunk, 4, 37, 9, 20, 0) == 0) die("FAILED. Index past the end of the palette.");
+        if(anvil_set_block(chunk, 0, 100, 0, 1, 0) == 0) die("FAILED. Set a block in a missing section.");
+        check_anvil_blocks(chunk);
+
+        /* and again after a trip through the binary format */
+        struct buffer b = nbt_dump_binary(anvil_chunk_root(chunk));
+        if(b.data == NULL) die_with_err(errno);
+
+        nbt_node* reparsed = nbt_parse(b.data, b.len);
+        if(reparsed == NULL) die_with_err(errno);
+        if(!nbt_eq(reparsed, anvil_chunk_root(chunk))) die("Trees not equal.");
+
+        anvil_chunk* copy = anvil_chunk_wrap(reparsed);
+        if(copy == NULL) die_with_err(errno);
+        check_anvil_blocks(copy);
+
+        anvil_chunk_free(copy);
+        anvil_chunk_free(chunk);
+        buffer_free(&b);
+    }
+    printf("OK.\n");
+
+    printf("Checking path queries... ");
+    {
+        static const struct {
+            const char* expr;
+            int matches;
+        } queries[] = {
+            { "Level.Sections[*].Y",           2 },
+            { "Level.Sections[-1].Palette[*]", 20 },
+            { "..{byte_array}",                2 },
+            { "Level..Y{byte}",                2 },
+            { "'Level'.*[1].*{list}",          1 },
+            { "Level.Sections[5]",             0 },
+            { "",                              1 }
+        };
+        enum { NQUERIES = sizeof queries / sizeof *queries };
+
+        nbt_node* chunk = make_anvil_chunk();
+        nbt_query* compiled[NQUERIES];
+        int counts[NQUERIES] = { 0 };
+
+        for(size_t i = 0; i < NQUERIES; i++)
+            if((compiled[i] = nbt_query_compile(queries[i].expr)) == NULL)
+                die_with_err(errno);
+
+        if(nbt_query_run_batch(chunk, compiled, NQUERIES, count_match, counts) != 0)
+            die_with_err(errno);
+        for(size_t i = 0; i < NQUERIES; i++)
+            if(counts[i] != queries[i].matches)
+                die("FAILED. Wrong number of matches.");
+
+        /* matches come in tree order, so the first Y is the first section's */
+        nbt_node* y = NULL;
+        if(nbt_query_run(chunk, compiled[0], first_match, &y) != 1) die("FAILED. Visitor not obeyed.");
+        if(y == NULL || y->payload.tag_byte != 1) die("FAILED. Matches out of order.");
+
+        static const char* bad[] = { ".Level", "Level.[0]", "Level[x]", "{nope}", "'Level", "Level.." };
+        for(size_t i = 0; i < sizeof bad / sizeof *bad; i++)
+            if(nbt_query_compile(bad[i]) != NULL || errno != NBT_ERR)
+                die("FAILED. Bad query compiled.");
+
+        for(size_t i = 0; i < NQUERIES; i++)
+            nbt_query_free(compiled[i]);
+        nbt_free(chunk);
+    }
+    printf("OK.\n");
+
+    printf("Checking tree hashes... ");
+    {
+        if(nbt_hash(tree) != nbt_hash(tree_copy)) die("FAILED. Equal trees hash differently.");
+        if(!nbt_eq(tree, tree_copy)) die("FAILED. Hashing changed nbt_eq.");
+
+        /* an edit after hashing shows up once the cache is dropped */
+        nbt_node* root = make_anvil_chunk();
+        nbt_node* clone = nbt_clone_shared(root);
+        if(clone == NULL) die_with_err(errno);
+        if(nbt_hash(root) != nbt_hash(clone)) die("FAILED. Clone hashes differently.");
+
+        nbt_query* q = nbt_query_compile("Level.Sections[0].Y");
+        if(q == NULL) die_with_err(errno);
+        nbt_node* y = NULL;
+        nbt_query_run(clone, q, first_match, &y);
+        if(y == NULL) die("FAILED. Section not found.");
+        nbt_query_free(q);
+
+        /* the clone shares Y with the original until it's made its own */
+        if((y = nbt_mutable(clone, y)) == NULL) die_with_err(errno);
+        y->payload.tag_byte = 9;
+        if(nbt_hash(root) == nbt_hash(clone)) die("FAILED. Edit not hashed.");
+        if(nbt_eq(root, clone) || nbt_eq_hashed(root, clone)) die("FAILED. Trees with different hashes equal.");
+
+        /* putting it back by hand leaves a stale hash, which only nbt_eq_hashed believes */
+        y->payload.tag_byte = 1;
+        if(!nbt_eq(root, clone)) die("FAILED. Stale hash made equal trees differ.");
+        if(nbt_eq_hashed(root, clone)) die("FAILED. Cached hashes not used.");
+        nbt_hash_invalidate(clone);
+        if(!nbt_eq_hashed(root, clone)) die("FAILED. Trees not equal after invalidating.");
+
+        /* floats that are only nearly equal still compare equal, hashed or not */
+        nbt_node* a = new_node(TAG_COMPOUND, "");
+        nbt_node* b = new_node(TAG_COMPOUND, "");
+        nbt_node* f = new_node(TAG_FLOAT, "f");
+        f->payload.tag_float = 1.0f;
+        add_child(a, f);
+        f = new_node(TAG_FLOAT, "f");
+        f->payload.tag_float = 1.0f + 1e-7f;
+        add_child(b, f);
+        if(nbt_hash(a) == nbt_hash(b)) die("FAILED. Floats hashed loosely.");
+        if(!nbt_eq(a, b)) die("FAILED. Hashes overrode the float tolerance.");
+        nbt_free(a);
+        nbt_free(b);
+
+        /* block writes go into arrays behind the tree's back */
+        anvil_chunk* chunk = anvil_chunk_wrap(root);
+        if(chunk == NULL) die_with_err(errno);
+        uint64_t before = nbt_hash(anvil_chunk_root(chunk));
+        if(anvil_set_block(chunk, 3, 20, 5, 42, 7)) die_with_err(errno);
+        if(nbt_hash(anvil_chunk_root(chunk)) == before) die("FAILED. Block write not hashed.");
+
+        anvil_chunk_free(chunk);
+        nbt_free(clone);
+    }
+    printf("OK.\n");
+
+    printf("Checking shared clones... ");
+    {
+        /* an undo history: a snapshot before every edit */
+        enum { EDITS = 50 };
+        nbt_node* history[EDITS];
+        nbt_node* root = make_anvil_chunk();
+
+        nbt_query* q = nbt_query_compile("Level.Sections[0].Y");
+        if(q == NULL) die_with_err(errno);
+
+        for(int i = 0; i < EDITS; i++)
+        {
+            if((history[i] = nbt_clone_shared(root)) == NULL) die_with_err(errno);
+
+            nbt_node* y = NULL;
+            nbt_query_run(root, q, first_match, &y);
+            if((y = nbt_mutable(root, y)) == NULL) die_with_err(errno);
+            y->payload.tag_byte = (int8_t)(i + 2);
+        }
+
+        for(int i = 0; i < EDITS; i++)
+        {
+            nbt_node* y = NULL;
+            nbt_query_run(history[i], q, first_match, &y);
+            if(y == NULL || y->payload.tag_byte != (i == 0 ? 1 : i + 1))
+                die("FAILED. Snapshot changed.");
+        }
+
+        /* the section that was never touched is the same node in all of them */
+        nbt_node* sections = nbt_find_by_name(nbt_find_by_name(root, "Level"), "Sections");
+        nbt_node* old = nbt_find_by_name(nbt_find_by_name(history[0], "Level"), "Sections");
+        if(nbt_list_item(sections, 1) != nbt_list_item(old, 1)) die("FAILED. Section copied.");
+        if(nbt_list_item(sections, 0) == nbt_list_item(old, 0)) die("FAILED. Section not copied.");
+
+        /* filtering and block writes leave the snapshot alone too */
+        nbt_node* copy = nbt_clone_shared(history[0]);
+        if(copy == NULL) die_with_err(errno);
+        size_t calls = 0;
+        nbt_filter_inplace(copy, count_all_but_data, &calls);
+
+        /* the predicate is asked once about each node, shared or not */
+        nbt_node* own = nbt_clone(history[0]);
+        if(own == NULL) die_with_err(errno);
+        size_t own_calls = 0;
+        nbt_filter_inplace(own, count_all_but_data, &own_calls);
+        if(calls != own_calls) die("FAILED. Predicate called again on shared nodes.");
+        if(!nbt_eq(copy, own)) die("FAILED. Shared and deep filters differ.");
+        nbt_free(own);
+
+        anvil_chunk* chunk = anvil_chunk_wrap(nbt_clone_shared(history[0]));
+        if(chunk == NULL) die_with_err(errno);
+        if(anvil_set_block(chunk, 3, 20, 5, 42, 7)) die_with_err(errno);
+
+        nbt_node* fresh = make_anvil_chunk();
+        if(!nbt_eq(history[0], fresh)) die("FAILED. Snapshot changed.");
+        if(nbt_eq(copy, fresh)) die("FAILED. Filter didn't filter.");
+
+        nbt_free(fresh);
+        anvil_chunk_free(chunk);
+        nbt_free(copy);
+        for(int i = EDITS - 1; i >= 0; i--)
+            nbt_free(history[i]);
+        nbt_free(root);
+        nbt_query_free(q);
+    }
+    printf("OK.\n");
+
+    printf("Checking intern pool... ");
+    {
+        nbt_intern* pool = nbt_intern_create();
+        if(pool == NULL) die_with_err(errno);
+
+        nbt_node* a = make_anvil_chunk();
+        nbt_node* b = make_anvil_chunk();
+
+        size_t first = nbt_intern_tree(pool, a);
+        if(nbt_intern_tree(pool, b) <= first) die("FAILED. Second tree not deduplicated.");
+        if(nbt_find_by_name(a, "Level") != nbt_find_by_name(b, "Level")) die("FAILED. Level not shared.");
+
+        /* a pooled subtree is shared, and can't have its children swapped */
+        if(nbt_intern_tree(pool, nbt_find_by_name(a, "Level")) != 0 || errno != NBT_ERR)
+            die("FAILED. Shared tree interned in place.");
+
+        /* the twenty empty palette entries in one tree are one node now */
+        nbt_node* palette = nbt_find_by_name(a, "Palette");
+        if(nbt_list_item(palette, 0) != nbt_list_item(palette, 19)) die("FAILED. Palette entries not shared.");
+
+        /* changing one tree leaves the other be */
+        nbt_node* y = nbt_find_by_name(b, "Y");
+        if((y = nbt_mutable(b, y)) == NULL) die_with_err(errno);
+        y->payload.tag_byte = 5;
+        if(nbt_find_by_name(a, "Y")->payload.tag_byte != 1) die("FAILED. Interned node changed.");
+
+        nbt_intern_stats stats;
+        nbt_intern_get_stats(pool, &stats);
+        if(stats.hits == 0 || stats.bytes_saved == 0 || stats.entries == 0) die("FAILED. Wrong stats.");
+
+        nbt_free(a);
+        nbt_free(b);
+        nbt_intern_trim(pool);
+        nbt_intern_get_stats(pool, &stats);
+        if(stats.entries != 0) die("FAILED. Unused subtrees kept.");
+
+        nbt_intern_free(pool);
+    }
+    printf("OK.\n");
+
+    printf("Checking tree diffs... ");
+    {
+        nbt_node* before = make_anvil_chunk();
+        nbt_node* after = nbt_clone(before);
+        if(after == NULL) die_with_err(errno);
+
+        /* a block, an entry gone, an entry added and a palette entry appended */
+        anvil_chunk* chunk = anvil_chunk_wrap(after);
+        if(chunk == NULL) die_with_err(errno);
+        if(anvil_set_block(chunk, 3, 20, 5, 42, 7)) die_with_err(errno);
+        after = anvil_chunk_root(chunk);
+
+        nbt_query* q = nbt_query_compile("Level.Sections[1].Palette");
+        if(q == NULL) die_with_err(errno);
+        nbt_node* palette = NULL;
+        nbt_query_run(after, q, first_match, &palette);
+        if(palette == NULL) die("FAILED. Palette not found.");
+        if((palette = nbt_mutable(after, palette)) == NULL) die_with_err(errno);
+        add_list_item(palette, new_node(TAG_COMPOUND, NULL));
+        nbt_query_free(q);
+
+        nbt_node* level = nbt_mutable(after, nbt_find_by_name(after, "Level"));
+        if(level == NULL) die_with_err(errno);
+        add_child(level, new_node(TAG_LONG, "LastUpdate"));
+        nbt_node* legacy = nbt_mutable(after, nbt_list_item(nbt_find_by_name(level, "Sections"), 0));
+        if(legacy == NULL) die_with_err(errno);
+        nbt_filter_inplace(legacy, keep_all_but_data, NULL);
+        nbt_hash_invalidate(after);
+
+        nbt_node* diff = nbt_diff(before, after);
+        if(diff == NULL) die_with_err(errno);
+
+        /* the diff travels as bytes, and is a lot smaller than the chunk */
+        struct buffer whole = nbt_dump_binary(after);
+        struct buffer sent  = nbt_dump_binary(diff);
+        if(whole.data == NULL || sent.data == NULL) die_with_err(errno);
+        if(sent.len * 20 > whole.len) die("FAILED. Diff too big.");
+
+        nbt_node* received = nbt_parse(sent.data, sent.len);
+        if(received == NULL) die_with_err(errno);
+
+        if((err = nbt_patch(before, received)) != NBT_OK) die_with_err(err);
+        if(!nbt_eq(before, after)) die("FAILED. Patched tree not equal.");
+        if(nbt_patch(before, received) != NBT_ERR) die("FAILED. Patched the wrong tree.");
+
+        /* nothing changed, nothing to do */
+        nbt_node* none = nbt_diff(tree, tree_copy);
+        if(none == NULL) die_with_err(errno);
+        if(nbt_find_by_name(none, "ops")->payload.tag_list.list->entry.flink !=
+           &nbt_find_by_name(none, "ops")->payload.tag_list.list->entry)
+            die("FAILED. Equal trees have a diff.");
+
+        /* an edit in place behind a stale hash still makes it into the diff */
+        nbt_node* old = make_anvil_chunk();
+        nbt_node* edited = make_anvil_chunk();
+        if(nbt_hash(old) != nbt_hash(edited)) die("FAILED. Equal trees hash differently.");
+        nbt_find_by_name(edited, "Y")->payload.tag_byte = 9;
+
+        nbt_node* stale = nbt_diff(old, edited);
+        if(stale == NULL) die_with_err(errno);
+        if((err = nbt_patch(old, stale)) != NBT_OK) die_with_err(err);
+        if(!nbt_eq(old, edited)) die("FAILED. Edit behind a stale hash dropped.");
+
+        /* an op that fails takes the ones before it back with it */
+        nbt_node* bad = new_node(TAG_COMPOUND, NULL);
+        nbt_node* kind = new_node(TAG_BYTE, "op");
+        nbt_node* path = new_node(TAG_LIST, "path");
+        nbt_node* step = new_node(TAG_STRING, NULL);
+        step->payload.tag_string = copy_string("nowhere");
+        add_list_item(path, step);
+        add_child(bad, kind);
+        add_child(bad, path);
+        add_list_item(nbt_find_by_name(stale, "ops"), bad);
+
+        nbt_node* untouched = make_anvil_chunk();
+        if(nbt_patch(untouched, stale) != NBT_ERR) die("FAILED. Bad op applied.");
+        nbt_node* fresh_chunk = make_anvil_chunk();
+        if(!nbt_eq(untouched, fresh_chunk)) die("FAILED. Failed patch left half applied.");
+
+        /* a tree that's shared is left alone, rather than changed for everyone */
+        nbt_node* snapshot = nbt_clone_shared(untouched);
+        if(snapshot == NULL) die_with_err(errno);
+        nbt_node* shared_level = nbt_find_by_name(untouched, "Level");
+        nbt_node* level_copy = nbt_clone(shared_level);
+        nbt_node* other = nbt_clone(shared_level);
+        if(level_copy == NULL || other == NULL) die_with_err(errno);
+        add_child(other, new_node(TAG_INT, "Extra"));
+        nbt_node* grow = nbt_diff(level_copy, other);
+        if(grow == NULL) die_with_err(errno);
+        if(nbt_patch(shared_level, grow) != NBT_ERR) die("FAILED. Shared tree patched.");
+        if(!nbt_eq(snapshot, fresh_chunk)) die("FAILED. Snapshot changed by a patch.");
+
+        nbt_free(grow);
+        nbt_free(other);
+        nbt_free(level_copy);
+        nbt_free(snapshot);
+        nbt_free(fresh_chunk);
+        nbt_free(untouched);
+
+        nbt_free(stale);
+        nbt_free(edited);
+        nbt_free(old);
+        nbt_free(none);
+        nbt_free(received);
+        nbt_free(diff);
+        buffer_free(&whole);
+        buffer_free(&sent);
+        anvil_chunk_free(chunk);
+        nbt_free(before);
+    }
+    printf("OK.\n");
+
+    printf("Checking tree iterators... ");
+    {
+        size_t size = nbt_size(tree);
+        struct visit_order order = { malloc(size * sizeof(nbt_node*)), 0 };
+        if(order.nodes == NULL) die("Out of memory.");
+        nbt_map(tree, record_node, &order);
+        if(order.len != size) die("FAILED. nbt_size disagrees with nbt_map.");
+
+        /* the same walk as nbt_map, and children are one deeper than their parent */
+        size_t i = 0, parent_depth = 0;
+        bool expect_child = false;
+        nbt_iterator it;
+        for(nbt_node* n = nbt_iter_begin(&it, tree); n; n = nbt_iter_next(&it), i++)
+        {
+            if(i >= size || n != order.nodes[i]) die("FAILED. Iterator went its own way.");
+            if(expect_child && it.depth != parent_depth + 1) die("FAILED. Wrong depth.");
+
+            expect_child = (n->type == TAG_LIST || n->type == TAG_COMPOUND) &&
+                           !list_empty(&nbt_children(n)->entry);
+            parent_depth = it.depth;
+        }
+        nbt_iter_end(&it);
+        if(i != size) die("FAILED. Iterator stopped early.");
+        free(order.nodes);
+
+        /* skipping everything under the root's children leaves just those */
+        size_t children = 0, visited = 0;
+        nbt_node* child;
+        nbt_for_each_child(child, tree)
+            children += child != NULL;
+        for(nbt_node* n = nbt_iter_begin(&it, tree); n; n = nbt_iter_next(&it))
+        {
+            if(it.depth == 1) nbt_iter_skip(&it);
+            visited++;
+        }
+        nbt_iter_end(&it);
+        if(visited != children + 1) die("FAILED. Skipped subtrees visited.");
+
+        /* far deeper than the iterator's own stack, and than recursion would like */
+        enum { DEPTH = 100000 };
+        nbt_node* deep = new_node(TAG_COMPOUND, "top");
+        nbt_node* bottom = deep;
+        for(size_t d = 0; d < DEPTH; d++)
+        {
+            nbt_node* next = new_node(TAG_COMPOUND, d == DEPTH - 1 ? "bottom" : "");
+            add_child(bottom, next);
+            bottom = next;
+        }
+
+        size_t deepest = 0;
+        for(nbt_node* n = nbt_iter_begin(&it, deep); n; n = nbt_iter_next(&it))
+            deepest = it.depth;
+        nbt_iter_end(&it);
+        if(deepest != DEPTH) die("FAILED. Deep tree cut short.");
+
+        if(nbt_size(deep) != DEPTH + 1 || errno != NBT_OK) die("FAILED. Deep tree miscounted.");
+        if(nbt_find_by_name(deep, "bottom") != bottom) die("FAILED. Deepest node not found.");
+        if(nbt_find_by_name(deep, "nowhere") != NULL || errno != NBT_OK) die("FAILED. Missing node found.");
+        nbt_memory_stats usage = nbt_memory_usage(deep);
+        if(usage.nodes != (DEPTH + 1) * sizeof(nbt_node) || errno != NBT_OK) die("FAILED. Deep tree measured wrong.");
+        bottom->hash = 42;
+        nbt_hash_invalidate(deep);
+        if(bottom->hash != 0 || errno != NBT_OK) die("FAILED. Deepest hash not forgotten.");
+
+        /* with no memory for the stack, there's no answer rather than a wrong one */
+        nbt_allocator refused = { refused_allocate, refused_reallocate, refused_release, NULL };
+        nbt_use_allocator(&refused);
+        size_t counted = nbt_size(deep);
+        int size_err = errno;
+        nbt_node* found = nbt_find_by_name(deep, "bottom");
+        int found_err = errno;
+        usage = nbt_memory_usage(deep);
+        int usage_err = errno;
+        nbt_use_allocator(NULL);
+        if(usage_err != NBT_EMEM) die("FAILED. Short measure not reported.");
+        if(counted != 0 || size_err != NBT_EMEM) die("FAILED. Part of a tree counted as all of it.");
+        if(found != NULL || found_err != NBT_EMEM) die("FAILED. Unfinished search passed off as a miss.");
+
+        /* nbt_mutable finds its way down the same way, and copies the shared path */
+        nbt_node* snapshot = nbt_clone_shared(deep);
+        if(snapshot == NULL) die_with_err(errno);
+        nbt_node* mine = nbt_mutable(deep, bottom);
+        if(mine == NULL) die_with_err(errno);
+        if(mine == bottom || strcmp(mine->name, "bottom") != 0) die("FAILED. Deep shared node not copied.");
+        if(nbt_find_by_name(deep, "bottom") != mine) die("FAILED. Copy not put in place.");
+        if(nbt_find_by_name(snapshot, "bottom") != bottom) die("FAILED. Snapshot changed.");
+        nbt_free(snapshot);
+        nbt_free(deep);
+    }
+    printf("OK.\n");
+
+    printf("Checking parallel traversal... ");
+    {
+        /* wide enough to be split up many times over, with a deep branch too */
+        nbt_node* big = new_node(TAG_LIST, "big");
+        for(size_t n = 0; n < 50000; n += nbt_size(tree))
+        {
+            nbt_node* copy = nbt_clone(tree);
+            if(copy == NULL) die_with_err(errno);
+            add_list_item(big, copy);
+        }
+
+        nbt_node* bottom = new_node(TAG_COMPOUND, NULL);
+        add_list_item(big, bottom);
+        for(int d = 0; d < 1000; d++)
+        {
+            nbt_node* next = new_node(TAG_COMPOUND, "");
+            add_child(bottom, next);
+            bottom = next;
+        }
+        nbt_node* answer = new_node(TAG_INT, "answer");
+        answer->payload.tag_int = 42;
+        add_child(bottom, answer);
+
+        struct int_sum expected = { 0, 0 };
+        nbt_iterator it;
+        for(nbt_node* n = nbt_iter_begin(&it, big); n; n = nbt_iter_next(&it))
+            int_sum_visit(n, &expected, NULL);
+        nbt_iter_end(&it);
+
+        for(int threads = 1; threads <= 4; threads += 3)
+        {
+            size_t count = 0;
+            if(nbt_map_parallel(big, count_node, &count, threads) != 0) die_with_err(errno);
+            if(count != expected.nodes) die("FAILED. Nodes missed or visited twice.");
+
+            static const nbt_reducer summing = { sizeof(struct int_sum), int_sum_init, int_sum_visit, int_sum_merge };
+            struct int_sum total = { 0, 0 };
+            if(nbt_reduce_parallel(big, &summing, &total, NULL, threads) != 0) die_with_err(errno);
+            if(total.nodes != expected.nodes || total.sum != expected.sum) die("FAILED. Partials merged wrong.");
+
+            if(nbt_map_parallel(big, stop_at_ints, NULL, threads) != 1) die("FAILED. Visitor couldn't stop the walk.");
+        }
+
+        nbt_free(big);
+    }
+    printf("OK.\n");
+
     printf("Freeing resources... ");
 
     fclose(temp);
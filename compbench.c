@@ -0,0 +1,169 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Lukas Niederbremer <webmaster@flippeh.de> and Clark Gaebel <cg.wowus.cg@gmail.com>
+ * wrote this file. As long as you retain this notice you can do whatever you
+ * want with this stuff. If we meet some day, and you think this stuff is worth
+ * it, you can buy us a beer in return.
+ * -----------------------------------------------------------------------------
+ */
+
+/*
+ * Sweeps the deflate settings over every chunk of a region file, and prints
+ * how fast each combination compresses against how small it gets. Then glues
+ * the whole region into one tree and times parallel gzip dumps of it.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "nbt.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char* strategy_names[] = {
+    "default", "filtered", "huffman", "rle", "fixed"
+};
+
+static void die(const char* message)
+{
+    fprintf(stderr, "%s\n", message);
+    exit(1);
+}
+
+/* Wall clock time, so multithreaded runs aren't billed for every core. */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Moves every chunk into one big compound, named by its index. */
+static nbt_node* glue_chunks(nbt_node** chunks, size_t nchunks)
+{
+    nbt_node* world = nbt_new_node(TAG_COMPOUND, "");
+    if(world == NULL) die("Out of memory.");
+
+    for(size_t i = 0; i < nchunks; i++)
+    {
+        struct tag_list* entry = nbt_new_entry(chunks[i]);
+        char* name = malloc(24);
+        if(entry == NULL || name == NULL) die("Out of memory.");
+
+        sprintf(name, "%zu", i);
+        free(chunks[i]->name);
+        chunks[i]->name = name;
+
+        list_add_tail(&entry->entry, &world->payload.tag_compound->entry);
+    }
+
+    return world;
+}
+
+int main(int argc, char** argv)
+{
+    if(argc != 2)
+    {
+        fprintf(stderr, "Usage: %s [region file]\n", argv[0]);
+        return 1;
+    }
+
+    MCR* mcr = mcr_open(argv[1], O_RDONLY);
+    if(mcr == NULL) die("Could not open the region file.");
+
+    nbt_node* chunks[32*32];
+    size_t nchunks = 0;
+    size_t broken = 0;
+    size_t raw_bytes = 0;
+
+    for(int x = 0; x < 32; x++)
+        for(int z = 0; z < 32; z++)
+        {
+            nbt_node* chunk = mcr_chunk_get(mcr, x, z);
+            if(chunk == NULL)
+            {
+                /* a missing chunk leaves errno at NBT_OK */
+                if(errno != NBT_OK) broken++;
+                continue;
+            }
+
+            struct buffer b = nbt_dump_binary(chunk);
+            if(b.data == NULL) die("Could not dump a chunk.");
+            raw_bytes += b.len;
+            buffer_free(&b);
+
+            chunks[nchunks++] = chunk;
+        }
+
+    mcr_close(mcr);
+
+    if(nchunks == 0) die("No chunks in that region.");
+
+    printf("%zu chunks, %.2f MB uncompressed\n", nchunks, raw_bytes / 1e6);
+    if(broken > 0) printf("%zu chunks could not be read, and are left out\n", broken);
+    printf("\n");
+    printf("level  mem  strategy      MB/s   ratio\n");
+
+    for(int strategy = DEFLATE_DEFAULT; strategy <= DEFLATE_FIXED; strategy++)
+        for(int mem_level = 8; mem_level <= 9; mem_level++)
+            for(int level = 1; level <= 9; level++)
+            {
+                nbt_compression_options opts = {
+                    .level     = level,
+                    .mem_level = mem_level,
+                    .strategy  = (nbt_deflate_strategy)strategy
+                };
+
+                size_t compressed_bytes = 0;
+                double start = now();
+
+                for(size_t i = 0; i < nchunks; i++)
+                {
+                    struct buffer b = nbt_dump_compressed_opts(chunks[i], STRAT_INFLATE, &opts);
+                    if(b.data == NULL) die(nbt_error_to_string(errno));
+
+                    compressed_bytes += b.len;
+                    buffer_free(&b);
+                }
+
+                double elapsed = now() - start;
+
+                printf("%5d  %3d  %-8s  %8.2f  %6.3f\n",
+                       level, mem_level, strategy_names[strategy],
+                       elapsed > 0 ? raw_bytes / 1e6 / elapsed : 0.0,
+                       (double)raw_bytes / compressed_bytes);
+            }
+
+    nbt_node* world = glue_chunks(chunks, nchunks);
+
+    printf("\nthreads  gzip MB/s   ratio\n");
+
+    for(int threads = 1; threads <= 16; threads *= 2)
+    {
+        nbt_compression_options opts = NBT_COMPRESSION_DEFAULT;
+        opts.threads = threads;
+
+        double start = now();
+
+        struct buffer b = nbt_dump_compressed_opts(world, STRAT_GZIP, &opts);
+        if(b.data == NULL) die(nbt_error_to_string(errno));
+
+        double elapsed = now() - start;
+
+        printf("%7d  %9.2f  %6.3f\n",
+               threads,
+               elapsed > 0 ? raw_bytes / 1e6 / elapsed : 0.0,
+               (double)raw_bytes / b.len);
+
+        buffer_free(&b);
+    }
+
+    nbt_free(world);
+
+    return 0;
+}
@@ -53,6 +53,21 @@ static inline void list_del(struct list_head* loc)
     loc->blink = NULL;
 }
 
+/* Moves every element of `list' to the beginning of `head'. `list' is left
+ * unusable until it's initialized again. */
+static inline void list_splice(struct list_head* restrict list,
+                               struct list_head* restrict head)
+{
+    if(list->flink == list)
+        return;
+
+    list->blink->flink = head->flink;
+    head->flink->blink = list->blink;
+
+    head->flink = list->flink;
+    list->flink->blink = head;
+}
+
 /* Tests if the list is empty */
 #define list_empty(head) ((head)->flink == (head))
 
@@ -1,6 +1,13 @@
+#define _POSIX_C_SOURCE 200809L // for pwrite
+#define _DEFAULT_SOURCE // for preadv
 #include "nbt.h"
+#include "alloc.h"
+#include "threadpool.h"
+#include "uring.h"
+#include <pthread.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <stdlib.h>
 #include <errno.h>
 #ifdef __WIN32__
@@ -8,68 +15,181 @@
 #include <winsock.h>
 #else
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #endif
 #include <libgen.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 
 #define MCR_HEADER_SIZE 8192
 
+// compression type byte in front of each chunk
+#define MCR_COMPRESSION_GZIP 1
+#define MCR_COMPRESSION_ZLIB 2
+#define MCR_COMPRESSION_NONE 3
+#define MCR_COMPRESSION_LZ4  4
+
+#define MCR_SECTOR_SIZE 4096
+
 // private structure
 struct MCR {
+    const nbt_allocator *alloc; // the override it was opened under, see nbt_use_allocator
     int fd;
     int readonly;
-    uint32_t last_timestamp;
+    nbt_compression_options zopts;
+    nbt_compression_strategy strat;
+    // the file as it was when opened, chunks are served from here until they're set
+    const unsigned char *map;
+    size_t map_len;
+    int map_owned; // map was read into malloc'd memory rather than mapped
+    int created; // the file had no header when it was opened
+    mcr_io_backend io;
+    // background compression, see mcr_set_async
+    struct threadpool *pool; // NULL when chunks are compressed by mcr_chunk_set itself
+    pthread_mutex_t lock; // guards chunks against workers installing what they compressed
+    int async_err; // first thing that went wrong in the background since the last flush
     struct MCRChunk {
+        uint32_t offset; // in sectors, as found in the header
+        uint8_t nsect;
         uint32_t timestamp;
         uint32_t len;
-        unsigned char *data; // compression type + data
+        unsigned char *data; // private copy of compression type + data, or NULL to use the map
+        uint8_t slack; // bytes readable past len in data, see mcr_chunk_get
+        int dirty; // set or deleted since the last flush
+        uint32_t gen; // bumped on every set, so stale background work can tell
     } chunk[32][32];
 };
 
-int _mcr_read_chunk(MCR *mcr, int x, int z, void *header)
+// maps a chunk's compression type byte to a strategy, returns -1 for unknown types
+int _mcr_type_to_strat(uint8_t type, nbt_compression_strategy *strat)
 {
-    assert(mcr && header);
-    struct MCRChunk *chunk = &mcr->chunk[x][z];
-    memset(chunk, 0, sizeof *chunk);
-    
-    // chunk location in header
-    const unsigned char *b = (const unsigned char *)header + (4 * ((x % 32) + (z % 32) * 32));
-    
-    int offset = (b[0] << 16) | (b[1] << 8) | b[2];
-    int nsect = b[3];
-    
-    // chunk not present, everything is 0
-    if (offset == 0 && nsect == 0) return 0;
-    
-    // timestamp
-    chunk->timestamp = ntohl(*(uint32_t*)b+4096);
-    if (mcr->last_timestamp < chunk->timestamp) mcr->last_timestamp = chunk->timestamp;
-    
-    // read actual length
-    lseek(mcr->fd, offset*4096, SEEK_SET);
-    if (read(mcr->fd, &chunk->len, 4) != 4) return -1;
-    chunk->len = ntohl(chunk->len);
-    
-    // read data
-    chunk->len++; // it's weird, but some libs seem to forget one byte
-    chunk->data = malloc(chunk->len);
-    if (read(mcr->fd, chunk->data, chunk->len) < chunk->len-1) {
-        free(chunk->data);
-        chunk->data = NULL;
-        return -1;
+    switch (type) {
+        case MCR_COMPRESSION_GZIP: *strat = STRAT_GZIP; return 0;
+        case MCR_COMPRESSION_ZLIB: *strat = STRAT_INFLATE; return 0;
+        case MCR_COMPRESSION_NONE: *strat = STRAT_NONE; return 0;
+        case MCR_COMPRESSION_LZ4:  *strat = STRAT_LZ4; return 0;
+        default: return -1;
+    }
+}
+
+uint8_t _mcr_strat_to_type(nbt_compression_strategy strat)
+{
+    switch (strat) {
+        case STRAT_GZIP: return MCR_COMPRESSION_GZIP;
+        case STRAT_NONE: return MCR_COMPRESSION_NONE;
+        case STRAT_LZ4:  return MCR_COMPRESSION_LZ4;
+        default:         return MCR_COMPRESSION_ZLIB;
+    }
+}
+
+// fills in chunk locations and timestamps from the header, doesn't touch chunk data
+void _mcr_read_header(MCR *mcr, const unsigned char *header)
+{
+    for(int x=0; x < 32; x++) for(int z=0; z<32; z++) {
+        struct MCRChunk *chunk = &mcr->chunk[x][z];
+        const unsigned char *b = header + (4 * (x + z * 32));
+        
+        chunk->offset = (b[0] << 16) | (b[1] << 8) | b[2];
+        chunk->nsect = b[3];
+        
+        // chunk not present, everything is 0
+        if (chunk->offset == 0 && chunk->nsect == 0) continue;
+        
+        // timestamp, big endian like the location, in the second 4KiB of the header
+        const unsigned char *t = b + 4096;
+        chunk->timestamp = ((uint32_t)t[0] << 24) | ((uint32_t)t[1] << 16) | ((uint32_t)t[2] << 8) | t[3];
+    }
+}
+
+/*
+ * Finds a chunk's bytes (compression type + data), either in its private copy
+ * or in the file map. Returns 1 if the chunk isn't there, 0 if it is, -1 if the
+ * header points somewhere it can't.
+ * `avail' is how many bytes can be read at `data', which may be a bit more than
+ * `len' when the chunk is read from the file.
+ */
+int _mcr_chunk_bytes(const MCR *mcr, int x, int z, const unsigned char **data, uint32_t *len, size_t *avail)
+{
+    const struct MCRChunk *chunk = &mcr->chunk[x][z];
+    if (chunk->data) {
+        *data = chunk->data;
+        *len = chunk->len;
+        *avail = chunk->len + chunk->slack;
+        return 0;
     }
+    if (chunk->dirty || (chunk->offset == 0 && chunk->nsect == 0)) return 1;
+    
+    size_t start = (size_t)chunk->offset * MCR_SECTOR_SIZE;
+    size_t end = start + (size_t)chunk->nsect * MCR_SECTOR_SIZE;
+    if (end > mcr->map_len) end = mcr->map_len;
+    if (start < MCR_HEADER_SIZE || start + 4 > end) return -1;
     
+    const unsigned char *b = mcr->map + start;
+    *len = ((uint32_t)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+    *data = b + 4;
+    *avail = end - start - 4;
+    if (*len == 0 || *len > *avail) return -1;
     return 0;
 }
 
+void _mcr_unmap(MCR *mcr)
+{
+    if (mcr->map == NULL) return;
+    #ifdef __WIN32__
+    mem_free((void*)mcr->map);
+    #else
+    if (mcr->map_owned) mem_free((void*)mcr->map);
+    else munmap((void*)mcr->map, mcr->map_len);
+    #endif
+    mcr->map = NULL;
+    mcr->map_len = 0;
+}
+
 void _mcr_free(MCR *mcr)
 {
     if (mcr == NULL) return;
+    threadpool_destroy(mcr->pool);
+    pthread_mutex_destroy(&mcr->lock);
     for(int x=0; x < 32; x++) for(int z=0; z<32; z++)
-        free(mcr->chunk[x][z].data);
-    free(mcr);
+        mem_free(mcr->chunk[x][z].data);
+    _mcr_unmap(mcr);
+    mem_free(mcr);
+}
+
+// lets background compression catch up, so the chunk table is settled
+void _mcr_wait(MCR *mcr)
+{
+    if (mcr->pool) threadpool_wait(mcr->pool);
+}
+
+// maps the file, or reads it into memory where it can't be mapped
+int _mcr_map(MCR *mcr, size_t len)
+{
+    #ifndef __WIN32__
+    void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, mcr->fd, 0);
+    if (map != MAP_FAILED) {
+        mcr->map = map;
+        mcr->map_len = len;
+        return 0;
+    }
+    #endif
+    unsigned char *copy = mem_alloc(len);
+    if (copy == NULL) {
+        errno = NBT_EMEM;
+        return -1;
+    }
+    lseek(mcr->fd, 0, SEEK_SET);
+    if (read(mcr->fd, copy, len) != (ssize_t)len) {
+        mem_free(copy);
+        errno = NBT_EIO;
+        return -1;
+    }
+    mcr->map = copy;
+    mcr->map_len = len;
+    mcr->map_owned = 1;
+    return 0;
 }
 
 struct MCR * mcr_open(const char *path, int mode)
@@ -80,9 +200,15 @@ struct MCR * mcr_open(const char *path, int mode)
         return NULL;
     }
     
-    struct MCR *mcr = calloc(1, sizeof(struct MCR));
-    if (mcr == NULL) return NULL;
-    void *header = NULL;
+    struct MCR *mcr = mem_calloc(1, sizeof(struct MCR));
+    if (mcr == NULL) {
+        errno = NBT_EMEM;
+        return NULL;
+    }
+    mcr->alloc = mem_override();
+    mcr->zopts = NBT_COMPRESSION_DEFAULT;
+    mcr->strat = STRAT_INFLATE;
+    pthread_mutex_init(&mcr->lock, NULL);
     
     // open file
     #ifdef __WIN32__
@@ -90,112 +216,401 @@ struct MCR * mcr_open(const char *path, int mode)
     #endif
     mcr->fd = open(path, mode, 0666);
     if (mcr->fd == -1) goto err;
+    struct stat st;
+    if (fstat(mcr->fd, &st) == -1) goto err;
+    if (S_ISDIR(st.st_mode)) {
+        errno = EISDIR; // open(2) lets a directory through read-only
+        goto err;
+    }
     
-    if (lseek(mcr->fd, 0, SEEK_END) == 0 && mode & O_CREAT && (mode & O_RDWR || mode & O_WRONLY)) {
+    off_t size = lseek(mcr->fd, 0, SEEK_END);
+    if (size == 0 && mode & O_CREAT && (mode & O_RDWR || mode & O_WRONLY)) {
         // new file
-        mcr->last_timestamp = 1;
+        mcr->created = 1;
     } else {
-        // read header
+        // map the file, only the header is looked at for now
         if (mode == O_RDONLY) mcr->readonly = 1;
-        header = malloc(MCR_HEADER_SIZE);
-        lseek(mcr->fd, 0, SEEK_SET);
-        if (read(mcr->fd, header, MCR_HEADER_SIZE) != MCR_HEADER_SIZE) goto err;
-
-        // read chunks
-        for(int x=0; x < 32; x++) for(int z=0; z<32; z++) {
-            if (_mcr_read_chunk(mcr, x, z, header)) fprintf(stderr, "Error loading chunk %d,%d from %s\n", x,z,path);
+        if (size == -1) goto err;
+        if (size < MCR_HEADER_SIZE) {
+            errno = NBT_EIO; // too short to even have a header
+            goto err;
         }
-        
-        free(header);
+        if (_mcr_map(mcr, (size_t)size)) goto err;
+        _mcr_read_header(mcr, mcr->map);
     }
     
     return mcr;
 err:
-    if (mcr->fd != -1) close(mcr->fd);
-    free(header);
-    _mcr_free(mcr);
-    
+    {
+        // callers go by errno, ENOENT in particular, so cleaning up mustn't clobber it
+        int saved = errno;
+        if (mcr->fd != -1) close(mcr->fd);
+        _mcr_free(mcr);
+        errno = saved;
+    }
     return NULL;
 }
 
-int mcr_close(MCR *mcr)
+// positional write, doesn't care where the file offset is
+int _mcr_write_at(int fd, const void *buf, size_t len, off_t off)
+{
+    #ifdef __WIN32__
+    if (lseek(fd, off, SEEK_SET) != off) return -1;
+    return write(fd, buf, len) == (ssize_t)len ? 0 : -1;
+    #else
+    return pwrite(fd, buf, len, off) == (ssize_t)len ? 0 : -1;
+    #endif
+}
+
+#define SECTOR_USED(map, i) ((map)[(i) / 8] & (1 << ((i) % 8)))
+
+// marks sectors [start, start+n) used or free, growing the bitmap as needed
+int _mcr_mark_sectors(unsigned char **used, size_t *nsectors, size_t start, size_t n, int in_use)
+{
+    if (start + n > *nsectors) {
+        size_t grown = (start + n + 255) & ~(size_t)255;
+        unsigned char *tmp = mem_realloc(*used, grown / 8);
+        if (tmp == NULL) return -1;
+        memset(tmp + *nsectors / 8, 0, (grown - *nsectors) / 8);
+        *used = tmp;
+        *nsectors = grown;
+    }
+    for(size_t i = start; i < start + n; i++) {
+        if (in_use) (*used)[i / 8] |= 1 << (i % 8);
+        else (*used)[i / 8] &= ~(1 << (i % 8));
+    }
+    return 0;
+}
+
+// first fit, a run past the end of the bitmap is always free
+size_t _mcr_find_sectors(const unsigned char *used, size_t nsectors, size_t n)
+{
+    size_t run = 0;
+    for(size_t i = 2; i < nsectors; i++) {
+        run = SECTOR_USED(used, i) ? 0 : run + 1;
+        if (run == n) return i + 1 - n;
+    }
+    return nsectors - run;
+}
+
+// writes one header entry, or stages it if the whole header is written later
+int _mcr_write_entry(MCR *mcr, int i, uint32_t loc, uint32_t time, unsigned char *header)
+{
+    loc = htonl(loc);
+    time = htonl(time);
+    if (header) {
+        memcpy(header + 4 * i, &loc, 4);
+        memcpy(header + 4096 + 4 * i, &time, 4);
+        return 0;
+    }
+    if (_mcr_write_at(mcr->fd, &loc, 4, 4 * i)) return -1;
+    return _mcr_write_at(mcr->fd, &time, 4, 4096 + 4 * i);
+}
+
+/*
+ * Writes out chunks that were set or deleted since the last flush, and nothing
+ * else. Each gets the first run of free sectors big enough for it, and then its
+ * header entry. The sectors a chunk had, and those of deleted chunks, stay
+ * taken until the flush is over, so until the header stops pointing at them
+ * nothing is written over them; a flush cut short leaves every entry on the
+ * disk pointing at a whole chunk, old or new. They're free for the next flush.
+ */
+int _mcr_flush(MCR *mcr)
 {
     assert(mcr);
-    uint32_t *chunkLoc = NULL, *chunkTime = NULL;
-    void *empty = NULL;
-    
-    if (!mcr->readonly) {
-        // write file
-        chunkLoc = calloc(1024, 4);
-        chunkTime = calloc(1024, 4);
-        empty = calloc(4096, 1);
+    if (mcr->readonly) return 0;
+    _mcr_wait(mcr);
+    
+    unsigned char *used = NULL, *header = NULL, *buf = NULL;
+    size_t nsectors = 0, bufsize = 0;
+    
+    // which sectors are taken: the header, plus every chunk the header on disk points at
+    if (_mcr_mark_sectors(&used, &nsectors, 0, 2, 1)) goto err;
+    for(int x=0; x < 32; x++) for(int z=0; z<32; z++) {
+        struct MCRChunk *chunk = &mcr->chunk[x][z];
+        if (chunk->offset == 0) continue;
+        if (_mcr_mark_sectors(&used, &nsectors, chunk->offset, chunk->nsect, 1)) goto err;
+    }
+    
+    // a new file gets its whole header written at the end, in one go
+    if (mcr->created && (header = mem_calloc(MCR_HEADER_SIZE, 1)) == NULL) goto err;
+    
+    for(int x=0; x < 32; x++) for(int z=0; z<32; z++) {
+        int i = x + z*32;
+        struct MCRChunk *chunk = &mcr->chunk[x][z];
+        if (!chunk->dirty && !header) continue;
         
-        // write chunks
-        lseek(mcr->fd, 8192, SEEK_SET);
-        for(int x=0; x < 32; x++) for(int z=0; z<32; z++) {
-            int i = x + z*32;
-            struct MCRChunk *chunk = &mcr->chunk[x][z];
-            if (chunk->data == NULL) continue;
-            
-            assert(lseek(mcr->fd, 0, SEEK_CUR)%4096 == 0);
-            size_t chunkOffsetBlocks = lseek(mcr->fd, 0, SEEK_CUR) / 4096;
-            size_t chunkLenBlocks = (chunk->len+4+4095) / 4096;
-            if (chunkLenBlocks > 255) {
+        if (chunk->dirty && chunk->data == NULL) {
+            // deleted, its sectors are simply forgotten
+            chunk->offset = 0;
+            chunk->nsect = 0;
+        } else if (chunk->dirty) {
+            size_t nsect = (chunk->len + 4 + MCR_SECTOR_SIZE - 1) / MCR_SECTOR_SIZE;
+            if (nsect > 255) {
                 errno = EFBIG;
                 goto err;
             }
-            chunkLoc[i] = (chunkOffsetBlocks << 8) | chunkLenBlocks;
-            chunkTime[i] = chunk->timestamp;
-
+            
+            size_t offset = _mcr_find_sectors(used, nsectors, nsect);
+            if (_mcr_mark_sectors(&used, &nsectors, offset, nsect, 1)) goto err;
+            
+            // length, data, then zeroes up to the end of the last sector
+            if (bufsize < nsect * MCR_SECTOR_SIZE) {
+                mem_free(buf);
+                bufsize = nsect * MCR_SECTOR_SIZE;
+                if ((buf = mem_alloc(bufsize)) == NULL) goto err;
+            }
             uint32_t chunkLen = htonl(chunk->len);
-            if (write(mcr->fd, &chunkLen, 4) != 4) goto err;
-            if (chunk->len != write(mcr->fd, chunk->data, chunk->len)) goto err;
-
-            // write filling
-            ssize_t fill = 4096-((chunk->len+4)%4096);
-            if (write(mcr->fd, empty, fill) != fill) goto err;
-            assert(lseek(mcr->fd, 0, SEEK_CUR) == (off_t)((chunkOffsetBlocks + chunkLenBlocks)*4096));
-        }
-
-        // write locations and timestamps
-        lseek(mcr->fd, 0, SEEK_SET);
-        for(int i=0; i<1024; i++) {
-            chunkLoc[i] = htonl(chunkLoc[i]);
-            chunkTime[i] = htonl(chunkTime[i]);
+            memcpy(buf, &chunkLen, 4);
+            memcpy(buf + 4, chunk->data, chunk->len);
+            memset(buf + 4 + chunk->len, 0, nsect * MCR_SECTOR_SIZE - 4 - chunk->len);
+            if (_mcr_write_at(mcr->fd, buf, nsect * MCR_SECTOR_SIZE, (off_t)offset * MCR_SECTOR_SIZE)) goto err;
+            
+            chunk->offset = offset;
+            chunk->nsect = nsect;
         }
-        if (write(mcr->fd, chunkLoc, 4096) != 4096) goto err;
-        if (write(mcr->fd, chunkTime, 4096) != 4096) goto err;
-
-        free(chunkLoc); chunkLoc = NULL;
-        free(chunkTime); chunkTime = NULL;
-        free(empty); empty = NULL;
+        
+        uint32_t loc = chunk->offset ? (chunk->offset << 8) | chunk->nsect : 0;
+        if (_mcr_write_entry(mcr, i, loc, chunk->offset ? chunk->timestamp : 0, header)) goto err;
+        chunk->dirty = 0;
     }
     
-    close(mcr->fd);
-    _mcr_free(mcr);
+    if (header) {
+        if (_mcr_write_at(mcr->fd, header, MCR_HEADER_SIZE, 0)) goto err;
+        mcr->created = 0;
+    }
+    
+    mem_free(used);
+    mem_free(header);
+    mem_free(buf);
+    
+    // everything that did compress is out, but a chunk that didn't is lost
+    if (mcr->async_err != NBT_OK) {
+        errno = mcr->async_err;
+        mcr->async_err = NBT_OK;
+        return -1;
+    }
     return 0;
     
 err:
+    if (header) {
+        // chunks may already be out, and without a header they'd be lost; the
+        // ones that aren't are still dirty and left for the next flush
+        int saved = errno;
+        for(int x=0; x < 32; x++) for(int z=0; z<32; z++) {
+            struct MCRChunk *chunk = &mcr->chunk[x][z];
+            if (chunk->dirty || chunk->offset == 0) continue;
+            _mcr_write_entry(mcr, x + z*32, (chunk->offset << 8) | chunk->nsect, chunk->timestamp, header);
+        }
+        if (_mcr_write_at(mcr->fd, header, MCR_HEADER_SIZE, 0) == 0) mcr->created = 0;
+        errno = saved;
+    }
+    mem_free(used);
+    mem_free(header);
+    mem_free(buf);
+    return -1;
+}
+
+int _mcr_close(MCR *mcr)
+{
+    assert(mcr);
+    int ret = mcr_flush(mcr);
     close(mcr->fd);
     _mcr_free(mcr);
-    free(chunkLoc);
-    free(chunkTime);
-    free(empty);
-    return -1;
+    return ret;
 }
 
 nbt_node *mcr_chunk_get(MCR *mcr, int x, int z)
 {
     assert(mcr && x < 32 && z < 32 && x >= 0 && z >= 0);
-    struct MCRChunk *chunk = &mcr->chunk[x][z];
-    if (chunk->data == NULL) {
-        errno = NBT_OK;
+    _mcr_wait(mcr);
+    const unsigned char *data;
+    uint32_t len;
+    size_t avail;
+    switch (_mcr_chunk_bytes(mcr, x, z, &data, &len, &avail)) {
+        case 1:
+            errno = NBT_OK;
+            return NULL;
+        case -1:
+            errno = NBT_EIO;
+            return NULL;
+    }
+    nbt_compression_strategy strat;
+    if (_mcr_type_to_strat(data[0], &strat)) {
+        // unknown, or stored in an external .mcc file
+        errno = NBT_ECOMP;
         return NULL;
     }
-    return nbt_parse_compressed(chunk->data+1, chunk->len-1);
+    // it's weird, but some libs seem to forget one byte
+    size_t payload = len - 1;
+    if (avail > len) payload++;
+    return nbt_parse_compressed_strat(data+1, payload, strat);
+}
+
+int mcr_chunk_exists(MCR *mcr, int x, int z)
+{
+    assert(mcr && x < 32 && z < 32 && x >= 0 && z >= 0);
+    _mcr_wait(mcr);
+    const struct MCRChunk *chunk = &mcr->chunk[x][z];
+    if (chunk->data) return 1;
+    return !chunk->dirty && chunk->offset != 0 && chunk->nsect != 0;
+}
+
+int mcr_chunk_stat(MCR *mcr, int x, int z, bool peek, mcr_chunk_info *info)
+{
+    assert(mcr && info && x < 32 && z < 32 && x >= 0 && z >= 0);
+    _mcr_wait(mcr);
+    const struct MCRChunk *chunk = &mcr->chunk[x][z];
+
+    info->offset = chunk->dirty ? 0 : chunk->offset;
+    info->sectors = chunk->dirty ? 0 : chunk->nsect;
+    info->timestamp = chunk->timestamp;
+    info->length = 0;
+    info->type = -1;
+    if (!peek) return 0;
+
+    const unsigned char *data;
+    uint32_t len;
+    size_t avail;
+    switch (_mcr_chunk_bytes(mcr, x, z, &data, &len, &avail)) {
+        case -1: return -1;
+        case 1: return 0;
+    }
+    info->length = len;
+    info->type = data[0];
+    return 0;
+}
+
+uint32_t mcr_chunk_timestamp(MCR *mcr, int x, int z)
+{
+    assert(mcr && x < 32 && z < 32 && x >= 0 && z >= 0);
+    _mcr_wait(mcr);
+    const unsigned char *data;
+    uint32_t len;
+    size_t avail;
+    if (_mcr_chunk_bytes(mcr, x, z, &data, &len, &avail) == 1) return 0;
+    return mcr->chunk[x][z].timestamp;
+}
+
+size_t mcr_file_size(MCR *mcr)
+{
+    assert(mcr);
+    return mcr->map_len;
+}
+
+mcr_memory_stats mcr_memory_usage(MCR *mcr)
+{
+    assert(mcr);
+    mcr_memory_stats m = { sizeof *mcr, mcr->map_len, 0, 0, mem_overhead(sizeof *mcr), 0 };
+    
+    // workers install what they compressed under the lock
+    pthread_mutex_lock(&mcr->lock);
+    for(int x=0; x < 32; x++) for(int z=0; z<32; z++) {
+        const struct MCRChunk *chunk = &mcr->chunk[x][z];
+        if (chunk->data == NULL) continue;
+        size_t bytes = (size_t)chunk->len + chunk->slack;
+        if (chunk->dirty) m.pending += bytes;
+        else m.cached += bytes;
+        m.overhead += mem_overhead(bytes);
+    }
+    pthread_mutex_unlock(&mcr->lock);
+    
+    m.total = m.header + m.pending + m.cached;
+    if (mcr->map_owned) {
+        m.total += m.mapped;
+        m.overhead += mem_overhead(m.mapped);
+    }
+    m.total += m.overhead;
+    return m;
 }
 
 int mcr_chunk_set(MCR *mcr, int x, int z, nbt_node *root)
+{
+    return mcr_chunk_set_strat(mcr, x, z, root, mcr->strat);
+}
+
+// makes compressed bytes the chunk's private copy, with the type byte in front
+int _mcr_chunk_install(struct MCRChunk *chunk, uint8_t type, const void *compressed, size_t len, uint32_t timestamp)
+{
+    uint8_t *data = mem_alloc(len + 1);
+    if (data == NULL) {
+        errno = NBT_EMEM;
+        return -1;
+    }
+    data[0] = type;
+    memcpy(data+1, compressed, len);
+    mem_free(chunk->data);
+    chunk->data = data;
+    chunk->len = len + 1;
+    chunk->slack = 0;
+    chunk->timestamp = timestamp;
+    chunk->dirty = 1;
+    return 0;
+}
+
+// a chunk on its way through the background compressor
+struct _mcr_async_job {
+    MCR *mcr;
+    int x, z;
+    uint32_t gen; // the chunk's gen when it was set, if it's moved on this is stale
+    uint32_t timestamp;
+    nbt_compression_strategy strat;
+    nbt_compression_options zopts;
+    struct buffer raw; // the tree as nbt_dump_binary had it
+};
+
+void _mcr_async_compress(void *vjob)
+{
+    struct _mcr_async_job *job = vjob;
+    MCR *mcr = job->mcr;
+    
+    struct buffer compressed = nbt_compress(job->raw.data, job->raw.len, job->strat, &job->zopts);
+    int err = compressed.data ? NBT_OK : errno;
+    buffer_free(&job->raw);
+    
+    pthread_mutex_lock(&mcr->lock);
+    struct MCRChunk *chunk = &mcr->chunk[job->x][job->z];
+    // if it was set again or deleted since, that one wins
+    if (chunk->gen == job->gen && err == NBT_OK &&
+        _mcr_chunk_install(chunk, _mcr_strat_to_type(job->strat), compressed.data, compressed.len, job->timestamp))
+        err = errno;
+    if (err != NBT_OK && mcr->async_err == NBT_OK) mcr->async_err = err;
+    pthread_mutex_unlock(&mcr->lock);
+    buffer_free(&compressed);
+    
+    mem_free(job);
+}
+
+// snapshots the tree and leaves the compressing to the pool
+int _mcr_chunk_set_async(MCR *mcr, int x, int z, nbt_node *root, nbt_compression_strategy strat)
+{
+    struct _mcr_async_job *job = mem_alloc(sizeof *job);
+    if (job == NULL) {
+        errno = NBT_EMEM;
+        return -1;
+    }
+    job->raw = nbt_dump_binary(root);
+    if (job->raw.data == NULL) {
+        mem_free(job);
+        return -1;
+    }
+    job->mcr = mcr;
+    job->x = x;
+    job->z = z;
+    job->timestamp = (uint32_t)time(NULL);
+    job->strat = strat;
+    job->zopts = mcr->zopts;
+    
+    pthread_mutex_lock(&mcr->lock);
+    job->gen = ++mcr->chunk[x][z].gen;
+    pthread_mutex_unlock(&mcr->lock);
+    
+    if (threadpool_submit(mcr->pool, _mcr_async_compress, job))
+        _mcr_async_compress(job); // no memory to queue it, do it here
+    return 0;
+}
+
+int _mcr_chunk_set_strat(MCR *mcr, int x, int z, nbt_node *root, nbt_compression_strategy strat)
 {
     assert(mcr && x < 32 && z < 32 && x >= 0 && z >= 0);
     if (mcr->readonly) {
@@ -204,27 +619,494 @@ int mcr_chunk_set(MCR *mcr, int x, int z, nbt_node *root)
     }
     struct MCRChunk *chunk = &mcr->chunk[x][z];
     if (root == NULL) {
-        // delete chunk
-        free(chunk->data);
+        // delete chunk, its sectors are given back on flush
+        pthread_mutex_lock(&mcr->lock);
+        chunk->gen++;
+        mem_free(chunk->data);
         chunk->data = NULL;
+        chunk->slack = 0;
         chunk->len = 0;
         chunk->timestamp = 0;
-    } else {
-        // compress chunk
-        struct buffer compressed = nbt_dump_compressed(root, STRAT_INFLATE);
-        chunk->len = compressed.len+1;
-        uint8_t *data = malloc(chunk->len);
-        if (data == NULL) {
-            buffer_free(&compressed);
+        chunk->dirty = 1;
+        pthread_mutex_unlock(&mcr->lock);
+        return 0;
+    }
+    if (mcr->pool) return _mcr_chunk_set_async(mcr, x, z, root, strat);
+    
+    // compress chunk
+    struct buffer compressed = nbt_dump_compressed_opts(root, strat, &mcr->zopts);
+    if (compressed.data == NULL) return -1;
+    pthread_mutex_lock(&mcr->lock);
+    chunk->gen++;
+    int ret = _mcr_chunk_install(chunk, _mcr_strat_to_type(strat), compressed.data, compressed.len, (uint32_t)time(NULL));
+    pthread_mutex_unlock(&mcr->lock);
+    buffer_free(&compressed);
+    return ret;
+}
+
+struct buffer mcr_chunk_get_raw(MCR *mcr, int x, int z, uint8_t *type)
+{
+    assert(mcr && type && x < 32 && z < 32 && x >= 0 && z >= 0);
+    _mcr_wait(mcr);
+    const unsigned char *data;
+    uint32_t len;
+    size_t avail;
+    switch (_mcr_chunk_bytes(mcr, x, z, &data, &len, &avail)) {
+        case 1:
+            errno = NBT_OK;
+            return BUFFER_INIT;
+        case -1:
+            errno = NBT_EIO;
+            return BUFFER_INIT;
+    }
+    
+    // the same byte mcr_chunk_get allows for, or a copy would lose it
+    size_t payload = len - 1;
+    if (avail > len) payload++;
+    
+    struct buffer raw = BUFFER_INIT;
+    // never empty, so a chunk of just a type byte still has non-NULL data
+    if (buffer_reserve(&raw, payload + 1) || buffer_append(&raw, data + 1, payload)) {
+        buffer_free(&raw);
+        errno = NBT_EMEM;
+        return raw;
+    }
+    *type = data[0];
+    return raw;
+}
+
+int _mcr_chunk_set_raw(MCR *mcr, int x, int z, uint8_t type, const void *data, size_t len, uint32_t timestamp)
+{
+    assert(mcr && data && x < 32 && z < 32 && x >= 0 && z >= 0);
+    if (mcr->readonly) {
+        errno = EPERM;
+        return -1;
+    }
+    if (len + 5 > 255 * (size_t)MCR_SECTOR_SIZE) {
+        errno = EFBIG; // more sectors than a header entry can say
+        return -1;
+    }
+    pthread_mutex_lock(&mcr->lock);
+    struct MCRChunk *chunk = &mcr->chunk[x][z];
+    chunk->gen++;
+    int ret = _mcr_chunk_install(chunk, type, data, len, timestamp);
+    pthread_mutex_unlock(&mcr->lock);
+    return ret;
+}
+
+int _mcr_set_async(MCR *mcr, int nthreads)
+{
+    assert(mcr && nthreads >= 0);
+    if (mcr->pool) {
+        // whatever was queued is done before the pool goes
+        threadpool_destroy(mcr->pool);
+        mcr->pool = NULL;
+    }
+    if (nthreads == 0) return 0;
+    if ((mcr->pool = threadpool_create((size_t)nthreads)) == NULL) {
+        errno = NBT_EMEM;
+        return -1;
+    }
+    return 0;
+}
+
+void mcr_set_compression(MCR *mcr, const nbt_compression_options *opts)
+{
+    assert(mcr);
+    mcr->zopts = opts ? *opts : NBT_COMPRESSION_DEFAULT;
+}
+
+int mcr_set_compression_type(MCR *mcr, nbt_compression_strategy strat)
+{
+    assert(mcr);
+    #ifndef HAVE_LZ4
+    if (strat == STRAT_LZ4) {
+        errno = NBT_ECOMP;
+        return -1;
+    }
+    #endif
+    mcr->strat = strat;
+    return 0;
+}
+
+// shared by every chunk of one mcr_for_each_chunk_parallel call
+struct _mcr_parallel {
+    MCR *mcr;
+    mcr_chunk_visitor_t visit;
+    void *aux;
+    const nbt_allocator *caller; // the override of whoever called, for the visitor
+    pthread_mutex_t lock;
+    int stop; // 1 once a visitor said stop, -1 once a chunk failed
+    int err;
+};
+
+struct _mcr_parallel_job {
+    struct _mcr_parallel *ctx;
+    int x, z;
+};
+
+void _mcr_parallel_chunk(void *vjob)
+{
+    struct _mcr_parallel_job *job = vjob;
+    struct _mcr_parallel *ctx = job->ctx;
+    
+    pthread_mutex_lock(&ctx->lock);
+    int stop = ctx->stop;
+    pthread_mutex_unlock(&ctx->lock);
+    if (stop) return;
+    
+    // reading only looks at the map and the chunk table, so it's safe to share
+    nbt_node *tree = mcr_chunk_get(ctx->mcr, job->x, job->z);
+    if (tree == NULL) {
+        if (errno == NBT_OK) return; // deleted under our feet, not an error
+        pthread_mutex_lock(&ctx->lock);
+        if (ctx->stop == 0) {
+            ctx->stop = -1;
+            ctx->err = errno;
+        }
+        pthread_mutex_unlock(&ctx->lock);
+        return;
+    }
+    
+    // parsed under the region's allocator, but the visitor's own work is the caller's
+    const nbt_allocator *parsing = nbt_use_allocator(ctx->caller);
+    bool more = ctx->visit(job->x, job->z, tree, ctx->aux);
+    nbt_use_allocator(parsing);
+    if (!more) {
+        pthread_mutex_lock(&ctx->lock);
+        if (ctx->stop == 0) ctx->stop = 1;
+        pthread_mutex_unlock(&ctx->lock);
+    }
+}
+
+int _mcr_for_each_chunk_since(MCR *mcr, uint32_t since, int nthreads, mcr_chunk_visitor_t visit, void *aux,
+                              const nbt_allocator *caller)
+{
+    assert(mcr && visit);
+    _mcr_wait(mcr);
+    
+    struct _mcr_parallel ctx = { mcr, visit, aux, caller, PTHREAD_MUTEX_INITIALIZER, 0, NBT_OK };
+    struct _mcr_parallel_job *jobs = mem_alloc(32 * 32 * sizeof *jobs);
+    if (jobs == NULL) {
+        errno = NBT_EMEM;
+        return -1;
+    }
+    
+    // only chunks that are there, so idle slots don't cost a task each
+    size_t njobs = 0;
+    for(int x=0; x < 32; x++) for(int z=0; z<32; z++) {
+        const unsigned char *data;
+        uint32_t len;
+        size_t avail;
+        if (_mcr_chunk_bytes(mcr, x, z, &data, &len, &avail) == 1) continue;
+        if (mcr->chunk[x][z].timestamp < since) continue;
+        jobs[njobs].ctx = &ctx;
+        jobs[njobs].x = x;
+        jobs[njobs].z = z;
+        njobs++;
+    }
+    
+    struct threadpool *pool = NULL;
+    if (nthreads > 1 && njobs > 1) {
+        pool = threadpool_create((size_t)nthreads);
+        if (pool == NULL) {
+            mem_free(jobs);
+            errno = NBT_EMEM;
             return -1;
         }
-        data[0] = 2; // compression type
-        memcpy(data+1, compressed.data, compressed.len);
-        buffer_free(&compressed);
-        chunk->timestamp = mcr->last_timestamp;
-        free(chunk->data);
-        chunk->data = data;
     }
     
+    for(size_t i = 0; i < njobs; i++) {
+        if (pool == NULL || threadpool_submit(pool, _mcr_parallel_chunk, &jobs[i])) {
+            _mcr_parallel_chunk(&jobs[i]); // no pool, or no memory to queue it: do it here
+        }
+    }
+    threadpool_destroy(pool);
+    
+    mem_free(jobs);
+    pthread_mutex_destroy(&ctx.lock);
+    
+    errno = ctx.err;
+    return ctx.stop < 0 ? -1 : ctx.stop;
+}
+
+int mcr_for_each_chunk_parallel(MCR *mcr, int nthreads, mcr_chunk_visitor_t visit, void *aux)
+{
+    return mcr_for_each_chunk_since(mcr, 0, nthreads, visit, aux);
+}
+
+int mcr_set_io_backend(MCR *mcr, mcr_io_backend io)
+{
+    assert(mcr);
+    #ifndef HAVE_IO_URING
+    if (io == MCR_IO_URING) {
+        errno = ENOSYS;
+        return -1;
+    }
+    #endif
+    mcr->io = io;
     return 0;
 }
+
+mcr_io_backend mcr_get_io_backend(MCR *mcr)
+{
+    assert(mcr);
+    return mcr->io;
+}
+
+#ifndef __WIN32__
+
+// one chunk of a prefetch: its length prefix and the rest of its sectors go to separate buffers
+struct _mcr_read {
+    int x, z;
+    uint32_t offset;
+    size_t size; // bytes to read, sectors minus the length prefix, clipped to the file
+    unsigned char prefix[4];
+    unsigned char *buf;
+};
+
+// a run of reads that are back to back on disk, done with one preadv
+struct _mcr_run {
+    size_t first, count;
+    size_t bytes;
+    int failed;
+};
+
+int _mcr_read_cmp(const void *a, const void *b)
+{
+    uint32_t x = ((const struct _mcr_read *)a)->offset, y = ((const struct _mcr_read *)b)->offset;
+    return x < y ? -1 : x > y;
+}
+
+// preadv can't take more than IOV_MAX buffers, two per chunk
+#define MCR_RUN_MAX 512
+#define MCR_URING_DEPTH 64
+
+// hands the buffers of a finished run over to their chunks
+void _mcr_finish_run(MCR *mcr, struct _mcr_read *reads, const struct _mcr_run *run)
+{
+    for(size_t i = run->first; i < run->first + run->count; i++) {
+        struct _mcr_read *r = &reads[i];
+        uint32_t len = ((uint32_t)r->prefix[0] << 24) | (r->prefix[1] << 16) | (r->prefix[2] << 8) | r->prefix[3];
+        if (run->failed || len == 0 || len > r->size) continue; // left to mcr_chunk_get to complain about
+        
+        struct MCRChunk *chunk = &mcr->chunk[r->x][r->z];
+        uint8_t slack = r->size > len;
+        unsigned char *shrunk = mem_realloc(r->buf, len + slack);
+        chunk->data = shrunk ? shrunk : r->buf;
+        chunk->len = len;
+        chunk->slack = slack;
+        r->buf = NULL;
+    }
+}
+
+long _mcr_prefetch_preadv(MCR *mcr, struct _mcr_read *reads, struct iovec *iov, struct _mcr_run *runs, size_t nruns)
+{
+    long syscalls = 0;
+    for(size_t i = 0; i < nruns; i++) {
+        struct _mcr_run *run = &runs[i];
+        off_t off = (off_t)reads[run->first].offset * MCR_SECTOR_SIZE;
+        ssize_t got;
+        do {
+            got = preadv(mcr->fd, iov + 2 * run->first, (int)(2 * run->count), off);
+            syscalls++;
+        } while (got == -1 && errno == EINTR);
+        // a short read means the file changed under us, skip the lot
+        run->failed = got != (ssize_t)run->bytes;
+        _mcr_finish_run(mcr, reads, run);
+    }
+    return syscalls;
+}
+
+// the same reads, but up to MCR_URING_DEPTH runs in flight at once. -1 if the ring couldn't be had
+long _mcr_prefetch_uring(MCR *mcr, struct _mcr_read *reads, struct iovec *iov, struct _mcr_run *runs, size_t nruns)
+{
+    struct uring *ring = uring_create(nruns < MCR_URING_DEPTH ? (unsigned)nruns : MCR_URING_DEPTH);
+    if (ring == NULL) return -1;
+    
+    long syscalls = 0;
+    size_t next = 0, done = 0;
+    int broken = 0;
+    while (done < next || (!broken && next < nruns)) {
+        if (!broken) {
+            while (next < nruns && !uring_readv(ring, mcr->fd, iov + 2 * runs[next].first, (int)(2 * runs[next].count),
+                                                (off_t)reads[runs[next].first].offset * MCR_SECTOR_SIZE, next)) {
+                next++;
+            }
+            if (uring_submit(ring, 1) == 0) {
+                syscalls++;
+            } else {
+                // whatever the kernel didn't take is never going to be read, and nor is the rest
+                broken = 1;
+                size_t dropped = uring_unsubmitted(ring);
+                for(size_t i = next - dropped; i < nruns; i++) runs[i].failed = 1;
+                next -= dropped;
+            }
+        } else if (uring_wait(ring, 1) == 0) {
+            // what's in flight is still being read into the buffers, so neither
+            // they nor the ring can go until it's all reaped; if even waiting
+            // fails, we keep reaping until it is
+            syscalls++;
+        }
+        
+        uint64_t which;
+        int res;
+        while (uring_reap(ring, &which, &res)) {
+            struct _mcr_run *run = &runs[which];
+            run->failed = res != (int)run->bytes;
+            _mcr_finish_run(mcr, reads, run);
+            done++;
+        }
+    }
+    uring_destroy(ring);
+    return syscalls;
+}
+
+#endif
+
+long _mcr_prefetch(MCR *mcr, const int *xz, size_t n)
+{
+    assert(mcr);
+    #ifdef __WIN32__
+    (void)xz; (void)n;
+    return 0; // the whole file was read in when it was opened
+    #else
+    _mcr_wait(mcr);
+    if (mcr->map_owned || mcr->map == NULL) return 0; // already in memory, or nothing on disk yet
+    if (xz == NULL) n = 32 * 32;
+    
+    struct _mcr_read *reads = mem_calloc(n, sizeof *reads);
+    struct iovec *iov = mem_alloc(2 * n * sizeof *iov);
+    struct _mcr_run *runs = mem_alloc(n * sizeof *runs);
+    long syscalls = -1;
+    if (reads == NULL || iov == NULL || runs == NULL) {
+        errno = NBT_EMEM;
+        goto out;
+    }
+    
+    // only chunks that are on disk and not already in memory
+    size_t nreads = 0;
+    for(size_t i = 0; i < n; i++) {
+        int x = xz ? xz[2 * i] : (int)(i / 32), z = xz ? xz[2 * i + 1] : (int)(i % 32);
+        assert(x < 32 && z < 32 && x >= 0 && z >= 0);
+        struct MCRChunk *chunk = &mcr->chunk[x][z];
+        if (chunk->data || chunk->dirty || chunk->offset < 2 || chunk->nsect == 0) continue;
+        
+        size_t start = (size_t)chunk->offset * MCR_SECTOR_SIZE;
+        size_t end = start + (size_t)chunk->nsect * MCR_SECTOR_SIZE;
+        if (end > mcr->map_len) end = mcr->map_len;
+        if (start + 4 >= end) continue;
+        
+        struct _mcr_read *r = &reads[nreads];
+        // a chunk asked for twice is only read once
+        int dup = 0;
+        for(size_t j = 0; j < nreads && xz; j++) dup |= reads[j].x == x && reads[j].z == z;
+        if (dup) continue;
+        r->x = x;
+        r->z = z;
+        r->offset = chunk->offset;
+        r->size = end - start - 4;
+        if ((r->buf = mem_alloc(r->size)) == NULL) {
+            errno = NBT_EMEM;
+            goto out;
+        }
+        nreads++;
+    }
+    
+    // sort by where they are on disk, then glue neighbours into runs
+    qsort(reads, nreads, sizeof *reads, _mcr_read_cmp);
+    size_t nruns = 0;
+    for(size_t i = 0; i < nreads; i++) {
+        struct _mcr_read *r = &reads[i];
+        iov[2 * i].iov_base = r->prefix;
+        iov[2 * i].iov_len = 4;
+        iov[2 * i + 1].iov_base = r->buf;
+        iov[2 * i + 1].iov_len = r->size;
+        
+        struct _mcr_run *run = nruns ? &runs[nruns - 1] : NULL;
+        const struct _mcr_read *prev = i ? &reads[i - 1] : NULL;
+        if (run && run->count < MCR_RUN_MAX && prev->size + 4 == (size_t)(r->offset - prev->offset) * MCR_SECTOR_SIZE) {
+            run->count++;
+            run->bytes += 4 + r->size;
+        } else {
+            run = &runs[nruns++];
+            run->first = i;
+            run->count = 1;
+            run->bytes = 4 + r->size;
+            run->failed = 0;
+        }
+    }
+    
+    syscalls = -1;
+    if (mcr->io == MCR_IO_URING && nruns > 0) {
+        syscalls = _mcr_prefetch_uring(mcr, reads, iov, runs, nruns);
+        // the kernel won't give us a ring, so don't ask again every time
+        if (syscalls == -1) mcr->io = MCR_IO_PREADV;
+    }
+    if (syscalls == -1) syscalls = _mcr_prefetch_preadv(mcr, reads, iov, runs, nruns);
+    
+out:
+    if (reads) for(size_t i = 0; i < n; i++) mem_free(reads[i].buf);
+    mem_free(reads);
+    mem_free(iov);
+    mem_free(runs);
+    return syscalls;
+    #endif
+}
+
+// what a region keeps outlives the call, so it all comes from the allocator it was opened under
+int mcr_flush(MCR *mcr)
+{
+    const nbt_allocator *old = nbt_use_allocator(mcr->alloc);
+    int ret = _mcr_flush(mcr);
+    nbt_use_allocator(old);
+    return ret;
+}
+
+int mcr_close(MCR *mcr)
+{
+    const nbt_allocator *old = nbt_use_allocator(mcr->alloc);
+    int ret = _mcr_close(mcr);
+    nbt_use_allocator(old);
+    return ret;
+}
+
+int mcr_chunk_set_strat(MCR *mcr, int x, int z, nbt_node *root, nbt_compression_strategy strat)
+{
+    const nbt_allocator *old = nbt_use_allocator(mcr->alloc);
+    int ret = _mcr_chunk_set_strat(mcr, x, z, root, strat);
+    nbt_use_allocator(old);
+    return ret;
+}
+
+int mcr_chunk_set_raw(MCR *mcr, int x, int z, uint8_t type, const void *data, size_t len, uint32_t timestamp)
+{
+    const nbt_allocator *old = nbt_use_allocator(mcr->alloc);
+    int ret = _mcr_chunk_set_raw(mcr, x, z, type, data, len, timestamp);
+    nbt_use_allocator(old);
+    return ret;
+}
+
+int mcr_set_async(MCR *mcr, int nthreads)
+{
+    const nbt_allocator *old = nbt_use_allocator(mcr->alloc);
+    int ret = _mcr_set_async(mcr, nthreads);
+    nbt_use_allocator(old);
+    return ret;
+}
+
+int mcr_for_each_chunk_since(MCR *mcr, uint32_t since, int nthreads, mcr_chunk_visitor_t visit, void *aux)
+{
+    const nbt_allocator *old = nbt_use_allocator(mcr->alloc);
+    int ret = _mcr_for_each_chunk_since(mcr, since, nthreads, visit, aux, old);
+    nbt_use_allocator(old);
+    return ret;
+}
+
+long mcr_prefetch(MCR *mcr, const int *xz, size_t n)
+{
+    const nbt_allocator *old = nbt_use_allocator(mcr->alloc);
+    long ret = _mcr_prefetch(mcr, xz, n);
+    nbt_use_allocator(old);
+    return ret;
+}
@@ -29,7 +29,8 @@ typedef enum {
     NBT_ERR  = -1, /* Generic error, most likely of the parsing variety. */
     NBT_EMEM = -2, /* Out of memory. */
     NBT_EIO  = -3, /* IO error. */
-    NBT_EZ   = -4  /* Zlib compression/decompression error. */
+    NBT_EZ   = -4, /* Zlib compression/decompression error. */
+    NBT_ECOMP = -5 /* Compression type not supported (by this build). */
 } nbt_status;
 
 typedef enum {
@@ -44,7 +45,8 @@ typedef enum {
     TAG_STRING     = 8, /* char *, 8 bits, signed, TAG_SHORT length */
     TAG_LIST       = 9, /* X *, X bits, TAG_INT length, no names inside */
     TAG_COMPOUND   = 10, /* nbt_tag * */
-    TAG_INT_ARRAY  = 11 /* long *, 32 bits, signed, TAG_INT length */
+    TAG_INT_ARRAY  = 11, /* long *, 32 bits, signed, TAG_INT length */
+    TAG_LONG_ARRAY = 12  /* long long *, 64 bits, signed, TAG_INT length */
 
 } nbt_type;
 
@@ -52,10 +54,55 @@ typedef enum {
     STRAT_GZIP,   /* Use a gzip header. Use this if you want your data to be
                      compressed like level.dat */
 
-    STRAT_INFLATE /* Use a zlib header. Use this if you want your data to be
+    STRAT_INFLATE, /* Use a zlib header. Use this if you want your data to be
                      compressed like a chunk. */
+
+    STRAT_NONE,   /* Don't compress at all. Costs disk, saves CPU. */
+
+    STRAT_LZ4     /* An LZ4 block stream, the way lz4-java writes them. Only
+                     available if cNBT was built against liblz4, otherwise
+                     you'll get NBT_ECOMP. */
 } nbt_compression_strategy;
 
+/* The deflate strategies zlib knows about. The values match zlib's Z_* names. */
+typedef enum {
+    DEFLATE_DEFAULT      = 0, /* Z_DEFAULT_STRATEGY. Good for most things. */
+    DEFLATE_FILTERED     = 1, /* Z_FILTERED. Favors huffman coding over string
+                                 matching. Sometimes a win on big arrays. */
+    DEFLATE_HUFFMAN_ONLY = 2, /* Z_HUFFMAN_ONLY. No string matching at all. */
+    DEFLATE_RLE          = 3, /* Z_RLE. Only matches runs, fast on block data. */
+    DEFLATE_FIXED        = 4  /* Z_FIXED. No dynamic huffman codes. */
+} nbt_deflate_strategy;
+
+/*
+ * Knobs for the deflate stream written by the dump functions. Each field is
+ * passed straight through to deflateInit2, so see the zlib manual for the
+ * gory details.
+ */
+typedef struct {
+    int level;     /* 0 (stored) to 9 (smallest), or -1 for zlib's default. */
+    int mem_level; /* 1 to 9. More memory buys some speed. zlib uses 8. */
+    nbt_deflate_strategy strategy;
+
+    /*
+     * If more than 1, STRAT_GZIP output bigger than a single block (128k) is
+     * deflated in parallel blocks on this many threads, pigz-style. The
+     * result is still one ordinary gzip member.
+     */
+    int threads;
+} nbt_compression_options;
+
+/*
+ * Presets for the common cases. FAST is meant for live saves, ARCHIVE for
+ * backups nobody is waiting on.
+ *
+ * Usage:
+ *   nbt_compression_options o = NBT_COMPRESSION_FAST;
+ */
+#define NBT_COMPRESSION_DEFAULT (nbt_compression_options) { -1, 8, DEFLATE_DEFAULT,  1 }
+#define NBT_COMPRESSION_FAST    (nbt_compression_options) {  1, 8, DEFLATE_DEFAULT,  1 }
+#define NBT_COMPRESSION_ARCHIVE (nbt_compression_options) {  9, 9, DEFLATE_FILTERED, 1 }
+
 /*
  * Represents a single node in the tree. You should switch on `type' and ONLY
  * access the union member it signifies. tag_compound and tag_list contain
@@ -87,6 +134,11 @@ typedef struct nbt_node {
             int32_t length;
         } tag_int_array;
 
+        struct nbt_long_array {
+            int64_t *data;
+            int32_t length;
+        } tag_long_array;
+
         char* tag_string; /* TODO: technically, this should be a UTF-8 string */
 
         /*
@@ -111,6 +163,20 @@ typedef struct nbt_node {
         struct tag_list *tag_compound;
 
     } payload;
+
+    /*
+     * The subtree's nbt_hash, or 0 if it hasn't been worked out since the node
+     * was made. If you make nodes yourself, zero this. If you change a tree by
+     * hand, call nbt_hash_invalidate on it.
+     */
+    uint64_t hash;
+    bool hash_fuzzy; /* The subtree has floats, which nbt_eq compares loosely. */
+
+    /*
+     * How many trees share this node, not counting the first. If you make
+     * nodes yourself, zero this.
+     */
+    unsigned refs;
 } nbt_node;
 
                /***** High Level Loading/Saving Functions *****/
@@ -137,6 +203,14 @@ nbt_node* nbt_parse_path(const char* filename);
  */
 nbt_node* nbt_parse_compressed(const void* chunk_start, size_t length);
 
+/*
+ * The same as nbt_parse_compressed, but for when you already know how the data
+ * was compressed. This is the only way to read STRAT_NONE and STRAT_LZ4 data,
+ * since those can't be sniffed out reliably.
+ */
+nbt_node* nbt_parse_compressed_strat(const void* chunk_start, size_t length,
+                                     nbt_compression_strategy);
+
 /*
  * Dumps a tree into a file. Check your damn error codes. This function should
  * return NBT_OK.
@@ -158,6 +232,30 @@ nbt_status nbt_dump_file(const nbt_node* tree,
 struct buffer nbt_dump_compressed(const nbt_node* tree,
                                   nbt_compression_strategy);
 
+/*
+ * The same as nbt_dump_file and nbt_dump_compressed, but with control over how
+ * hard zlib tries. Passing NULL for `opts' is the same as passing
+ * NBT_COMPRESSION_DEFAULT.
+ *
+ * @see nbt_compression_options
+ */
+nbt_status nbt_dump_file_opts(const nbt_node* tree,
+                              FILE* fp, nbt_compression_strategy,
+                              const nbt_compression_options* opts);
+
+struct buffer nbt_dump_compressed_opts(const nbt_node* tree,
+                                       nbt_compression_strategy,
+                                       const nbt_compression_options* opts);
+
+/*
+ * Compresses data that's already in the binary format, as nbt_dump_binary
+ * makes it. This is the second half of nbt_dump_compressed_opts, for when the
+ * tree was dumped somewhere else, or earlier. STRAT_NONE gives back a copy.
+ */
+struct buffer nbt_compress(const void* mem, size_t len,
+                           nbt_compression_strategy,
+                           const nbt_compression_options* opts);
+
                 /***** Low Level Loading/Saving Functions *****/
 
 /*
@@ -190,18 +288,65 @@ struct buffer nbt_dump_binary(const nbt_node* tree);
                    /***** Tree Manipulation Functions *****/
 
 /*
- * Clones an existing tree. Returns NULL on memory errors.
+ * Makes a node of the given type with a copy of `name' (which may be NULL).
+ * Its payload is zeroed; lists and compounds start out empty, and a list's
+ * type is TAG_INVALID until something is added to it. Trees built by hand
+ * must make every node with this and every list entry with nbt_new_entry:
+ * they're freed back to the allocator they came from, which isn't malloc.
+ * A node's name and payload are freed with the allocator the node came from,
+ * so they have to be allocated with it too: the process's allocator, unless
+ * the node was made under an override. Returns NULL on memory errors.
+ */
+nbt_node* nbt_new_node(nbt_type type, const char* name);
+
+/*
+ * Makes a list entry holding `data', ready to go into a list or compound with
+ * list_add_tail. Returns NULL on memory errors.
+ */
+struct tag_list* nbt_new_entry(nbt_node* data);
+
+/*
+ * Clones an existing tree, every node of it, so the clone and the original
+ * can each be changed in place however you like. Returns NULL on memory
+ * errors.
  */
 nbt_node* nbt_clone(nbt_node*);
 
 /*
- * Recursively deallocates a node and all its children. If this is used on a an
- * entire tree, no memory will be leaked.
+ * A snapshot of a tree. Only the root is copied: everything under it is
+ * shared between the clone and the original, so cloning costs about as much
+ * as the root has children, however big the tree. Either can still be changed
+ * and freed without the other noticing, as long as nodes under the root are
+ * changed through nbt_mutable; changing a shared node in place changes it in
+ * both. Returns NULL on memory errors.
+ */
+nbt_node* nbt_clone_shared(nbt_node*);
+
+/*
+ * Gets `node', somewhere in `tree', ready to be changed in place. If it or any
+ * node above it is shared with another tree, those are copied, so a change
+ * copies the path down to it and nothing else. Returns the node to change,
+ * which is `node' itself if nothing was shared, and a copy otherwise; the one
+ * passed in then belongs to the other trees.
+ *
+ * The cached hashes of the nodes on the way are cleared, so nbt_hash sees the
+ * change. `tree' has to be one you're free to change, like a root from a
+ * parse or from nbt_clone_shared. Finding `node' is quickest if `tree' is its
+ * parent; otherwise `tree' is walked until it turns up, so pass the parent
+ * when you have it. Returns NULL and sets errno to NBT_ERR if `node' isn't in
+ * `tree', or NBT_EMEM.
+ */
+nbt_node* nbt_mutable(nbt_node* tree, nbt_node* node);
+
+/*
+ * Deallocates a node and all its children, however deep. If this is used on an
+ * entire tree, no memory will be leaked. Subtrees other trees share are left
+ * for the last of them to free.
  */
 void nbt_free(nbt_node*);
 
 /*
- * Recursively frees all the elements of a list, and then frees the list itself.
+ * Frees all the elements of a list, and then frees the list itself.
  */
 void nbt_free_list(struct tag_list*);
 
@@ -224,11 +369,172 @@ typedef bool (*nbt_predicate_t)(const nbt_node* node, void* aux);
  * Returns false if it was terminated by a visitor, true otherwise. In most
  * cases this can be ignored.
  *
- * TODO: Is there a way to do this without expensive function pointers? Maybe
- * something like list_for_each?
+ * Calling through a function pointer for every node costs, in a hot loop.
+ * nbt_for_each_child and nbt_iterator below do the same walks inline.
  */
 bool nbt_map(nbt_node* tree, nbt_visitor_t, void* aux);
 
+/* The children of a list or compound. */
+static inline struct tag_list* nbt_children(const nbt_node* node)
+{
+    return node->type == TAG_LIST ? node->payload.tag_list.list : node->payload.tag_compound;
+}
+
+/*
+ * Loops over the children of a list or compound, like list_for_each, but with
+ * `child' set to each child node in turn:
+ *
+ *   nbt_node* child;
+ *   nbt_for_each_child(child, compound)
+ *       printf("%s\n", child->name);
+ *
+ * Don't take `child' out of the list inside the loop.
+ */
+#define nbt_for_each_child(child, parent)                                        \
+    for(struct list_head* nbt_pos_ = nbt_children(parent)->entry.flink;         \
+        nbt_pos_ != &nbt_children(parent)->entry &&                             \
+            ((child) = list_entry(nbt_pos_, struct tag_list, entry)->data, 1);  \
+        nbt_pos_ = nbt_pos_->flink)
+
+/* How deep an iterator goes before its stack has to come from the heap. */
+#define NBT_ITER_DEPTH 32
+
+/*
+ * Walks a whole tree in pre-order, each node before the ones under it, keeping
+ * its own stack instead of recursing or calling back, so the loop body is
+ * compiled right into the walk:
+ *
+ *   nbt_iterator it;
+ *   for(nbt_node* n = nbt_iter_begin(&it, tree); n; n = nbt_iter_next(&it))
+ *   {
+ *       if(n->type == TAG_COMPOUND && boring(n))
+ *           nbt_iter_skip(&it); // nothing under n is visited
+ *       ...
+ *   }
+ *   nbt_iter_end(&it);
+ *
+ * `it.depth' is how far down the current node is: 0 for `tree', 1 for its
+ * children, and so on. Breaking out of the loop is fine, as long as
+ * nbt_iter_end is called. The tree mustn't be changed during the walk, except
+ * for the payloads of nodes that aren't lists or compounds.
+ *
+ * Past NBT_ITER_DEPTH levels the stack is moved to the heap. If there's no
+ * memory for it the walk ends early, with errno set to NBT_EMEM.
+ */
+typedef struct {
+    size_t depth;
+
+    /* the rest is private */
+    nbt_node* node;
+    bool skip;
+    size_t cap;
+    struct nbt_iter_level {
+        struct list_head* pos; /* the entry of the node at this level */
+        struct list_head* end; /* the head of the list it's in */
+    } *stack, fixed[NBT_ITER_DEPTH]; /* `stack' is NULL until it's outgrown `fixed' */
+} nbt_iterator;
+
+/* Starts a walk at `tree', which is returned. */
+static inline nbt_node* nbt_iter_begin(nbt_iterator* it, nbt_node* tree)
+{
+    it->depth = 0;
+    it->node  = tree;
+    it->skip  = false;
+    it->cap   = NBT_ITER_DEPTH;
+    it->stack = NULL;
+    return tree;
+}
+
+/* Makes the stack bigger. Only nbt_iter_next needs this. */
+bool nbt_iter_grow(nbt_iterator* it);
+
+/* Moves to the next node and returns it, or NULL at the end of the tree. */
+static inline nbt_node* nbt_iter_next(nbt_iterator* it)
+{
+    nbt_node* node = it->node;
+    if(node == NULL) return NULL;
+
+    if(!it->skip && (node->type == TAG_LIST || node->type == TAG_COMPOUND))
+    {
+        struct list_head* head = &nbt_children(node)->entry;
+
+        if(head->flink != head)
+        {
+            if(it->depth == it->cap && !nbt_iter_grow(it))
+                return it->node = NULL;
+
+            struct nbt_iter_level* level = (it->stack ? it->stack : it->fixed) + it->depth++;
+            level->pos = head->flink;
+            level->end = head;
+            return it->node = list_entry(head->flink, struct tag_list, entry)->data;
+        }
+    }
+
+    it->skip = false;
+
+    /* on to the next sibling, or the next of whichever node above has one */
+    while(it->depth > 0)
+    {
+        struct nbt_iter_level* level = (it->stack ? it->stack : it->fixed) + it->depth - 1;
+
+        level->pos = level->pos->flink;
+        if(level->pos != level->end)
+            return it->node = list_entry(level->pos, struct tag_list, entry)->data;
+
+        it->depth--;
+    }
+
+    return it->node = NULL;
+}
+
+/* Leaves out everything under the current node when moving on. */
+static inline void nbt_iter_skip(nbt_iterator* it)
+{
+    it->skip = true;
+}
+
+/* Frees whatever the iterator allocated. */
+void nbt_iter_end(nbt_iterator* it);
+
+/*
+ * nbt_map for trees too big for one thread, on `nthreads' workers (1 does it
+ * all on the calling thread). Each node is still visited once, but on any of
+ * the threads, alongside others, and in no particular order, so whatever the
+ * visitor touches besides the node needs a lock; nbt_reduce_parallel does
+ * without. It mustn't change the shape of the tree.
+ *
+ * Every few thousand nodes a thread shares the siblings it hasn't got to yet,
+ * at the highest level it has any, with the other workers, unless earlier work
+ * is still waiting for one. They take a few at a time, and share in turn. A
+ * long list of tiny compounds only spreads so far, since its entries still
+ * have to be followed one at a time.
+ *
+ * Returns 0 once every node has been visited, 1 if a visitor stopped it early,
+ * or -1 with errno set if the threads or memory couldn't be had. Once a
+ * visitor returns false the others stop as soon as they notice.
+ */
+int nbt_map_parallel(nbt_node* tree, nbt_visitor_t visit, void* aux, int nthreads);
+
+/*
+ * Folds a tree into one value on several threads. Each thread has a partial
+ * result of `size' bytes of its own, which `init' sets up and `visit' adds the
+ * nodes it's given to, so the visitor needs no locks. At the end, `merge' adds
+ * each partial to the final result, in no particular order.
+ */
+typedef struct {
+    size_t size;
+    void (*init)(void* partial, void* aux);
+    bool (*visit)(nbt_node* node, void* partial, void* aux); /* false stops the walk */
+    void (*merge)(void* result, const void* partial, void* aux);
+} nbt_reducer;
+
+/*
+ * Walks the tree like nbt_map_parallel, folding it with `r' and merging the
+ * partials into `result', which has to be set up beforehand. Partials of a
+ * walk that was stopped are merged all the same. Returns as nbt_map_parallel.
+ */
+int nbt_reduce_parallel(nbt_node* tree, const nbt_reducer* r, void* result, void* aux, int nthreads);
+
 /*
  * Returns a new tree, consisting of a copy of all the nodes the predicate
  * returned `true' for. If the new tree is empty, this function will return
@@ -242,6 +548,9 @@ nbt_node* nbt_filter(const nbt_node* tree, nbt_predicate_t, void* aux);
 /*
  * The exact same as nbt_filter, except instead of returning a new tree, the
  * existing tree is modified in place, and then returned for convenience.
+ * Subtrees shared with other trees (see nbt_clone_shared) are copied out
+ * first if anything in them goes. If there's no memory for that, errno is set to
+ * NBT_EMEM and they're left whole.
  */
 nbt_node* nbt_filter_inplace(nbt_node* tree, nbt_predicate_t, void* aux);
 
@@ -258,7 +567,9 @@ nbt_node* nbt_find(nbt_node* tree, nbt_predicate_t, void* aux);
 
 /*
  * Returns the first node with the name `name'. If no node with that name is in
- * the tree, returns NULL.
+ * the tree, returns NULL with errno set to NBT_OK. A tree deeper than
+ * NBT_ITER_DEPTH may need memory to walk; if there's none, it returns NULL
+ * with errno set to NBT_EMEM, though the node might well be there.
  *
  * If `name' is NULL, this function will find the first unnamed node.
  *
@@ -279,9 +590,42 @@ nbt_node* nbt_find_by_name(nbt_node* tree, const char* name);
  */
 nbt_node* nbt_find_by_path(nbt_node* tree, const char* path);
 
-/* Returns the number of nodes in the tree. */
+/*
+ * Returns the number of nodes in the tree, with errno set to NBT_OK. Walking a
+ * tree deeper than NBT_ITER_DEPTH may need memory; if there's none, it returns
+ * 0 with errno set to NBT_EMEM.
+ */
 size_t nbt_size(const nbt_node* tree);
 
+/* Where a tree's memory goes, in bytes. */
+typedef struct {
+    size_t nodes;    /* the nbt_node structs */
+    size_t entries;  /* list entries, the one heading each list and compound too */
+    size_t names;
+    size_t strings;
+    size_t arrays;
+    size_t overhead; /* an estimate of what malloc adds to the names, strings and
+                        arrays, and the pools' tag on each node and entry */
+    size_t total;    /* all of the above */
+} nbt_memory_stats;
+
+/*
+ * Adds up the heap `tree' takes. This is a walk of the whole tree, so it costs
+ * about as much as nbt_free would; measure a tree once and keep the number
+ * rather than asking again. Subtrees shared with other trees (see
+ * nbt_clone_shared) count in full, in every tree they're in. The walk only
+ * allocates for trees deeper than NBT_ITER_DEPTH; if that fails, errno is
+ * NBT_EMEM and the count is short of the real thing.
+ */
+nbt_memory_stats nbt_memory_usage(const nbt_node* tree);
+
+/*
+ * The same, but leaving out the subtrees under `tree' that are shared with
+ * other trees, and without walking them. The entries pointing at them still
+ * count. This is what `tree' adds on top of a pool it was interned into.
+ */
+nbt_memory_stats nbt_memory_usage_unshared(const nbt_node* tree);
+
 /*
  * Returns the Nth item of a list
  * Don't use this to iterate through a list, it would be very inefficient
@@ -290,11 +634,256 @@ nbt_node* nbt_list_item(nbt_node* list, int n);
 
 /* TODO: More utilities as requests are made and patches contributed. */
 
+                         /***** Path Queries *****/
+/*
+ * A query picks nodes out of a tree by path, and is compiled once so that it
+ * can be run on as many trees as you like. Paths start at the root's children:
+ *
+ *   Level.Entities[*].Pos[1]   the second coordinate of every entity
+ *   Level.TileEntities[-1]     the last tile entity
+ *   Level..id                  every "id" anywhere under Level
+ *   ..{long_array}             every long array in the tree
+ *   Level.*{int}               every int directly in Level
+ *   "odd.name".'x[0]'          names with special characters, quoted
+ *
+ * - `name' is a compound entry (or named list item) called that, in quotes
+ *   (with backslash escapes) if it has any of . [ ] { } * or quotes in it
+ * - `*' is any child at all, `[*]' any list item, `[n]' the nth list item
+ *   (negative n counts from the end)
+ * - `..' before a step makes it look at every descendant, not just children
+ * - `{type}' keeps only nodes of that type: byte, short, int, long, float,
+ *   double, byte_array, string, list, compound, int_array or long_array
+ *
+ * An empty query matches the root. Matches are found in the order of a depth
+ * first walk of the tree, each node at most once per query.
+ */
+typedef struct nbt_query nbt_query;
+
+/*
+ * Called with every node a query matches, and which of the queries (counting
+ * from 0) it was. Return true to keep going, false to stop.
+ */
+typedef bool (*nbt_query_visitor_t)(nbt_node* node, size_t which, void* aux);
+
+/*
+ * Compiles a query. Returns NULL and sets errno to NBT_ERR if it doesn't make
+ * sense, or NBT_EMEM.
+ */
+nbt_query* nbt_query_compile(const char* expr);
+
+/*
+ * Runs a query over `tree', handing every match to `visit'. Branches the query
+ * can't match in aren't walked. Returns 0 once the tree is done, 1 if the
+ * visitor stopped it, or -1 with errno set.
+ */
+int nbt_query_run(nbt_node* tree, const nbt_query* q, nbt_visitor_t visit, void* aux);
+
+/*
+ * Runs `n' queries in a single walk of the tree, which costs about what the
+ * most expensive of them would alone. Returns as nbt_query_run does.
+ */
+int nbt_query_run_batch(nbt_node* tree, nbt_query* const* queries, size_t n,
+                        nbt_query_visitor_t visit, void* aux);
+
+void nbt_query_free(nbt_query* q);
+
+                      /***** Diffs *****/
+
+/*
+ * nbt_diff works out how to turn one tree into another, and nbt_patch does it.
+ * A diff is an NBT tree itself, so nbt_dump_binary or nbt_dump_compressed make
+ * it into bytes to store or send, and nbt_parse reads it back. A small edit to
+ * a big tree makes a diff about the size of the edit.
+ *
+ * The diff is a list of edits, each at a path from the root: replace a node,
+ * rewrite part of an array, take an entry out of a compound or put one in, or
+ * splice items into a list. Compound entries are matched up by name and list
+ * items by position, so a compound whose entries were reordered, or that has
+ * two with the same name, goes whole.
+ *
+ * Unchanged subtrees are spotted by their hashes (see nbt_hash), and checked
+ * node by node unless the two trees share them, so a stale cached hash costs
+ * time but never an edit. The diff holds the hash of the tree it was made
+ * from, and nbt_patch won't apply it to any other; for that the cached hashes
+ * of `a' have to be up to date.
+ */
+
+/*
+ * Returns the diff that turns `a' into `b', or NULL and sets errno to
+ * NBT_EMEM.
+ */
+nbt_node* nbt_diff(nbt_node* a, nbt_node* b);
+
+/*
+ * Applies a diff to `tree', in place, copying out whatever it changes that's
+ * shared with other trees. `tree' itself has to be one you're free to change,
+ * like a root from a parse or from nbt_clone_shared. It's all or nothing:
+ * returns NBT_ERR if the diff was made from a different tree, `tree' is
+ * shared, or the diff doesn't make sense, or NBT_EMEM, and the tree is left
+ * as it was.
+ */
+nbt_status nbt_patch(nbt_node* tree, const nbt_node* diff);
+
+                      /***** Intern Pools *****/
+
+/*
+ * An intern pool keeps one copy of every subtree it's shown, by content, so
+ * trees with parts in common can share them instead of each holding a copy:
+ * the empty lists, lighting arrays and palettes that thousands of chunks
+ * have in common, say. Sharing works as it does between clones (see
+ * nbt_clone_shared), so nodes of an interned tree are changed through
+ * nbt_mutable.
+ *
+ * Numbers aren't pooled, since an entry in the pool costs more than they do.
+ * A pool can be used from any number of threads at once.
+ */
+typedef struct nbt_intern nbt_intern;
+
+typedef struct {
+    size_t entries;     /* subtrees in the pool right now */
+    size_t bytes;       /* estimated heap they take, each counted once */
+    size_t hits;        /* subtrees swapped for the pool's copy */
+    size_t bytes_saved; /* estimated heap those swaps freed, all told */
+} nbt_intern_stats;
+
+/* Returns NULL and sets errno to NBT_EMEM if it can't. */
+nbt_intern* nbt_intern_create(void);
+
+/* Frees the pool. Trees sharing its subtrees keep them. */
+void nbt_intern_free(nbt_intern* pool);
+
+/*
+ * Swaps every subtree of `tree' the pool has a copy of for that copy, and adds
+ * the ones it hasn't. `tree' itself stays put, and has to be one you're free
+ * to change. Returns about how many bytes that freed. If `tree' is shared with
+ * other trees (a subtree of a snapshot, or one the pool already holds), it's
+ * left alone, and this returns 0 with errno set to NBT_ERR; interning the
+ * root it hangs from does the job instead.
+ */
+size_t nbt_intern_tree(nbt_intern* pool, nbt_node* tree);
+
+/*
+ * The pool holds on to its subtrees even after every tree using them is gone.
+ * Those are let go of whenever the pool would otherwise grow, or now, by this.
+ * Returns how many went.
+ */
+size_t nbt_intern_trim(nbt_intern* pool);
+
+void nbt_intern_get_stats(nbt_intern* pool, nbt_intern_stats* stats);
+
+                    /***** Memory Allocation *****/
+
+/*
+ * Everything the library allocates, zlib's working memory included, comes
+ * from an allocator: by default malloc, realloc and free, but any functions
+ * that behave like those will do. `ctx' is passed along untouched, so one set
+ * of functions can serve several arenas, or keep count for several parts of a
+ * program.
+ *
+ * Nodes and list entries, which is most of any tree, come out of pools the
+ * library keeps. Those take big slabs from the allocator and hand them out to
+ * each thread a batch at a time, and they keep freed ones for the next tree
+ * rather than giving them back.
+ */
+typedef struct {
+    void* (*allocate)(size_t size, void* ctx);
+    void* (*reallocate)(void* ptr, size_t size, void* ctx);
+    void  (*release)(void* ptr, void* ctx);
+    void* ctx;
+} nbt_allocator;
+
+/*
+ * Sets the allocator of the whole process, or puts malloc's back if `alloc' is
+ * NULL. It's copied. Memory has to go back to the allocator it came from, so
+ * only do this before the library has allocated anything, or once all of it
+ * has been freed, and never while another thread is using the library. The
+ * pools give all their slabs back to the old allocator first.
+ */
+void nbt_set_allocator(const nbt_allocator* alloc);
+
+/*
+ * Overrides the allocator for the calling thread only, or goes back to the
+ * process's if `alloc' is NULL. Returns the override it replaced, so it can be
+ * put back:
+ *
+ *   const nbt_allocator* old = nbt_use_allocator(&arena);
+ *   nbt_node* tree = nbt_parse(data, len);
+ *   nbt_use_allocator(old);
+ *
+ * `alloc' isn't copied, so it has to outlive everything allocated from it.
+ * Nodes and list entries skip the pools while there's an override, each one
+ * coming from the override on its own, and remember where they came from:
+ * they go back there however they're freed, names and payloads with them,
+ * so a tree can share them with one made under another allocator (see
+ * nbt_clone_shared). Work the library hands to its own threads, like
+ * compressing in parallel or nbt_map_parallel, uses the override of the
+ * thread that asked.
+ *
+ * Regions, worlds and intern pools remember the override they were made
+ * under, and keep what they hold in it whichever thread calls them, so they
+ * can be shared between threads with different overrides or none. Buffers
+ * they return come from the caller's allocator. Chunks handed to a visitor
+ * (see mcr_for_each_chunk_since) are parsed under the region's allocator,
+ * and are freed back to it by nbt_free, but the visitor itself runs under
+ * the override of the thread that made the call, whichever thread it's on,
+ * so whatever it builds or keeps is allocated there.
+ *
+ * Anything else allocated under an override has to be freed under it too.
+ * That goes for buffers and the strings nbt_dump_ascii returns as much as
+ * for queries, which have to be used under the allocator they were made with
+ * for as long as they're around. Changes to a tree in place are made under
+ * the allocator its nodes came from.
+ */
+const nbt_allocator* nbt_use_allocator(const nbt_allocator* alloc);
+
                       /***** Utility Functions *****/
 
 /* Returns true if the trees are identical. */
 bool nbt_eq(const nbt_node* restrict a, const nbt_node* restrict b);
 
+/*
+ * The same, but subtrees whose hashes are both cached (see nbt_hash) and
+ * differ are told apart without being walked. Only for trees whose cached
+ * hashes are known to be up to date: one edited in place without
+ * nbt_hash_invalidate may be called different from a tree it's equal to.
+ */
+bool nbt_eq_hashed(const nbt_node* restrict a, const nbt_node* restrict b);
+
+/*
+ * Stricter than nbt_eq: floats have to match bit for bit, and even empty lists
+ * have to be lists of the same thing, since they'd be written out that way.
+ * Cached hashes aren't looked at.
+ */
+bool nbt_identical(const nbt_node* a, const nbt_node* b);
+
+/*
+ * A 64 bit hash of a tree's structure: every node's type, name and payload.
+ * Equal hashes mean the trees are all but certainly equal, so comparing the
+ * hash of a tree against the one from last time is a cheap way to tell if
+ * anything changed. Floats and doubles are hashed bit for bit, though, so
+ * trees nbt_eq calls equal may still hash differently if their floats are
+ * only nearly equal.
+ *
+ * The hash of every node is cached in the node, so hashing again after a
+ * small change only costs as much as the nodes that changed. The library
+ * clears the cache in the trees it changes, and nbt_mutable clears it for the
+ * nodes it hands out. If you change one some other way, call
+ * nbt_hash_invalidate. Trees shared between threads can be hashed from any
+ * of them at once. Hashes don't depend on the machine's byte order, so they
+ * can be stored and compared elsewhere.
+ */
+uint64_t nbt_hash(nbt_node* tree);
+
+/*
+ * Forgets the cached hashes of `tree' and everything under it. After editing a
+ * node in place, call it on the root. Setting `hash' to 0 on just the edited
+ * node and each node above it does the same job, and keeps the rest cached.
+ * Trees deeper than NBT_ITER_DEPTH may need memory to walk; if there's none,
+ * errno is set to NBT_EMEM and the hashes past that depth are left as they
+ * were.
+ */
+void nbt_hash_invalidate(nbt_node* tree);
+
 /*
  * Converts a type to a print-friendly string. The string is statically
  * allocated, and therefore does not have to be freed by the user.
@@ -321,13 +910,30 @@ const char* nbt_error_to_string(nbt_status);
 typedef struct MCR MCR;
 
 /*
- * Opens a MCR file
+ * Opens a MCR file. Anvil (.mca) files use the very same container, so they are
+ * opened with this too; see the Anvil functions below for getting at their blocks.
  * valid mode flags: O_RDONLY, O_WRONLY, O_RDWR, O_CREAT, O_EXCL, O_TRUNC
+ * Only the header is looked at here. The file is mapped read-only, and chunks
+ * are read out of the mapping when you ask for them, so opening is cheap no
+ * matter how many chunks the file holds.
+ * Returns NULL with errno set on failure: whatever open(2) said, EISDIR for a
+ * directory, NBT_EIO if the file is too short to be a region or can't be read,
+ * or NBT_EMEM.
  */
 MCR* mcr_open(const char *path, int mode);
 
+/*
+ * Writes chunks that were set or deleted since the last flush to disk. Chunks
+ * that weren't touched aren't rewritten, and neither is the rest of the header.
+ * New data only ever goes into free sectors, never over a chunk the header
+ * still points at, so a flush that fails or is cut short leaves every chunk on
+ * disk whole, the old version or the new. Does nothing on read-only files.
+ * Returns 0 on success, -1 on error.
+ */
+int mcr_flush(MCR *mcr);
+
 /* Closes a MCR file
- * If it was open in a writable mode, it is written to disk now.
+ * If it was open in a writable mode, any changes are flushed to disk now.
  * All memory associated with it is freed, including chunks that still hold 
  * references, you'll want to clone chunk root nodes if you need them after closing the file.
  */
@@ -341,12 +947,381 @@ int mcr_close(MCR* mcr);
  */
 nbt_node *mcr_chunk_get(MCR *mcr, int x, int z);
 
+/*
+ * Returns 1 if the chunk is in the file, 0 if it isn't. Only the header is
+ * looked at, nothing is read or inflated.
+ */
+int mcr_chunk_exists(MCR *mcr, int x, int z);
+
+/* Where and what a chunk is, as far as the region file is concerned. */
+typedef struct {
+    uint32_t offset;    /* First sector, counting the header's two. 0 if the
+                           chunk isn't on disk. */
+    uint8_t  sectors;   /* How many 4KiB sectors the header gives it. */
+    uint32_t timestamp;
+    uint32_t length;    /* Bytes of chunk, compression type included, or 0 if
+                           not peeked at. */
+    int      type;      /* The compression type byte (1 gzip, 2 zlib, 3 none,
+                           4 lz4), or -1 if not peeked at. */
+} mcr_chunk_info;
+
+/*
+ * Describes a chunk from the header alone. If `peek' is true the length and
+ * compression type are read too, which means touching the chunk's first
+ * sector, but nothing is ever inflated. Returns -1 if `peek' found the header
+ * pointing past the end of the file or at a bad length, 0 otherwise.
+ */
+int mcr_chunk_stat(MCR *mcr, int x, int z, bool peek, mcr_chunk_info *info);
+
+/*
+ * When chunk (x, z) was last written, in seconds since the epoch, from the
+ * header, or from when it was set if it was set since. 0 if it isn't there.
+ */
+uint32_t mcr_chunk_timestamp(MCR *mcr, int x, int z);
+
+/* The size of the file as it was when it was opened, header included. */
+size_t mcr_file_size(MCR *mcr);
+
+/* Where an open region's memory goes, in bytes. */
+typedef struct {
+    size_t header;     /* the MCR itself, with its table of every chunk */
+    size_t mapped;     /* the file as opened. Only counted in `total' if it had to
+                          be read into the heap; normally it's mapped, and the
+                          kernel can drop the pages whenever it likes */
+    size_t pending;    /* compressed chunks set since the last flush */
+    size_t cached;     /* compressed chunks that are on disk as well: read in
+                          by mcr_prefetch, or set and flushed since */
+    size_t overhead;   /* an estimate of what malloc adds to all of that */
+    size_t total;      /* heap in use, all told */
+} mcr_memory_stats;
+
+/*
+ * Adds up the memory `mcr' holds on to. Trees are never cached, so this is
+ * all compressed bytes. Chunks still being compressed in the background
+ * aren't counted until they're done.
+ */
+mcr_memory_stats mcr_memory_usage(MCR *mcr);
+
 /*
  * Sets a root node for a (possibly empty) chunk, or deletes the chunk if passed NULL
  * Returns 0 on success, -1 on error
  */
 int mcr_chunk_set(MCR *mcr, int x, int z, nbt_node *root);
 
+/*
+ * The same as mcr_chunk_set, but compresses this one chunk with `strat' instead
+ * of the file's default. Returns -1 and sets errno to NBT_ECOMP if the build
+ * can't do that kind of compression.
+ */
+int mcr_chunk_set_strat(MCR *mcr, int x, int z, nbt_node *root,
+                        nbt_compression_strategy strat);
+
+/*
+ * A chunk's bytes as they are in the file, still compressed, for copying
+ * chunks between regions without inflating and deflating them again. `type'
+ * gets the compression type byte (1 gzip, 2 zlib, 3 none, 4 lz4), which
+ * isn't checked, so unknown types come through too. Free the buffer when
+ * you're done. Returns a buffer with NULL `data' and errno set to NBT_OK if
+ * the chunk isn't there, or to an error code if it couldn't be read.
+ */
+struct buffer mcr_chunk_get_raw(MCR *mcr, int x, int z, uint8_t *type);
+
+/*
+ * Sets a chunk to bytes from mcr_chunk_get_raw, written as they are. Pass the
+ * source's mcr_chunk_timestamp to keep it, or time(NULL) to count this as a
+ * change. Returns -1 and sets errno if the chunk is too big for a region, 0
+ * otherwise.
+ */
+int mcr_chunk_set_raw(MCR *mcr, int x, int z, uint8_t type,
+                      const void *data, size_t len, uint32_t timestamp);
+
+/*
+ * Sets how mcr_chunk_set compresses chunks in this file from now on. Chunks
+ * already in the file are left alone. The default is STRAT_INFLATE, which is
+ * what every version of Minecraft can read. Returns 0 on success, -1 on error.
+ */
+int mcr_set_compression_type(MCR *mcr, nbt_compression_strategy strat);
+
+/*
+ * Sets the deflate options used by every following mcr_chunk_set on this file.
+ * Passing NULL goes back to NBT_COMPRESSION_DEFAULT.
+ */
+void mcr_set_compression(MCR *mcr, const nbt_compression_options *opts);
+
+/*
+ * Moves compression off the calling thread. With `nthreads' above 0, setting a
+ * chunk only dumps the tree into the binary format, which is quick, and hands
+ * it to one of `nthreads' background threads to compress; the tree is yours
+ * again as soon as mcr_chunk_set returns. 0 goes back to compressing on the
+ * caller, after finishing whatever is queued.
+ *
+ * Anything that reads chunks waits for the queue to drain first, and so do
+ * mcr_flush and mcr_close. A chunk that fails to compress in the background
+ * keeps what it had before, and the next mcr_flush returns -1 with errno set
+ * once it has written out everything else. Returns 0 on success, or -1 with
+ * errno set.
+ */
+int mcr_set_async(MCR *mcr, int nthreads);
+
+/* How mcr_prefetch talks to the disk. */
+typedef enum {
+    MCR_IO_PREADV, /* One preadv per run of neighbouring chunks, one at a time. */
+    MCR_IO_URING   /* The same reads, many in flight at once through io_uring.
+                      Only in builds with HAVE_IO_URING, and falls back to
+                      preadv on kernels that don't have it. */
+} mcr_io_backend;
+
+/*
+ * Chooses how mcr_prefetch reads. Returns -1 with errno set to ENOSYS if the
+ * build doesn't have that backend, 0 otherwise.
+ */
+int mcr_set_io_backend(MCR *mcr, mcr_io_backend io);
+
+/*
+ * The backend mcr_prefetch is using. That's the one last set, unless it was
+ * MCR_IO_URING and the kernel wouldn't hand out a ring: then mcr_prefetch fell
+ * back to preadv, and this says MCR_IO_PREADV from then on.
+ */
+mcr_io_backend mcr_get_io_backend(MCR *mcr);
+
+/*
+ * Reads chunks from disk into memory in big batches, ahead of mcr_chunk_get.
+ * The chunks are sorted by where they are in the file, chunks sitting right
+ * next to each other are read with a single call, and nothing already in memory
+ * is read again. `xz' is an array of `n' (x, z) pairs, or NULL for every chunk.
+ *
+ * Returns the number of read system calls it took, or -1 with errno set. A
+ * chunk that couldn't be read is just left where it was, for mcr_chunk_get to
+ * complain about. Don't call it while other threads are reading from `mcr'.
+ */
+long mcr_prefetch(MCR *mcr, const int *xz, size_t n);
+
+/*
+ * Called by mcr_for_each_chunk_parallel for every chunk in the file. The tree is
+ * yours, free it with nbt_free when you're done. Return true to keep going,
+ * false to stop. This runs on several threads at once, so mind what you touch.
+ */
+typedef bool (*mcr_chunk_visitor_t)(int x, int z, nbt_node* tree, void* aux);
+
+/*
+ * Inflates and parses every chunk in the file on `nthreads' worker threads (1
+ * does it all on the calling thread), handing each tree to `visit' as soon as
+ * it's ready. Chunks come in no particular order. Don't set chunks in `mcr'
+ * until this returns.
+ *
+ * Returns 0 once every chunk has been visited, 1 if a visitor stopped it early,
+ * or -1 with errno set if a chunk couldn't be read. Chunks still in flight when
+ * it stops are finished, the rest are never parsed.
+ */
+int mcr_for_each_chunk_parallel(MCR *mcr, int nthreads,
+                                mcr_chunk_visitor_t visit, void *aux);
+
+/*
+ * The same, but only for chunks written at or after `since' (seconds since the
+ * epoch). Everything else is skipped on the header alone, without being read.
+ */
+int mcr_for_each_chunk_since(MCR *mcr, uint32_t since, int nthreads,
+                             mcr_chunk_visitor_t visit, void *aux);
+
+                         /***** World Functions *****/
+/*
+ * A World is a directory of region files (r.X.Z.mca, or r.X.Z.mcr), addressed
+ * by global chunk coordinates. Parsed chunks are kept in a cache, bounded by a
+ * byte budget, so asking for the same chunk again costs a hash lookup instead
+ * of an inflate and a parse. Region files stay open too, a bounded number of
+ * them, so their headers are only read once.
+ *
+ * - open the directory with world_open
+ * - get chunks with world_chunk_get, and hand each back with world_chunk_release
+ * - close it with world_close
+ *
+ * Cached trees are shared between everyone who asks for them, so treat them as
+ * read-only and never nbt_free them. A World may be used from several threads.
+ */
+
+typedef struct World World;
+
+typedef struct {
+    size_t hits;      /* world_chunk_get served from the cache */
+    size_t misses;    /* world_chunk_get that had to read a region file */
+    size_t evictions; /* chunks dropped to stay within the budget */
+    size_t bytes;     /* estimated size of everything cached right now, interned too */
+    size_t budget;
+
+    size_t region_hits;      /* region lookups that found it open already */
+    size_t region_misses;    /* region lookups that had to open the file */
+    size_t region_evictions; /* regions closed to stay within the limit */
+    size_t regions;          /* regions open right now */
+} world_stats;
+
+/*
+ * Opens the world in directory `path', caching up to about `budget' bytes of
+ * parsed chunks. Nothing is read until chunks are asked for. Returns NULL and
+ * sets errno on error.
+ */
+World *world_open(const char *path, size_t budget);
+
+/* Frees the world, and every cached chunk along with it, held or not. */
+void world_close(World *world);
+
+/*
+ * Gets the chunk at global chunk coordinates (cx, cz), reading it if it isn't
+ * cached. Returns NULL with errno set to NBT_OK if the chunk doesn't exist, or
+ * to an error code if it couldn't be read. The chunk stays in the cache at
+ * least until you world_chunk_release it; chunks held longer than that push
+ * the cache over its budget rather than being evicted.
+ */
+nbt_node *world_chunk_get(World *world, int cx, int cz);
+
+/* Gives back a chunk from world_chunk_get. Once per successful get. */
+void world_chunk_release(World *world, int cx, int cz);
+
+/*
+ * Sets how many region files may be kept open at once, 64 unless you say
+ * otherwise. Regions that are being read from are never closed, so this can be
+ * exceeded for a moment.
+ */
+void world_set_region_limit(World *world, size_t max_regions);
+
+/*
+ * Interns every chunk read from now on into `pool' (see nbt_intern_tree), so
+ * what cached chunks have in common is only held once, and only counted once
+ * against the budget. Everything in the pool counts, whether or not a cached
+ * chunk still uses it, and the pool is trimmed along with the cache when
+ * that's over budget. A pool serving several worlds counts against each of
+ * them in full. Chunk nodes are shared, so change them through nbt_mutable.
+ * A pool has to outlive the worlds using it. Pass NULL to stop.
+ */
+void world_set_intern(World *world, nbt_intern *pool);
+
+/*
+ * Splits global chunk coordinates into the region they're in and the slot in
+ * that region. Any of the out pointers may be NULL.
+ */
+void world_chunk_region(int cx, int cz, int *rx, int *rz, int *x, int *z);
+
+/*
+ * Returns 1 if chunk (cx, cz) exists, 0 if it doesn't, or -1 with errno set if
+ * its region couldn't be opened. Only region headers are looked at.
+ */
+int world_chunk_exists(World *world, int cx, int cz);
+
+/* Copies out the cache counters. */
+void world_get_stats(World *world, world_stats *stats);
+
+/*
+ * Hands every chunk in the world written at or after `since' (seconds since
+ * the epoch) to `visit', with global chunk coordinates, one region at a time
+ * and each region on `nthreads' threads, as mcr_for_each_chunk_since does.
+ * Older chunks are skipped on their region's header alone. The trees are
+ * yours, not the cache's; free them with nbt_free.
+ *
+ * Returns 0 once every such chunk has been visited, 1 if a visitor stopped it
+ * early, or -1 with errno set.
+ */
+int world_for_each_chunk_since(World *world, uint32_t since, int nthreads,
+                               mcr_chunk_visitor_t visit, void *aux);
+
+/*
+ * Checkpoints for world_for_each_chunk_since, kept in the file `name' in the
+ * world directory, so a job that runs over and over only sees what changed:
+ *
+ *     uint32_t since, started = time(NULL);
+ *     world_checkpoint_load(world, "nightly.checkpoint", &since);
+ *     world_for_each_chunk_since(world, since, 4, visit, aux);
+ *     world_checkpoint_save(world, "nightly.checkpoint", started);
+ *
+ * Save the time the run started, not when it ended, so chunks written during
+ * the run are seen next time. Loading a checkpoint that was never saved gives
+ * 0, which is everything. Saving replaces the file atomically, so a crash
+ * leaves either the old checkpoint or the new one. Both return 0 on success,
+ * or -1 with errno set.
+ */
+int world_checkpoint_load(World *world, const char *name, uint32_t *since);
+int world_checkpoint_save(World *world, const char *name, uint32_t since);
+
+                     /***** Anvil Chunk Functions *****/
+/*
+ * Anvil chunks cut the column into 16x16x16 sections, each holding its blocks
+ * in YZX order (index = y*256 + z*16 + x, all relative to the section). Three
+ * generations of section layout are understood:
+ *
+ * - 1.2 to 1.12:  Level.Sections, with Blocks/Add/Data/BlockLight/SkyLight
+ * - 1.13 to 1.17: Level.Sections, with Palette and a packed BlockStates array
+ * - 1.18 on:      sections, with block_states.palette and block_states.data
+ *
+ * An anvil_chunk finds every section once when it's made, so reading and
+ * writing blocks never searches the tree by name.
+ */
+
+/* The section Ys an anvil_chunk can keep track of. */
+#define ANVIL_SECTION_MIN (-8)
+#define ANVIL_SECTION_MAX 23
+
+/*
+ * A view of one section. The pointers point straight into the chunk's tree,
+ * nothing is copied, so writing through them changes the chunk. They go stale
+ * if you replace the nodes they came from.
+ */
+typedef struct {
+    int y;                      /* Section Y, covering blocks y*16 to y*16+15. */
+
+    unsigned char* blocks;      /* 4096 block ids, or NULL. */
+    unsigned char* add;         /* 4096 nibbles, bits 8-11 of the ids, or NULL. */
+    unsigned char* data;        /* 4096 nibbles of block metadata, or NULL. */
+    unsigned char* block_light; /* 4096 nibbles, or NULL. */
+    unsigned char* sky_light;   /* 4096 nibbles, or NULL. */
+
+    nbt_node* palette;          /* TAG_LIST of block states, or NULL. */
+    int64_t*  states;           /* Packed palette indices. NULL if the palette
+                                   has a single entry, which fills the section. */
+    int32_t   states_len;
+    int       bits;             /* Bits per packed index. */
+    bool      states_span;      /* Indices cross long boundaries (before 1.16). */
+} anvil_section;
+
+typedef struct anvil_chunk anvil_chunk;
+
+/*
+ * Indexes the sections of a chunk tree. The anvil_chunk takes ownership of
+ * `root', which is freed with it. Sections are copied out of any tree `root'
+ * shares them with, since views write into them. Returns NULL and sets errno
+ * to NBT_ERR if it doesn't look like an Anvil chunk, or NBT_EMEM.
+ */
+anvil_chunk* anvil_chunk_wrap(nbt_node* root);
+
+/* mcr_chunk_get, then anvil_chunk_wrap. errno is set like mcr_chunk_get's. */
+anvil_chunk* anvil_chunk_get(MCR* mcr, int x, int z);
+
+/* Saves the chunk's tree with mcr_chunk_set. */
+int anvil_chunk_set(MCR* mcr, int x, int z, anvil_chunk* chunk);
+
+/* The chunk's tree. It still belongs to the anvil_chunk. */
+nbt_node* anvil_chunk_root(anvil_chunk* chunk);
+
+void anvil_chunk_free(anvil_chunk* chunk);
+
+/* Returns section `y', or NULL if the chunk doesn't have it. */
+anvil_section* anvil_chunk_section(anvil_chunk* chunk, int y);
+
+/*
+ * Returns the block at (x, y, z), where x and z are 0-15 within the chunk and
+ * y is the world height. For palette sections that's the index into the
+ * section's palette, otherwise it's the block id. Missing sections read as 0.
+ */
+int anvil_get_block(const anvil_chunk* chunk, int x, int y, int z);
+
+/* Returns the metadata nibble at (x, y, z), or 0 if the section has none. */
+int anvil_get_data(const anvil_chunk* chunk, int x, int y, int z);
+
+/*
+ * Sets the block at (x, y, z). For palette sections `block' is an index into the
+ * existing palette and `data' is ignored. Returns -1 and sets errno to NBT_ERR if
+ * the section doesn't exist or can't hold that value, 0 otherwise. Don't forget
+ * to anvil_chunk_set it afterwards.
+ */
+int anvil_set_block(anvil_chunk* chunk, int x, int y, int z, int block, int data);
+
 #ifdef __cplusplus
 }
 #endif
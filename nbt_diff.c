@@ -0,0 +1,893 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Lukas Niederbremer <webmaster@flippeh.de> and Clark Gaebel <cg.wowus.cg@gmail.com>
+ * wrote this file. As long as you retain this notice you can do whatever you
+ * want with this stuff. If we meet some day, and you think this stuff is worth
+ * it, you can buy us a beer in return.
+ * -----------------------------------------------------------------------------
+ */
+#include "nbt.h"
+
+#include "alloc.h"
+#include "slab.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A diff looks like this:
+ *
+ *   TAG_Compound("diff")
+ *       TAG_Long("base")       nbt_hash of the tree it was made from
+ *       TAG_List("ops")        of compounds, applied in order, each with
+ *           TAG_Byte("op")     one of the below
+ *           TAG_List("path")   of strings: the names of compound entries and
+ *                              the indices (in decimal) of list items, from
+ *                              the root down to the node the op is about
+ *
+ * and whatever else the op needs. Ops that bring a node along carry it as
+ * "value", and its real name, if it has one, as the string "name".
+ */
+enum op {
+    OP_SET,    /* replace the node with "value" */
+    OP_RANGE,  /* resize the array to "length" items and write "data" from "at" */
+    OP_REMOVE, /* take the node out of its compound or list */
+    OP_INSERT, /* put "value" into the compound, so it's entry number "at" */
+    OP_SPLICE  /* replace "remove" items of the list from "at" with "items" */
+};
+
+/* strdup isn't standard. GNU extension. */
+static char* copy_string(const char* s)
+{
+    char* r = mem_alloc(strlen(s) + 1);
+    if(r == NULL) return NULL;
+
+    return strcpy(r, s);
+}
+
+static struct tag_list* children(const nbt_node* node)
+{
+    return node->type == TAG_LIST ? node->payload.tag_list.list : node->payload.tag_compound;
+}
+
+/* Compound entries without a name can only be told apart from "" by position. */
+static const char* key(const nbt_node* node)
+{
+    return node->name ? node->name : "";
+}
+
+/* The items of an array, how many there are and how big each one is. */
+static void* array_data(const nbt_node* node, int32_t* length, size_t* size)
+{
+    switch(node->type)
+    {
+    case TAG_BYTE_ARRAY:
+        *length = node->payload.tag_byte_array.length;
+        *size   = 1;
+        return node->payload.tag_byte_array.data;
+    case TAG_INT_ARRAY:
+        *length = node->payload.tag_int_array.length;
+        *size   = 4;
+        return node->payload.tag_int_array.data;
+    case TAG_LONG_ARRAY:
+        *length = node->payload.tag_long_array.length;
+        *size   = 8;
+        return node->payload.tag_long_array.data;
+    default:
+        *length = 0;
+        *size   = 1;
+        return NULL;
+    }
+}
+
+static void set_array_data(nbt_node* node, void* data, int32_t length)
+{
+    switch(node->type)
+    {
+    case TAG_BYTE_ARRAY:
+        node->payload.tag_byte_array.data   = data;
+        node->payload.tag_byte_array.length = length;
+        break;
+    case TAG_INT_ARRAY:
+        node->payload.tag_int_array.data   = data;
+        node->payload.tag_int_array.length = length;
+        break;
+    case TAG_LONG_ARRAY:
+        node->payload.tag_long_array.data   = data;
+        node->payload.tag_long_array.length = length;
+        break;
+    default:
+        assert(false);
+    }
+}
+
+static bool is_array(nbt_type type)
+{
+    return type == TAG_BYTE_ARRAY || type == TAG_INT_ARRAY || type == TAG_LONG_ARRAY;
+}
+
+/* Adds `child' to the end of a list or compound, or frees it if it can't. */
+static bool append(nbt_node* parent, nbt_node* child)
+{
+    if(child == NULL) return false;
+
+    struct tag_list* entry = nbt_new_entry(child);
+    if(entry == NULL)
+    {
+        nbt_free(child);
+        return false;
+    }
+
+    list_add_tail(&entry->entry, &children(parent)->entry);
+    return true;
+}
+
+static bool add_int(nbt_node* compound, nbt_type type, const char* name, int64_t value)
+{
+    nbt_node* node = nbt_new_node(type, name);
+    if(node == NULL) return false;
+
+    switch(type)
+    {
+    case TAG_BYTE: node->payload.tag_byte = (int8_t)value;  break;
+    case TAG_INT:  node->payload.tag_int  = (int32_t)value; break;
+    case TAG_LONG: node->payload.tag_long = value;          break;
+    default:       assert(false);
+    }
+
+    return append(compound, node);
+}
+
+static bool add_string(nbt_node* compound, const char* name, const char* value)
+{
+    nbt_node* node = nbt_new_node(TAG_STRING, name);
+    if(node == NULL) return false;
+
+    if((node->payload.tag_string = copy_string(value)) == NULL)
+    {
+        nbt_free(node);
+        errno = NBT_EMEM;
+        return false;
+    }
+
+    return append(compound, node);
+}
+
+/* Copies `node' into `op' as "value", with its name on the side. */
+static bool add_value(nbt_node* op, nbt_node* node)
+{
+    if(node->name && !add_string(op, "name", node->name)) return false;
+
+    nbt_node* value = nbt_clone(node);
+    if(value == NULL) return false;
+
+    char* name = copy_string("value");
+    if(name == NULL)
+    {
+        nbt_free(value);
+        errno = NBT_EMEM;
+        return false;
+    }
+
+    mem_free(value->name);
+    value->name = name;
+    value->hash = 0;
+
+    return append(op, value);
+}
+
+/* The compound's entry called `name', of any type, or NULL. */
+static nbt_node* entry_named(const nbt_node* compound, const char* name)
+{
+    if(compound->type != TAG_COMPOUND) return NULL;
+
+    const struct list_head* pos;
+    list_for_each(pos, &compound->payload.tag_compound->entry)
+    {
+        nbt_node* node = list_entry(pos, struct tag_list, entry)->data;
+        if(node->name && strcmp(node->name, name) == 0)
+            return node;
+    }
+
+    return NULL;
+}
+
+/* The same, but only if it's a `type'. */
+static nbt_node* field(const nbt_node* compound, const char* name, nbt_type type)
+{
+    nbt_node* node = entry_named(compound, name);
+    return node && node->type == type ? node : NULL;
+}
+
+/*
+ * The diff being made. `path' holds the steps from the root of the trees to
+ * the nodes being compared, each a compound entry's name or, if that's NULL,
+ * a list index.
+ */
+struct step {
+    const char* name;
+    int32_t index;
+};
+
+struct differ {
+    nbt_node* ops;
+    struct step* path;
+    size_t depth, cap;
+};
+
+static bool push(struct differ* d, const char* name, int32_t index)
+{
+    if(d->depth == d->cap)
+    {
+        size_t cap = d->cap ? d->cap * 2 : 16;
+        struct step* grown = mem_realloc(d->path, cap * sizeof *grown);
+        if(grown == NULL)
+        {
+            errno = NBT_EMEM;
+            return false;
+        }
+        d->path = grown;
+        d->cap  = cap;
+    }
+
+    d->path[d->depth].name  = name;
+    d->path[d->depth].index = index;
+    d->depth++;
+    return true;
+}
+
+static void pop(struct differ* d)
+{
+    d->depth--;
+}
+
+/* Starts an op at the current path, which is added to the diff. */
+static nbt_node* new_op(struct differ* d, enum op kind)
+{
+    nbt_node* op   = nbt_new_node(TAG_COMPOUND, NULL);
+    nbt_node* path = nbt_new_node(TAG_LIST, "path");
+    if(op == NULL || path == NULL) goto err;
+
+    path->payload.tag_list.type = TAG_STRING;
+
+    for(size_t i = 0; i < d->depth; i++)
+    {
+        char index[16];
+        const char* step = d->path[i].name;
+
+        if(step == NULL)
+        {
+            snprintf(index, sizeof index, "%d", (int)d->path[i].index);
+            step = index;
+        }
+
+        nbt_node* s = nbt_new_node(TAG_STRING, NULL);
+        if(s == NULL) goto err;
+        if((s->payload.tag_string = copy_string(step)) == NULL)
+        {
+            nbt_free(s);
+            errno = NBT_EMEM;
+            goto err;
+        }
+        if(!append(path, s)) goto err;
+    }
+
+    if(!add_int(op, TAG_BYTE, "op", kind)) goto err;
+
+    bool ok = append(op, path);
+    path = NULL;
+    if(!ok || !append(d->ops, op)) return NULL;
+
+    return op;
+
+err:
+    nbt_free(path);
+    nbt_free(op);
+    return NULL;
+}
+
+static bool diff_node(struct differ* d, nbt_node* a, nbt_node* b);
+
+static bool diff_set(struct differ* d, nbt_node* b)
+{
+    nbt_node* op = new_op(d, OP_SET);
+    return op && add_value(op, b);
+}
+
+/* Sends the stretch of the array between the first and last items that changed. */
+static bool diff_array(struct differ* d, const nbt_node* a, const nbt_node* b)
+{
+    int32_t alen, blen;
+    size_t size;
+    const char* ad = array_data(a, &alen, &size);
+    const char* bd = array_data(b, &blen, &size);
+
+    int32_t start = 0, end = blen;
+    int32_t shortest = alen < blen ? alen : blen;
+
+    while(start < shortest && memcmp(ad + start * size, bd + start * size, size) == 0)
+        start++;
+
+    /* if the length changed, everything past `start' may have moved */
+    if(alen == blen)
+        while(end > start && memcmp(ad + (end - 1) * size, bd + (end - 1) * size, size) == 0)
+            end--;
+
+    if(alen == blen && start == end) return true;
+
+    nbt_node* op = new_op(d, OP_RANGE);
+    if(op == NULL) return false;
+    if(!add_int(op, TAG_INT, "at", start) || !add_int(op, TAG_INT, "length", blen)) return false;
+
+    nbt_node* data = nbt_new_node(b->type, "data");
+    if(data == NULL) return false;
+
+    void* copy = mem_alloc((end - start) * size + 1);
+    if(copy == NULL)
+    {
+        nbt_free(data);
+        errno = NBT_EMEM;
+        return false;
+    }
+    memcpy(copy, bd + start * size, (end - start) * size);
+    set_array_data(data, copy, end - start);
+
+    return append(op, data);
+}
+
+/* The children of a list or compound in an array, so they can be got at by index. */
+static nbt_node** items(const nbt_node* node, size_t* count)
+{
+    struct tag_list* list = children(node);
+    *count = list_length(&list->entry);
+
+    nbt_node** ret = mem_alloc((*count + 1) * sizeof *ret);
+    if(ret == NULL)
+    {
+        errno = NBT_EMEM;
+        return NULL;
+    }
+
+    size_t i = 0;
+    const struct list_head* pos;
+    list_for_each(pos, &list->entry)
+        ret[i++] = list_entry(pos, struct tag_list, entry)->data;
+
+    return ret;
+}
+
+/*
+ * Different hashes are proof of a change, but equal ones are only a hint: a
+ * hash cached before an edit in place would hide it. Subtrees the two trees
+ * share are the same, though, and nbt_identical sees that without a walk.
+ */
+static bool unchanged(nbt_node* a, nbt_node* b)
+{
+    return nbt_hash(a) == nbt_hash(b) && nbt_identical(a, b);
+}
+
+/*
+ * Lists are lined up by position. Items that are the same at the front and
+ * the back are left alone, and whatever's between them changed. If that's as
+ * many items in both, and they're the sort with insides worth diffing, each
+ * is diffed with its counterpart. Otherwise they're spliced in.
+ */
+static bool diff_list(struct differ* d, const nbt_node* a, const nbt_node* b)
+{
+    size_t na, nb;
+    nbt_node** ai = items(a, &na);
+    nbt_node** bi = items(b, &nb);
+    bool ok = false;
+
+    if(ai == NULL || bi == NULL) goto done;
+
+    size_t shortest = na < nb ? na : nb;
+    size_t front = 0, back = 0;
+
+    while(front < shortest && unchanged(ai[front], bi[front]))
+        front++;
+    while(back < shortest - front && unchanged(ai[na - 1 - back], bi[nb - 1 - back]))
+        back++;
+
+    size_t am = na - front - back, bm = nb - front - back;
+    nbt_type type = b->payload.tag_list.type;
+
+    if(am == bm && (type == TAG_LIST || type == TAG_COMPOUND || is_array(type)))
+    {
+        for(size_t i = front; i < front + am; i++)
+        {
+            if(!push(d, NULL, (int32_t)i)) goto done;
+            bool item_ok = diff_node(d, ai[i], bi[i]);
+            pop(d);
+            if(!item_ok) goto done;
+        }
+
+        ok = true;
+        goto done;
+    }
+
+    nbt_node* op = new_op(d, OP_SPLICE);
+    if(op == NULL) goto done;
+    if(!add_int(op, TAG_INT, "at", (int64_t)front) || !add_int(op, TAG_INT, "remove", (int64_t)am))
+        goto done;
+
+    nbt_node* list = nbt_new_node(TAG_LIST, "items");
+    if(list == NULL) goto done;
+    list->payload.tag_list.type = type;
+
+    for(size_t i = front; i < front + bm; i++)
+        if(!append(list, nbt_clone(bi[i])))
+        {
+            nbt_free(list);
+            goto done;
+        }
+
+    ok = append(op, list);
+
+done:
+    mem_free(ai);
+    mem_free(bi);
+    return ok;
+}
+
+struct named {
+    const char* name;
+    size_t pos;
+};
+
+static int named_cmp(const void* a, const void* b)
+{
+    return strcmp(((const struct named*)a)->name, ((const struct named*)b)->name);
+}
+
+/* Sorts the entries of a compound by name, and says if any two share one. */
+static struct named* by_name(nbt_node** entries, size_t n, bool* unique)
+{
+    struct named* ret = mem_alloc((n + 1) * sizeof *ret);
+    if(ret == NULL)
+    {
+        errno = NBT_EMEM;
+        return NULL;
+    }
+
+    for(size_t i = 0; i < n; i++)
+    {
+        ret[i].name = key(entries[i]);
+        ret[i].pos  = i;
+    }
+
+    if(n > 1) qsort(ret, n, sizeof *ret, named_cmp);
+
+    *unique = true;
+    for(size_t i = 1; i < n; i++)
+        if(strcmp(ret[i - 1].name, ret[i].name) == 0)
+            *unique = false;
+
+    return ret;
+}
+
+/* Where the entry called `name' is, or -1. */
+static long find_named(const struct named* sorted, size_t n, const char* name)
+{
+    struct named needle = { name, 0 };
+    const struct named* found = n ? bsearch(&needle, sorted, n, sizeof *sorted, named_cmp) : NULL;
+    return found ? (long)found->pos : -1;
+}
+
+/*
+ * Compounds are lined up by name: entries only `a' has are removed, entries
+ * only `b' has are inserted where they go, and the rest are diffed. That only
+ * works if the entries both have are in the same order, and no two have the
+ * same name. Compounds where that isn't so are sent whole.
+ */
+static bool diff_compound(struct differ* d, const nbt_node* a, nbt_node* b)
+{
+    size_t na, nb;
+    nbt_node** ai = items(a, &na);
+    nbt_node** bi = items(b, &nb);
+    struct named* as = NULL;
+    struct named* bs = NULL;
+    bool ok = false;
+    bool a_unique, b_unique;
+
+    if(ai == NULL || bi == NULL) goto done;
+    if((as = by_name(ai, na, &a_unique)) == NULL) goto done;
+    if((bs = by_name(bi, nb, &b_unique)) == NULL) goto done;
+
+    bool in_order = a_unique && b_unique;
+    long last = -1;
+
+    for(size_t j = 0; j < nb && in_order; j++)
+    {
+        long i = find_named(as, na, key(bi[j]));
+        if(i < 0) continue;
+        if(i < last) in_order = false;
+        last = i;
+    }
+
+    if(!in_order)
+    {
+        ok = diff_set(d, b);
+        goto done;
+    }
+
+    for(size_t i = 0; i < na; i++)
+    {
+        if(find_named(bs, nb, key(ai[i])) >= 0) continue;
+
+        if(!push(d, key(ai[i]), 0)) goto done;
+        bool removed = new_op(d, OP_REMOVE) != NULL;
+        pop(d);
+        if(!removed) goto done;
+    }
+
+    for(size_t j = 0; j < nb; j++)
+    {
+        long i = find_named(as, na, key(bi[j]));
+
+        if(i < 0)
+        {
+            nbt_node* op = new_op(d, OP_INSERT);
+            if(op == NULL) goto done;
+            if(!add_int(op, TAG_INT, "at", (int64_t)j) || !add_value(op, bi[j])) goto done;
+            continue;
+        }
+
+        if(!push(d, key(bi[j]), 0)) goto done;
+        bool entry_ok = diff_node(d, ai[i], bi[j]);
+        pop(d);
+        if(!entry_ok) goto done;
+    }
+
+    ok = true;
+
+done:
+    mem_free(ai);
+    mem_free(bi);
+    mem_free(as);
+    mem_free(bs);
+    return ok;
+}
+
+static bool diff_node(struct differ* d, nbt_node* a, nbt_node* b)
+{
+    if(unchanged(a, b))
+        return true;
+
+    /* the hash leaves out what empty lists would have held */
+    bool same_kind = a->type == b->type &&
+                     (a->type != TAG_LIST || a->payload.tag_list.type == b->payload.tag_list.type);
+
+    if(!same_kind || (a->name == NULL) != (b->name == NULL) || (a->name && strcmp(a->name, b->name) != 0))
+        return diff_set(d, b);
+
+    switch(a->type)
+    {
+    case TAG_BYTE_ARRAY:
+    case TAG_INT_ARRAY:
+    case TAG_LONG_ARRAY:
+        return diff_array(d, a, b);
+    case TAG_LIST:
+        return diff_list(d, a, b);
+    case TAG_COMPOUND:
+        return diff_compound(d, a, b);
+    default:
+        return diff_set(d, b);
+    }
+}
+
+nbt_node* nbt_diff(nbt_node* a, nbt_node* b)
+{
+    assert(a && b);
+
+    struct differ d = { NULL, NULL, 0, 0 };
+
+    nbt_node* diff = nbt_new_node(TAG_COMPOUND, "diff");
+    if(diff == NULL) return NULL;
+
+    if(!add_int(diff, TAG_LONG, "base", (int64_t)nbt_hash(a))) goto err;
+
+    if((d.ops = nbt_new_node(TAG_LIST, "ops")) == NULL) goto err;
+    d.ops->payload.tag_list.type = TAG_COMPOUND;
+
+    nbt_node* ops = d.ops;
+    if(!append(diff, ops)) goto err;
+
+    if(!diff_node(&d, a, b)) goto err;
+
+    mem_free(d.path);
+    return diff;
+
+err:
+    mem_free(d.path);
+    nbt_free(diff);
+    return NULL;
+}
+
+/* The entry a path step leads to in `parent', or NULL. */
+static struct tag_list* find_step(nbt_node* parent, const char* step)
+{
+    struct list_head* pos;
+
+    if(parent->type == TAG_COMPOUND)
+    {
+        list_for_each(pos, &parent->payload.tag_compound->entry)
+        {
+            struct tag_list* entry = list_entry(pos, struct tag_list, entry);
+            if(strcmp(key(entry->data), step) == 0)
+                return entry;
+        }
+    }
+    else if(parent->type == TAG_LIST)
+    {
+        char* end;
+        long index = strtol(step, &end, 10);
+        if(end == step || *end != '\0' || index < 0) return NULL;
+
+        list_for_each(pos, &parent->payload.tag_list.list->entry)
+            if(index-- == 0)
+                return list_entry(pos, struct tag_list, entry);
+    }
+
+    return NULL;
+}
+
+/* The list entry `index' would go before, which is the list head at the end. */
+static struct list_head* position(nbt_node* parent, int32_t index)
+{
+    struct list_head* head = &children(parent)->entry;
+    struct list_head* pos = head->flink;
+
+    while(index-- > 0 && pos != head)
+        pos = pos->flink;
+
+    return pos;
+}
+
+/* A copy of the op's "value", by its real name. */
+static nbt_node* take_value(const nbt_node* op)
+{
+    nbt_node* value = entry_named(op, "value");
+    nbt_node* name  = field(op, "name", TAG_STRING);
+    if(value == NULL) return NULL;
+
+    nbt_node* ret = nbt_clone(value);
+    if(ret == NULL) return NULL;
+
+    mem_free(ret->name);
+    ret->name = NULL;
+    ret->hash = 0;
+
+    if(name && (ret->name = copy_string(name->payload.tag_string)) == NULL)
+    {
+        nbt_free(ret);
+        errno = NBT_EMEM;
+        return NULL;
+    }
+
+    return ret;
+}
+
+static nbt_status patch_set(nbt_node* node, nbt_node* parent, const nbt_node* op)
+{
+    nbt_node* value = take_value(op);
+    if(value == NULL) return errno == NBT_EMEM ? NBT_EMEM : NBT_ERR;
+
+    if(parent && parent->type == TAG_LIST && value->type != parent->payload.tag_list.type)
+    {
+        nbt_free(value);
+        return NBT_ERR;
+    }
+
+    /* a shared node would change under the other trees too (nbt_mutable gets ours copied) */
+    if(__atomic_load_n(&node->refs, __ATOMIC_ACQUIRE) != 0)
+    {
+        nbt_free(value);
+        return NBT_ERR;
+    }
+
+    /* swap the insides, so whatever points at the node sees the new one */
+    nbt_node old = *node;
+    *node = *value;
+    *value = old;
+    nbt_free(value);
+
+    return NBT_OK;
+}
+
+static nbt_status patch_range(nbt_node* node, const nbt_node* op)
+{
+    nbt_node* at     = field(op, "at", TAG_INT);
+    nbt_node* length = field(op, "length", TAG_INT);
+    nbt_node* data   = field(op, "data", node->type);
+    if(at == NULL || length == NULL || data == NULL || !is_array(node->type)) return NBT_ERR;
+
+    int32_t old, n;
+    size_t size;
+    char* dest = array_data(node, &old, &size);
+    const char* src = array_data(data, &n, &size);
+
+    int32_t from = at->payload.tag_int, len = length->payload.tag_int;
+
+    /* the range can't go past the end, or leave a gap when the array grows */
+    if(from < 0 || len < 0 || from > old || from > len || n > len - from) return NBT_ERR;
+    if(len > old && from + n != len) return NBT_ERR;
+
+    if(len != old)
+    {
+        char* grown = mem_realloc(dest, (size_t)len * size + 1);
+        if(grown == NULL) return NBT_EMEM;
+        dest = grown;
+        set_array_data(node, dest, len);
+    }
+
+    memcpy(dest + (size_t)from * size, src, (size_t)n * size);
+    return NBT_OK;
+}
+
+static nbt_status patch_insert(nbt_node* node, const nbt_node* op)
+{
+    nbt_node* at = field(op, "at", TAG_INT);
+    if(at == NULL || node->type != TAG_COMPOUND) return NBT_ERR;
+
+    int32_t index = at->payload.tag_int;
+    if(index < 0 || (size_t)index > list_length(&node->payload.tag_compound->entry)) return NBT_ERR;
+
+    nbt_node* value = take_value(op);
+    if(value == NULL) return errno == NBT_EMEM ? NBT_EMEM : NBT_ERR;
+
+    struct tag_list* entry = nbt_new_entry(value);
+    if(entry == NULL)
+    {
+        nbt_free(value);
+        return NBT_EMEM;
+    }
+
+    list_add_tail(&entry->entry, position(node, index));
+    return NBT_OK;
+}
+
+static nbt_status patch_splice(nbt_node* node, const nbt_node* op)
+{
+    nbt_node* at     = field(op, "at", TAG_INT);
+    nbt_node* remove = field(op, "remove", TAG_INT);
+    nbt_node* list   = field(op, "items", TAG_LIST);
+    if(at == NULL || remove == NULL || list == NULL || node->type != TAG_LIST) return NBT_ERR;
+
+    size_t count = list_length(&node->payload.tag_list.list->entry);
+    size_t added = list_length(&list->payload.tag_list.list->entry);
+    int32_t from = at->payload.tag_int, n = remove->payload.tag_int;
+
+    if(from < 0 || n < 0 || (size_t)from + (size_t)n > count) return NBT_ERR;
+    /* items that stay behind have to be of the same type as the new ones */
+    if(added > 0 && count > (size_t)n && list->payload.tag_list.type != node->payload.tag_list.type)
+        return NBT_ERR;
+
+    /* copy the new items first, so running out of memory leaves the list be */
+    nbt_node* fresh = nbt_clone((nbt_node*)list);
+    if(fresh == NULL) return NBT_EMEM;
+
+    struct list_head* pos = position(node, from);
+    while(n-- > 0)
+    {
+        struct list_head* next = pos->flink;
+        struct tag_list* entry = list_entry(pos, struct tag_list, entry);
+
+        list_del(pos);
+        nbt_free(entry->data);
+        slab_free(SLAB_ENTRY, entry);
+
+        pos = next;
+    }
+
+    struct list_head* item;
+    struct list_head* tmp;
+    list_for_each_safe(item, tmp, &fresh->payload.tag_list.list->entry)
+    {
+        list_del(item);
+        list_add_tail(item, pos);
+    }
+
+    if(added > 0) node->payload.tag_list.type = list->payload.tag_list.type;
+
+    nbt_free(fresh);
+    return NBT_OK;
+}
+
+static nbt_status patch_op(nbt_node* tree, const nbt_node* op)
+{
+    nbt_node* kind = field(op, "op", TAG_BYTE);
+    nbt_node* path = field(op, "path", TAG_LIST);
+    if(kind == NULL || path == NULL) return NBT_ERR;
+
+    nbt_node* node = tree;
+    nbt_node* parent = NULL;
+    struct tag_list* entry = NULL;
+
+    /* everything on the way down is about to change, so it can't be shared */
+    const struct list_head* pos;
+    list_for_each(pos, &path->payload.tag_list.list->entry)
+    {
+        nbt_node* step = list_entry(pos, struct tag_list, entry)->data;
+        if(step->type != TAG_STRING) return NBT_ERR;
+
+        node->hash = 0;
+        if((entry = find_step(node, step->payload.tag_string)) == NULL) return NBT_ERR;
+
+        parent = node;
+        if((node = nbt_mutable(parent, entry->data)) == NULL) return NBT_EMEM;
+    }
+    node->hash = 0;
+
+    switch(kind->payload.tag_byte)
+    {
+    case OP_SET:
+        return patch_set(node, parent, op);
+
+    case OP_RANGE:
+        return patch_range(node, op);
+
+    case OP_REMOVE:
+        if(entry == NULL) return NBT_ERR;
+        list_del(&entry->entry);
+        nbt_free(entry->data);
+        slab_free(SLAB_ENTRY, entry);
+        return NBT_OK;
+
+    case OP_INSERT:
+        return patch_insert(node, op);
+
+    case OP_SPLICE:
+        return patch_splice(node, op);
+    }
+
+    return NBT_ERR;
+}
+
+nbt_status nbt_patch(nbt_node* tree, const nbt_node* diff)
+{
+    assert(tree && diff);
+
+    nbt_node* base = field(diff, "base", TAG_LONG);
+    nbt_node* ops  = field(diff, "ops", TAG_LIST);
+    if(ops == NULL) return NBT_ERR;
+
+    /* changing it in place would change it for the trees sharing it */
+    if(__atomic_load_n(&tree->refs, __ATOMIC_ACQUIRE) != 0) return NBT_ERR;
+
+    if(base && (uint64_t)base->payload.tag_long != nbt_hash(tree))
+        return NBT_ERR;
+
+    /*
+     * The ops go to a snapshot, which only takes the tree's place once they've
+     * all gone in, so one failing halfway leaves the tree as it was. It only
+     * copies what the ops change, the same as patching in place would.
+     */
+    nbt_node* copy = nbt_clone_shared(tree);
+    if(copy == NULL) return NBT_EMEM;
+
+    const struct list_head* pos;
+    list_for_each(pos, &ops->payload.tag_list.list->entry)
+    {
+        nbt_node* op = list_entry(pos, struct tag_list, entry)->data;
+        nbt_status err = op->type == TAG_COMPOUND ? patch_op(copy, op) : NBT_ERR;
+        if(err != NBT_OK)
+        {
+            nbt_free(copy);
+            return err;
+        }
+    }
+
+    /* swap the insides, so whatever points at the tree sees the patched one */
+    nbt_node old = *tree;
+    *tree = *copy;
+    *copy = old;
+    nbt_free(copy);
+
+    return NBT_OK;
+}
@@ -0,0 +1,245 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Lukas Niederbremer <webmaster@flippeh.de> and Clark Gaebel <cg.wowus.cg@gmail.com>
+ * wrote this file. As long as you retain this notice you can do whatever you
+ * want with this stuff. If we meet some day, and you think this stuff is worth
+ * it, you can buy us a beer in return.
+ * -----------------------------------------------------------------------------
+ */
+#include "nbt.h"
+
+#include "alloc.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * An open addressing hash table of subtrees, keyed by nbt_hash. Each holds a
+ * reference to its node, so the node lives as long as it's in the pool, even
+ * when no tree uses it any more. Those are dropped by trimming, which happens
+ * before the table grows, so nodes only the pool wants can't pile up much.
+ */
+struct slot {
+    uint64_t hash;
+    nbt_node* node; /* NULL if the slot's free */
+    size_t bytes;   /* what the node holds that isn't in other slots */
+};
+
+struct nbt_intern {
+    const nbt_allocator* alloc; /* the override it was made under, see nbt_use_allocator */
+    pthread_mutex_t lock;
+    struct slot* slots;
+    size_t cap;     /* a power of two, or 0 */
+    size_t used;
+    nbt_intern_stats stats;
+};
+
+nbt_intern* nbt_intern_create(void)
+{
+    nbt_intern* pool = mem_calloc(1, sizeof *pool);
+    if(pool == NULL)
+    {
+        errno = NBT_EMEM;
+        return NULL;
+    }
+
+    pool->alloc = mem_override();
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+void nbt_intern_free(nbt_intern* pool)
+{
+    if(pool == NULL) return;
+
+    const nbt_allocator* old = nbt_use_allocator(pool->alloc);
+
+    for(size_t i = 0; i < pool->cap; i++)
+        nbt_free(pool->slots[i].node);
+
+    pthread_mutex_destroy(&pool->lock);
+    mem_free(pool->slots);
+    mem_free(pool);
+
+    nbt_use_allocator(old);
+}
+
+static bool is_scalar(nbt_type type)
+{
+    return type == TAG_BYTE || type == TAG_SHORT || type == TAG_INT ||
+           type == TAG_LONG || type == TAG_FLOAT || type == TAG_DOUBLE;
+}
+
+static struct tag_list* children(const nbt_node* node)
+{
+    return node->type == TAG_LIST ? node->payload.tag_list.list : node->payload.tag_compound;
+}
+
+/* The slot `hash' is in, or the free one it would go in. */
+static struct slot* find_slot(struct slot* slots, size_t cap, uint64_t hash)
+{
+    size_t i = (size_t)hash & (cap - 1);
+    while(slots[i].node && slots[i].hash != hash)
+        i = (i + 1) & (cap - 1);
+    return &slots[i];
+}
+
+/*
+ * Moves whatever's still wanted into a table of `cap' slots, dropping the
+ * nodes only the pool holds on to. Dropping a node can leave ones under it
+ * held only by the pool too, so it goes round until nothing more goes.
+ */
+static bool rebuild(nbt_intern* pool, size_t cap)
+{
+    struct slot* slots = mem_calloc(cap, sizeof *slots);
+    if(slots == NULL) return false;
+
+    bool dropped;
+    do
+    {
+        dropped = false;
+        for(size_t i = 0; i < pool->cap; i++)
+        {
+            nbt_node* node = pool->slots[i].node;
+            if(node == NULL || __atomic_load_n(&node->refs, __ATOMIC_ACQUIRE) != 0) continue;
+
+            pool->slots[i].node = NULL;
+            pool->used--;
+            pool->stats.bytes -= pool->slots[i].bytes;
+            nbt_free(node);
+            dropped = true;
+        }
+    } while(dropped);
+
+    for(size_t i = 0; i < pool->cap; i++)
+        if(pool->slots[i].node)
+            *find_slot(slots, cap, pool->slots[i].hash) = pool->slots[i];
+
+    mem_free(pool->slots);
+    pool->slots = slots;
+    pool->cap   = cap;
+    return true;
+}
+
+/* Makes room for one more, trimming before growing. False if there's no memory for it. */
+static bool reserve(nbt_intern* pool)
+{
+    if((pool->used + 1) * 4 <= pool->cap * 3) return true;
+
+    if(pool->cap > 0)
+    {
+        if(!rebuild(pool, pool->cap)) return false;
+        if((pool->used + 1) * 2 <= pool->cap) return true;
+    }
+
+    return rebuild(pool, pool->cap ? pool->cap * 2 : 256);
+}
+
+/*
+ * Swaps the children of `tree' for the pool's copies where it has them, and
+ * adds the rest. Only goes into nodes nothing else shares, since swapping
+ * children under somebody else's feet isn't safe, same as they'd be or not.
+ */
+static size_t intern_children(nbt_intern* pool, nbt_node* tree)
+{
+    size_t saved = 0;
+
+    struct list_head* pos;
+    list_for_each(pos, &children(tree)->entry)
+    {
+        struct tag_list* entry = list_entry(pos, struct tag_list, entry);
+        nbt_node* child = entry->data;
+
+        /* a pool entry costs more than a number */
+        if(is_scalar(child->type)) continue;
+
+        uint64_t hash = nbt_hash(child);
+        struct slot* slot = pool->cap ? find_slot(pool->slots, pool->cap, hash) : NULL;
+
+        if(slot && slot->node)
+        {
+            if(slot->node == child || !nbt_identical(slot->node, child)) continue;
+
+            if(__atomic_load_n(&child->refs, __ATOMIC_ACQUIRE) == 0)
+                saved += nbt_memory_usage(child).total;
+
+            __atomic_fetch_add(&slot->node->refs, 1, __ATOMIC_RELAXED);
+            entry->data = slot->node;
+            nbt_free(child);
+
+            pool->stats.hits++;
+            continue;
+        }
+
+        if((child->type == TAG_LIST || child->type == TAG_COMPOUND)
+           && __atomic_load_n(&child->refs, __ATOMIC_ACQUIRE) == 0)
+            saved += intern_children(pool, child);
+
+        if(!reserve(pool)) continue; /* it's only an optimization */
+
+        slot = find_slot(pool->slots, pool->cap, hash);
+        slot->hash  = hash;
+        slot->node  = child;
+        /* its pooled children have slots of their own, and are counted there, once */
+        slot->bytes = nbt_memory_usage_unshared(child).total;
+        __atomic_fetch_add(&child->refs, 1, __ATOMIC_RELAXED);
+        pool->used++;
+        pool->stats.bytes += slot->bytes;
+    }
+
+    return saved;
+}
+
+size_t nbt_intern_tree(nbt_intern* pool, nbt_node* tree)
+{
+    assert(pool && tree);
+
+    if(tree->type != TAG_LIST && tree->type != TAG_COMPOUND) return 0;
+
+    /* the others sharing it would see its children swapped under them */
+    if(__atomic_load_n(&tree->refs, __ATOMIC_ACQUIRE) != 0) return (errno = NBT_ERR), 0;
+
+    /* the table lives as long as the pool, whichever thread adds to it */
+    const nbt_allocator* old = nbt_use_allocator(pool->alloc);
+
+    pthread_mutex_lock(&pool->lock);
+    size_t saved = intern_children(pool, tree);
+    pool->stats.bytes_saved += saved;
+    pthread_mutex_unlock(&pool->lock);
+
+    nbt_use_allocator(old);
+
+    return saved;
+}
+
+size_t nbt_intern_trim(nbt_intern* pool)
+{
+    assert(pool);
+
+    const nbt_allocator* old = nbt_use_allocator(pool->alloc);
+
+    pthread_mutex_lock(&pool->lock);
+    size_t before = pool->used;
+    if(pool->cap > 0) rebuild(pool, pool->cap);
+    size_t dropped = before - pool->used;
+    pthread_mutex_unlock(&pool->lock);
+
+    nbt_use_allocator(old);
+
+    return dropped;
+}
+
+void nbt_intern_get_stats(nbt_intern* pool, nbt_intern_stats* stats)
+{
+    assert(pool && stats);
+
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    stats->entries = pool->used;
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -7,16 +7,32 @@
  * it, you can buy us a beer in return.
  * -----------------------------------------------------------------------------
  */
+/* for fileno, fstat, mmap and friends */
+#define _POSIX_C_SOURCE 200112L
+
 #include "nbt.h"
 
+#include "alloc.h"
 #include "buffer.h"
 #include "list.h"
+#include "threadpool.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <zlib.h>
+#ifndef __WIN32__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
 
 /*
  * zlib resources:
@@ -29,6 +45,28 @@
 /* The number of bytes to process at a time */
 #define CHUNK_SIZE 4096
 
+/* How much uncompressed data each job gets when deflating in parallel. */
+#define PARALLEL_BLOCK_SIZE (128 * 1024)
+
+/* The most history deflate can ever refer back to. */
+#define DICTIONARY_SIZE 32768
+
+/*
+ * zlib's memory comes from the library's allocator too. The stream is tied to
+ * the one in use when it's set up, so it doesn't matter which thread ends it.
+ */
+static voidpf z_alloc(voidpf opaque, uInt items, uInt size)
+{
+    const nbt_allocator* a = opaque;
+    return a->allocate((size_t)items * size, a->ctx);
+}
+
+static void z_free(voidpf opaque, voidpf ptr)
+{
+    const nbt_allocator* a = opaque;
+    a->release(ptr, a->ctx);
+}
+
 /*
  * Reads a whole file into a buffer. Returns a NULL buffer and sets errno on
  * error.
@@ -38,12 +76,21 @@ static struct buffer read_file(FILE* fp)
     struct buffer ret = BUFFER_INIT;
 
     size_t bytes_read;
+    size_t step = CHUNK_SIZE;
+
+    /*
+     * If we know how big the file is, swallow it in one read. The extra byte
+     * is so that read hits EOF, and we don't need another one to find out.
+     */
+    struct stat st;
+    if(fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        step = (size_t)st.st_size + 1;
 
     do {
-        if(buffer_reserve(&ret, ret.len + CHUNK_SIZE))
+        if(buffer_reserve(&ret, ret.len + step))
             return (errno = NBT_EMEM), buffer_free(&ret), BUFFER_INIT;
 
-        bytes_read = fread(ret.data + ret.len, 1, CHUNK_SIZE, fp);
+        bytes_read = fread(ret.data + ret.len, 1, step, fp);
         ret.len += bytes_read;
 
         if(ferror(fp))
@@ -73,22 +120,430 @@ static nbt_status write_file(FILE* fp, const void* data, size_t len)
     return NBT_OK;
 }
 
+/*
+ * One block of a parallel gzip stream. Each block is deflated as a raw stream
+ * on its own, primed with the tail of the block before it so the ratio doesn't
+ * suffer much. Every block but the last ends on a sync flush, which leaves it
+ * byte-aligned and unterminated, so the blocks can simply be glued together.
+ */
+struct deflate_job {
+    const unsigned char* in;
+    size_t len;
+    size_t dict_len; /* the dictionary is the `dict_len' bytes before `in' */
+    bool last;
+
+    const nbt_compression_options* opts;
+
+    struct buffer out;
+    uLong crc;
+    nbt_status err;
+};
+
+static void deflate_block(void* vjob)
+{
+    struct deflate_job* job = vjob;
+
+    job->crc = crc32(crc32(0L, Z_NULL, 0), job->in, job->len);
+
+    z_stream stream = {
+        .zalloc   = z_alloc,
+        .zfree    = z_free,
+        .opaque   = (voidpf)mem_allocator(),
+        .next_in  = (void*)job->in,
+        .avail_in = job->len
+    };
+
+    /* Negative windowBits means a raw deflate stream. No header, no trailer. */
+    if(deflateInit2(&stream,
+                    job->opts->level,
+                    Z_DEFLATED,
+                    -15,
+                    job->opts->mem_level,
+                    (int)job->opts->strategy
+                   ) != Z_OK)
+    {
+        job->err = NBT_EZ;
+        return;
+    }
+
+    if(job->dict_len > 0 &&
+       deflateSetDictionary(&stream, job->in - job->dict_len, job->dict_len) != Z_OK)
+    {
+        job->err = NBT_EZ;
+        goto done;
+    }
+
+    int flush = job->last ? Z_FINISH : Z_SYNC_FLUSH;
+
+    do {
+        if(buffer_reserve(&job->out, job->out.len + CHUNK_SIZE))
+        {
+            job->err = NBT_EMEM;
+            goto done;
+        }
+
+        stream.next_out  = job->out.data + job->out.len;
+        stream.avail_out = CHUNK_SIZE;
+
+        if(deflate(&stream, flush) == Z_STREAM_ERROR)
+        {
+            job->err = NBT_EZ;
+            goto done;
+        }
+
+        job->out.len += CHUNK_SIZE - stream.avail_out;
+
+    } while(stream.avail_out == 0);
+
+done:
+    (void)deflateEnd(&stream);
+}
+
+/* Appends `x' as 4 little-endian bytes, like the gzip trailer wants. */
+static int append_le32(struct buffer* b, uLong x)
+{
+    unsigned char le[4] = {
+        x & 0xff, (x >> 8) & 0xff, (x >> 16) & 0xff, (x >> 24) & 0xff
+    };
+
+    return buffer_append(b, le, sizeof le);
+}
+
+/*
+ * Compresses `mem' into a single gzip member, splitting the work into
+ * PARALLEL_BLOCK_SIZE pieces over `opts->threads' threads. The per-block CRCs
+ * are stitched together with crc32_combine, so nothing is read twice. Returns
+ * a NULL buffer on failure, and sets errno appropriately.
+ */
+static struct buffer __compress_parallel(const void* mem,
+                                         size_t len,
+                                         const nbt_compression_options* opts)
+{
+    struct buffer ret = BUFFER_INIT;
+
+    size_t njobs = (len + PARALLEL_BLOCK_SIZE - 1) / PARALLEL_BLOCK_SIZE;
+
+    struct deflate_job* jobs = mem_calloc(njobs, sizeof *jobs);
+    if(jobs == NULL)
+        return (errno = NBT_EMEM), BUFFER_INIT;
+
+    errno = NBT_OK;
+
+    struct threadpool* pool = threadpool_create((size_t)opts->threads);
+    if(pool == NULL)
+    {
+        errno = NBT_EMEM;
+        goto parallel_error;
+    }
+
+    for(size_t i = 0; i < njobs; i++)
+    {
+        size_t start = i * PARALLEL_BLOCK_SIZE;
+
+        jobs[i] = (struct deflate_job) {
+            .in       = (const unsigned char*)mem + start,
+            .len      = i == njobs - 1 ? len - start : PARALLEL_BLOCK_SIZE,
+            .dict_len = start < DICTIONARY_SIZE ? start : DICTIONARY_SIZE,
+            .last     = i == njobs - 1,
+            .opts     = opts,
+            .out      = BUFFER_INIT,
+            .err      = NBT_OK
+        };
+
+        if(threadpool_submit(pool, deflate_block, &jobs[i]))
+            deflate_block(&jobs[i]); /* no room in the queue, do it ourselves */
+    }
+
+    threadpool_destroy(pool);
+    errno = NBT_OK; /* pthreads may have scribbled on it */
+
+    /* A bare-bones gzip header: no name, no timestamp, unknown OS. */
+    static const unsigned char header[10] = {
+        0x1f, 0x8b, 8 /* deflate */, 0, 0, 0, 0, 0, 0, 0xff
+    };
+
+    if(buffer_append(&ret, header, sizeof header))
+        errno = NBT_EMEM;
+
+    uLong crc = crc32(0L, Z_NULL, 0);
+
+    for(size_t i = 0; i < njobs && errno == NBT_OK; i++)
+    {
+        if(jobs[i].err != NBT_OK)
+            errno = jobs[i].err;
+        else if(buffer_append(&ret, jobs[i].out.data, jobs[i].out.len))
+            errno = NBT_EMEM;
+
+        crc = crc32_combine(crc, jobs[i].crc, (z_off_t)jobs[i].len);
+    }
+
+    if(errno == NBT_OK && (append_le32(&ret, crc) || append_le32(&ret, (uLong)len)))
+        errno = NBT_EMEM;
+
+    if(errno != NBT_OK)
+        goto parallel_error;
+
+    for(size_t i = 0; i < njobs; i++)
+        buffer_free(&jobs[i].out);
+    mem_free(jobs);
+
+    return ret;
+
+parallel_error:
+    for(size_t i = 0; i < njobs; i++)
+        buffer_free(&jobs[i].out);
+    mem_free(jobs);
+
+    buffer_free(&ret);
+    return BUFFER_INIT;
+}
+
+#ifdef HAVE_LZ4
+
+/*
+ * LZ4 data is framed the way lz4-java's LZ4BlockOutputStream does it, since
+ * that's what the JVM side reads and writes. Each block looks like:
+ *
+ *   "LZ4Block" | token | compressed length | original length | checksum
+ *
+ * followed by the block's data. The token's high nibble says whether the data
+ * is LZ4 or stored raw, and its low nibble is log2(block size) - 10. Lengths
+ * and checksum are little-endian 32 bit. The checksum is the xxhash32 of the
+ * original data with lz4-java's seed, trimmed to 28 bits. The stream ends with
+ * an empty raw block.
+ */
+
+#define LZ4_MAGIC          "LZ4Block"
+#define LZ4_MAGIC_LENGTH   8
+#define LZ4_HEADER_LENGTH  (LZ4_MAGIC_LENGTH + 1 + 4 + 4 + 4)
+#define LZ4_METHOD_RAW     0x10
+#define LZ4_METHOD_LZ4     0x20
+#define LZ4_LEVEL_BASE     10
+#define LZ4_BLOCK_SIZE     (1 << 16)
+#define LZ4_BLOCK_LEVEL    (16 - LZ4_LEVEL_BASE)
+#define LZ4_CHECKSUM_SEED  0x9747b28cU
+
+static inline uint32_t read_le32(const unsigned char* p)
+{
+    return (uint32_t)p[0]       | (uint32_t)p[1] << 8 |
+           (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void write_le32(unsigned char* p, uint32_t x)
+{
+    p[0] = x & 0xff; p[1] = (x >> 8) & 0xff; p[2] = (x >> 16) & 0xff; p[3] = x >> 24;
+}
+
+static inline uint32_t rotl32(uint32_t x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+/* Plain old XXH32. */
+static uint32_t xxh32(const unsigned char* p, size_t len, uint32_t seed)
+{
+    static const uint32_t P1 = 0x9E3779B1U, P2 = 0x85EBCA77U, P3 = 0xC2B2AE3DU,
+                          P4 = 0x27D4EB2FU, P5 = 0x165667B1U;
+
+    const unsigned char* end = p + len;
+    uint32_t h;
+
+    if(len >= 16)
+    {
+        uint32_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+
+        for(; p + 16 <= end; p += 16)
+        {
+            v1 = rotl32(v1 + read_le32(p)      * P2, 13) * P1;
+            v2 = rotl32(v2 + read_le32(p + 4)  * P2, 13) * P1;
+            v3 = rotl32(v3 + read_le32(p + 8)  * P2, 13) * P1;
+            v4 = rotl32(v4 + read_le32(p + 12) * P2, 13) * P1;
+        }
+
+        h = rotl32(v1, 1) + rotl32(v2, 7) + rotl32(v3, 12) + rotl32(v4, 18);
+    }
+    else
+        h = seed + P5;
+
+    h += (uint32_t)len;
+
+    for(; p + 4 <= end; p += 4)
+        h = rotl32(h + read_le32(p) * P3, 17) * P4;
+
+    for(; p < end; p++)
+        h = rotl32(h + *p * P5, 11) * P1;
+
+    h ^= h >> 15; h *= P2;
+    h ^= h >> 13; h *= P3;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static inline uint32_t lz4_checksum(const unsigned char* p, size_t len)
+{
+    return xxh32(p, len, LZ4_CHECKSUM_SEED) & 0xFFFFFFF;
+}
+
+static struct buffer __compress_lz4(const void* mem, size_t len)
+{
+    struct buffer ret = BUFFER_INIT;
+    const unsigned char* in = mem;
+
+    errno = NBT_OK;
+
+    for(size_t start = 0; start < len; start += LZ4_BLOCK_SIZE)
+    {
+        int n = len - start < LZ4_BLOCK_SIZE ? (int)(len - start) : LZ4_BLOCK_SIZE;
+
+        if(buffer_reserve(&ret, ret.len + LZ4_HEADER_LENGTH + LZ4_compressBound(n)))
+            return (errno = NBT_EMEM), buffer_free(&ret), BUFFER_INIT;
+
+        unsigned char* header = ret.data + ret.len;
+        unsigned char* out    = header + LZ4_HEADER_LENGTH;
+
+        int method = LZ4_METHOD_LZ4;
+        int clen = LZ4_compress_default((const char*)in + start, (char*)out,
+                                        n, LZ4_compressBound(n));
+
+        /* Incompressible. Store it, like lz4-java does. */
+        if(clen <= 0 || clen >= n)
+        {
+            method = LZ4_METHOD_RAW;
+            clen = n;
+            memcpy(out, in + start, n);
+        }
+
+        memcpy(header, LZ4_MAGIC, LZ4_MAGIC_LENGTH);
+        header[LZ4_MAGIC_LENGTH] = method | LZ4_BLOCK_LEVEL;
+        write_le32(header + LZ4_MAGIC_LENGTH + 1, clen);
+        write_le32(header + LZ4_MAGIC_LENGTH + 5, n);
+        write_le32(header + LZ4_MAGIC_LENGTH + 9, lz4_checksum(in + start, n));
+
+        ret.len += LZ4_HEADER_LENGTH + clen;
+    }
+
+    /* The end marker. */
+    unsigned char end[LZ4_HEADER_LENGTH] = { 0 };
+    memcpy(end, LZ4_MAGIC, LZ4_MAGIC_LENGTH);
+    end[LZ4_MAGIC_LENGTH] = LZ4_METHOD_RAW | LZ4_BLOCK_LEVEL;
+
+    if(buffer_append(&ret, end, sizeof end))
+        return (errno = NBT_EMEM), buffer_free(&ret), BUFFER_INIT;
+
+    return ret;
+}
+
+static struct buffer __decompress_lz4(const void* mem, size_t len)
+{
+    struct buffer ret = BUFFER_INIT;
+    const unsigned char* in = mem;
+
+    errno = NBT_OK;
+
+    for(;;)
+    {
+        if(len < LZ4_HEADER_LENGTH || memcmp(in, LZ4_MAGIC, LZ4_MAGIC_LENGTH) != 0)
+            goto decompression_error;
+
+        int method = in[LZ4_MAGIC_LENGTH] & 0xF0;
+        int level  = LZ4_LEVEL_BASE + (in[LZ4_MAGIC_LENGTH] & 0x0F);
+        uint32_t clen  = read_le32(in + LZ4_MAGIC_LENGTH + 1);
+        uint32_t olen  = read_le32(in + LZ4_MAGIC_LENGTH + 5);
+        uint32_t check = read_le32(in + LZ4_MAGIC_LENGTH + 9);
+
+        in  += LZ4_HEADER_LENGTH;
+        len -= LZ4_HEADER_LENGTH;
+
+        if(method != LZ4_METHOD_RAW && method != LZ4_METHOD_LZ4) goto decompression_error;
+        if(olen > (1U << level) || clen > len)                  goto decompression_error;
+        if((olen == 0) != (clen == 0))                          goto decompression_error;
+        if(method == LZ4_METHOD_RAW && olen != clen)            goto decompression_error;
+
+        if(olen == 0) /* the end marker */
+            break;
+
+        if(buffer_reserve(&ret, ret.len + olen))
+        {
+            errno = NBT_EMEM;
+            goto decompression_error;
+        }
+
+        unsigned char* out = ret.data + ret.len;
+
+        if(method == LZ4_METHOD_RAW)
+            memcpy(out, in, olen);
+        else if(LZ4_decompress_safe((const char*)in, (char*)out, (int)clen, (int)olen) != (int)olen)
+            goto decompression_error;
+
+        if(lz4_checksum(out, olen) != check)
+            goto decompression_error;
+
+        ret.len += olen;
+        in  += clen;
+        len -= clen;
+    }
+
+    /* Don't hand back a NULL buffer for an empty stream. */
+    if(buffer_reserve(&ret, 1))
+    {
+        errno = NBT_EMEM;
+        goto decompression_error;
+    }
+
+    return ret;
+
+decompression_error:
+    if(errno == NBT_OK)
+        errno = NBT_ERR;
+
+    buffer_free(&ret);
+    return BUFFER_INIT;
+}
+
+#else
+
+static struct buffer __compress_lz4(const void* mem, size_t len)
+{
+    (void)mem; (void)len;
+    return (errno = NBT_ECOMP), BUFFER_INIT;
+}
+
+static struct buffer __decompress_lz4(const void* mem, size_t len)
+{
+    (void)mem; (void)len;
+    return (errno = NBT_ECOMP), BUFFER_INIT;
+}
+
+#endif
+
 /*
  * Reads in uncompressed data and returns a buffer with the $(strat)-compressed
  * data within. Returns a NULL buffer on failure, and sets errno appropriately.
  */
 static struct buffer __compress(const void* mem,
                                 size_t len,
-                                nbt_compression_strategy strat)
+                                nbt_compression_strategy strat,
+                                const nbt_compression_options* opts)
 {
     struct buffer ret = BUFFER_INIT;
 
+    nbt_compression_options defaults = NBT_COMPRESSION_DEFAULT;
+    if(opts == NULL)
+        opts = &defaults;
+
+    if(strat == STRAT_LZ4)
+        return __compress_lz4(mem, len);
+
+    if(strat == STRAT_GZIP && opts->threads > 1 && len > PARALLEL_BLOCK_SIZE)
+        return __compress_parallel(mem, len, opts);
+
     errno = NBT_OK;
 
     z_stream stream = {
-        .zalloc   = Z_NULL,
-        .zfree    = Z_NULL,
-        .opaque   = Z_NULL,
+        .zalloc   = z_alloc,
+        .zfree    = z_free,
+        .opaque   = (voidpf)mem_allocator(),
         .next_in  = (void*)mem,
         .avail_in = len
     };
@@ -102,11 +557,11 @@ static struct buffer __compress(const void* mem,
         windowbits += 16;
 
     if(deflateInit2(&stream,
-                    Z_DEFAULT_COMPRESSION,
+                    opts->level,
                     Z_DEFLATED,
                     windowbits,
-                    8,
-                    Z_DEFAULT_STRATEGY
+                    opts->mem_level,
+                    (int)opts->strategy
                    ) != Z_OK)
     {
         errno = NBT_EZ;
@@ -155,9 +610,9 @@ static struct buffer __decompress(const void* mem, size_t len)
     errno = NBT_OK;
 
     z_stream stream = {
-        .zalloc   = Z_NULL,
-        .zfree    = Z_NULL,
-        .opaque   = Z_NULL,
+        .zalloc   = z_alloc,
+        .zfree    = z_free,
+        .opaque   = (voidpf)mem_allocator(),
         .next_in  = (void*)mem,
         .avail_in = len
     };
@@ -236,6 +691,61 @@ nbt_node* nbt_parse_file(FILE* fp)
     return ret;
 }
 
+#ifndef __WIN32__
+
+/*
+ * Maps regular files straight into memory and inflates from there, which saves
+ * copying the whole compressed file into a buffer first. Anything that can't
+ * be mapped (pipes, devices, empty files) goes through nbt_parse_file instead.
+ */
+nbt_node* nbt_parse_path(const char* filename)
+{
+    int fd = open(filename, O_RDONLY);
+
+    if(fd == -1)
+    {
+        errno = NBT_EIO;
+        return NULL;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        size_t len = (size_t)st.st_size;
+        void* map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if(map != MAP_FAILED)
+        {
+            close(fd);
+
+            (void)posix_madvise(map, len, POSIX_MADV_SEQUENTIAL);
+
+            nbt_node* r = nbt_parse_compressed(map, len);
+
+            int err = errno; /* munmap is allowed to clobber it */
+            munmap(map, len);
+            errno = err;
+
+            return r;
+        }
+    }
+
+    FILE* fp = fdopen(fd, "rb");
+
+    if(fp == NULL)
+    {
+        close(fd);
+        errno = NBT_EIO;
+        return NULL;
+    }
+
+    nbt_node* r = nbt_parse_file(fp);
+    fclose(fp);
+    return r;
+}
+
+#else
+
 nbt_node* nbt_parse_path(const char* filename)
 {
     FILE* fp = fopen(filename, "rb");
@@ -251,9 +761,31 @@ nbt_node* nbt_parse_path(const char* filename)
     return r;
 }
 
+#endif
+
 nbt_node* nbt_parse_compressed(const void* chunk_start, size_t length)
 {
-    struct buffer decompressed = __decompress(chunk_start, length);
+    return nbt_parse_compressed_strat(chunk_start, length, STRAT_INFLATE);
+}
+
+nbt_node* nbt_parse_compressed_strat(const void* chunk_start, size_t length,
+                                     nbt_compression_strategy strat)
+{
+    struct buffer decompressed;
+
+    switch(strat)
+    {
+    case STRAT_NONE:
+        return nbt_parse(chunk_start, length);
+
+    case STRAT_LZ4:
+        decompressed = __decompress_lz4(chunk_start, length);
+        break;
+
+    default: /* zlib figures out gzip vs. zlib on its own */
+        decompressed = __decompress(chunk_start, length);
+        break;
+    }
 
     if(decompressed.data == NULL)
         return NULL;
@@ -270,7 +802,14 @@ nbt_node* nbt_parse_compressed(const void* chunk_start, size_t length)
  */
 nbt_status nbt_dump_file(const nbt_node* tree, FILE* fp, nbt_compression_strategy strat)
 {
-    struct buffer compressed = nbt_dump_compressed(tree, strat);
+    return nbt_dump_file_opts(tree, fp, strat, NULL);
+}
+
+nbt_status nbt_dump_file_opts(const nbt_node* tree, FILE* fp,
+                              nbt_compression_strategy strat,
+                              const nbt_compression_options* opts)
+{
+    struct buffer compressed = nbt_dump_compressed_opts(tree, strat, opts);
 
     if(compressed.data == NULL)
         return (nbt_status)errno;
@@ -283,12 +822,35 @@ nbt_status nbt_dump_file(const nbt_node* tree, FILE* fp, nbt_compression_strateg
 
 struct buffer nbt_dump_compressed(const nbt_node* tree, nbt_compression_strategy strat)
 {
-    struct buffer uncompressed = nbt_dump_binary(tree);
+    return nbt_dump_compressed_opts(tree, strat, NULL);
+}
+
+struct buffer nbt_compress(const void* mem, size_t len,
+                           nbt_compression_strategy strat,
+                           const nbt_compression_options* opts)
+{
+    if(strat != STRAT_NONE)
+        return __compress(mem, len, strat, opts);
 
-    if(uncompressed.data == NULL)
+    struct buffer copy = BUFFER_INIT;
+    if(buffer_append(&copy, mem, len))
+    {
+        errno = NBT_EMEM;
         return BUFFER_INIT;
+    }
+    return copy;
+}
+
+struct buffer nbt_dump_compressed_opts(const nbt_node* tree,
+                                       nbt_compression_strategy strat,
+                                       const nbt_compression_options* opts)
+{
+    struct buffer uncompressed = nbt_dump_binary(tree);
+
+    if(uncompressed.data == NULL || strat == STRAT_NONE)
+        return uncompressed;
 
-    struct buffer compressed = __compress(uncompressed.data, uncompressed.len, strat);
+    struct buffer compressed = __compress(uncompressed.data, uncompressed.len, strat, opts);
 
     buffer_free(&uncompressed);
     return compressed;
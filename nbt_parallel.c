@@ -0,0 +1,280 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Lukas Niederbremer <webmaster@flippeh.de> and Clark Gaebel <cg.wowus.cg@gmail.com>
+ * wrote this file. As long as you retain this notice you can do whatever you
+ * want with this stuff. If we meet some day, and you think this stuff is worth
+ * it, you can buy us a beer in return.
+ * -----------------------------------------------------------------------------
+ */
+#include "nbt.h"
+
+#include "alloc.h"
+#include "threadpool.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* Nodes a thread walks on its own between offers of work to the others. */
+#define SPLIT_NODES 4096
+
+/* Siblings taken from a shared run at a time. */
+#define RUN_CHUNK 8
+
+/* Partials are rounded up to this, so no two threads write to one cache line. */
+#define PARTIAL_ALIGN 64
+
+struct walk {
+    struct threadpool* pool; /* NULL if it's all done on the calling thread */
+    const nbt_reducer* r;
+    void* aux;
+
+    /* one partial for every worker, then one for the calling thread */
+    unsigned char* partials;
+    size_t stride;
+
+    size_t queued; /* atomic, helpers submitted that haven't started */
+    bool stop;     /* atomic */
+    int err;       /* atomic, the first error or NBT_OK */
+};
+
+/*
+ * Siblings, [next, end), shared out a few at a time to every worker that
+ * comes to help. Only one pass is ever made down the list: skipping ahead to
+ * split it up some other way would take as long as walking it, a cache miss
+ * per sibling.
+ */
+struct run {
+    struct walk* w;
+    pthread_mutex_t lock;
+    struct list_head* next;
+    struct list_head* end;
+    size_t users; /* atomic, the last to let go frees it */
+};
+
+/* The partial of worker `i', or of the calling thread if `i' is the number of workers. */
+static void* partial_of(const struct walk* w, size_t i)
+{
+    return w->partials ? w->partials + i * w->stride : NULL;
+}
+
+static void fail(struct walk* w, int err)
+{
+    int none = NBT_OK;
+    __atomic_compare_exchange_n(&w->err, &none, err, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    __atomic_store_n(&w->stop, true, __ATOMIC_RELAXED);
+}
+
+static void walk_siblings(struct walk* w, struct list_head* first, struct list_head* end, void* partial);
+
+static void let_go(struct run* run)
+{
+    if(__atomic_sub_fetch(&run->users, 1, __ATOMIC_ACQ_REL) != 0) return;
+
+    pthread_mutex_destroy(&run->lock);
+    mem_free(run);
+}
+
+/* A worker's share of a run: it walks a few siblings at a time until there are none left. */
+static void help(void* vrun)
+{
+    struct run* run = vrun;
+    struct walk* w = run->w;
+    void* partial = partial_of(w, (size_t)threadpool_worker_index());
+
+    __atomic_fetch_sub(&w->queued, 1, __ATOMIC_RELAXED);
+
+    while(!__atomic_load_n(&w->stop, __ATOMIC_RELAXED))
+    {
+        pthread_mutex_lock(&run->lock);
+        struct list_head* first = run->next;
+        struct list_head* last = first;
+        for(size_t n = 0; n < RUN_CHUNK && last != run->end; n++)
+            last = last->flink;
+        run->next = last;
+        pthread_mutex_unlock(&run->lock);
+
+        if(first == last) break;
+        walk_siblings(w, first, last, partial);
+    }
+
+    let_go(run);
+}
+
+/*
+ * Shares the siblings after `pos', up to `*end', with every worker, this one
+ * included once it's done with what it has, and brings `*end' forward to stop
+ * there. If the pool won't take any helpers, it all stays with the caller.
+ */
+static void share(struct walk* w, struct list_head* pos, struct list_head** end)
+{
+    struct run* run = mem_alloc(sizeof *run);
+    if(run == NULL) return;
+
+    run->w     = w;
+    run->next  = pos->flink;
+    run->end   = *end;
+    run->users = 1;
+    pthread_mutex_init(&run->lock, NULL);
+
+    size_t helpers = 0;
+    for(size_t i = threadpool_size(w->pool); i > 0; i--, helpers++)
+    {
+        __atomic_fetch_add(&run->users, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&w->queued, 1, __ATOMIC_RELAXED);
+
+        if(threadpool_submit(w->pool, help, run))
+        {
+            __atomic_fetch_sub(&run->users, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_sub(&w->queued, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    if(helpers > 0) *end = pos->flink;
+    let_go(run);
+}
+
+/*
+ * Shares the rest of the siblings at the highest level that has any left: the
+ * ones the walk was given, then each level of the iterator going down. Those are the
+ * biggest lumps of work, most worth the cost of moving to another thread. Not
+ * while helpers are still waiting for a worker, though; nobody's short of
+ * work then, and more would only be queued for nothing.
+ */
+static void split(struct walk* w, nbt_iterator* it, struct list_head* pos, struct list_head** end)
+{
+    if(__atomic_load_n(&w->queued, __ATOMIC_RELAXED) > 0) return;
+
+    if(pos->flink != *end)
+    {
+        share(w, pos, end);
+        return;
+    }
+
+    struct nbt_iter_level* levels = it->stack ? it->stack : it->fixed;
+
+    for(size_t d = 0; d < it->depth; d++)
+        if(levels[d].pos->flink != levels[d].end)
+        {
+            share(w, levels[d].pos, &levels[d].end);
+            return;
+        }
+}
+
+/* Visits the siblings [first, end) and everything under them, sharing as it goes. */
+static void walk_siblings(struct walk* w, struct list_head* first, struct list_head* end, void* partial)
+{
+    size_t budget = SPLIT_NODES;
+
+    for(struct list_head* pos = first; pos != end; pos = pos->flink)
+    {
+        nbt_iterator it;
+        nbt_node* node;
+
+        for(node = nbt_iter_begin(&it, list_entry(pos, struct tag_list, entry)->data);
+            node;
+            node = nbt_iter_next(&it))
+        {
+            if(__atomic_load_n(&w->stop, __ATOMIC_RELAXED)) break;
+
+            if(!w->r->visit(node, partial, w->aux))
+            {
+                __atomic_store_n(&w->stop, true, __ATOMIC_RELAXED);
+                break;
+            }
+
+            if(--budget == 0)
+            {
+                if(w->pool) split(w, &it, pos, &end);
+                budget = SPLIT_NODES;
+            }
+        }
+
+        /* the iterator only gives up halfway down when its stack couldn't grow */
+        if(node == NULL && it.depth > 0) fail(w, NBT_EMEM);
+
+        nbt_iter_end(&it);
+
+        if(__atomic_load_n(&w->stop, __ATOMIC_RELAXED)) break;
+    }
+}
+
+int nbt_reduce_parallel(nbt_node* tree, const nbt_reducer* r, void* result, void* aux, int nthreads)
+{
+    assert(r && r->visit);
+
+    if(tree == NULL) return 0;
+
+    size_t workers = nthreads > 1 ? (size_t)nthreads : 0;
+    struct walk w = { NULL, r, aux, NULL, 0, 0, false, NBT_OK };
+
+    w.stride = (r->size + PARTIAL_ALIGN - 1) / PARTIAL_ALIGN * PARTIAL_ALIGN;
+    if(w.stride > 0 && (w.partials = mem_alloc((workers + 1) * w.stride)) == NULL)
+    {
+        errno = NBT_EMEM;
+        return -1;
+    }
+
+    if(r->init)
+        for(size_t i = 0; i <= workers; i++)
+            r->init(partial_of(&w, i), aux);
+
+    if(workers > 0 && (w.pool = threadpool_create(workers)) == NULL)
+    {
+        mem_free(w.partials);
+        errno = NBT_EMEM;
+        return -1;
+    }
+
+    /*
+     * The whole tree, as a list of one, starts out on this thread, which shares
+     * it out as it goes, and then waits for the workers to finish.
+     */
+    struct list_head head;
+    struct tag_list top;
+    INIT_LIST_HEAD(&head);
+    top.data = tree;
+    list_add_tail(&top.entry, &head);
+
+    walk_siblings(&w, head.flink, &head, partial_of(&w, workers));
+
+    /* every worker keeps helping until the last run is done, then they can go */
+    if(w.pool) threadpool_wait(w.pool);
+    threadpool_destroy(w.pool);
+
+    if(r->merge)
+        for(size_t i = 0; i <= workers; i++)
+            r->merge(result, partial_of(&w, i), aux);
+
+    mem_free(w.partials);
+
+    if(w.err != NBT_OK)
+    {
+        errno = w.err;
+        return -1;
+    }
+    return w.stop ? 1 : 0;
+}
+
+struct mapping {
+    nbt_visitor_t visit;
+    void* aux;
+};
+
+static bool map_visit(nbt_node* node, void* partial, void* aux)
+{
+    struct mapping* m = aux;
+    (void)partial;
+    return m->visit(node, m->aux);
+}
+
+int nbt_map_parallel(nbt_node* tree, nbt_visitor_t visit, void* aux, int nthreads)
+{
+    assert(visit);
+
+    struct mapping m = { visit, aux };
+    const nbt_reducer r = { 0, NULL, map_visit, NULL };
+    return nbt_reduce_parallel(tree, &r, NULL, &m, nthreads);
+}
@@ -9,8 +9,10 @@
  */
 #include "nbt.h"
 
+#include "alloc.h"
 #include "buffer.h"
 #include "list.h"
+#include "slab.h"
 
 #include <assert.h>
 #include <errno.h>
@@ -78,7 +80,15 @@ static inline const void* swapped_memscan(void* dest, const void* src, size_t n)
 }
 
 #define CHECKED_MALLOC(var, n, on_error) do { \
-    if((var = malloc(n)) == NULL)             \
+    if((var = mem_alloc(n)) == NULL)          \
+    {                                         \
+        errno = NBT_EMEM;                     \
+        on_error;                             \
+    }                                         \
+} while(0)
+
+#define CHECKED_SLAB_ALLOC(var, cls, on_error) do { \
+    if((var = slab_alloc(cls)) == NULL)       \
     {                                         \
         errno = NBT_EMEM;                     \
         on_error;                             \
@@ -115,14 +125,14 @@ static inline void bprintf(struct buffer* b, const char* restrict format, ...)
     siz = vsnprintf(NULL, 0, format, args) + 1;
     va_end(args);
 
-    char* buf = malloc(siz);
+    char* buf = mem_alloc(siz);
 
     va_start(args, format);
     vsnprintf(buf, siz, format, args);
     va_end(args);
 
     buffer_append(b, buf, siz - 1);
-    free(buf);
+    mem_free(buf);
 }
 
 /*
@@ -150,7 +160,7 @@ parse_error:
     if(errno == NBT_OK)
         errno = NBT_ERR;
 
-    free(ret);
+    mem_free(ret);
     return NULL;
 }
 
@@ -173,7 +183,7 @@ parse_error:
     if(errno == NBT_OK)
         errno = NBT_ERR;
 
-    free(ret.data);
+    mem_free(ret.data);
     ret.data = NULL;
     return ret;
 }
@@ -200,7 +210,34 @@ parse_error:
     if(errno == NBT_OK)
         errno = NBT_ERR;
 
-    free(ret.data);
+    mem_free(ret.data);
+    ret.data = NULL;
+    return ret;
+}
+
+static inline struct nbt_long_array read_long_array(const char** memory, size_t* length)
+{
+    struct nbt_long_array ret;
+    ret.data = NULL;
+
+    READ_GENERIC(&ret.length, sizeof ret.length, swapped_memscan, goto parse_error);
+
+    if(ret.length < 0) goto parse_error;
+
+    CHECKED_MALLOC(ret.data, 8*(size_t)ret.length, goto parse_error);
+
+    READ_GENERIC(ret.data, (size_t)8*ret.length, memscan, goto parse_error);
+    // swap
+    for(int i=0; i < ret.length; i++)
+        be2ne(&ret.data[i], sizeof ret.data[i]);
+
+    return ret;
+
+parse_error:
+    if(errno == NBT_OK)
+        errno = NBT_ERR;
+
+    mem_free(ret.data);
     ret.data = NULL;
     return ret;
 }
@@ -245,7 +282,7 @@ static struct nbt_list read_list(const char** memory, size_t* length)
     READ_GENERIC(&type, sizeof type, swapped_memscan, goto parse_error);
     READ_GENERIC(&elems, sizeof elems, swapped_memscan, goto parse_error);
 
-    CHECKED_MALLOC(ret.list, sizeof *ret.list, goto parse_error);
+    CHECKED_SLAB_ALLOC(ret.list, SLAB_ENTRY, goto parse_error);
 
     ret.type = (nbt_type)type;
     ret.list->data = NULL; /* the first value in a list is a sentinel. don't even try to read it. */
@@ -255,13 +292,13 @@ static struct nbt_list read_list(const char** memory, size_t* length)
     {
         struct tag_list* new;
 
-        CHECKED_MALLOC(new, sizeof *new, goto parse_error);
+        CHECKED_SLAB_ALLOC(new, SLAB_ENTRY, goto parse_error);
 
         new->data = parse_unnamed_tag((nbt_type)type, NULL, memory, length);
 
         if(new->data == NULL)
         {
-            free(new);
+            slab_free(SLAB_ENTRY, new);
             goto parse_error;
         }
 
@@ -288,7 +325,7 @@ static struct tag_list* read_compound(const char** memory, size_t* length)
 {
     struct tag_list* ret;
 
-    CHECKED_MALLOC(ret, sizeof *ret, goto parse_error);
+    CHECKED_SLAB_ALLOC(ret, SLAB_ENTRY, goto parse_error);
 
     ret->data = NULL;
     INIT_LIST_HEAD(&ret->entry);
@@ -306,8 +343,8 @@ static struct tag_list* read_compound(const char** memory, size_t* length)
         name = read_string(memory, length);
         if(name == NULL) goto parse_error;
 
-        CHECKED_MALLOC(new_entry, sizeof *new_entry,
-            free(name);
+        CHECKED_SLAB_ALLOC(new_entry, SLAB_ENTRY,
+            mem_free(name);
             goto parse_error;
         );
 
@@ -315,8 +352,8 @@ static struct tag_list* read_compound(const char** memory, size_t* length)
 
         if(new_entry->data == NULL)
         {
-            free(new_entry);
-            free(name);
+            slab_free(SLAB_ENTRY, new_entry);
+            mem_free(name);
             goto parse_error;
         }
 
@@ -340,10 +377,13 @@ static inline nbt_node* parse_unnamed_tag(nbt_type type, char* name, const char*
 {
     nbt_node* node;
 
-    CHECKED_MALLOC(node, sizeof *node, goto parse_error);
+    CHECKED_SLAB_ALLOC(node, SLAB_NODE, goto parse_error);
 
     node->type = type;
     node->name = name;
+    node->hash = 0;
+    node->hash_fuzzy = false;
+    node->refs = 0;
 
 #define COPY_INTO_PAYLOAD(payload_name) \
     READ_GENERIC(&node->payload.payload_name, sizeof node->payload.payload_name, swapped_memscan, goto parse_error);
@@ -393,6 +433,9 @@ static inline nbt_node* parse_unnamed_tag(nbt_type type, char* name, const char*
     case TAG_INT_ARRAY:
         node->payload.tag_int_array = read_int_array(memory, length);
         break;
+    case TAG_LONG_ARRAY:
+        node->payload.tag_long_array = read_long_array(memory, length);
+        break;
 
     default:
         goto parse_error; /* Unknown node or TAG_END. Either way, we shouldn't be parsing this. */
@@ -408,7 +451,7 @@ parse_error:
     if(errno == NBT_OK)
         errno = NBT_ERR;
 
-    free(node);
+    slab_free(SLAB_NODE, node);
     return NULL;
 }
 
@@ -442,7 +485,7 @@ parse_error:
     if(errno == NBT_OK)
         errno = NBT_ERR;
 
-    free(name);
+    mem_free(name);
     return NULL;
 }
 
@@ -485,6 +528,16 @@ static inline void dump_int_array(const struct nbt_int_array ia, struct buffer*
     bprintf(b, "]");
 }
 
+static inline void dump_long_array(const struct nbt_long_array la, struct buffer* b)
+{
+    assert(la.length >= 0);
+
+    bprintf(b, "[ ");
+    for(int32_t i = 0; i < la.length; ++i)
+        bprintf(b, "%" PRIi64 " ", la.data[i]);
+    bprintf(b, "]");
+}
+
 static inline nbt_status dump_list_contents_ascii(const struct tag_list* list, struct buffer* b, size_t ident)
 {
     const struct list_head* pos;
@@ -566,6 +619,12 @@ static inline nbt_status __nbt_dump_ascii(const nbt_node* tree, struct buffer* b
         dump_int_array(tree->payload.tag_int_array, b);
         bprintf(b, "\n");
     }
+    else if(tree->type == TAG_LONG_ARRAY)
+    {
+        bprintf(b, "TAG_Long_Array(\"%s\"): ", SAFE_NAME(tree));
+        dump_long_array(tree->payload.tag_long_array, b);
+        bprintf(b, "\n");
+    }
 
     else
         return NBT_ERR;
@@ -580,7 +639,7 @@ char* nbt_dump_ascii(const nbt_node* tree)
     /* empty tree */
     if(tree == NULL)
     {
-        char* r = malloc(1);
+        char* r = mem_alloc(1);
         if(r == NULL)
             return (errno = NBT_EMEM), NULL;
 
@@ -634,14 +693,44 @@ static nbt_status dump_int_array_binary(const struct nbt_int_array ia, struct bu
     // big endian
     int32_t *be_data = ia.data;
     if (little_endian()) {
-        be_data = malloc(4*ia.length);
+        be_data = mem_alloc(4*ia.length);
         if (be_data == NULL) return NBT_EMEM;
         for(int i=0; i < ia.length; i++) be_data[i] = htonl(ia.data[i]);
     }
     
     CHECKED_APPEND(b, be_data, 4*ia.length);
 
-    if (be_data != ia.data) free(be_data);
+    if (be_data != ia.data) mem_free(be_data);
+    return NBT_OK;
+}
+
+static nbt_status dump_long_array_binary(const struct nbt_long_array la, struct buffer* b)
+{
+    int32_t dumped_length = la.length;
+
+    ne2be(&dumped_length, sizeof dumped_length);
+
+    CHECKED_APPEND(b, &dumped_length, sizeof dumped_length);
+
+    if(la.length) assert(la.data);
+
+    // big endian
+    int64_t *be_data = la.data;
+    if (little_endian()) {
+        be_data = mem_alloc(8*(size_t)la.length);
+        if (be_data == NULL) return NBT_EMEM;
+        for(int i=0; i < la.length; i++) {
+            be_data[i] = la.data[i];
+            ne2be(&be_data[i], sizeof be_data[i]);
+        }
+    }
+
+    if (buffer_append(b, be_data, 8*(size_t)la.length)) {
+        if (be_data != la.data) mem_free(be_data);
+        return NBT_EMEM;
+    }
+
+    if (be_data != la.data) mem_free(be_data);
     return NBT_OK;
 }
 
@@ -777,6 +866,8 @@ static inline nbt_status __dump_binary(const nbt_node* tree, bool dump_type, str
         return dump_compound_binary(tree->payload.tag_compound, b);
     else if(tree->type == TAG_INT_ARRAY)
         return dump_int_array_binary(tree->payload.tag_int_array, b);
+    else if(tree->type == TAG_LONG_ARRAY)
+        return dump_long_array_binary(tree->payload.tag_long_array, b);
 
     else
         return NBT_ERR;
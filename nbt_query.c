@@ -0,0 +1,418 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Lukas Niederbremer <webmaster@flippeh.de> and Clark Gaebel <cg.wowus.cg@gmail.com>
+ * wrote this file. As long as you retain this notice you can do whatever you
+ * want with this stuff. If we meet some day, and you think this stuff is worth
+ * it, you can buy us a beer in return.
+ * -----------------------------------------------------------------------------
+ */
+#include "nbt.h"
+
+#include "alloc.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum step_kind {
+    STEP_NAME,  /* a child with this name */
+    STEP_ANY,   /* any child, compound entry or list item */
+    STEP_INDEX, /* the list item at `index', counting from the end if negative */
+    STEP_ITEMS, /* every list item */
+    STEP_TYPE   /* keeps the node it's at if it's a `type' */
+};
+
+struct step {
+    enum step_kind kind;
+    bool descend;  /* after "..", so it looks at every descendant, not just children */
+    char* name;
+    int32_t index;
+    nbt_type type;
+};
+
+struct nbt_query {
+    size_t nsteps;
+    struct step steps[];
+};
+
+static const struct {
+    const char* name;
+    nbt_type type;
+} type_names[] = {
+    { "byte",       TAG_BYTE       },
+    { "short",      TAG_SHORT      },
+    { "int",        TAG_INT        },
+    { "long",       TAG_LONG       },
+    { "float",      TAG_FLOAT      },
+    { "double",     TAG_DOUBLE     },
+    { "byte_array", TAG_BYTE_ARRAY },
+    { "string",     TAG_STRING     },
+    { "list",       TAG_LIST       },
+    { "compound",   TAG_COMPOUND   },
+    { "int_array",  TAG_INT_ARRAY  },
+    { "long_array", TAG_LONG_ARRAY }
+};
+
+/* Characters that end a bare name. */
+static bool is_special(char c)
+{
+    return c == '\0' || c == '.' || c == '[' || c == ']' || c == '{' || c == '}' ||
+           c == '*'  || c == '"' || c == '\'';
+}
+
+/* Copies a quoted name, whose opening quote is at `*p', and moves `*p' past the closing one. */
+static char* parse_quoted(const char** p)
+{
+    char quote = *(*p)++;
+
+    char* name = mem_alloc(strlen(*p) + 1);
+    if(name == NULL) return NULL;
+
+    size_t len = 0;
+    for(; **p != quote; (*p)++)
+    {
+        if(**p == '\\' && (*p)[1] != '\0') (*p)++;
+        if(**p == '\0')
+        {
+            mem_free(name);
+            errno = NBT_ERR;
+            return NULL;
+        }
+        name[len++] = **p;
+    }
+    (*p)++;
+
+    name[len] = '\0';
+    return name;
+}
+
+static char* parse_bare(const char** p)
+{
+    size_t len = 0;
+    while(!is_special((*p)[len])) len++;
+
+    if(len == 0)
+    {
+        errno = NBT_ERR;
+        return NULL;
+    }
+
+    char* name = mem_alloc(len + 1);
+    if(name == NULL) return NULL;
+
+    memcpy(name, *p, len);
+    name[len] = '\0';
+    *p += len;
+    return name;
+}
+
+/* [*] or [n], with `*p' at the '['. */
+static bool parse_index(const char** p, struct step* s)
+{
+    const char* c = *p + 1;
+
+    if(*c == '*')
+    {
+        s->kind = STEP_ITEMS;
+        c++;
+    }
+    else
+    {
+        char* end;
+        long n = strtol(c, &end, 10);
+        if(end == c || n < INT32_MIN || n > INT32_MAX) return false;
+
+        s->kind  = STEP_INDEX;
+        s->index = (int32_t)n;
+        c = end;
+    }
+
+    if(*c != ']') return false;
+
+    *p = c + 1;
+    return true;
+}
+
+/* {type}, with `*p' at the '{'. */
+static bool parse_type(const char** p, struct step* s)
+{
+    const char* start = *p + 1;
+    const char* end = strchr(start, '}');
+    if(end == NULL) return false;
+
+    for(size_t i = 0; i < sizeof type_names / sizeof *type_names; i++)
+        if(strlen(type_names[i].name) == (size_t)(end - start) &&
+           strncmp(type_names[i].name, start, end - start) == 0)
+        {
+            s->kind = STEP_TYPE;
+            s->type = type_names[i].type;
+            *p = end + 1;
+            return true;
+        }
+
+    return false;
+}
+
+nbt_query* nbt_query_compile(const char* expr)
+{
+    assert(expr);
+
+    /* every step takes at least one character, so that's as many as there can be */
+    nbt_query* q = mem_alloc(sizeof *q + (strlen(expr) + 1) * sizeof(struct step));
+    if(q == NULL)
+    {
+        errno = NBT_EMEM;
+        return NULL;
+    }
+    q->nsteps = 0;
+
+    const char* p = expr;
+    while(*p)
+    {
+        struct step* s = &q->steps[q->nsteps];
+        memset(s, 0, sizeof *s);
+
+        /* what may come next: after a dot only a name, anywhere else [ and { too */
+        bool named = false;
+
+        if(p[0] == '.' && p[1] == '.')
+        {
+            s->descend = true;
+            p += 2;
+        }
+        else if(*p == '.')
+        {
+            if(q->nsteps == 0) goto syntax_error;
+            named = true;
+            p++;
+        }
+        else if(q->nsteps > 0 && *p != '[' && *p != '{')
+        {
+            goto syntax_error;
+        }
+
+        if(*p == '*')
+        {
+            s->kind = STEP_ANY;
+            p++;
+        }
+        else if(*p == '[' && !named)
+        {
+            if(!parse_index(&p, s)) goto syntax_error;
+        }
+        else if(*p == '{' && !named)
+        {
+            if(!parse_type(&p, s)) goto syntax_error;
+        }
+        else
+        {
+            s->kind = STEP_NAME;
+            s->name = *p == '"' || *p == '\'' ? parse_quoted(&p) : parse_bare(&p);
+            if(s->name == NULL) goto error;
+        }
+
+        q->nsteps++;
+    }
+
+    return q;
+
+syntax_error:
+    errno = NBT_ERR;
+error:
+    if(errno != NBT_ERR) errno = NBT_EMEM;
+    nbt_query_free(q);
+    return NULL;
+}
+
+void nbt_query_free(nbt_query* q)
+{
+    if(q == NULL) return;
+
+    for(size_t i = 0; i < q->nsteps; i++)
+        mem_free(q->steps[i].name);
+
+    mem_free(q);
+}
+
+/*
+ * A query's progress at a node: it got there having matched steps [0, step).
+ * Every node carries the set of these for all the queries that reached it, so
+ * one walk of the tree runs every query at once, and a branch nobody reached
+ * is never walked at all.
+ */
+struct state {
+    uint32_t query;
+    uint32_t step;
+};
+
+struct run {
+    nbt_query* const* queries;
+    nbt_query_visitor_t visit;
+    void* aux;
+
+    /* the state sets of the nodes on the path down to here, one after another */
+    struct state* stack;
+    size_t len, cap;
+
+    bool stop;
+    int err;
+};
+
+/* Whether `child', item `index' of `count' in a list (or -1 in a compound), passes a step. */
+static bool step_matches(const struct step* s, const nbt_node* child, int32_t index, int32_t count)
+{
+    switch(s->kind)
+    {
+    case STEP_NAME:
+        if(child->name == NULL) return s->name[0] == '\0';
+        return strcmp(child->name, s->name) == 0;
+
+    case STEP_ANY:
+        return true;
+
+    case STEP_INDEX:
+        if(index < 0) return false;
+        return index == (s->index >= 0 ? s->index : count + s->index);
+
+    case STEP_ITEMS:
+        return index >= 0;
+
+    case STEP_TYPE:
+        return child->type == s->type;
+    }
+
+    return false;
+}
+
+/*
+ * Puts (query, step) into the set being built for `node', which starts at
+ * `base' on the stack. Type filters right after a step apply to the node that
+ * step landed on, so they're checked here.
+ */
+static void add_state(struct run* r, size_t base, const nbt_node* node, uint32_t query, uint32_t step)
+{
+    const nbt_query* q = r->queries[query];
+
+    while(step < q->nsteps && q->steps[step].kind == STEP_TYPE && !q->steps[step].descend)
+    {
+        if(node->type != q->steps[step].type) return;
+        step++;
+    }
+
+    for(size_t i = base; i < r->len; i++)
+        if(r->stack[i].query == query && r->stack[i].step == step)
+            return;
+
+    if(r->len == r->cap)
+    {
+        size_t cap = r->cap ? r->cap * 2 : 64;
+        struct state* grown = mem_realloc(r->stack, cap * sizeof *grown);
+        if(grown == NULL)
+        {
+            r->err  = NBT_EMEM;
+            r->stop = true;
+            return;
+        }
+        r->stack = grown;
+        r->cap   = cap;
+    }
+
+    r->stack[r->len].query = query;
+    r->stack[r->len].step  = step;
+    r->len++;
+}
+
+/* `node''s states are the ones on the stack from `base' up. */
+static void run_node(struct run* r, nbt_node* node, size_t base)
+{
+    size_t end = r->len;
+
+    for(size_t i = base; i < end && !r->stop; i++)
+        if(r->stack[i].step == r->queries[r->stack[i].query]->nsteps)
+            if(!r->visit(node, r->stack[i].query, r->aux))
+                r->stop = true;
+
+    if(r->stop) return;
+    if(node->type != TAG_LIST && node->type != TAG_COMPOUND) return;
+
+    struct tag_list* list = node->type == TAG_LIST ? node->payload.tag_list.list : node->payload.tag_compound;
+    int32_t count = node->type == TAG_LIST ? (int32_t)list_length(&list->entry) : 0;
+    int32_t index = node->type == TAG_LIST ? 0 : -1;
+
+    struct list_head* pos;
+    list_for_each(pos, &list->entry)
+    {
+        nbt_node* child = list_entry(pos, struct tag_list, entry)->data;
+        size_t child_base = r->len;
+
+        for(size_t i = base; i < end && !r->stop; i++)
+        {
+            struct state st = r->stack[i]; /* a copy, adding may move the stack */
+            const nbt_query* q = r->queries[st.query];
+            if(st.step == q->nsteps) continue;
+
+            const struct step* s = &q->steps[st.step];
+
+            if(s->descend)
+                add_state(r, child_base, child, st.query, st.step); /* might be further down */
+
+            if(step_matches(s, child, index, count))
+                add_state(r, child_base, child, st.query, st.step + 1);
+        }
+
+        if(r->len > child_base && !r->stop)
+            run_node(r, child, child_base);
+
+        r->len = child_base;
+        if(r->stop) break;
+
+        if(index >= 0) index++;
+    }
+}
+
+int nbt_query_run_batch(nbt_node* tree, nbt_query* const* queries, size_t n,
+                        nbt_query_visitor_t visit, void* aux)
+{
+    assert(tree && (queries || n == 0) && visit);
+
+    struct run r = { queries, visit, aux, NULL, 0, 0, false, NBT_OK };
+
+    for(size_t i = 0; i < n; i++)
+        add_state(&r, 0, tree, (uint32_t)i, 0);
+
+    if(r.len > 0 && !r.stop)
+        run_node(&r, tree, 0);
+
+    mem_free(r.stack);
+
+    if(r.err != NBT_OK)
+    {
+        errno = r.err;
+        return -1;
+    }
+    return r.stop ? 1 : 0;
+}
+
+struct single {
+    nbt_visitor_t visit;
+    void* aux;
+};
+
+static bool single_visit(nbt_node* node, size_t which, void* aux)
+{
+    struct single* s = aux;
+    (void)which;
+    return s->visit(node, s->aux);
+}
+
+int nbt_query_run(nbt_node* tree, const nbt_query* q, nbt_visitor_t visit, void* aux)
+{
+    assert(q && visit);
+
+    struct single s = { visit, aux };
+    nbt_query* const queries[] = { (nbt_query*)q };
+    return nbt_query_run_batch(tree, queries, 1, single_visit, &s);
+}
@@ -9,6 +9,9 @@
  */
 #include "nbt.h"
 
+#include "alloc.h"
+#include "slab.h"
+
 #include <assert.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -17,7 +20,7 @@
 /* strdup isn't standard. GNU extension. */
 static inline char* __strdup(const char* s)
 {
-    char* r = malloc(strlen(s) + 1);
+    char* r = mem_alloc(strlen(s) + 1);
     if(r == NULL) return NULL;
 
     strcpy(r, s);
@@ -25,61 +28,173 @@ static inline char* __strdup(const char* s)
 }
 
 #define CHECKED_MALLOC(var, n, on_error) do { \
-    if((var = malloc(n)) == NULL)             \
+    if((var = mem_alloc(n)) == NULL)          \
+    {                                         \
+        errno = NBT_EMEM;                     \
+        on_error;                             \
+    }                                         \
+} while(0)
+
+#define CHECKED_SLAB_ALLOC(var, cls, on_error) do { \
+    if((var = slab_alloc(cls)) == NULL)       \
     {                                         \
         errno = NBT_EMEM;                     \
         on_error;                             \
     }                                         \
 } while(0)
 
+/*
+ * Lets go of `tree', freeing it if nothing else uses it. Its children, if it
+ * had any, are returned for the caller to free.
+ */
+static struct tag_list* release(nbt_node* tree)
+{
+    if(tree == NULL) return NULL;
+
+    /* other trees still use it, so just let go */
+    if(__atomic_fetch_sub(&tree->refs, 1, __ATOMIC_ACQ_REL) != 0) return NULL;
+
+    struct tag_list* children = NULL;
+
+    /* its name and payload came from the same allocator it did */
+    const nbt_allocator* old = nbt_use_allocator(slab_origin(tree));
+
+    if(tree->type == TAG_LIST)
+        children = tree->payload.tag_list.list;
+
+    else if (tree->type == TAG_COMPOUND)
+        children = tree->payload.tag_compound;
+
+    else if(tree->type == TAG_BYTE_ARRAY)
+        mem_free(tree->payload.tag_byte_array.data);
+
+    else if(tree->type == TAG_INT_ARRAY)
+        mem_free(tree->payload.tag_int_array.data);
+
+    else if(tree->type == TAG_LONG_ARRAY)
+        mem_free(tree->payload.tag_long_array.data);
+
+    else if(tree->type == TAG_STRING)
+        mem_free(tree->payload.tag_string);
+
+    mem_free(tree->name);
+    slab_free(SLAB_NODE, tree);
+
+    nbt_use_allocator(old);
+    return children;
+}
+
+/*
+ * Rather than recursing, which a deep enough tree would overflow the stack
+ * with, the entries of every list freed along the way are moved onto the front
+ * of `list', and freed from there. That needs no memory, so it can't fail.
+ */
 void nbt_free_list(struct tag_list* list)
 {
     if (!list)
         return;
 
-    struct list_head* current;
-    struct list_head* temp;
-    list_for_each_safe(current, temp, &list->entry)
+    while(!list_empty(&list->entry))
     {
-        struct tag_list* entry = list_entry(current, struct tag_list, entry);
+        struct tag_list* entry = list_entry(list->entry.flink, struct tag_list, entry);
+        list_del(&entry->entry);
 
-        nbt_free(entry->data);
-        free(entry);
+        struct tag_list* children = release(entry->data);
+        slab_free(SLAB_ENTRY, entry);
+
+        if(children)
+        {
+            list_splice(&children->entry, &list->entry);
+            slab_free(SLAB_ENTRY, children);
+        }
     }
 
-    free(list);
+    slab_free(SLAB_ENTRY, list);
 }
 
 void nbt_free(nbt_node* tree)
 {
-    if(tree == NULL) return;
+    nbt_free_list(release(tree));
+}
 
-    if(tree->type == TAG_LIST)
-        nbt_free_list(tree->payload.tag_list.list);
+bool nbt_iter_grow(nbt_iterator* it)
+{
+    size_t cap = it->cap * 2;
 
-    else if (tree->type == TAG_COMPOUND)
-        nbt_free_list(tree->payload.tag_compound);
+    struct nbt_iter_level* stack = mem_realloc(it->stack, cap * sizeof *stack);
+    if(stack == NULL)
+    {
+        errno = NBT_EMEM;
+        return false;
+    }
 
-    else if(tree->type == TAG_BYTE_ARRAY)
-        free(tree->payload.tag_byte_array.data);
+    if(it->stack == NULL)
+        memcpy(stack, it->fixed, sizeof it->fixed);
 
-    else if(tree->type == TAG_INT_ARRAY)
-        free(tree->payload.tag_int_array.data);
+    it->stack = stack;
+    it->cap   = cap;
+    return true;
+}
 
-    else if(tree->type == TAG_STRING)
-        free(tree->payload.tag_string);
+void nbt_iter_end(nbt_iterator* it)
+{
+    mem_free(it->stack);
+    it->stack = NULL;
+}
+
+nbt_node* nbt_new_node(nbt_type type, const char* name)
+{
+    nbt_node* node;
+    CHECKED_SLAB_ALLOC(node, SLAB_NODE, return NULL);
+
+    memset(node, 0, sizeof *node);
+    node->type = type;
+
+    if(name && (node->name = __strdup(name)) == NULL) goto err;
+
+    if(type == TAG_LIST || type == TAG_COMPOUND)
+    {
+        struct tag_list* list = nbt_new_entry(NULL);
+        if(list == NULL) goto err;
+
+        INIT_LIST_HEAD(&list->entry);
+
+        if(type == TAG_LIST)
+        {
+            node->payload.tag_list.type = TAG_INVALID;
+            node->payload.tag_list.list = list;
+        }
+        else
+            node->payload.tag_compound = list;
+    }
+
+    return node;
 
-    free(tree->name);
-    free(tree);
+err:
+    mem_free(node->name);
+    slab_free(SLAB_NODE, node);
+    errno = NBT_EMEM;
+    return NULL;
 }
 
-static struct tag_list* clone_list(struct tag_list* list)
+struct tag_list* nbt_new_entry(nbt_node* data)
+{
+    struct tag_list* entry;
+    CHECKED_SLAB_ALLOC(entry, SLAB_ENTRY, return NULL);
+
+    entry->data = data;
+    INIT_LIST_HEAD(&entry->entry);
+    return entry;
+}
+
+/* A new list of the same children, which are now shared with one more tree. */
+static struct tag_list* share_list(struct tag_list* list)
 {
     /* even empty lists are valid pointers! */
     assert(list);
 
     struct tag_list* ret;
-    CHECKED_MALLOC(ret, sizeof *ret, goto clone_error);
+    CHECKED_SLAB_ALLOC(ret, SLAB_ENTRY, goto clone_error);
 
     INIT_LIST_HEAD(&ret->entry);
     ret->data = NULL;
@@ -90,15 +205,10 @@ static struct tag_list* clone_list(struct tag_list* list)
         struct tag_list* current = list_entry(pos, struct tag_list, entry);
         struct tag_list* new;
 
-        CHECKED_MALLOC(new, sizeof *new, goto clone_error);
+        CHECKED_SLAB_ALLOC(new, SLAB_ENTRY, goto clone_error);
 
-        new->data = nbt_clone(current->data);
-
-        if(new->data == NULL)
-        {
-            free(new);
-            goto clone_error;
-        }
+        new->data = current->data;
+        __atomic_fetch_add(&new->data->refs, 1, __ATOMIC_RELAXED);
 
         list_add_tail(&new->entry, &ret->entry);
     }
@@ -116,16 +226,20 @@ static inline char* safe_strdup(const char* s)
     return s ? __strdup(s) : NULL;
 }
 
-nbt_node* nbt_clone(nbt_node* tree)
+nbt_node* nbt_clone_shared(nbt_node* tree)
 {
     if(tree == NULL) return NULL;
     assert(tree->type != TAG_INVALID);
 
     nbt_node* ret;
-    CHECKED_MALLOC(ret, sizeof *ret, return NULL);
+    CHECKED_SLAB_ALLOC(ret, SLAB_NODE, return NULL);
 
     ret->type = tree->type;
     ret->name = safe_strdup(tree->name);
+    /* same contents, same hash; `hash_fuzzy' is good by the time `hash' is set */
+    ret->hash = __atomic_load_n(&tree->hash, __ATOMIC_ACQUIRE);
+    ret->hash_fuzzy = __atomic_load_n(&tree->hash_fuzzy, __ATOMIC_RELAXED);
+    ret->refs = 0;
 
     if(tree->name && ret->name == NULL) goto clone_error;
 
@@ -161,15 +275,28 @@ nbt_node* nbt_clone(nbt_node* tree)
         ret->payload.tag_int_array.length = tree->payload.tag_int_array.length;
     }
 
+    else if(tree->type == TAG_LONG_ARRAY)
+    {
+        int64_t* newbuf;
+        CHECKED_MALLOC(newbuf, 8*(size_t)tree->payload.tag_long_array.length, goto clone_error);
+
+        memcpy(newbuf,
+               tree->payload.tag_long_array.data,
+               8*(size_t)tree->payload.tag_long_array.length);
+
+        ret->payload.tag_long_array.data   = newbuf;
+        ret->payload.tag_long_array.length = tree->payload.tag_long_array.length;
+    }
+
     else if(tree->type == TAG_LIST)
     {
-        ret->payload.tag_list.list = clone_list(tree->payload.tag_list.list);
+        ret->payload.tag_list.list = share_list(tree->payload.tag_list.list);
         ret->payload.tag_list.type = tree->payload.tag_list.type;
         if(ret->payload.tag_list.list == NULL) goto clone_error;
     }
     else if(tree->type == TAG_COMPOUND)
     {
-        ret->payload.tag_compound = clone_list(tree->payload.tag_compound);
+        ret->payload.tag_compound = share_list(tree->payload.tag_compound);
         if(ret->payload.tag_compound == NULL) goto clone_error;
     }
     else
@@ -180,12 +307,140 @@ nbt_node* nbt_clone(nbt_node* tree)
     return ret;
 
 clone_error:
-    if(ret) free(ret->name);
+    if(ret) mem_free(ret->name);
 
-    free(ret);
+    slab_free(SLAB_NODE, ret);
     return NULL;
 }
 
+/*
+ * Gives `entry' a node of its own, if the one there is shared, by cloning it
+ * and letting go of the original. The node the entry is in has to be its own
+ * already.
+ */
+static nbt_node* unshare(struct tag_list* entry)
+{
+    nbt_node* node = entry->data;
+    if(__atomic_load_n(&node->refs, __ATOMIC_ACQUIRE) == 0) return node;
+
+    nbt_node* copy = nbt_clone_shared(node);
+    if(copy == NULL) return NULL;
+
+    entry->data = copy;
+    nbt_free(node); /* frees it after all if the other trees let go meanwhile */
+    return copy;
+}
+
+/*
+ * A shared clone, with each node made its own on the way down: every child is
+ * still shared when its parent is reached, so it's copied in turn, and the
+ * original gets its nodes back to itself as that happens.
+ */
+nbt_node* nbt_clone(nbt_node* tree)
+{
+    nbt_node* ret = nbt_clone_shared(tree);
+    if(ret == NULL) return NULL;
+
+    nbt_iterator it;
+    nbt_node* node;
+    for(node = nbt_iter_begin(&it, ret); node; node = nbt_iter_next(&it))
+    {
+        if(node->type != TAG_LIST && node->type != TAG_COMPOUND) continue;
+
+        struct list_head* pos;
+        list_for_each(pos, &nbt_children(node)->entry)
+            if(unshare(list_entry(pos, struct tag_list, entry)) == NULL) goto err;
+    }
+
+    /* the iterator only stops halfway down when its stack couldn't grow */
+    if(it.depth > 0) goto err;
+
+    nbt_iter_end(&it);
+    return ret;
+
+err:
+    nbt_iter_end(&it);
+    nbt_free(ret);
+    errno = NBT_EMEM;
+    return NULL;
+}
+
+static struct tag_list* children(nbt_node* tree)
+{
+    return tree->type == TAG_LIST ? tree->payload.tag_list.list : tree->payload.tag_compound;
+}
+
+/* How far `pos' is into the list headed by `head'. */
+static size_t index_in(const struct list_head* pos, const struct list_head* head)
+{
+    size_t i = 0;
+    for(const struct list_head* p = head->flink; p != pos; p = p->flink)
+        i++;
+    return i;
+}
+
+nbt_node* nbt_mutable(nbt_node* tree, nbt_node* node)
+{
+    assert(tree && node);
+
+    /* whatever's on the way is about to change, so its hash is too */
+    tree->hash = 0;
+    if(tree == node) return tree;
+
+    /* usually it's a child, and that's quick to check */
+    struct tag_list* list = tree->type == TAG_LIST || tree->type == TAG_COMPOUND ? children(tree) : NULL;
+    struct list_head* pos;
+
+    if(list)
+        list_for_each(pos, &list->entry)
+        {
+            struct tag_list* entry = list_entry(pos, struct tag_list, entry);
+            if(entry->data == node)
+            {
+                nbt_node* ret = unshare(entry);
+                if(ret == NULL) errno = NBT_EMEM;
+                else            ret->hash = 0;
+                return ret;
+            }
+        }
+
+    /* the iterator's stack is the way down to wherever it finds it */
+    nbt_iterator it;
+    nbt_node* n;
+    for(n = nbt_iter_begin(&it, tree); n && n != node; n = nbt_iter_next(&it))
+        ;
+
+    if(n == NULL)
+    {
+        /* the iterator only gives up halfway down when its stack couldn't grow */
+        errno = it.depth > 0 ? NBT_EMEM : NBT_ERR;
+        nbt_iter_end(&it);
+        return NULL;
+    }
+
+    /*
+     * Copy the shared nodes on the way down, each into the copy of the one
+     * above. A copy's children are where the original's were, and the
+     * original stays as it was for the trees still sharing it, so the
+     * iterator's positions in it say where to go in the copy.
+     */
+    struct nbt_iter_level* levels = it.stack ? it.stack : it.fixed;
+    nbt_node* at = tree;
+    for(size_t d = 0; d < it.depth && at; d++)
+    {
+        size_t i = index_in(levels[d].pos, levels[d].end);
+        for(pos = children(at)->entry.flink; i-- > 0; pos = pos->flink)
+            ;
+
+        at = unshare(list_entry(pos, struct tag_list, entry));
+        if(at) at->hash = 0;
+    }
+
+    nbt_iter_end(&it);
+    if(at == NULL) errno = NBT_EMEM;
+    return at;
+}
+
 bool nbt_map(nbt_node* tree, nbt_visitor_t v, void* aux)
 {
     assert(v);
@@ -221,7 +476,7 @@ static struct tag_list* filter_list(const struct tag_list* list, nbt_predicate_t
     assert(list);
 
     struct tag_list* ret;
-    CHECKED_MALLOC(ret, sizeof *ret, goto filter_error);
+    CHECKED_SLAB_ALLOC(ret, SLAB_ENTRY, goto filter_error);
 
     ret->data = NULL;
     INIT_LIST_HEAD(&ret->entry);
@@ -237,7 +492,7 @@ static struct tag_list* filter_list(const struct tag_list* list, nbt_predicate_t
         if(new_node == NULL) continue;
 
         struct tag_list* new_entry;
-        CHECKED_MALLOC(new_entry, sizeof *new_entry, goto filter_error);
+        CHECKED_SLAB_ALLOC(new_entry, SLAB_ENTRY, goto filter_error);
 
         new_entry->data = new_node;
         list_add_tail(&new_entry->entry, &ret->entry);
@@ -263,10 +518,13 @@ nbt_node* nbt_filter(const nbt_node* tree, nbt_predicate_t filter, void* aux)
     if(!filter(tree, aux)) return NULL;
 
     nbt_node* ret;
-    CHECKED_MALLOC(ret, sizeof *ret, goto filter_error);
+    CHECKED_SLAB_ALLOC(ret, SLAB_NODE, goto filter_error);
 
     ret->type = tree->type;
     ret->name = safe_strdup(tree->name);
+    ret->hash = 0;
+    ret->hash_fuzzy = false;
+    ret->refs = 0;
 
     if(tree->name && ret->name == NULL) goto filter_error;
 
@@ -297,14 +555,28 @@ nbt_node* nbt_filter(const nbt_node* tree, nbt_predicate_t filter, void* aux)
 
         memcpy(ret->payload.tag_int_array.data,
                tree->payload.tag_int_array.data,
-               tree->payload.tag_int_array.length);
+               4*tree->payload.tag_int_array.length);
 
         ret->payload.tag_int_array.length = tree->payload.tag_int_array.length;
     }
 
+    else if(tree->type == TAG_LONG_ARRAY)
+    {
+        CHECKED_MALLOC(ret->payload.tag_long_array.data,
+                       8*(size_t)tree->payload.tag_long_array.length,
+                       goto filter_error);
+
+        memcpy(ret->payload.tag_long_array.data,
+               tree->payload.tag_long_array.data,
+               8*(size_t)tree->payload.tag_long_array.length);
+
+        ret->payload.tag_long_array.length = tree->payload.tag_long_array.length;
+    }
+
     /* Okay, we want to keep this node, but keep traversing the tree! */
     else if(tree->type == TAG_LIST)
     {
+        ret->payload.tag_list.type = tree->payload.tag_list.type;
         ret->payload.tag_list.list = filter_list(tree->payload.tag_list.list, filter, aux);
         if(ret->payload.tag_list.list == NULL) goto filter_error;
     }
@@ -324,38 +596,127 @@ filter_error:
     if(errno == NBT_OK)
         errno = NBT_EMEM;
 
-    if(ret) free(ret->name);
+    if(ret) mem_free(ret->name);
 
-    free(ret);
+    slab_free(SLAB_NODE, ret);
     return NULL;
 }
 
-nbt_node* nbt_filter_inplace(nbt_node* tree, nbt_predicate_t filter, void* aux)
+/*
+ * Filters the children of `tree', which has been kept, out of a tree that's
+ * shared: nothing in it can be changed, so on the first child that goes (or
+ * changes), the rest is done to a copy of `tree' instead. Returns `tree' if
+ * nothing under it goes, its copy, or NULL with errno set to NBT_EMEM.
+ */
+static nbt_node* filter_shared(nbt_node* tree, nbt_predicate_t filter, void* aux)
 {
-    assert(filter);
+    nbt_node* copy = NULL;
+    struct list_head* head = &nbt_children(tree)->entry;
+    struct list_head* pos;
+    struct list_head* n;
+    size_t index = 0;
 
-    if(tree == NULL)               return                 NULL;
-    if(!filter(tree, aux))         return nbt_free(tree), NULL;
-    if(tree->type != TAG_LIST &&
-       tree->type != TAG_COMPOUND) return tree;
+    for(pos = head->flink, n = pos->flink; pos != head; pos = n, n = pos->flink, index++)
+    {
+        struct tag_list* cur = list_entry(pos, struct tag_list, entry);
+        nbt_node* child = cur->data;
+        nbt_node* kept = NULL;
+
+        if(filter(child, aux))
+        {
+            kept = child;
+            if((child->type == TAG_LIST || child->type == TAG_COMPOUND) &&
+               (kept = filter_shared(child, filter, aux)) == NULL)
+                goto err;
+
+            if(kept == child) continue;
+        }
+
+        if(copy == NULL)
+        {
+            /* the first change: carry on from the same child in a copy of our own */
+            if((copy = nbt_clone_shared(tree)) == NULL)
+            {
+                nbt_free(kept);
+                goto err;
+            }
+
+            head = &nbt_children(copy)->entry;
+            for(pos = head->flink; index > 0; index--) pos = pos->flink;
+            n = pos->flink;
+            cur = list_entry(pos, struct tag_list, entry);
+        }
+
+        /* either way, the copy lets go of `child' */
+        if(kept)
+            cur->data = kept;
+        else
+        {
+            list_del(pos);
+            slab_free(SLAB_ENTRY, cur);
+        }
+        nbt_free(child);
+    }
+
+    if(copy == NULL) return tree;
+
+    copy->hash = 0;
+    return copy;
+
+err:
+    nbt_free(copy);
+    errno = NBT_EMEM;
+    return NULL;
+}
+
+/* Filters the children of `tree', which is its own and has been kept. */
+static void filter_children(nbt_node* tree, nbt_predicate_t filter, void* aux)
+{
+    tree->hash = 0; /* children may go */
 
     struct list_head* pos;
     struct list_head* n;
-    struct tag_list *list = tree->type == TAG_LIST? tree->payload.tag_list.list : tree->payload.tag_compound;
 
-    list_for_each_safe(pos, n, &list->entry)
+    list_for_each_safe(pos, n, &nbt_children(tree)->entry)
     {
         struct tag_list* cur = list_entry(pos, struct tag_list, entry);
+        nbt_node* child = cur->data;
 
-        cur->data = nbt_filter_inplace(cur->data, filter, aux);
-
-        if(cur->data == NULL)
+        if(!filter(child, aux))
         {
             list_del(pos);
-            free(cur);
+            slab_free(SLAB_ENTRY, cur);
+            nbt_free(child);
+            continue;
+        }
+
+        if(child->type != TAG_LIST && child->type != TAG_COMPOUND) continue;
+
+        /* a shared subtree is only copied if something in it is going */
+        if(__atomic_load_n(&child->refs, __ATOMIC_ACQUIRE) > 0)
+        {
+            nbt_node* kept = filter_shared(child, filter, aux);
+            if(kept && kept != child)
+            {
+                cur->data = kept;
+                nbt_free(child);
+            }
         }
+        else
+            filter_children(child, filter, aux);
     }
+}
+
+nbt_node* nbt_filter_inplace(nbt_node* tree, nbt_predicate_t filter, void* aux)
+{
+    assert(filter);
 
+    if(tree == NULL)               return                 NULL;
+    if(!filter(tree, aux))         return nbt_free(tree), NULL;
+    if(tree->type != TAG_LIST &&
+       tree->type != TAG_COMPOUND) return tree;
+
+    filter_children(tree, filter, aux);
     return tree;
 }
 
@@ -381,10 +742,8 @@ nbt_node* nbt_find(nbt_node* tree, nbt_predicate_t predicate, void* aux)
     return NULL;
 }
 
-static bool names_are_equal(const nbt_node* node, void* vname)
+static inline bool names_are_equal(const nbt_node* node, const char* name)
 {
-    const char* name = vname;
-
     assert(node);
 
     if(name == NULL && node->name == NULL)
@@ -398,7 +757,21 @@ static bool names_are_equal(const nbt_node* node, void* vname)
 
 nbt_node* nbt_find_by_name(nbt_node* tree, const char* name)
 {
-    return nbt_find(tree, &names_are_equal, (void*)name);
+    nbt_node* found = NULL;
+
+    nbt_iterator it;
+    for(nbt_node* node = nbt_iter_begin(&it, tree); node; node = nbt_iter_next(&it))
+        if(names_are_equal(node, name))
+        {
+            found = node;
+            break;
+        }
+
+    /* the iterator only gives up halfway down when its stack couldn't grow */
+    errno = found == NULL && it.depth > 0 ? NBT_EMEM : NBT_OK;
+
+    nbt_iter_end(&it);
+    return found;
 }
 
 /*
@@ -480,29 +853,117 @@ nbt_node* nbt_find_by_path(nbt_node* tree, const char* path)
     return NULL;
 }
 
-/* Gets the length of the list, plus the length of all its children. */
-static inline size_t nbt_full_list_length(struct tag_list* list)
+size_t nbt_size(const nbt_node* tree)
 {
     size_t accum = 0;
 
-    struct list_head* pos;
-    list_for_each(pos, &list->entry)
-        accum += nbt_size(list_entry(pos, const struct tag_list, entry)->data);
+    nbt_iterator it;
+    for(nbt_node* node = nbt_iter_begin(&it, (nbt_node*)tree); node; node = nbt_iter_next(&it))
+        accum++;
+
+    /* a count of part of the tree would pass for the real thing, so there's none */
+    errno = NBT_OK;
+    if(it.depth > 0)
+    {
+        errno = NBT_EMEM;
+        accum = 0;
+    }
 
+    nbt_iter_end(&it);
     return accum;
 }
 
-size_t nbt_size(const nbt_node* tree)
+/* Counts `size' bytes of a block from malloc towards `*field'. */
+static void count_block(nbt_memory_stats* m, size_t* field, const void* block, size_t size)
 {
-    if(tree == NULL)
-        return 0;
+    if(block == NULL) return;
 
-    if(tree->type == TAG_LIST)
-        return nbt_full_list_length(tree->payload.tag_list.list) + 1;
-    if(tree->type == TAG_COMPOUND)
-        return nbt_full_list_length(tree->payload.tag_compound) + 1;
-    
-    return 1;
+    *field      += size;
+    m->overhead += mem_overhead(size);
+}
+
+/* Counts `tree' itself, without what's under it, except the entries holding its children. */
+static void add_node_usage(const nbt_node* tree, nbt_memory_stats* m)
+{
+    m->nodes    += sizeof *tree;
+    m->overhead += SLAB_HEADER;
+    if(tree->name) count_block(m, &m->names, tree->name, strlen(tree->name) + 1);
+
+    switch(tree->type)
+    {
+    case TAG_STRING:
+        count_block(m, &m->strings, tree->payload.tag_string, strlen(tree->payload.tag_string) + 1);
+        break;
+
+    case TAG_BYTE_ARRAY:
+        count_block(m, &m->arrays, tree->payload.tag_byte_array.data,
+                    (size_t)tree->payload.tag_byte_array.length);
+        break;
+    case TAG_INT_ARRAY:
+        count_block(m, &m->arrays, tree->payload.tag_int_array.data,
+                    4 * (size_t)tree->payload.tag_int_array.length);
+        break;
+    case TAG_LONG_ARRAY:
+        count_block(m, &m->arrays, tree->payload.tag_long_array.data,
+                    8 * (size_t)tree->payload.tag_long_array.length);
+        break;
+
+    case TAG_LIST:
+    case TAG_COMPOUND:
+    {
+        const struct tag_list* list = tree->type == TAG_LIST ? tree->payload.tag_list.list
+                                                             : tree->payload.tag_compound;
+        m->entries  += sizeof *list;
+        m->overhead += SLAB_HEADER;
+
+        const struct list_head* pos;
+        list_for_each(pos, &list->entry)
+        {
+            m->entries  += sizeof *list;
+            m->overhead += SLAB_HEADER;
+        }
+        break;
+    }
+
+    default:
+        break;
+    }
+}
+
+/* Walks `tree', leaving out the shared subtrees under it unless `shared' is set. */
+static nbt_memory_stats memory_usage(const nbt_node* tree, bool shared)
+{
+    nbt_memory_stats m = { 0, 0, 0, 0, 0, 0, 0 };
+    errno = NBT_OK;
+    if(tree == NULL) return m;
+
+    nbt_iterator it;
+    for(nbt_node* node = nbt_iter_begin(&it, (nbt_node*)tree); node; node = nbt_iter_next(&it))
+    {
+        if(!shared && it.depth > 0 && __atomic_load_n(&node->refs, __ATOMIC_ACQUIRE) > 0)
+        {
+            nbt_iter_skip(&it);
+            continue;
+        }
+        add_node_usage(node, &m);
+    }
+
+    /* an undercount is still a usable estimate, but say so */
+    if(it.depth > 0) errno = NBT_EMEM;
+    nbt_iter_end(&it);
+
+    m.total = m.nodes + m.entries + m.names + m.strings + m.arrays + m.overhead;
+    return m;
+}
+
+nbt_memory_stats nbt_memory_usage(const nbt_node* tree)
+{
+    return memory_usage(tree, true);
+}
+
+nbt_memory_stats nbt_memory_usage_unshared(const nbt_node* tree)
+{
+    return memory_usage(tree, false);
 }
 
 nbt_node* nbt_list_item(nbt_node* list, int n) {
@@ -9,6 +9,9 @@
  */
 #include "nbt.h"
 
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
 #include <string.h>
 
 const char* nbt_type_to_string(nbt_type t)
@@ -27,6 +30,8 @@ const char* nbt_type_to_string(nbt_type t)
         DEF_CASE(TAG_STRING);
         DEF_CASE(TAG_LIST);
         DEF_CASE(TAG_COMPOUND);
+        DEF_CASE(TAG_INT_ARRAY);
+        DEF_CASE(TAG_LONG_ARRAY);
     default:
         return "TAG_UNKNOWN";
     }
@@ -47,6 +52,8 @@ const char* nbt_error_to_string(nbt_status s)
         return "IO Error. Nonexistant/corrupt file?";
     case NBT_EZ:
         return "Fatal zlib error. Corrupt file?";
+    case NBT_ECOMP:
+        return "Unsupported compression type.";
     default:
         return "Unknown error.";
     }
@@ -78,11 +85,34 @@ static inline bool floats_are_close(double a, double b)
     return (min(a, b) + epsilon) >= max(a, b);
 }
 
-bool nbt_eq(const nbt_node* restrict a, const nbt_node* restrict b)
+/*
+ * A node's cached hash, or 0, and whether it's fuzzy. Other threads may be
+ * hashing the same shared node, and `hash_fuzzy' is written before `hash'.
+ */
+static inline uint64_t cached_hash(const nbt_node* node, bool* fuzzy)
 {
+    uint64_t h = __atomic_load_n(&node->hash, __ATOMIC_ACQUIRE);
+    *fuzzy = __atomic_load_n(&node->hash_fuzzy, __ATOMIC_RELAXED);
+    return h;
+}
+
+static bool eq(const nbt_node* restrict a, const nbt_node* restrict b, bool hashed)
+{
+    if(a == b) /* shared by two trees */
+        return true;
+
     if(a->type != b->type)
         return false;
 
+    /* different hashes are proof enough, unless there are floats that might be close */
+    if(hashed)
+    {
+        bool afuzzy, bfuzzy;
+        uint64_t ah = cached_hash(a, &afuzzy), bh = cached_hash(b, &bfuzzy);
+        if(ah && bh && ah != bh && !afuzzy && !bfuzzy)
+            return false;
+    }
+
     if(safe_strcmp(a->name, b->name) != 0)
         return false;
 
@@ -121,7 +151,7 @@ bool nbt_eq(const nbt_node* restrict a, const nbt_node* restrict b)
             struct tag_list* ae = list_entry(ai, struct tag_list, entry);
             struct tag_list* be = list_entry(bi, struct tag_list, entry);
 
-            if(!nbt_eq(ae->data, be->data))
+            if(!eq(ae->data, be->data, hashed))
                 return false;
         }
 
@@ -136,9 +166,322 @@ bool nbt_eq(const nbt_node* restrict a, const nbt_node* restrict b)
         return memcmp(a->payload.tag_int_array.data,
                       b->payload.tag_int_array.data,
                       4*a->payload.tag_int_array.length) == 0;
+    case TAG_LONG_ARRAY:
+        if(a->payload.tag_long_array.length != b->payload.tag_long_array.length) return false;
+        return memcmp(a->payload.tag_long_array.data,
+                      b->payload.tag_long_array.data,
+                      8*(size_t)a->payload.tag_long_array.length) == 0;
 
     default: /* wtf invalid type */
         return false;
     }
 }
 
+bool nbt_eq(const nbt_node* restrict a, const nbt_node* restrict b)
+{
+    return eq(a, b, false);
+}
+
+bool nbt_eq_hashed(const nbt_node* restrict a, const nbt_node* restrict b)
+{
+    return eq(a, b, true);
+}
+
+bool nbt_identical(const nbt_node* a, const nbt_node* b)
+{
+    if(a == b) return true;
+    if(a->type != b->type || safe_strcmp(a->name, b->name) != 0) return false;
+
+    switch(a->type)
+    {
+    case TAG_BYTE:   return a->payload.tag_byte  == b->payload.tag_byte;
+    case TAG_SHORT:  return a->payload.tag_short == b->payload.tag_short;
+    case TAG_INT:    return a->payload.tag_int   == b->payload.tag_int;
+    case TAG_LONG:   return a->payload.tag_long  == b->payload.tag_long;
+    case TAG_FLOAT:  return memcmp(&a->payload.tag_float, &b->payload.tag_float, sizeof(float)) == 0;
+    case TAG_DOUBLE: return memcmp(&a->payload.tag_double, &b->payload.tag_double, sizeof(double)) == 0;
+    case TAG_STRING: return strcmp(a->payload.tag_string, b->payload.tag_string) == 0;
+
+    case TAG_BYTE_ARRAY:
+        return a->payload.tag_byte_array.length == b->payload.tag_byte_array.length &&
+               memcmp(a->payload.tag_byte_array.data, b->payload.tag_byte_array.data,
+                      a->payload.tag_byte_array.length) == 0;
+    case TAG_INT_ARRAY:
+        return a->payload.tag_int_array.length == b->payload.tag_int_array.length &&
+               memcmp(a->payload.tag_int_array.data, b->payload.tag_int_array.data,
+                      4 * (size_t)a->payload.tag_int_array.length) == 0;
+    case TAG_LONG_ARRAY:
+        return a->payload.tag_long_array.length == b->payload.tag_long_array.length &&
+               memcmp(a->payload.tag_long_array.data, b->payload.tag_long_array.data,
+                      8 * (size_t)a->payload.tag_long_array.length) == 0;
+
+    case TAG_LIST:
+        if(a->payload.tag_list.type != b->payload.tag_list.type) return false;
+        /* fall through */
+    case TAG_COMPOUND:
+    {
+        const struct tag_list* alist = a->type == TAG_LIST ? a->payload.tag_list.list : a->payload.tag_compound;
+        const struct tag_list* blist = b->type == TAG_LIST ? b->payload.tag_list.list : b->payload.tag_compound;
+        const struct list_head* ai = alist->entry.flink;
+        const struct list_head* bi = blist->entry.flink;
+        const struct list_head* aend = &alist->entry;
+        const struct list_head* bend = &blist->entry;
+
+        for(; ai != aend && bi != bend; ai = ai->flink, bi = bi->flink)
+            if(!nbt_identical(list_entry(ai, struct tag_list, entry)->data,
+                          list_entry(bi, struct tag_list, entry)->data))
+                return false;
+
+        return ai == aend && bi == bend;
+    }
+
+    default:
+        return false;
+    }
+}
+
+
+/*
+ * XXH64. Arrays are most of the bytes in a chunk, and its four independent
+ * lanes keep the multipliers busy (or get vectorized) where a byte at a time
+ * hash would crawl.
+ *
+ * So that a hash means the same on every machine, input is read as if it
+ * were little-endian: arrays of `width' byte numbers in memory have their
+ * numbers' bytes taken lowest first, whatever order the machine keeps them
+ * in. On little-endian machines that's just the bytes as they are.
+ */
+#define XXH_P1 UINT64_C(11400714785074694791)
+#define XXH_P2 UINT64_C(14029467366897019727)
+#define XXH_P3 UINT64_C(1609587929392839161)
+#define XXH_P4 UINT64_C(9650029242287828579)
+#define XXH_P5 UINT64_C(2870177450012600261)
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+/* are we running on a little-endian system? */
+static inline int little_endian()
+{
+    uint16_t t = 0x0001;
+    char*    c = (char*)&t;
+    return  *c ==  0x01;
+}
+
+/* The `n' bytes at `p', which starts a number of `width' bytes, as a little-endian number. */
+static inline uint64_t read_le(const unsigned char* p, size_t n, size_t width)
+{
+    uint64_t v = 0;
+
+    if(little_endian())
+    {
+        memcpy(&v, p, n);
+        return v;
+    }
+
+    for(size_t k = 0; k < n; k++)
+        v |= (uint64_t)p[k / width * width + width - 1 - k % width] << 8 * k;
+    return v;
+}
+
+static inline uint64_t read64(const unsigned char* p, size_t width)
+{
+    return read_le(p, 8, width);
+}
+
+static inline uint32_t read32(const unsigned char* p, size_t width)
+{
+    return (uint32_t)read_le(p, 4, width);
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_P2;
+    acc  = rotl64(acc, 31);
+    return acc * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+static inline uint64_t xxh_avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint64_t xxh64(const void* mem, size_t len, uint64_t seed, size_t width)
+{
+    if(len == 0) return xxh_avalanche(seed + XXH_P5);
+
+    const unsigned char* p   = mem;
+    const unsigned char* end = p + len;
+    uint64_t h;
+
+    if(len >= 32)
+    {
+        uint64_t v1 = seed + XXH_P1 + XXH_P2;
+        uint64_t v2 = seed + XXH_P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_P1;
+
+        for(; p + 32 <= end; p += 32)
+        {
+            v1 = xxh_round(v1, read64(p, width));
+            v2 = xxh_round(v2, read64(p + 8, width));
+            v3 = xxh_round(v3, read64(p + 16, width));
+            v4 = xxh_round(v4, read64(p + 24, width));
+        }
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    }
+    else
+    {
+        h = seed + XXH_P5;
+    }
+
+    h += (uint64_t)len;
+
+    for(; p + 8 <= end; p += 8)
+        h = rotl64(h ^ xxh_round(0, read64(p, width)), 27) * XXH_P1 + XXH_P4;
+
+    if(p + 4 <= end)
+    {
+        h = rotl64(h ^ (read32(p, width) * XXH_P1), 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+
+    /* only strings and byte arrays, whose width is 1, have bytes left by now */
+    for(; p < end; p++)
+        h = rotl64(h ^ (*p * XXH_P5), 11) * XXH_P1;
+
+    return xxh_avalanche(h);
+}
+
+/* Folds one more value into a node's hash. */
+static inline uint64_t hash_mix(uint64_t h, uint64_t v)
+{
+    return rotl64(h ^ xxh_round(0, v), 27) * XXH_P1 + XXH_P4;
+}
+
+uint64_t nbt_hash(nbt_node* tree)
+{
+    assert(tree);
+
+    bool fuzzy;
+    uint64_t cached = cached_hash(tree, &fuzzy);
+    if(cached) return cached;
+
+    fuzzy = false;
+    uint64_t h = hash_mix(XXH_P5, (uint64_t)tree->type);
+
+    /* NULL and "" are different names as far as nbt_eq is concerned */
+    h = hash_mix(h, tree->name ? xxh64(tree->name, strlen(tree->name), 1, 1) : 0);
+
+    switch(tree->type)
+    {
+    case TAG_BYTE:
+        h = hash_mix(h, (uint64_t)tree->payload.tag_byte);
+        break;
+    case TAG_SHORT:
+        h = hash_mix(h, (uint64_t)tree->payload.tag_short);
+        break;
+    case TAG_INT:
+        h = hash_mix(h, (uint64_t)tree->payload.tag_int);
+        break;
+    case TAG_LONG:
+        h = hash_mix(h, (uint64_t)tree->payload.tag_long);
+        break;
+    case TAG_FLOAT:
+    {
+        uint32_t bits;
+        memcpy(&bits, &tree->payload.tag_float, sizeof bits);
+        h = hash_mix(h, bits);
+        fuzzy = true;
+        break;
+    }
+    case TAG_DOUBLE:
+    {
+        uint64_t bits;
+        memcpy(&bits, &tree->payload.tag_double, sizeof bits);
+        h = hash_mix(h, bits);
+        fuzzy = true;
+        break;
+    }
+    case TAG_BYTE_ARRAY:
+        h = hash_mix(h, xxh64(tree->payload.tag_byte_array.data,
+                              (size_t)tree->payload.tag_byte_array.length, 0, 1));
+        break;
+    case TAG_STRING:
+        h = hash_mix(h, xxh64(tree->payload.tag_string, strlen(tree->payload.tag_string), 0, 1));
+        break;
+    case TAG_INT_ARRAY:
+        h = hash_mix(h, xxh64(tree->payload.tag_int_array.data,
+                              4 * (size_t)tree->payload.tag_int_array.length, 0, 4));
+        break;
+    case TAG_LONG_ARRAY:
+        h = hash_mix(h, xxh64(tree->payload.tag_long_array.data,
+                              8 * (size_t)tree->payload.tag_long_array.length, 0, 8));
+        break;
+    case TAG_LIST:
+    case TAG_COMPOUND:
+    {
+        /* like nbt_eq, this looks at the elements in order, but not at a list's element type */
+        struct tag_list* list = tree->type == TAG_LIST ? tree->payload.tag_list.list : tree->payload.tag_compound;
+        uint64_t count = 0;
+
+        struct list_head* pos;
+        list_for_each(pos, &list->entry)
+        {
+            nbt_node* child = list_entry(pos, struct tag_list, entry)->data;
+
+            bool child_fuzzy;
+            h = hash_mix(h, nbt_hash(child));
+            cached_hash(child, &child_fuzzy);
+            fuzzy |= child_fuzzy;
+            count++;
+        }
+
+        h = hash_mix(h, count);
+        break;
+    }
+    default:
+        break;
+    }
+
+    h = xxh_avalanche(h);
+
+    h = h ? h : 1; /* 0 means "not cached" */
+
+    /* shared nodes can be hashed by several threads at once, all to the same result */
+    __atomic_store_n(&tree->hash_fuzzy, fuzzy, __ATOMIC_RELAXED);
+    __atomic_store_n(&tree->hash, h, __ATOMIC_RELEASE);
+    return h;
+}
+
+void nbt_hash_invalidate(nbt_node* tree)
+{
+    errno = NBT_OK;
+    if(tree == NULL) return;
+
+    /* nbt_hash may be reading these from another thread, if it's shared */
+    nbt_iterator it;
+    for(nbt_node* node = nbt_iter_begin(&it, tree); node; node = nbt_iter_next(&it))
+        __atomic_store_n(&node->hash, 0, __ATOMIC_RELAXED);
+
+    if(it.depth > 0) errno = NBT_EMEM;
+    nbt_iter_end(&it);
+}
@@ -0,0 +1,385 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Lukas Niederbremer <webmaster@flippeh.de> and Clark Gaebel <cg.wowus.cg@gmail.com>
+ * wrote this file. As long as you retain this notice you can do whatever you
+ * want with this stuff. If we meet some day, and you think this stuff is worth
+ * it, you can buy us a beer in return.
+ * -----------------------------------------------------------------------------
+ */
+
+/*
+ * Region file benchmarks. Most take the chunks of an existing region file as
+ * their sample data.
+ *
+ *   types    - save and load latency per chunk compression type
+ *   parallel - mcr_for_each_chunk_parallel scaling from 1 to N threads, over a
+ *              full region made by repeating the sample chunks
+ *   read     - reads every chunk of a world directory cold from disk, through
+ *              the mapping and through mcr_prefetch with each I/O backend
+ *   async    - how long mcr_chunk_set holds up its caller, compressing on the
+ *              spot and with mcr_set_async, over a full region
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "nbt.h"
+
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TEMP_REGION "regionbench.tmp.mcr"
+
+static void die(const char* message)
+{
+    fprintf(stderr, "%s\n", message);
+    exit(1);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Every chunk in the sample region, in slot order. */
+static nbt_node* sample[32*32];
+static size_t nsample;
+
+static void load_sample(const char* path)
+{
+    MCR* mcr = mcr_open(path, O_RDONLY);
+    if(mcr == NULL) die("Could not open the region file.");
+
+    for(int x = 0; x < 32; x++)
+        for(int z = 0; z < 32; z++)
+            if((sample[nsample] = mcr_chunk_get(mcr, x, z)) != NULL)
+                nsample++;
+
+    mcr_close(mcr);
+
+    if(nsample == 0) die("No chunks in that region.");
+}
+
+static void bench_types(void)
+{
+    static const struct {
+        nbt_compression_strategy strat;
+        const char* name;
+    } types[] = {
+        { STRAT_GZIP,    "gzip" },
+        { STRAT_INFLATE, "zlib" },
+        { STRAT_NONE,    "none" },
+        { STRAT_LZ4,     "lz4"  }
+    };
+
+    printf("type   save us/chunk  load us/chunk  file MB\n");
+
+    for(size_t t = 0; t < sizeof types / sizeof *types; t++)
+    {
+        MCR* mcr = mcr_open(TEMP_REGION, O_RDWR|O_CREAT|O_TRUNC);
+        if(mcr == NULL) die("Could not create the temporary region.");
+
+        if(mcr_set_compression_type(mcr, types[t].strat))
+        {
+            printf("%-5s  (not supported by this build)\n", types[t].name);
+            mcr_close(mcr);
+            continue;
+        }
+
+        double start = now();
+        for(size_t i = 0; i < nsample; i++)
+            if(mcr_chunk_set(mcr, (int)(i % 32), (int)(i / 32), sample[i]))
+                die(nbt_error_to_string(errno));
+        double save = now() - start;
+
+        if(mcr_close(mcr)) die("Could not write the temporary region.");
+
+        struct stat st;
+        if(stat(TEMP_REGION, &st)) die("Could not stat the temporary region.");
+
+        mcr = mcr_open(TEMP_REGION, O_RDONLY);
+        if(mcr == NULL) die("Could not reopen the temporary region.");
+
+        start = now();
+        for(size_t i = 0; i < nsample; i++)
+        {
+            nbt_node* chunk = mcr_chunk_get(mcr, (int)(i % 32), (int)(i / 32));
+            if(chunk == NULL) die(nbt_error_to_string(errno));
+            nbt_free(chunk);
+        }
+        double load = now() - start;
+
+        mcr_close(mcr);
+
+        printf("%-5s  %13.1f  %13.1f  %7.2f\n", types[t].name,
+               save * 1e6 / nsample, load * 1e6 / nsample, st.st_size / 1e6);
+    }
+
+    remove(TEMP_REGION);
+}
+
+static bool free_chunk(int x, int z, nbt_node* tree, void* aux)
+{
+    (void)x; (void)z; (void)aux;
+    nbt_free(tree);
+    return true;
+}
+
+static void bench_parallel(void)
+{
+    MCR* mcr = mcr_open(TEMP_REGION, O_RDWR|O_CREAT|O_TRUNC);
+    if(mcr == NULL) die("Could not create the temporary region.");
+
+    for(int i = 0; i < 32*32; i++)
+        if(mcr_chunk_set(mcr, i % 32, i / 32, sample[i % nsample]))
+            die(nbt_error_to_string(errno));
+
+    if(mcr_close(mcr)) die("Could not write the temporary region.");
+
+    mcr = mcr_open(TEMP_REGION, O_RDONLY);
+    if(mcr == NULL) die("Could not reopen the temporary region.");
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if(ncpu < 1) ncpu = 1;
+
+    printf("%ld cpus\n", ncpu);
+    printf("threads  chunks/s  speedup\n");
+
+    double base = 0;
+    for(long threads = 1; ; threads = threads * 2 > ncpu && threads < ncpu ? ncpu : threads * 2)
+    {
+        double start = now();
+        if(mcr_for_each_chunk_parallel(mcr, (int)threads, free_chunk, NULL) != 0)
+            die(nbt_error_to_string(errno));
+        double elapsed = now() - start;
+
+        if(threads == 1) base = elapsed;
+
+        printf("%7ld  %8.0f  %7.2f\n", threads, 32*32 / elapsed, base / elapsed);
+
+        if(threads >= ncpu) break;
+    }
+
+    mcr_close(mcr);
+    remove(TEMP_REGION);
+}
+
+static int cmp_double(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_async(void)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if(ncpu < 1) ncpu = 1;
+
+    /* one worker even on one cpu, the caller still gets to go on without waiting */
+    int modes[] = { 0, 1, (int)ncpu };
+    size_t nmodes = ncpu > 1 ? 3 : 2;
+
+    static double latency[32*32];
+
+    printf("%ld cpus\n", ncpu);
+    printf("workers  p50 us  p90 us  p99 us  max us  close ms  total ms\n");
+
+    for(size_t m = 0; m < nmodes; m++)
+    {
+        MCR* mcr = mcr_open(TEMP_REGION, O_RDWR|O_CREAT|O_TRUNC);
+        if(mcr == NULL) die("Could not create the temporary region.");
+        if(mcr_set_async(mcr, modes[m])) die(nbt_error_to_string(errno));
+
+        double start = now();
+        for(int i = 0; i < 32*32; i++)
+        {
+            double t = now();
+            if(mcr_chunk_set(mcr, i % 32, i / 32, sample[i % nsample]))
+                die(nbt_error_to_string(errno));
+            latency[i] = now() - t;
+        }
+
+        double closing = now();
+        if(mcr_close(mcr)) die("Could not write the temporary region.");
+        double end = now();
+
+        qsort(latency, 32*32, sizeof *latency, cmp_double);
+
+        printf("%7d  %6.0f  %6.0f  %6.0f  %6.0f  %8.1f  %8.1f\n", modes[m],
+               latency[32*32 / 2] * 1e6, latency[32*32 * 9 / 10] * 1e6,
+               latency[32*32 * 99 / 100] * 1e6, latency[32*32 - 1] * 1e6,
+               (end - closing) * 1e3, (end - start) * 1e3);
+    }
+
+    remove(TEMP_REGION);
+}
+
+/* The region files in a world directory, by path. */
+static char** list_regions(const char* dir, size_t* nregions)
+{
+    DIR* d = opendir(dir);
+    if(d == NULL) die("Could not open the world directory.");
+
+    char** paths = NULL;
+    *nregions = 0;
+
+    struct dirent* e;
+    while((e = readdir(d)) != NULL)
+    {
+        size_t len = strlen(e->d_name);
+        if(len < 4 || (strcmp(e->d_name + len - 4, ".mca") && strcmp(e->d_name + len - 4, ".mcr")))
+            continue;
+
+        paths = realloc(paths, (*nregions + 1) * sizeof *paths);
+        char* path = malloc(strlen(dir) + len + 2);
+        if(paths == NULL || path == NULL) die("Out of memory.");
+
+        sprintf(path, "%s/%s", dir, e->d_name);
+        paths[(*nregions)++] = path;
+    }
+
+    closedir(d);
+
+    if(*nregions == 0) die("No region files in that directory.");
+    return paths;
+}
+
+/* Throws the files out of the page cache, so the next read has to hit the disk. */
+static size_t drop_cache(char** paths, size_t nregions)
+{
+    size_t bytes = 0;
+
+    for(size_t i = 0; i < nregions; i++)
+    {
+        int fd = open(paths[i], O_RDONLY);
+        if(fd == -1) die("Could not open a region file.");
+
+        struct stat st;
+        if(fstat(fd, &st) == 0) bytes += st.st_size;
+
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+
+    return bytes;
+}
+
+static void bench_read(const char* dir)
+{
+    static const struct {
+        const char* name;
+        bool prefetch;
+        mcr_io_backend io;
+    } modes[] = {
+        { "mmap",     false, MCR_IO_PREADV },
+        { "preadv",   true,  MCR_IO_PREADV },
+        { "io_uring", true,  MCR_IO_URING  }
+    };
+
+    size_t nregions;
+    char** paths = list_regions(dir, &nregions);
+
+    printf("%zu regions\n", nregions);
+    printf("mode      read calls     MB/s  chunks/s\n");
+
+    for(size_t m = 0; m < sizeof modes / sizeof *modes; m++)
+    {
+        size_t bytes = drop_cache(paths, nregions);
+        size_t nchunks = 0;
+        size_t fell_back = 0;
+        long calls = 0;
+
+        double start = now();
+
+        for(size_t r = 0; r < nregions; r++)
+        {
+            MCR* mcr = mcr_open(paths[r], O_RDONLY);
+            if(mcr == NULL) die("Could not open a region file.");
+
+            if(modes[m].prefetch)
+            {
+                if(mcr_set_io_backend(mcr, modes[m].io))
+                {
+                    mcr_close(mcr);
+                    break;
+                }
+
+                long n = mcr_prefetch(mcr, NULL, 0);
+                if(n < 0) die(nbt_error_to_string(errno));
+                calls += n;
+                /* io_uring quietly turns into preadv on kernels without it */
+                if(mcr_get_io_backend(mcr) != modes[m].io) fell_back++;
+            }
+
+            for(int x = 0; x < 32; x++)
+                for(int z = 0; z < 32; z++)
+                {
+                    nbt_node* chunk = mcr_chunk_get(mcr, x, z);
+                    if(chunk == NULL && errno != NBT_OK) die(nbt_error_to_string(errno));
+                    if(chunk) nchunks++;
+                    nbt_free(chunk);
+                }
+
+            mcr_close(mcr);
+        }
+
+        double elapsed = now() - start;
+
+        if(nchunks == 0)
+            printf("%-8s  (not supported by this build)\n", modes[m].name);
+        else if(modes[m].prefetch)
+            printf("%-8s  %10ld  %7.1f  %8.0f\n", modes[m].name, calls,
+                   bytes / 1e6 / elapsed, nchunks / elapsed);
+        else
+            printf("%-8s  %10s  %7.1f  %8.0f\n", modes[m].name, "(faults)",
+                   bytes / 1e6 / elapsed, nchunks / elapsed);
+
+        if(fell_back > 0)
+            printf("          (fell back to preadv in %zu of %zu regions)\n", fell_back, nregions);
+    }
+
+    for(size_t i = 0; i < nregions; i++)
+        free(paths[i]);
+    free(paths);
+}
+
+int main(int argc, char** argv)
+{
+    if(argc != 3)
+    {
+        fprintf(stderr, "Usage: %s types|parallel|async [region file]\n"
+                        "       %s read [world directory]\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    if(strcmp(argv[1], "read") == 0)
+    {
+        bench_read(argv[2]);
+        return 0;
+    }
+
+    load_sample(argv[2]);
+
+    if(strcmp(argv[1], "types") == 0)
+        bench_types();
+    else if(strcmp(argv[1], "parallel") == 0)
+        bench_parallel();
+    else if(strcmp(argv[1], "async") == 0)
+        bench_async();
+    else
+        die("Unknown benchmark.");
+
+    for(size_t i = 0; i < nsample; i++)
+        nbt_free(sample[i]);
+
+    return 0;
+}
@@ -1,55 +1,416 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Lukas Niederbremer <webmaster@flippeh.de> and Clark Gaebel <cg.wowus.cg@gmail.com>
+ * wrote this file. As long as you retain this notice you can do whatever you
+ * want with this stuff. If we meet some day, and you think this stuff is worth
+ * it, you can buy us a beer in return.
+ * -----------------------------------------------------------------------------
+ */
+
+/*
+ * Region file analytics from the headers alone. Nothing is ever inflated, so a
+ * whole world goes by in about the time it takes to read 8KiB per region.
+ *
+ * For every region it checks for chunks pointing into the header or past the
+ * end of the file, and for chunks sharing sectors. Over the whole lot it
+ * reports dead space, how fragmented the free space is, and a histogram of
+ * chunk sizes.
+ *
+ *   -v       list every chunk: slot, offset, sectors, timestamp (and with -l,
+ *            length and compression type)
+ *   -l       also read each chunk's length and compression type, which costs
+ *            a read of its first sector
+ *   -j N     read N regions at a time (default 4)
+ *
+ * Arguments are region files, or world directories to take the .mca and .mcr
+ * files out of (their region/ subdirectory too, if there is one).
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
 #include "nbt.h"
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define SECTOR_SIZE 4096
+#define HEADER_SECTORS 2
+
+/* Chunk sizes in sectors: 1, 2, 3-4, 5-8, ... 129-255. */
+#define NBUCKETS 9
+
+static bool verbose, peek;
+
+static void die(const char* message)
+{
+    fprintf(stderr, "%s\n", message);
+    exit(1);
+}
+
+struct stats {
+    size_t regions;
+    size_t unreadable;     /* regions that couldn't be opened at all */
+    size_t truncated;      /* regions shorter than their headers */
+    size_t chunks;
+    size_t file_sectors;   /* everything past the headers */
+    size_t used_sectors;   /* sectors claimed by at least one chunk */
+    size_t dead_sectors;   /* sectors nobody claims */
+    size_t holes;          /* runs of dead sectors between used ones */
+    size_t largest_hole;
+    size_t out_of_bounds;  /* chunks in the header or past the end of the file */
+    size_t overlapping;    /* chunks sharing a sector with another */
+    size_t slack_bytes;    /* unused tail of chunk sectors, with -l only */
+    size_t bad_length;     /* chunks whose length doesn't fit, with -l only */
+    size_t types[5];       /* by compression type, 0 for anything unknown */
+    size_t histogram[NBUCKETS];
+};
+
+/* Every field is a count to be summed, except the largest hole. */
+static void add_stats(struct stats* into, const struct stats* s)
+{
+    into->regions       += s->regions;
+    into->unreadable    += s->unreadable;
+    into->truncated     += s->truncated;
+    into->chunks        += s->chunks;
+    into->file_sectors  += s->file_sectors;
+    into->used_sectors  += s->used_sectors;
+    into->dead_sectors  += s->dead_sectors;
+    into->holes         += s->holes;
+    into->out_of_bounds += s->out_of_bounds;
+    into->overlapping   += s->overlapping;
+    into->slack_bytes   += s->slack_bytes;
+    into->bad_length    += s->bad_length;
+
+    for(size_t i = 0; i < sizeof s->types / sizeof *s->types; i++)
+        into->types[i] += s->types[i];
+
+    for(size_t i = 0; i < NBUCKETS; i++)
+        into->histogram[i] += s->histogram[i];
+
+    if(s->largest_hole > into->largest_hole)
+        into->largest_hole = s->largest_hole;
+}
+
+static int bucket(unsigned sectors)
+{
+    int b = 0;
+    while(b < NBUCKETS - 1 && (1u << b) < sectors)
+        b++;
+    return b;
+}
+
+/*
+ * Looks at one region. Everything it has to say about the region goes into
+ * `out', so regions done in parallel don't print over each other.
+ */
+static void region_info(const char* path, struct stats* s, struct buffer* out)
+{
+    char line[256];
+
+#define say(...) do {                                       \
+    int n_ = snprintf(line, sizeof line, __VA_ARGS__);      \
+    buffer_append(out, line, n_ < (int)sizeof line ? (size_t)n_ : sizeof line - 1); \
+} while(0)
+
+    s->regions++;
+
+    MCR* mcr = mcr_open(path, O_RDONLY);
+    if(mcr == NULL)
+    {
+        say("%s: can't read the header\n", path);
+        s->unreadable++;
+        return;
+    }
+
+    size_t nsectors = (mcr_file_size(mcr) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    if(nsectors < HEADER_SECTORS)
+    {
+        /* mcr_open turns these away, but one cut short since would wrap below */
+        say("%s: truncated, only %zu of the header's %d sectors\n", path, nsectors, HEADER_SECTORS);
+        s->truncated++;
+        mcr_close(mcr);
+        return;
+    }
+    s->file_sectors = nsectors - HEADER_SECTORS;
+
+    /* how many chunks claim each sector */
+    unsigned char* claims = calloc(nsectors, 1);
+    if(claims == NULL) die("Out of memory.");
+
+    mcr_chunk_info info[32][32];
+
+    for(int z = 0; z < 32; z++)
+        for(int x = 0; x < 32; x++)
+        {
+            mcr_chunk_info* c = &info[x][z];
+
+            int ret = mcr_chunk_stat(mcr, x, z, peek, c);
+            if(c->offset == 0 && c->sectors == 0) continue;
+
+            s->chunks++;
+            /* a chunk with no sectors has no size to file it under; it's out of bounds below */
+            if(c->sectors > 0)
+                s->histogram[bucket(c->sectors)]++;
+
+            if(verbose)
+            {
+                if(peek)
+                    say("%s: (%2d, %2d) offset %6u sectors %3u timestamp %10u length %8u type %d\n",
+                        path, x, z, c->offset, c->sectors, c->timestamp, c->length, c->type);
+                else
+                    say("%s: (%2d, %2d) offset %6u sectors %3u timestamp %10u\n",
+                        path, x, z, c->offset, c->sectors, c->timestamp);
+            }
+
+            if(c->offset < HEADER_SECTORS || c->offset + c->sectors > nsectors || c->sectors == 0)
+            {
+                say("%s: chunk (%d, %d) at sectors %u-%u is outside the file's %zu\n",
+                    path, x, z, c->offset, c->offset + c->sectors, nsectors);
+                s->out_of_bounds++;
+                continue;
+            }
+
+            for(unsigned i = c->offset; i < c->offset + c->sectors; i++)
+                if(claims[i] < 255) claims[i]++;
+
+            if(peek)
+            {
+                if(ret != 0)
+                {
+                    say("%s: chunk (%d, %d) has a bad length\n", path, x, z);
+                    s->bad_length++;
+                }
+                else
+                {
+                    s->slack_bytes += (size_t)c->sectors * SECTOR_SIZE - 4 - c->length;
+                    s->types[c->type >= 1 && c->type <= 4 ? c->type : 0]++;
+                }
+            }
+        }
+
+    /* a second pass, now that every claim is known, to name the overlaps */
+    for(int z = 0; z < 32; z++)
+        for(int x = 0; x < 32; x++)
+        {
+            mcr_chunk_info* c = &info[x][z];
+            if(c->offset < HEADER_SECTORS || c->sectors == 0 || c->offset + c->sectors > nsectors)
+                continue;
+
+            for(unsigned i = c->offset; i < c->offset + c->sectors; i++)
+                if(claims[i] > 1)
+                {
+                    say("%s: chunk (%d, %d) shares sector %u with another chunk\n", path, x, z, i);
+                    s->overlapping++;
+                    break;
+                }
+        }
+
+    /* dead space, and how it's broken up */
+    size_t hole = 0;
+    for(size_t i = HEADER_SECTORS; i <= nsectors; i++)
+    {
+        if(i < nsectors && claims[i] == 0)
+        {
+            s->dead_sectors++;
+            hole++;
+            continue;
+        }
+
+        if(i < nsectors) s->used_sectors++;
 
-static inline void* reverse_endianness(void* s, size_t len)
+        if(hole > 0)
+        {
+            s->holes++;
+            if(hole > s->largest_hole) s->largest_hole = hole;
+            hole = 0;
+        }
+    }
+
+    free(claims);
+    mcr_close(mcr);
+
+#undef say
+}
+
+/* The work queue for -j: every thread takes the next region off the list. */
+struct job {
+    char** paths;
+    size_t npaths;
+    size_t next;
+    pthread_mutex_t lock;
+    struct stats total;
+};
+
+static void* worker(void* vjob)
 {
-    for(char* b = s,
-            * e = b + len - 1;
-        b < e;
-        b++, e--)
+    struct job* job = vjob;
+
+    for(;;)
     {
-        char t = *b;
+        pthread_mutex_lock(&job->lock);
+        size_t i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        if(i >= job->npaths) break;
+
+        struct stats s;
+        struct buffer out = BUFFER_INIT;
+
+        memset(&s, 0, sizeof s);
+        region_info(job->paths[i], &s, &out);
+
+        pthread_mutex_lock(&job->lock);
+        fwrite(out.data, 1, out.len, stdout);
+        add_stats(&job->total, &s);
+        pthread_mutex_unlock(&job->lock);
 
-        *b = *e;
-        *e = t;
+        buffer_free(&out);
     }
 
-    return s;
+    return NULL;
 }
 
-static inline bool little_endian()
+static void add_path(char*** paths, size_t* npaths, const char* dir, const char* name)
 {
-    union {
-        int  i;
-        char c;
-    } u;
+    char* path = malloc(strlen(dir) + strlen(name) + 2);
+    *paths = realloc(*paths, (*npaths + 1) * sizeof **paths);
+    if(path == NULL || *paths == NULL) die("Out of memory.");
 
-    u.i = 0;
-    u.c = 1;
+    if(*dir)
+        sprintf(path, "%s/%s", dir, name);
+    else
+        strcpy(path, name);
 
-    return u.i == 1;
+    (*paths)[(*npaths)++] = path;
 }
 
-#define be2ne(x) do {                        \
-    if(little_endian())                      \
-        reverse_endianness(&(x), sizeof(x)); \
-} while(0)
+static void add_dir(char*** paths, size_t* npaths, const char* dir, bool descend)
+{
+    DIR* d = opendir(dir);
+    if(d == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+        return;
+    }
+
+    struct dirent* e;
+    while((e = readdir(d)) != NULL)
+    {
+        size_t len = strlen(e->d_name);
+
+        if(len > 4 && (strcmp(e->d_name + len - 4, ".mca") == 0 || strcmp(e->d_name + len - 4, ".mcr") == 0))
+            add_path(paths, npaths, dir, e->d_name);
+        else if(descend && strcmp(e->d_name, "region") == 0)
+        {
+            char* sub = malloc(strlen(dir) + sizeof "/region");
+            if(sub == NULL) die("Out of memory.");
+
+            sprintf(sub, "%s/region", dir);
+            add_dir(paths, npaths, sub, false);
+            free(sub);
+        }
+    }
+
+    closedir(d);
+}
 
 int main(int argc, char** argv)
 {
-    if(argc < 2)
+    int nthreads = 4;
+    int i;
+
+    for(i = 1; i < argc && argv[i][0] == '-'; i++)
+    {
+        if(strcmp(argv[i], "-v") == 0)
+            verbose = true;
+        else if(strcmp(argv[i], "-l") == 0)
+            peek = true;
+        else if(strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            nthreads = atoi(argv[++i]);
+        else
+            break;
+    }
+
+    if(i == argc || nthreads < 1)
     {
-        fprintf(stderr, "Usage: %s [minecraft region file]\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-v] [-l] [-j threads] [region file or world directory]...\n", argv[0]);
         return 1;
     }
 
-    FILE* f = fopen(argv[1], "rb");
+    struct job job;
+    memset(&job, 0, sizeof job);
+    pthread_mutex_init(&job.lock, NULL);
+
+    for(; i < argc; i++)
+    {
+        struct stat st;
+        if(stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+            add_dir(&job.paths, &job.npaths, argv[i], true);
+        else
+            add_path(&job.paths, &job.npaths, "", argv[i]);
+    }
+
+    if(job.npaths == 0) die("No region files.");
+
+    if((size_t)nthreads > job.npaths) nthreads = (int)job.npaths;
+
+    pthread_t* threads = malloc(nthreads * sizeof *threads);
+    if(threads == NULL) die("Out of memory.");
+
+    for(int t = 0; t < nthreads; t++)
+        if(pthread_create(&threads[t], NULL, worker, &job) != 0)
+            die("Could not start a thread.");
+
+    for(int t = 0; t < nthreads; t++)
+        pthread_join(threads[t], NULL);
+
+    const struct stats* s = &job.total;
+
+    printf("\n%zu regions (%zu unreadable, %zu truncated), %zu chunks\n",
+           s->regions, s->unreadable, s->truncated, s->chunks);
+    printf("%zu sectors past the headers: %zu used, %zu dead (%.1f%%)\n",
+           s->file_sectors, s->used_sectors, s->dead_sectors,
+           s->file_sectors ? 100.0 * s->dead_sectors / s->file_sectors : 0.0);
+    printf("dead space is in %zu holes, the largest %zu sectors\n", s->holes, s->largest_hole);
+    printf("%zu chunks out of bounds, %zu sharing sectors\n", s->out_of_bounds, s->overlapping);
+
+    if(peek)
+    {
+        printf("%.2f MB of slack at the ends of chunk sectors, %zu bad lengths\n",
+               s->slack_bytes / 1e6, s->bad_length);
+        printf("compression: %zu gzip, %zu zlib, %zu none, %zu lz4, %zu unknown\n",
+               s->types[1], s->types[2], s->types[3], s->types[4], s->types[0]);
+    }
+
+    printf("\nsectors  chunks\n");
+    for(int b = 0; b < NBUCKETS; b++)
+    {
+        unsigned lo = b == 0 ? 1 : (1u << (b - 1)) + 1;
+        unsigned hi = b == NBUCKETS - 1 ? 255 : 1u << b;
+        char range[16];
+
+        if(lo == hi)
+            snprintf(range, sizeof range, "%u", lo);
+        else
+            snprintf(range, sizeof range, "%u-%u", lo, hi);
+
+        printf("%7s  %6zu\n", range, s->histogram[b]);
+    }
 
-    //
+    for(size_t p = 0; p < job.npaths; p++)
+        free(job.paths[p]);
+    free(job.paths);
+    free(threads);
+    pthread_mutex_destroy(&job.lock);
 
-    fclose(f);
     return 0;
 }
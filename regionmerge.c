@@ -0,0 +1,221 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Lukas Niederbremer <webmaster@flippeh.de> and Clark Gaebel <cg.wowus.cg@gmail.com>
+ * wrote this file. As long as you retain this notice you can do whatever you
+ * want with this stuff. If we meet some day, and you think this stuff is worth
+ * it, you can buy us a beer in return.
+ * -----------------------------------------------------------------------------
+ */
+
+/*
+ * Merges region files into another without inflating a single chunk. Chunks
+ * move as the compressed bytes they already are, so this goes about as fast as
+ * the disk does.
+ *
+ * Where both sides have a chunk, the one written last (by the header's
+ * timestamp) wins, and timestamps come along with the chunks.
+ *
+ *   -o       chunks from the sources always win
+ *   -v       say what happened to every region
+ *
+ * Either every argument is a region file, or every argument is a directory of
+ * them, in which case each source region goes into the destination region of
+ * the same name, which is made if it isn't there.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "nbt.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+static bool overwrite, verbose;
+
+struct stats {
+    size_t regions;
+    size_t copied;  /* chunks written into the destination */
+    size_t kept;    /* chunks the destination had newer already */
+    size_t bytes;   /* compressed bytes copied */
+};
+
+static void die(const char* message)
+{
+    fprintf(stderr, "%s\n", message);
+    exit(1);
+}
+
+/* errno can be an nbt_status or a system error, depending on where it came from */
+static const char* error_string(int err)
+{
+    return err < 0 ? nbt_error_to_string((nbt_status)err) : strerror(err);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool is_dir(const char* path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static void merge_region(const char* dest_path, const char* src_path, struct stats* s)
+{
+    MCR* src = mcr_open(src_path, O_RDONLY);
+    if(src == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", src_path, error_string(errno));
+        return;
+    }
+
+    MCR* dest = mcr_open(dest_path, O_RDWR|O_CREAT);
+    if(dest == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", dest_path, error_string(errno));
+        mcr_close(src);
+        return;
+    }
+
+    /* the whole source in a few big reads, rather than a fault per chunk */
+    if(mcr_prefetch(src, NULL, 0) < 0)
+        fprintf(stderr, "%s: %s\n", src_path, error_string(errno));
+
+    size_t copied = 0, kept = 0;
+
+    for(int x = 0; x < 32; x++)
+        for(int z = 0; z < 32; z++)
+        {
+            if(!mcr_chunk_exists(src, x, z)) continue;
+
+            uint32_t when = mcr_chunk_timestamp(src, x, z);
+            if(!overwrite && mcr_chunk_exists(dest, x, z) && mcr_chunk_timestamp(dest, x, z) >= when)
+            {
+                kept++;
+                continue;
+            }
+
+            uint8_t type;
+            struct buffer raw = mcr_chunk_get_raw(src, x, z, &type);
+            if(raw.data == NULL)
+            {
+                fprintf(stderr, "%s: chunk (%d, %d): %s\n", src_path, x, z, error_string(errno));
+                continue;
+            }
+
+            if(mcr_chunk_set_raw(dest, x, z, type, raw.data, raw.len, when))
+                fprintf(stderr, "%s: chunk (%d, %d): %s\n", dest_path, x, z, error_string(errno));
+            else
+            {
+                copied++;
+                s->bytes += raw.len;
+            }
+
+            buffer_free(&raw);
+        }
+
+    mcr_close(src);
+    if(mcr_close(dest))
+        fprintf(stderr, "%s: %s\n", dest_path, error_string(errno));
+
+    if(verbose)
+        printf("%s -> %s: %zu copied, %zu kept\n", src_path, dest_path, copied, kept);
+
+    s->regions++;
+    s->copied += copied;
+    s->kept += kept;
+}
+
+static void merge_dir(const char* dest, const char* src, struct stats* s)
+{
+    DIR* d = opendir(src);
+    if(d == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", src, error_string(errno));
+        return;
+    }
+
+    struct dirent* e;
+    while((e = readdir(d)) != NULL)
+    {
+        size_t len = strlen(e->d_name);
+        if(len < 4 || (strcmp(e->d_name + len - 4, ".mca") && strcmp(e->d_name + len - 4, ".mcr")))
+            continue;
+
+        char* src_path  = malloc(strlen(src) + len + 2);
+        char* dest_path = malloc(strlen(dest) + len + 2);
+        if(src_path == NULL || dest_path == NULL) die("Out of memory.");
+
+        sprintf(src_path, "%s/%s", src, e->d_name);
+        sprintf(dest_path, "%s/%s", dest, e->d_name);
+        merge_region(dest_path, src_path, s);
+
+        free(src_path);
+        free(dest_path);
+    }
+
+    closedir(d);
+}
+
+int main(int argc, char** argv)
+{
+    int i;
+
+    for(i = 1; i < argc && argv[i][0] == '-'; i++)
+    {
+        if(strcmp(argv[i], "-o") == 0)
+            overwrite = true;
+        else if(strcmp(argv[i], "-v") == 0)
+            verbose = true;
+        else
+            break;
+    }
+
+    if(argc - i < 2)
+    {
+        fprintf(stderr, "Usage: %s [-o] [-v] [destination region] [source region]...\n"
+                        "       %s [-o] [-v] [destination directory] [source directory]...\n",
+                argv[0], argv[0]);
+        return 1;
+    }
+
+    const char* dest = argv[i++];
+    bool dirs = is_dir(argv[i]);
+
+    if(dirs && !is_dir(dest) && mkdir(dest, 0777) == -1)
+        die("Could not make the destination directory.");
+
+    struct stats s = { 0, 0, 0, 0 };
+    double start = now();
+
+    for(; i < argc; i++)
+    {
+        if(is_dir(argv[i]) != dirs)
+            die("Sources have to be all region files or all directories.");
+
+        if(dirs)
+            merge_dir(dest, argv[i], &s);
+        else
+            merge_region(dest, argv[i], &s);
+    }
+
+    double elapsed = now() - start;
+
+    printf("%zu regions, %zu chunks copied (%.2f MB), %zu kept, in %.2fs (%.1f MB/s)\n",
+           s.regions, s.copied, s.bytes / 1e6, s.kept, elapsed,
+           elapsed > 0 ? s.bytes / 1e6 / elapsed : 0.0);
+
+    return 0;
+}
@@ -0,0 +1,259 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Lukas Niederbremer <webmaster@flippeh.de> and Clark Gaebel <cg.wowus.cg@gmail.com>
+ * wrote this file. As long as you retain this notice you can do whatever you
+ * want with this stuff. If we meet some day, and you think this stuff is worth
+ * it, you can buy us a beer in return.
+ * -----------------------------------------------------------------------------
+ */
+#include "slab.h"
+
+#include "alloc.h"
+#include "nbt.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Objects moved between a thread and the depot at a time. */
+#define BATCH 64
+
+/* Objects carved out of every slab. */
+#define SLAB_OBJECTS (16 * BATCH)
+
+/*
+ * A free object. Batches are chained through `next', and the first of each
+ * also says how many are in it and where the next batch in the depot is.
+ */
+struct free_obj {
+    struct free_obj* next;
+    struct free_obj* next_batch;
+    size_t count;
+};
+
+/* Every pooled object, header and all, has to be able to hold a free_obj. */
+typedef char node_fits [SLAB_HEADER + sizeof(nbt_node)        >= sizeof(struct free_obj) ? 1 : -1];
+typedef char entry_fits[SLAB_HEADER + sizeof(struct tag_list) >= sizeof(struct free_obj) ? 1 : -1];
+
+struct slab {
+    struct slab* next;
+    /* the objects follow */
+};
+
+struct depot {
+    pthread_mutex_t lock;
+    size_t size;            /* of an object, with its header */
+    struct free_obj* batches;
+    struct slab* slabs;     /* every slab made so far */
+};
+
+static struct depot depots[SLAB_CLASSES] = {
+    { PTHREAD_MUTEX_INITIALIZER, SLAB_HEADER + sizeof(nbt_node),        NULL, NULL },
+    { PTHREAD_MUTEX_INITIALIZER, SLAB_HEADER + sizeof(struct tag_list), NULL, NULL }
+};
+
+struct cache {
+    struct free_obj* head;
+    size_t count;
+    unsigned generation;
+};
+
+static __thread struct cache caches[SLAB_CLASSES];
+
+/* Bumped by slab_release_all, so threads know their caches point at freed slabs. */
+static unsigned generation;
+
+/* Hands a thread's caches back to the depot when it exits. */
+static pthread_key_t  flush_key;
+static pthread_once_t flush_key_once = PTHREAD_ONCE_INIT;
+static __thread bool  flush_registered;
+
+/* Detaches the first `n' objects of the cache, as a batch. */
+static struct free_obj* take_batch(struct cache* c, size_t n)
+{
+    struct free_obj* batch = c->head;
+    struct free_obj* last  = batch;
+
+    for(size_t i = 1; i < n; i++)
+        last = last->next;
+
+    c->head   = last->next;
+    c->count -= n;
+
+    last->next  = NULL;
+    batch->count = n;
+    return batch;
+}
+
+static void give_batch(enum slab_class cls, struct free_obj* batch)
+{
+    struct depot* d = &depots[cls];
+
+    pthread_mutex_lock(&d->lock);
+    batch->next_batch = d->batches;
+    d->batches = batch;
+    pthread_mutex_unlock(&d->lock);
+}
+
+static void flush_caches(void* vcaches)
+{
+    for(int cls = 0; cls < SLAB_CLASSES; cls++)
+    {
+        struct cache* c = (struct cache*)vcaches + cls;
+        if(c->count > 0 && c->generation == __atomic_load_n(&generation, __ATOMIC_RELAXED))
+            give_batch((enum slab_class)cls, take_batch(c, c->count));
+    }
+}
+
+static void make_flush_key(void)
+{
+    pthread_key_create(&flush_key, flush_caches);
+}
+
+/* The calling thread's cache, emptied first if its slabs have been released since. */
+static struct cache* get_cache(enum slab_class cls)
+{
+    struct cache* c = &caches[cls];
+    unsigned current = __atomic_load_n(&generation, __ATOMIC_RELAXED);
+
+    if(c->generation != current)
+    {
+        c->head  = NULL;
+        c->count = 0;
+        c->generation = current;
+    }
+
+    return c;
+}
+
+/* Cuts a new slab into batches and puts them in the depot. Called with the lock held. */
+static bool carve(struct depot* d)
+{
+    const nbt_allocator* a = mem_global();
+    struct slab* slab = a->allocate(sizeof *slab + SLAB_OBJECTS * d->size, a->ctx);
+    if(slab == NULL) return false;
+
+    slab->next = d->slabs;
+    d->slabs = slab;
+
+    char* objects = (char*)(slab + 1);
+    for(size_t b = 0; b < SLAB_OBJECTS / BATCH; b++)
+    {
+        struct free_obj* batch = (struct free_obj*)(objects + b * BATCH * d->size);
+
+        for(size_t i = 0; i < BATCH; i++)
+        {
+            struct free_obj* obj = (struct free_obj*)((char*)batch + i * d->size);
+            obj->next = i + 1 < BATCH ? (struct free_obj*)((char*)obj + d->size) : NULL;
+        }
+
+        batch->count = BATCH;
+        batch->next_batch = d->batches;
+        d->batches = batch;
+    }
+
+    return true;
+}
+
+static bool refill(enum slab_class cls, struct cache* c)
+{
+    if(!flush_registered)
+    {
+        pthread_once(&flush_key_once, make_flush_key);
+        pthread_setspecific(flush_key, caches);
+        flush_registered = true;
+    }
+
+    struct depot* d = &depots[cls];
+
+    pthread_mutex_lock(&d->lock);
+    if(d->batches == NULL && !carve(d))
+    {
+        pthread_mutex_unlock(&d->lock);
+        return false;
+    }
+
+    struct free_obj* batch = d->batches;
+    d->batches = batch->next_batch;
+    pthread_mutex_unlock(&d->lock);
+
+    c->head  = batch;
+    c->count = batch->count;
+    return true;
+}
+
+void* slab_alloc(enum slab_class cls)
+{
+    union slab_header* h;
+    const nbt_allocator* a = mem_override();
+
+    if(a)
+    {
+        if((h = a->allocate(depots[cls].size, a->ctx)) == NULL) return NULL;
+
+        h->origin = a;
+        return h + 1;
+    }
+
+    struct cache* c = get_cache(cls);
+    if(c->head == NULL && !refill(cls, c)) return NULL;
+
+    struct free_obj* obj = c->head;
+    c->head = obj->next;
+    c->count--;
+
+    h = (union slab_header*)obj;
+    h->origin = NULL;
+    return h + 1;
+}
+
+void slab_free(enum slab_class cls, void* ptr)
+{
+    if(ptr == NULL) return;
+
+    union slab_header* h = (union slab_header*)ptr - 1;
+
+    if(h->origin)
+    {
+        h->origin->release(h, h->origin->ctx);
+        return;
+    }
+
+    struct cache* c = get_cache(cls);
+    struct free_obj* obj = (struct free_obj*)h;
+
+    obj->next = c->head;
+    c->head = obj;
+
+    /* keep one batch's worth, so a thread going back and forth doesn't thrash the depot */
+    if(++c->count >= 2 * BATCH)
+        give_batch(cls, take_batch(c, BATCH));
+}
+
+const nbt_allocator* slab_origin(const void* ptr)
+{
+    return ((const union slab_header*)ptr - 1)->origin;
+}
+
+void slab_release_all(void)
+{
+    const nbt_allocator* a = mem_global();
+
+    for(int cls = 0; cls < SLAB_CLASSES; cls++)
+    {
+        struct depot* d = &depots[cls];
+
+        pthread_mutex_lock(&d->lock);
+        while(d->slabs)
+        {
+            struct slab* next = d->slabs->next;
+            a->release(d->slabs, a->ctx);
+            d->slabs = next;
+        }
+        d->batches = NULL;
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    __atomic_fetch_add(&generation, 1, __ATOMIC_RELAXED);
+}
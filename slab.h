@@ -0,0 +1,65 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Lukas Niederbremer <webmaster@flippeh.de> and Clark Gaebel <cg.wowus.cg@gmail.com>
+ * wrote this file. As long as you retain this notice you can do whatever you
+ * want with this stuff. If we meet some day, and you think this stuff is worth
+ * it, you can buy us a beer in return.
+ * -----------------------------------------------------------------------------
+ */
+#ifndef NBT_SLAB_H
+#define NBT_SLAB_H
+
+#include "nbt.h" /* for nbt_allocator */
+
+#include <stdint.h>
+
+/*
+ * Pools for the two objects that make up nearly every allocation in a tree:
+ * nodes and list entries. Each thread keeps a cache of free ones, and swaps
+ * them with a shared depot a batch at a time when it runs out or has too
+ * many, so most allocations and frees never take a lock or leave the thread.
+ *
+ * Objects are carved from big slabs taken from the process's allocator, and
+ * the slabs are kept for reuse until nbt_set_allocator hands them back. While
+ * the thread has an allocator override (see nbt_use_allocator) the pools step
+ * aside, and objects come from the override one by one.
+ *
+ * Whichever thread frees an object, under whatever override, it goes back to
+ * where it came from: every object is preceded by a header that says.
+ */
+union slab_header {
+    const nbt_allocator* origin; /* NULL for the pools */
+    uint64_t align_u64;          /* so what follows is aligned for anything in a node */
+    double   align_double;
+};
+
+/* What the header costs every object, on top of its own size. */
+#define SLAB_HEADER sizeof(union slab_header)
+
+enum slab_class {
+    SLAB_NODE,  /* nbt_node */
+    SLAB_ENTRY, /* struct tag_list */
+    SLAB_CLASSES
+};
+
+/* Returns NULL if there's no memory for it. */
+void* slab_alloc(enum slab_class cls);
+
+/* Only takes what slab_alloc returned. Passing NULL is a no-op. */
+void slab_free(enum slab_class cls, void* obj);
+
+/*
+ * The override `obj' was allocated under, or NULL if it came from the pools,
+ * which is what nbt_use_allocator takes to go back to the process's allocator.
+ */
+const nbt_allocator* slab_origin(const void* obj);
+
+/*
+ * Gives every slab back to the process's allocator, and forgets whatever the
+ * threads had cached. Only safe when no object from the pools is in use, and
+ * no other thread is using the library.
+ */
+void slab_release_all(void);
+
+#endif
@@ -0,0 +1,275 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Lukas Niederbremer <webmaster@flippeh.de> and Clark Gaebel <cg.wowus.cg@gmail.com>
+ * wrote this file. As long as you retain this notice you can do whatever you
+ * want with this stuff. If we meet some day, and you think this stuff is worth
+ * it, you can buy us a beer in return.
+ * -----------------------------------------------------------------------------
+ */
+#include "threadpool.h"
+
+#include "alloc.h"
+#include "list.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+struct task {
+    void (*fn)(void*);
+    void* arg;
+    const nbt_allocator* alloc; /* the submitter's override, which the task runs under */
+    struct list_head entry;
+};
+
+/*
+ * Every worker owns a deque. It pushes and pops its own work at the back, and
+ * idle workers steal from the front, where the oldest (and, for recursive
+ * work, biggest) tasks are.
+ */
+struct worker {
+    pthread_mutex_t   lock;  /* guards `deque' only */
+    struct list_head  deque;
+    pthread_t         thread;
+    struct threadpool* pool;
+    size_t            index;
+};
+
+struct threadpool {
+    pthread_mutex_t lock;
+    pthread_cond_t  work;  /* signalled when a task is queued, or on shutdown */
+    pthread_cond_t  idle;  /* signalled when `pending' drops to zero */
+
+    size_t queued;         /* tasks sitting in deques, not yet claimed */
+    size_t pending;        /* queued + running */
+    size_t next;           /* deque the next outside submission goes to */
+    bool   shutdown;
+
+    size_t        nthreads;
+    struct worker workers[];
+};
+
+/* Which worker the calling thread is, if any. */
+static pthread_key_t  current_worker;
+static pthread_once_t current_worker_once = PTHREAD_ONCE_INIT;
+
+static void make_current_worker_key(void)
+{
+    pthread_key_create(&current_worker, NULL);
+}
+
+static struct task* pop_back(struct worker* w)
+{
+    struct task* t = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    if(!list_empty(&w->deque))
+    {
+        struct list_head* last = w->deque.blink;
+        list_del(last);
+        t = list_entry(last, struct task, entry);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return t;
+}
+
+static struct task* steal_front(struct worker* w)
+{
+    struct task* t = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    if(!list_empty(&w->deque))
+    {
+        struct list_head* first = w->deque.flink;
+        list_del(first);
+        t = list_entry(first, struct task, entry);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return t;
+}
+
+static void* worker(void* vworker)
+{
+    struct worker*     self = vworker;
+    struct threadpool* pool = self->pool;
+
+    pthread_setspecific(current_worker, self);
+
+    for(;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+
+        while(pool->queued == 0 && !pool->shutdown)
+            pthread_cond_wait(&pool->work, &pool->lock);
+
+        if(pool->queued == 0)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break; /* shutting down, and nothing left to do */
+        }
+
+        /*
+         * Claim a task. Tasks are in a deque before they're counted, so there's
+         * one to be found somewhere, even if somebody else's pop beats us to it
+         * in a particular deque.
+         */
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+
+        struct task* t = pop_back(self);
+        for(size_t i = 1; t == NULL; i++)
+            t = steal_front(&pool->workers[(self->index + i) % pool->nthreads]);
+
+        const nbt_allocator* old = nbt_use_allocator(t->alloc);
+        t->fn(t->arg);
+        mem_free(t);
+        nbt_use_allocator(old);
+
+        pthread_mutex_lock(&pool->lock);
+        if(--pool->pending == 0)
+            pthread_cond_broadcast(&pool->idle);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+struct threadpool* threadpool_create(size_t nthreads)
+{
+    assert(nthreads > 0);
+
+    pthread_once(&current_worker_once, make_current_worker_key);
+
+    struct threadpool* pool = mem_alloc(sizeof *pool + nthreads * sizeof(struct worker));
+    if(pool == NULL) return NULL;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pool->queued   = 0;
+    pool->pending  = 0;
+    pool->next     = 0;
+    pool->shutdown = false;
+    pool->nthreads = 0;
+
+    /* the deques have to be there before anyone can steal from them */
+    for(size_t i = 0; i < nthreads; i++)
+    {
+        struct worker* w = &pool->workers[i];
+
+        pthread_mutex_init(&w->lock, NULL);
+        INIT_LIST_HEAD(&w->deque);
+        w->pool  = pool;
+        w->index = i;
+    }
+
+    for(size_t i = 0; i < nthreads; i++)
+    {
+        if(pthread_create(&pool->workers[i].thread, NULL, worker, &pool->workers[i]) != 0)
+        {
+            /* destroy only cleans up after the workers that got started */
+            for(size_t j = pool->nthreads; j < nthreads; j++)
+                pthread_mutex_destroy(&pool->workers[j].lock);
+            threadpool_destroy(pool);
+            return NULL;
+        }
+
+        pool->nthreads++;
+    }
+
+    return pool;
+}
+
+int threadpool_submit(struct threadpool* pool, void (*fn)(void*), void* arg)
+{
+    assert(pool && fn);
+
+    struct task* t = mem_alloc(sizeof *t);
+    if(t == NULL) return 1;
+
+    t->fn    = fn;
+    t->arg   = arg;
+    t->alloc = mem_override();
+
+    /* a worker feeding itself keeps its work local, everyone else spreads it */
+    struct worker* self = pthread_getspecific(current_worker);
+    struct worker* w;
+
+    if(self != NULL && self->pool == pool)
+        w = self;
+    else
+    {
+        pthread_mutex_lock(&pool->lock);
+        w = &pool->workers[pool->next++ % pool->nthreads];
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    pthread_mutex_lock(&w->lock);
+    list_add_tail(&t->entry, &w->deque);
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pool->pending++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+void threadpool_wait(struct threadpool* pool)
+{
+    assert(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while(pool->pending > 0)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+size_t threadpool_size(const struct threadpool* pool)
+{
+    assert(pool);
+    return pool->nthreads;
+}
+
+int threadpool_worker_index(void)
+{
+    pthread_once(&current_worker_once, make_current_worker_key);
+
+    struct worker* self = pthread_getspecific(current_worker);
+    return self ? (int)self->index : -1;
+}
+
+void threadpool_destroy(struct threadpool* pool)
+{
+    if(pool == NULL) return;
+
+    /*
+     * Only once everything is done: workers that find nothing queued leave as
+     * soon as they see `shutdown', and running tasks may still queue more.
+     */
+    pthread_mutex_lock(&pool->lock);
+    while(pool->pending > 0)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    /* the others can still be stealing from a worker that's gone */
+    for(size_t i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    for(size_t i = 0; i < pool->nthreads; i++)
+        pthread_mutex_destroy(&pool->workers[i].lock);
+
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+
+    mem_free(pool);
+}
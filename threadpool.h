@@ -0,0 +1,53 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Lukas Niederbremer <webmaster@flippeh.de> and Clark Gaebel <cg.wowus.cg@gmail.com>
+ * wrote this file. As long as you retain this notice you can do whatever you
+ * want with this stuff. If we meet some day, and you think this stuff is worth
+ * it, you can buy us a beer in return.
+ * -----------------------------------------------------------------------------
+ */
+#ifndef NBT_THREADPOOL_H
+#define NBT_THREADPOOL_H
+
+#include <stddef.h>
+
+/*
+ * A fixed set of worker threads, each with its own deque of tasks. Workers run
+ * their own tasks newest first, and steal the oldest from each other when they
+ * run dry. Tasks are run in no particular order, and may run on any worker.
+ */
+struct threadpool;
+
+/*
+ * Starts `nthreads' workers. Returns NULL if the threads or the memory for them
+ * couldn't be had.
+ */
+struct threadpool* threadpool_create(size_t nthreads);
+
+/*
+ * Queues `fn(arg)' to be run on a worker. Tasks submitted from a worker go on
+ * that worker's own deque, anything else is dealt out round-robin. Returns
+ * non-zero if the task couldn't be queued, in which case it will never run.
+ */
+int threadpool_submit(struct threadpool* pool, void (*fn)(void* arg), void* arg);
+
+/* Blocks until every task submitted so far has finished running. */
+void threadpool_wait(struct threadpool* pool);
+
+/* The number of workers. */
+size_t threadpool_size(const struct threadpool* pool);
+
+/*
+ * Which worker of its pool the calling thread is, from 0 to threadpool_size - 1,
+ * or -1 if it isn't a worker at all. Handy for indexing per-worker state.
+ */
+int threadpool_worker_index(void);
+
+/*
+ * Waits for all outstanding tasks, then stops the workers and frees the pool.
+ * Passing NULL is a no-op.
+ */
+void threadpool_destroy(struct threadpool* pool);
+
+#endif
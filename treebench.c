@@ -0,0 +1,376 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Lukas Niederbremer <webmaster@flippeh.de> and Clark Gaebel <cg.wowus.cg@gmail.com>
+ * wrote this file. As long as you retain this notice you can do whatever you
+ * want with this stuff. If we meet some day, and you think this stuff is worth
+ * it, you can buy us a beer in return.
+ * -----------------------------------------------------------------------------
+ */
+
+/*
+ * Times the cycles that allocate and free whole trees: parsing chunks and
+ * freeing them, and deep copying them with nbt_filter and freeing the copies
+ * (nbt_clone_shared would share their subtrees, hardly allocating). Each is
+ * run with nodes and list entries from the library's pools, and again with
+ * every one of them going to malloc and free, on as many threads at once as
+ * asked for.
+ *
+ *   -n       drop the arrays from the chunks first. Old chunks are mostly a few
+ *            big arrays, which cost the same either way and hide the rest.
+ *
+ * Run it under `perf record -g' to see where the time goes; with the pools,
+ * malloc and free should all but drop out of the profile, save for strings and
+ * arrays.
+ *
+ * After that it times walking the parsed chunks without changing them, once
+ * with nbt_map calling a visitor for each node, and once with an nbt_iterator
+ * loop doing the same work inline. That only means something in an optimized
+ * build (CFLAGS=-O2); at -O0 nothing gets inlined.
+ *
+ * Last, all the chunks go into one list, without their arrays and copied until
+ * it's a few million nodes, and the strings in that are counted by nbt_map on one thread and by
+ * nbt_reduce_parallel on as many as asked for.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "nbt.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Times through the sample each thread makes, per measurement. */
+#define ROUNDS 20
+
+/* Walks are quick, and need more of them to time. */
+#define WALK_ROUNDS 200
+
+static void die(const char* message)
+{
+    fprintf(stderr, "%s\n", message);
+    exit(1);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* libc_allocate(size_t size, void* ctx)
+{
+    (void)ctx;
+    return malloc(size);
+}
+
+static void* libc_reallocate(void* ptr, size_t size, void* ctx)
+{
+    (void)ctx;
+    return realloc(ptr, size);
+}
+
+static void libc_release(void* ptr, void* ctx)
+{
+    (void)ctx;
+    free(ptr);
+}
+
+/* An override, so the pools step aside and everything goes to malloc. */
+static const nbt_allocator plain = { libc_allocate, libc_reallocate, libc_release, NULL };
+
+static bool is_not_array(const nbt_node* node, void* aux)
+{
+    (void)aux;
+    return node->type != TAG_BYTE_ARRAY && node->type != TAG_INT_ARRAY && node->type != TAG_LONG_ARRAY;
+}
+
+/* Every chunk of the sample region, as uncompressed NBT, and parsed once. */
+static struct buffer sample[32*32];
+static nbt_node* parsed[32*32];
+static size_t nsample, nnodes;
+
+static void load_sample(const char* path, bool strip_arrays)
+{
+    MCR* mcr = mcr_open(path, O_RDONLY);
+    if(mcr == NULL) die("Could not open the region file.");
+
+    for(int x = 0; x < 32; x++)
+        for(int z = 0; z < 32; z++)
+        {
+            nbt_node* chunk = mcr_chunk_get(mcr, x, z);
+            if(chunk == NULL) continue;
+
+            if(strip_arrays) chunk = nbt_filter_inplace(chunk, is_not_array, NULL);
+
+            sample[nsample] = nbt_dump_binary(chunk);
+            if(sample[nsample].data == NULL) die("Could not dump a chunk.");
+
+            parsed[nsample++] = chunk;
+            nnodes += nbt_size(chunk);
+            if(errno != NBT_OK) die(nbt_error_to_string(errno));
+        }
+
+    mcr_close(mcr);
+
+    if(nsample == 0) die("No chunks in that region.");
+}
+
+enum cycle { CYCLE_PARSE, CYCLE_FILTER };
+
+static bool keep_everything(const nbt_node* node, void* aux)
+{
+    (void)node;
+    (void)aux;
+    return true;
+}
+
+struct job {
+    enum cycle cycle;
+    bool pooled;
+};
+
+static void* run(void* vjob)
+{
+    const struct job* job = vjob;
+    if(!job->pooled) nbt_use_allocator(&plain);
+
+    for(int r = 0; r < ROUNDS; r++)
+        for(size_t i = 0; i < nsample; i++)
+        {
+            nbt_node* tree = NULL;
+
+            switch(job->cycle)
+            {
+            case CYCLE_PARSE:  tree = nbt_parse(sample[i].data, sample[i].len);     break;
+            case CYCLE_FILTER: tree = nbt_filter(parsed[i], keep_everything, NULL); break;
+            }
+
+            if(tree == NULL) die(nbt_error_to_string(errno));
+            nbt_free(tree);
+        }
+
+    nbt_use_allocator(NULL);
+    return NULL;
+}
+
+/* What both walks do at each node: count the strings, so there's something to do. */
+static bool count_string(nbt_node* node, void* aux)
+{
+    if(node->type == TAG_STRING) ++*(size_t*)aux;
+    return true;
+}
+
+/* Nanoseconds per node, walking every chunk WALK_ROUNDS times on this thread. */
+static double measure_walk(bool inlined, size_t* strings)
+{
+    *strings = 0;
+    double start = now();
+
+    for(int r = 0; r < WALK_ROUNDS; r++)
+        for(size_t i = 0; i < nsample; i++)
+        {
+            if(!inlined)
+            {
+                nbt_map(parsed[i], count_string, strings);
+                continue;
+            }
+
+            nbt_iterator it;
+            for(nbt_node* n = nbt_iter_begin(&it, parsed[i]); n; n = nbt_iter_next(&it))
+                count_string(n, strings);
+            nbt_iter_end(&it);
+        }
+
+    return (now() - start) * 1e9 / ((double)nnodes * WALK_ROUNDS);
+}
+
+/* Nodes the big tree has at least. */
+#define BIG_NODES 4000000
+
+static void zero_count(void* partial, void* aux)
+{
+    (void)aux;
+    *(size_t*)partial = 0;
+}
+
+static bool count_string_partial(nbt_node* node, void* partial, void* aux)
+{
+    (void)aux;
+    return count_string(node, partial);
+}
+
+static void add_count(void* result, const void* partial, void* aux)
+{
+    (void)aux;
+    *(size_t*)result += *(const size_t*)partial;
+}
+
+static const nbt_reducer string_counter = { sizeof(size_t), zero_count, count_string_partial, add_count };
+
+/*
+ * One list of every sample chunk, over and over, made by writing it out as NBT
+ * and parsing it: the chunks without their names, after a list header.
+ */
+static nbt_node* make_big_tree(size_t* nodes)
+{
+    struct buffer stripped[32*32];
+    size_t per_copy = 0, len = 3 + 3 + 5 + 1;
+
+    for(size_t i = 0; i < nsample; i++)
+    {
+        nbt_node* chunk = nbt_filter(parsed[i], is_not_array, NULL);
+        if(chunk == NULL) die(nbt_error_to_string(errno));
+
+        stripped[i] = nbt_dump_binary(chunk);
+        if(stripped[i].data == NULL) die("Could not dump a chunk.");
+
+        per_copy += nbt_size(chunk);
+        if(errno != NBT_OK) die(nbt_error_to_string(errno));
+        nbt_free(chunk);
+    }
+
+    size_t copies = BIG_NODES / per_copy + 1;
+    for(size_t i = 0; i < nsample; i++)
+        len += stripped[i].len * copies;
+
+    unsigned char* data = malloc(len);
+    if(data == NULL) die("Out of memory.");
+
+    size_t count = nsample * copies;
+    unsigned char* p = data;
+    static const unsigned char head[] = { 10, 0, 0, 9, 0, 0, 10 };
+    memcpy(p, head, sizeof head);
+    p += sizeof head;
+    for(int s = 24; s >= 0; s -= 8)
+        *p++ = (unsigned char)(count >> s);
+
+    for(size_t c = 0; c < copies; c++)
+        for(size_t i = 0; i < nsample; i++)
+        {
+            /* past the tag and the name */
+            size_t skip = 3 + ((size_t)stripped[i].data[1] << 8 | stripped[i].data[2]);
+            memcpy(p, stripped[i].data + skip, stripped[i].len - skip);
+            p += stripped[i].len - skip;
+        }
+    *p++ = 0;
+
+    for(size_t i = 0; i < nsample; i++)
+        buffer_free(&stripped[i]);
+
+    nbt_node* big = nbt_parse(data, p - data);
+    if(big == NULL) die(nbt_error_to_string(errno));
+    free(data);
+
+    *nodes = nbt_size(big);
+    if(errno != NBT_OK) die(nbt_error_to_string(errno));
+    return big;
+}
+
+/* Nanoseconds per node, all threads told. */
+static double measure(enum cycle cycle, bool pooled, int nthreads)
+{
+    struct job job = { cycle, pooled };
+    pthread_t threads[64];
+
+    double start = now();
+
+    for(int t = 0; t < nthreads; t++)
+        if(pthread_create(&threads[t], NULL, run, &job) != 0)
+            die("Could not start a thread.");
+
+    for(int t = 0; t < nthreads; t++)
+        pthread_join(threads[t], NULL);
+
+    return (now() - start) * 1e9 / ((double)nnodes * ROUNDS * nthreads);
+}
+
+int main(int argc, char** argv)
+{
+    int i = 1;
+    bool strip_arrays = false;
+
+    if(i < argc && strcmp(argv[i], "-n") == 0)
+    {
+        strip_arrays = true;
+        i++;
+    }
+
+    if(argc - i < 1 || argc - i > 2)
+    {
+        fprintf(stderr, "Usage: %s [-n] [region file] [threads]\n", argv[0]);
+        return 1;
+    }
+
+    int nthreads = argc - i == 2 ? atoi(argv[i + 1]) : 1;
+    if(nthreads < 1 || nthreads > 64) die("Between 1 and 64 threads, please.");
+
+    load_sample(argv[i], strip_arrays);
+    printf("%zu chunks, %zu nodes, %d thread%s\n", nsample, nnodes, nthreads, nthreads == 1 ? "" : "s");
+
+    static const char* names[] = { "parse+free", "filter+free" };
+
+    printf("cycle         malloc ns/node  pooled ns/node  speedup\n");
+
+    for(int c = CYCLE_PARSE; c <= CYCLE_FILTER; c++)
+    {
+        /* once to warm up the pools, and the heap */
+        measure((enum cycle)c, true, nthreads);
+        measure((enum cycle)c, false, nthreads);
+
+        double heap   = measure((enum cycle)c, false, nthreads);
+        double pooled = measure((enum cycle)c, true, nthreads);
+
+        printf("%-12s  %14.1f  %14.1f  %6.2fx\n", names[c], heap, pooled, heap / pooled);
+    }
+
+    /* the best of a few, taking turns, since a walk is over quickly */
+    size_t mapped, iterated;
+    double callback = 1e9, inlined = 1e9;
+
+    for(int r = 0; r < 5; r++)
+    {
+        double t = measure_walk(false, &mapped);
+        if(t < callback) callback = t;
+
+        t = measure_walk(true, &iterated);
+        if(t < inlined) inlined = t;
+    }
+
+    if(mapped != iterated) die("The walks disagree.");
+
+    printf("\nwalk          nbt_map ns/node   inline ns/node  speedup\n");
+    printf("%-12s  %15.2f  %15.2f  %6.2fx\n", "count", callback, inlined, callback / inlined);
+
+    size_t big_nodes;
+    nbt_node* big = make_big_tree(&big_nodes);
+
+    size_t serial = 0, parallel = 0;
+    double start = now();
+    nbt_map(big, count_string, &serial);
+    double one = (now() - start) * 1e9 / big_nodes;
+
+    start = now();
+    if(nbt_reduce_parallel(big, &string_counter, &parallel, NULL, nthreads) != 0)
+        die(nbt_error_to_string(errno));
+    double many = (now() - start) * 1e9 / big_nodes;
+    if(serial != parallel) die("The walks disagree.");
+
+    printf("\n%zu nodes     nbt_map ns/node  reduce ns/node  speedup\n", big_nodes);
+    printf("%-12s  %15.2f  %14.2f  %6.2fx\n", "count", one, many, one / many);
+    nbt_free(big);
+
+    for(size_t i = 0; i < nsample; i++)
+    {
+        buffer_free(&sample[i]);
+        nbt_free(parsed[i]);
+    }
+
+    return 0;
+}
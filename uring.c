@@ -0,0 +1,250 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Lukas Niederbremer <webmaster@flippeh.de> and Clark Gaebel <cg.wowus.cg@gmail.com>
+ * wrote this file. As long as you retain this notice you can do whatever you
+ * want with this stuff. If we meet some day, and you think this stuff is worth
+ * it, you can buy us a beer in return.
+ * -----------------------------------------------------------------------------
+ */
+#define _DEFAULT_SOURCE /* for syscall() */
+
+#include "uring.h"
+
+#include "alloc.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct uring {
+    int fd;
+
+    void*  sq_ring;
+    size_t sq_ring_len;
+    void*  cq_ring;        /* the same mapping as sq_ring on newer kernels */
+    size_t cq_ring_len;
+    struct io_uring_sqe* sqes;
+    size_t sqes_len;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned  sq_entries;
+    unsigned  queued;      /* sqes filled in since the last submit */
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+};
+
+struct uring* uring_create(unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+
+    struct uring* ring = mem_calloc(1, sizeof *ring);
+    if(ring == NULL) return NULL;
+
+    ring->sq_ring = ring->cq_ring = ring->sqes = MAP_FAILED;
+
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if(ring->fd < 0) goto err;
+
+    ring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_len = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(ring->cq_ring_len > ring->sq_ring_len) ring->sq_ring_len = ring->cq_ring_len;
+        ring->cq_ring_len = 0;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ|PROT_WRITE, MAP_SHARED,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ring == MAP_FAILED) goto err;
+
+    if(ring->cq_ring_len == 0)
+        ring->cq_ring = ring->sq_ring;
+    else
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ|PROT_WRITE, MAP_SHARED,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if(ring->cq_ring == MAP_FAILED) goto err;
+    }
+
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED,
+                      ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED) goto err;
+
+    char* sq = ring->sq_ring;
+    ring->sq_head    = (unsigned*)(sq + p.sq_off.head);
+    ring->sq_tail    = (unsigned*)(sq + p.sq_off.tail);
+    ring->sq_mask    = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring->sq_array   = (unsigned*)(sq + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+
+    char* cq = ring->cq_ring;
+    ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring->cqes    = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    return ring;
+
+err:
+    uring_destroy(ring);
+    return NULL;
+}
+
+unsigned uring_capacity(const struct uring* ring)
+{
+    return ring->sq_entries;
+}
+
+int uring_readv(struct uring* ring, int fd, const struct iovec* iov, int iovcnt,
+                off_t offset, uint64_t user_data)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if(tail - head >= ring->sq_entries) return 1;
+
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode    = IORING_OP_READV;
+    sqe->fd        = fd;
+    sqe->addr      = (uint64_t)(uintptr_t)iov;
+    sqe->len       = (unsigned)iovcnt;
+    sqe->off       = (uint64_t)offset;
+    sqe->user_data = user_data;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+
+    return 0;
+}
+
+int uring_submit(struct uring* ring, unsigned wait)
+{
+    for(;;)
+    {
+        long ret = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait,
+                           wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if(ret >= 0)
+        {
+            ring->queued -= (unsigned)ret;
+            return 0;
+        }
+        if(errno != EINTR) return -1;
+    }
+}
+
+unsigned uring_unsubmitted(const struct uring* ring)
+{
+    return ring->queued;
+}
+
+int uring_wait(struct uring* ring, unsigned wait)
+{
+    for(;;)
+    {
+        long ret = syscall(__NR_io_uring_enter, ring->fd, 0, wait, IORING_ENTER_GETEVENTS, NULL, 0);
+        if(ret >= 0) return 0;
+        if(errno != EINTR) return -1;
+    }
+}
+
+int uring_reap(struct uring* ring, uint64_t* user_data, int* res)
+{
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    if(head == tail) return 0;
+
+    const struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res       = cqe->res;
+
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+void uring_destroy(struct uring* ring)
+{
+    if(ring == NULL) return;
+
+    if(ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_len);
+    if(ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_len);
+    if(ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_len);
+    if(ring->fd >= 0) close(ring->fd);
+
+    mem_free(ring);
+}
+
+#else /* no io_uring in this build */
+
+struct uring* uring_create(unsigned entries)
+{
+    (void)entries;
+    errno = ENOSYS;
+    return NULL;
+}
+
+unsigned uring_capacity(const struct uring* ring)
+{
+    (void)ring;
+    return 0;
+}
+
+int uring_readv(struct uring* ring, int fd, const struct iovec* iov, int iovcnt,
+                off_t offset, uint64_t user_data)
+{
+    (void)ring; (void)fd; (void)iov; (void)iovcnt; (void)offset; (void)user_data;
+    return 1;
+}
+
+int uring_submit(struct uring* ring, unsigned wait)
+{
+    (void)ring; (void)wait;
+    errno = ENOSYS;
+    return -1;
+}
+
+unsigned uring_unsubmitted(const struct uring* ring)
+{
+    (void)ring;
+    return 0;
+}
+
+int uring_wait(struct uring* ring, unsigned wait)
+{
+    (void)ring; (void)wait;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_reap(struct uring* ring, uint64_t* user_data, int* res)
+{
+    (void)ring; (void)user_data; (void)res;
+    return 0;
+}
+
+void uring_destroy(struct uring* ring)
+{
+    (void)ring;
+}
+
+#endif
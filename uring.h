@@ -0,0 +1,67 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Lukas Niederbremer <webmaster@flippeh.de> and Clark Gaebel <cg.wowus.cg@gmail.com>
+ * wrote this file. As long as you retain this notice you can do whatever you
+ * want with this stuff. If we meet some day, and you think this stuff is worth
+ * it, you can buy us a beer in return.
+ * -----------------------------------------------------------------------------
+ */
+#ifndef NBT_URING_H
+#define NBT_URING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Just enough of io_uring to keep a pile of vectored reads in flight, talking
+ * to the kernel directly so there's no liburing to depend on. Only built with
+ * HAVE_IO_URING; without it uring_create always fails.
+ */
+struct uring;
+
+/*
+ * Sets up a ring with room for at least `entries' reads in flight. Returns
+ * NULL if the kernel (or the build) can't do io_uring, or on memory errors.
+ */
+struct uring* uring_create(unsigned entries);
+
+/* How many reads can be queued before some have to be reaped. */
+unsigned uring_capacity(const struct uring* ring);
+
+/*
+ * Queues a preadv. `iov' has to stay put until its completion is reaped.
+ * Returns non-zero if the submission queue is full.
+ */
+int uring_readv(struct uring* ring, int fd, const struct iovec* iov, int iovcnt,
+                off_t offset, uint64_t user_data);
+
+/*
+ * Submits everything queued, and waits for at least `wait' completions.
+ * Returns 0, or -1 with errno set.
+ */
+int uring_submit(struct uring* ring, unsigned wait);
+
+/*
+ * How many queued reads the kernel hasn't taken yet. After a failed submit
+ * these are the last ones queued; they'll never complete, everything queued
+ * before them will.
+ */
+unsigned uring_unsubmitted(const struct uring* ring);
+
+/*
+ * Waits for at least `wait' completions without submitting anything more.
+ * Returns 0, or -1 with errno set.
+ */
+int uring_wait(struct uring* ring, unsigned wait);
+
+/*
+ * Takes one completion off the ring, if there is one. `res' is what preadv
+ * would have returned, or minus the errno. Returns 1 if it got one, 0 if not.
+ */
+int uring_reap(struct uring* ring, uint64_t* user_data, int* res);
+
+void uring_destroy(struct uring* ring);
+
+#endif
@@ -0,0 +1,629 @@
+/*
+ * -----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Lukas Niederbremer <webmaster@flippeh.de> and Clark Gaebel <cg.wowus.cg@gmail.com>
+ * wrote this file. As long as you retain this notice you can do whatever you
+ * want with this stuff. If we meet some day, and you think this stuff is worth
+ * it, you can buy us a beer in return.
+ * -----------------------------------------------------------------------------
+ */
+#define _POSIX_C_SOURCE 200809L /* for fsync */
+#include "nbt.h"
+
+#include "alloc.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define WORLD_BUCKETS 1024
+#define WORLD_REGION_BUCKETS 64
+#define WORLD_DEFAULT_REGIONS 64
+
+// one parsed chunk in the cache
+struct WorldChunk {
+    int cx, cz;
+    nbt_node *tree;
+    size_t bytes;
+    int refs; // readers holding it, it can't be evicted until this is 0
+    struct list_head bucket;
+    struct list_head lru; // most recently used at the front
+};
+
+// one region file, with its header parsed
+struct WorldRegion {
+    int rx, rz;
+    MCR *mcr;
+    int refs;
+    struct list_head bucket;
+    struct list_head lru;
+};
+
+// private structure
+struct World {
+    const nbt_allocator *alloc; // the override it was opened under, see nbt_use_allocator
+    char *path;
+    size_t budget;
+    size_t bytes;
+    size_t max_regions;
+    size_t nregions;
+    nbt_intern *intern; // NULL if chunks aren't interned
+    pthread_mutex_t lock;
+    struct list_head lru;
+    struct list_head buckets[WORLD_BUCKETS];
+    struct list_head region_lru;
+    struct list_head region_buckets[WORLD_REGION_BUCKETS];
+    world_stats stats;
+};
+
+static unsigned _world_hash(int cx, int cz)
+{
+    uint32_t h = (uint32_t)cx * 73856093u ^ (uint32_t)cz * 19349663u;
+    return (h ^ (h >> 16)) % WORLD_BUCKETS;
+}
+
+void world_chunk_region(int cx, int cz, int *rx, int *rz, int *x, int *z)
+{
+    // floor division, chunk -1 is slot 31 of region -1
+    int r = cx < 0 ? (cx + 1) / 32 - 1 : cx / 32;
+    if (rx) *rx = r;
+    if (x) *x = cx - r * 32;
+    r = cz < 0 ? (cz + 1) / 32 - 1 : cz / 32;
+    if (rz) *rz = r;
+    if (z) *z = cz - r * 32;
+}
+
+static struct WorldChunk *_world_find(World *world, int cx, int cz)
+{
+    struct list_head *pos;
+    list_for_each(pos, &world->buckets[_world_hash(cx, cz)]) {
+        struct WorldChunk *c = list_entry(pos, struct WorldChunk, bucket);
+        if (c->cx == cx && c->cz == cz) return c;
+    }
+    return NULL;
+}
+
+static void _world_drop(World *world, struct WorldChunk *c)
+{
+    list_del(&c->bucket);
+    list_del(&c->lru);
+    world->bytes -= c->bytes;
+    nbt_free(c->tree);
+    mem_free(c);
+}
+
+// what the intern pool holds, which counts against the budget as much as the chunks do
+static size_t _world_pooled(World *world)
+{
+    if (world->intern == NULL) return 0;
+    nbt_intern_stats stats;
+    nbt_intern_get_stats(world->intern, &stats);
+    return stats.bytes;
+}
+
+/*
+ * Evicts unused chunks, least recently used first, until we're within budget.
+ * What an evicted chunk shared stays in the pool until the pool is trimmed,
+ * so that's done after every eviction that didn't get us there on its own.
+ */
+static void _world_trim(World *world)
+{
+    size_t pooled = _world_pooled(world);
+    struct list_head *pos, *p;
+    list_for_each_reverse_safe(pos, p, &world->lru) {
+        if (world->bytes + pooled <= world->budget) break;
+        struct WorldChunk *c = list_entry(pos, struct WorldChunk, lru);
+        if (c->refs > 0) continue;
+        _world_drop(world, c);
+        world->stats.evictions++;
+        if (pooled > 0 && world->bytes + pooled > world->budget) {
+            nbt_intern_trim(world->intern);
+            pooled = _world_pooled(world);
+        }
+    }
+}
+
+static struct WorldRegion *_world_find_region(World *world, int rx, int rz)
+{
+    struct list_head *pos;
+    list_for_each(pos, &world->region_buckets[_world_hash(rx, rz) % WORLD_REGION_BUCKETS]) {
+        struct WorldRegion *r = list_entry(pos, struct WorldRegion, bucket);
+        if (r->rx == rx && r->rz == rz) return r;
+    }
+    return NULL;
+}
+
+static void _world_drop_region(World *world, struct WorldRegion *r)
+{
+    list_del(&r->bucket);
+    list_del(&r->lru);
+    world->nregions--;
+    mcr_close(r->mcr);
+    mem_free(r);
+}
+
+// closes regions nobody is reading from, least recently used first, down to the limit
+static void _world_trim_regions(World *world)
+{
+    struct list_head *pos, *p;
+    list_for_each_reverse_safe(pos, p, &world->region_lru) {
+        if (world->nregions <= world->max_regions) break;
+        struct WorldRegion *r = list_entry(pos, struct WorldRegion, lru);
+        if (r->refs > 0) continue;
+        _world_drop_region(world, r);
+        world->stats.region_evictions++;
+    }
+}
+
+/*
+ * Opens r.X.Z.mca, or r.X.Z.mcr if there's no .mca. NULL with errno ENOENT only
+ * if neither is there; any other failure, a file we can't read or running out
+ * of descriptors, is passed on as is rather than taken for a missing region.
+ */
+static MCR *_world_open_region(World *world, int rx, int rz)
+{
+    static const char *exts[] = { "mca", "mcr" };
+    MCR *mcr = NULL;
+    errno = ENOENT;
+
+    size_t len = strlen(world->path) + 32;
+    char *path = mem_alloc(len);
+    if (path == NULL) {
+        errno = NBT_EMEM;
+        return NULL;
+    }
+    for (size_t i = 0; i < sizeof exts / sizeof *exts && mcr == NULL && errno == ENOENT; i++) {
+        snprintf(path, len, "%s/r.%d.%d.%s", world->path, rx, rz, exts[i]);
+        mcr = mcr_open(path, O_RDONLY);
+    }
+    int err = errno;
+    mem_free(path);
+    errno = err;
+    return mcr;
+}
+
+/*
+ * Gets the region holding chunk (cx, cz), opening it if it isn't open yet. Hand
+ * it back with _world_release_region. Returns NULL with errno set on error, or
+ * with errno ENOENT if there's no such region. Missing regions aren't cached,
+ * so one that's written later, or was only unreadable for a while, is found on
+ * the next look.
+ */
+static struct WorldRegion *_world_get_region(World *world, int cx, int cz)
+{
+    int rx, rz;
+    world_chunk_region(cx, cz, &rx, &rz, NULL, NULL);
+
+    pthread_mutex_lock(&world->lock);
+    struct WorldRegion *r = _world_find_region(world, rx, rz);
+    if (r) {
+        r->refs++;
+        list_del(&r->lru);
+        list_add_head(&r->lru, &world->region_lru);
+        world->stats.region_hits++;
+        pthread_mutex_unlock(&world->lock);
+        return r;
+    }
+    world->stats.region_misses++;
+    pthread_mutex_unlock(&world->lock);
+
+    MCR *mcr = _world_open_region(world, rx, rz);
+    if (mcr == NULL) return NULL;
+
+    struct WorldRegion *fresh = mem_alloc(sizeof *fresh);
+    if (fresh == NULL) {
+        mcr_close(mcr);
+        errno = NBT_EMEM;
+        return NULL;
+    }
+    fresh->rx = rx;
+    fresh->rz = rz;
+    fresh->mcr = mcr;
+    fresh->refs = 1;
+
+    pthread_mutex_lock(&world->lock);
+    if ((r = _world_find_region(world, rx, rz)) != NULL) {
+        // lost a race to open it, use the winner's
+        r->refs++;
+        pthread_mutex_unlock(&world->lock);
+        mcr_close(mcr);
+        mem_free(fresh);
+        return r;
+    }
+    list_add_head(&fresh->bucket, &world->region_buckets[_world_hash(rx, rz) % WORLD_REGION_BUCKETS]);
+    list_add_head(&fresh->lru, &world->region_lru);
+    world->nregions++;
+    _world_trim_regions(world);
+    pthread_mutex_unlock(&world->lock);
+    return fresh;
+}
+
+static void _world_release_region(World *world, struct WorldRegion *r)
+{
+    pthread_mutex_lock(&world->lock);
+    if (--r->refs == 0) _world_trim_regions(world);
+    pthread_mutex_unlock(&world->lock);
+}
+
+// reads a chunk out of its region file, NULL with errno NBT_OK if it isn't there
+static nbt_node *_world_load(World *world, int cx, int cz)
+{
+    struct WorldRegion *r = _world_get_region(world, cx, cz);
+    if (r == NULL) {
+        if (errno == ENOENT) errno = NBT_OK; // no region, no chunk
+        return NULL;
+    }
+
+    // reading only looks at the mapping and the header, so readers can share it
+    int x, z;
+    world_chunk_region(cx, cz, NULL, NULL, &x, &z);
+    nbt_node *tree = mcr_chunk_get(r->mcr, x, z);
+    int err = errno;
+    _world_release_region(world, r);
+    errno = err;
+    return tree;
+}
+
+World *world_open(const char *path, size_t budget)
+{
+    assert(path);
+    World *world = mem_calloc(1, sizeof *world);
+    if (world == NULL) {
+        errno = NBT_EMEM;
+        return NULL;
+    }
+    if ((world->path = mem_alloc(strlen(path) + 1)) == NULL) {
+        mem_free(world);
+        errno = NBT_EMEM;
+        return NULL;
+    }
+    strcpy(world->path, path);
+    world->alloc = mem_override();
+    world->budget = budget;
+    world->max_regions = WORLD_DEFAULT_REGIONS;
+    pthread_mutex_init(&world->lock, NULL);
+    INIT_LIST_HEAD(&world->lru);
+    for (int i = 0; i < WORLD_BUCKETS; i++) INIT_LIST_HEAD(&world->buckets[i]);
+    INIT_LIST_HEAD(&world->region_lru);
+    for (int i = 0; i < WORLD_REGION_BUCKETS; i++) INIT_LIST_HEAD(&world->region_buckets[i]);
+    return world;
+}
+
+void world_close(World *world)
+{
+    if (world == NULL) return;
+    const nbt_allocator *old = nbt_use_allocator(world->alloc);
+    while (!list_empty(&world->lru)) {
+        _world_drop(world, list_entry(world->lru.flink, struct WorldChunk, lru));
+    }
+    while (!list_empty(&world->region_lru)) {
+        _world_drop_region(world, list_entry(world->region_lru.flink, struct WorldRegion, lru));
+    }
+    pthread_mutex_destroy(&world->lock);
+    mem_free(world->path);
+    mem_free(world);
+    nbt_use_allocator(old);
+}
+
+static nbt_node *_world_chunk_get(World *world, int cx, int cz)
+{
+    pthread_mutex_lock(&world->lock);
+    struct WorldChunk *c = _world_find(world, cx, cz);
+    if (c) {
+        c->refs++;
+        list_del(&c->lru);
+        list_add_head(&c->lru, &world->lru);
+        world->stats.hits++;
+        pthread_mutex_unlock(&world->lock);
+        errno = NBT_OK;
+        return c->tree;
+    }
+    world->stats.misses++;
+    pthread_mutex_unlock(&world->lock);
+
+    // parse without the lock, so other readers aren't held up behind the inflate
+    nbt_node *tree = _world_load(world, cx, cz);
+    if (tree == NULL) return NULL;
+
+    struct WorldChunk *fresh = mem_alloc(sizeof *fresh);
+    if (fresh == NULL) {
+        nbt_free(tree);
+        errno = NBT_EMEM;
+        return NULL;
+    }
+    pthread_mutex_lock(&world->lock);
+    nbt_intern *pool = world->intern;
+    pthread_mutex_unlock(&world->lock);
+
+    // what goes into the pool is paid for there, once, however many chunks share it
+    if (pool) nbt_intern_tree(pool, tree);
+
+    fresh->cx = cx;
+    fresh->cz = cz;
+    fresh->tree = tree;
+    // what the pool holds of it is charged once, by _world_pooled
+    fresh->bytes = nbt_memory_usage_unshared(tree).total;
+    fresh->refs = 1;
+
+    pthread_mutex_lock(&world->lock);
+    if ((c = _world_find(world, cx, cz)) != NULL) {
+        // somebody else loaded it while we were busy, share theirs
+        c->refs++;
+        pthread_mutex_unlock(&world->lock);
+        nbt_free(tree);
+        mem_free(fresh);
+        errno = NBT_OK;
+        return c->tree;
+    }
+    list_add_head(&fresh->bucket, &world->buckets[_world_hash(cx, cz)]);
+    list_add_head(&fresh->lru, &world->lru);
+    world->bytes += fresh->bytes;
+    _world_trim(world);
+    pthread_mutex_unlock(&world->lock);
+
+    errno = NBT_OK;
+    return tree;
+}
+
+/*
+ * What the cache holds outlives the call, and may well be evicted by another
+ * thread, so it all comes from the world's allocator, whoever is asking.
+ */
+nbt_node *world_chunk_get(World *world, int cx, int cz)
+{
+    assert(world);
+    const nbt_allocator *old = nbt_use_allocator(world->alloc);
+    nbt_node *tree = _world_chunk_get(world, cx, cz);
+    nbt_use_allocator(old);
+    return tree;
+}
+
+void world_chunk_release(World *world, int cx, int cz)
+{
+    assert(world);
+
+    const nbt_allocator *old = nbt_use_allocator(world->alloc);
+    pthread_mutex_lock(&world->lock);
+    struct WorldChunk *c = _world_find(world, cx, cz);
+    assert(c && c->refs > 0);
+    if (c && --c->refs == 0) _world_trim(world);
+    pthread_mutex_unlock(&world->lock);
+    nbt_use_allocator(old);
+}
+
+void world_set_region_limit(World *world, size_t max_regions)
+{
+    assert(world);
+
+    const nbt_allocator *old = nbt_use_allocator(world->alloc);
+    pthread_mutex_lock(&world->lock);
+    world->max_regions = max_regions;
+    _world_trim_regions(world);
+    pthread_mutex_unlock(&world->lock);
+    nbt_use_allocator(old);
+}
+
+void world_set_intern(World *world, nbt_intern *pool)
+{
+    assert(world);
+
+    pthread_mutex_lock(&world->lock);
+    world->intern = pool;
+    pthread_mutex_unlock(&world->lock);
+}
+
+int world_chunk_exists(World *world, int cx, int cz)
+{
+    assert(world);
+
+    // a cached chunk is there by definition
+    pthread_mutex_lock(&world->lock);
+    int cached = _world_find(world, cx, cz) != NULL;
+    pthread_mutex_unlock(&world->lock);
+    if (cached) return 1;
+
+    const nbt_allocator *old = nbt_use_allocator(world->alloc);
+    struct WorldRegion *r = _world_get_region(world, cx, cz);
+    int exists = r == NULL && errno == ENOENT ? 0 : -1;
+    if (r) {
+        int x, z;
+        world_chunk_region(cx, cz, NULL, NULL, &x, &z);
+        exists = mcr_chunk_exists(r->mcr, x, z);
+        _world_release_region(world, r);
+    }
+    nbt_use_allocator(old);
+    return exists;
+}
+
+void world_get_stats(World *world, world_stats *stats)
+{
+    assert(world && stats);
+
+    pthread_mutex_lock(&world->lock);
+    *stats = world->stats;
+    stats->bytes = world->bytes + _world_pooled(world);
+    stats->budget = world->budget;
+    stats->regions = world->nregions;
+    pthread_mutex_unlock(&world->lock);
+}
+
+// one region of a world_for_each_chunk_since, so visitors get global coordinates
+struct _world_since {
+    int rx, rz;
+    mcr_chunk_visitor_t visit;
+    void *aux;
+    const nbt_allocator *caller; // visitors run under the override of whoever called
+};
+
+static bool _world_since_visit(int x, int z, nbt_node *tree, void *aux)
+{
+    struct _world_since *ctx = aux;
+    const nbt_allocator *world = nbt_use_allocator(ctx->caller);
+    bool more = ctx->visit(ctx->rx * 32 + x, ctx->rz * 32 + z, tree, ctx->aux);
+    nbt_use_allocator(world);
+    return more;
+}
+
+static int _world_region_cmp(const void *a, const void *b)
+{
+    const int *ra = a, *rb = b;
+    if (ra[0] != rb[0]) return ra[0] < rb[0] ? -1 : 1;
+    return ra[1] < rb[1] ? -1 : ra[1] > rb[1];
+}
+
+// the (rx, rz) of every region file in the world, sorted, each region once
+static int _world_list_regions(World *world, int **list, size_t *count)
+{
+    DIR *dir = opendir(world->path);
+    if (dir == NULL) {
+        errno = NBT_EIO;
+        return -1;
+    }
+
+    int *regions = NULL;
+    size_t n = 0, cap = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        int rx, rz, end = 0;
+        char ext[4];
+        if (sscanf(ent->d_name, "r.%d.%d.%3[a-z]%n", &rx, &rz, ext, &end) != 3) continue;
+        if (ent->d_name[end] != '\0' || (strcmp(ext, "mca") && strcmp(ext, "mcr"))) continue;
+
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            int *grown = mem_realloc(regions, cap * 2 * sizeof *regions);
+            if (grown == NULL) {
+                mem_free(regions);
+                closedir(dir);
+                errno = NBT_EMEM;
+                return -1;
+            }
+            regions = grown;
+        }
+        regions[2 * n] = rx;
+        regions[2 * n + 1] = rz;
+        n++;
+    }
+    closedir(dir);
+
+    // an .mca and an .mcr of the same region are one region, the .mca is what gets opened
+    if (n > 1) qsort(regions, n, 2 * sizeof *regions, _world_region_cmp);
+    size_t unique = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (unique > 0 && _world_region_cmp(&regions[2 * i], &regions[2 * (unique - 1)]) == 0) continue;
+        regions[2 * unique] = regions[2 * i];
+        regions[2 * unique + 1] = regions[2 * i + 1];
+        unique++;
+    }
+    *list = regions;
+    *count = unique;
+    return 0;
+}
+
+int world_for_each_chunk_since(World *world, uint32_t since, int nthreads,
+                               mcr_chunk_visitor_t visit, void *aux)
+{
+    assert(world && visit);
+
+    const nbt_allocator *old = nbt_use_allocator(world->alloc);
+    int *regions;
+    size_t n;
+    if (_world_list_regions(world, &regions, &n)) {
+        nbt_use_allocator(old);
+        return -1;
+    }
+
+    int ret = 0;
+    for (size_t i = 0; i < n && ret == 0; i++) {
+        struct _world_since ctx = { regions[2 * i], regions[2 * i + 1], visit, aux, old };
+        struct WorldRegion *r = _world_get_region(world, ctx.rx * 32, ctx.rz * 32);
+        if (r == NULL) {
+            if (errno == ENOENT) continue; // deleted since we listed it
+            ret = -1;
+            break;
+        }
+        ret = mcr_for_each_chunk_since(r->mcr, since, nthreads, _world_since_visit, &ctx);
+        int err = errno;
+        _world_release_region(world, r);
+        errno = err;
+    }
+
+    mem_free(regions);
+    nbt_use_allocator(old);
+    if (ret == 0) errno = NBT_OK;
+    return ret;
+}
+
+// `name' in the world directory, malloc'd, with `suffix' on the end
+static char *_world_file(World *world, const char *name, const char *suffix)
+{
+    size_t len = strlen(world->path) + strlen(name) + strlen(suffix) + 2;
+    char *path = mem_alloc(len);
+    if (path == NULL) {
+        errno = NBT_EMEM;
+        return NULL;
+    }
+    snprintf(path, len, "%s/%s%s", world->path, name, suffix);
+    return path;
+}
+
+int world_checkpoint_load(World *world, const char *name, uint32_t *since)
+{
+    assert(world && name && since);
+
+    char *path = _world_file(world, name, "");
+    if (path == NULL) return -1;
+
+    FILE *fp = fopen(path, "r");
+    mem_free(path);
+    if (fp == NULL) {
+        if (errno != ENOENT) {
+            errno = NBT_EIO;
+            return -1;
+        }
+        *since = 0; // never been run, everything is new
+        return 0;
+    }
+
+    unsigned long t;
+    int ok = fscanf(fp, "%lu", &t) == 1 && t <= UINT32_MAX;
+    fclose(fp);
+    if (!ok) {
+        errno = NBT_ERR;
+        return -1;
+    }
+    *since = (uint32_t)t;
+    return 0;
+}
+
+int world_checkpoint_save(World *world, const char *name, uint32_t since)
+{
+    assert(world && name);
+
+    char *path = _world_file(world, name, "");
+    char *tmp = path ? _world_file(world, name, ".tmp") : NULL;
+    if (tmp == NULL) {
+        mem_free(path);
+        return -1;
+    }
+
+    // written aside and renamed over, so a crash leaves the old checkpoint or the new one
+    int ret = -1;
+    FILE *fp = fopen(tmp, "w");
+    if (fp != NULL) {
+        int ok = fprintf(fp, "%lu\n", (unsigned long)since) > 0 && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+        if (fclose(fp) == 0 && ok && rename(tmp, path) == 0) ret = 0;
+        else remove(tmp);
+    }
+    if (ret) errno = NBT_EIO;
+
+    mem_free(tmp);
+    mem_free(path);
+    return ret;
+}